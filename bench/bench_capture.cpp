@@ -0,0 +1,111 @@
+/**
+ * Capture benchmark: RawSocket::read() vs a memory-mapped RxRing
+ *
+ * A child process floods the loopback interface with small UDP datagrams through
+ * UDPSocket::sendBatch(), while the parent captures them for a few seconds, first one
+ * per RawSocket::read() call, then a block at a time through RxRing::next().
+ * It needs root privileges.
+ *
+ * Usage: bench_capture [seconds] [interface] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <usock.h>
+#include <usock_ring.h>
+
+using namespace std;
+using namespace usock;
+
+#define	PKT_SIZE	64
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static pid_t flood (u_int16_t port)  {
+	pid_t child;
+
+	if ((child = fork()) == 0)  {
+		UDPSocket s;
+		DatagramBatch batch(64, PKT_SIZE);
+		struct sockaddr_in to;
+		char pkt[PKT_SIZE] = { 0 };
+
+		to.sin_family = AF_INET;
+		to.sin_port = htons(port);
+		to.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+		while (1)  {
+			while (batch.append(pkt, sizeof(pkt), (struct sockaddr*) &to, sizeof(to)));
+			s.sendBatch(batch);
+		}
+	}
+
+	return child;
+}
+
+static void stop (pid_t child)  {
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+}
+
+int main (int argc, char **argv)  {
+	double seconds = (argc > 1) ? atof(argv[1]) : 2.0;
+	string iface = (argc > 2) ? argv[2] : "lo";
+	u_int16_t port = (argc > 3) ? atoi(argv[3]) : 19995;
+	double start, elapsed;
+	long captured;
+	pid_t child;
+
+	// Nobody reads the datagrams: the receiving socket only keeps them from bouncing back as ICMP errors
+	UDPSocket sink;
+	sink.bind(port);
+
+	{
+		RawSocket s(iface);
+		s.buildIPv4("127.0.0.1", "127.0.0.1", RawSocket::udp);
+
+		child = flood(port);
+		captured = 0;
+		start = now();
+
+		while ((elapsed = now() - start) < seconds)  {
+			s.read(PKT_SIZE);
+			captured++;
+		}
+
+		stop(child);
+		s.close();
+		cout << "RawSocket::read(): " << (long) (captured / elapsed) << " packets/s\n";
+	}
+
+	{
+		RxRing ring(iface, ETH_P_IP);
+		vector<PacketView> pkts;
+
+		child = flood(port);
+		captured = 0;
+		start = now();
+
+		while ((elapsed = now() - start) < seconds)
+			captured += ring.next(pkts, seconds - elapsed);
+
+		stop(child);
+
+		RxStats st = ring.stats();
+		cout << "RxRing::next():    " << (long) (captured / elapsed) << " packets/s ("
+			<< st.drops << " dropped by the ring)\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * Internet checksum benchmark: 16 bits at a time vs the usock_checksum.h kernels
+ *
+ * It reports the throughput in GB/s of a plain 16-bit loop, of the 64-bit scalar kernel
+ * and of csumPartial() for a few buffer sizes. The kernels are checked for correctness
+ * by check/checksum.cpp (`make check`).
+ *
+ * Usage: bench_checksum [MB per size]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+#include <usock_checksum.h>
+
+using namespace std;
+using namespace usock;
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// What RawSocket::csum() used to do, plus the odd tail
+static u_int16_t reference (const u_int8_t *buf, u_int32_t len)  {
+	u_int32_t sum = 0;
+	u_int16_t w;
+
+	for (; len > 1; len -= 2, buf += 2)  {
+		memcpy (&w, buf, 2);
+		sum += w;
+
+		if (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	if (len)  {
+		w = 0;
+		memcpy (&w, buf, 1);
+		sum += w;
+	}
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (u_int16_t) ~sum;
+}
+
+int main (int argc, char **argv)  {
+	long mb = (argc > 1) ? atol(argv[1]) : 512;
+	u_int32_t sizes[] = { 64, 256, 1500, 9000, 65536 };
+	vector<u_int8_t> data(65536 + 64);
+	volatile u_int32_t sink = 0;
+
+	for (u_int32_t i=0; i < data.size(); i++)
+		data[i] = rand();
+
+	for (u_int32_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); s++)  {
+		long rounds = mb * 1024 * 1024 / sizes[s];
+		double t[3];
+
+		for (int k=0; k < 3; k++)  {
+			double start = now();
+
+			for (long i=0; i < rounds; i++)  {
+				// Shift the buffer by one byte per round, unaligned loads included
+				const u_int8_t *p = &data[i & 7];
+
+				if (k == 0)
+					sink += reference(p, sizes[s]);
+				else if (k == 1)
+					sink += csumPartialScalar(p, sizes[s]);
+				else
+					sink += csumPartial(p, sizes[s]);
+			}
+
+			t[k] = now() - start;
+		}
+
+		cout << sizes[s] << " bytes: 16-bit " << mb / 1024.0 / t[0] << " GB/s, scalar "
+			<< mb / 1024.0 / t[1] << " GB/s, " << csumKernel() << " " << mb / 1024.0 / t[2] << " GB/s\n";
+	}
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * Line echo benchmark: a thread per connection vs coroutines on a Reactor per core
+ *
+ * It starts a line echo server on the loopback interface, written either as a blocking
+ * readline()/send() loop in a thread for each connection, or as the same loop in a coroutine
+ * (asyncReadline()/asyncSend()), run by a Reactor and a SO_REUSEPORT listener in each thread,
+ * one thread per core. The clients, coroutines themselves, keep a number of connections busy
+ * with ping-pong requests for a few seconds, and the benchmark reports the request rate and
+ * the RSS of the server.
+ *
+ * Build with -std=c++20. Usage: bench_coro <threads|coro> [connections] [seconds] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <usock.h>
+#include <usock_coro.h>
+
+using namespace std;
+using namespace usock;
+
+static const string request = "GET /some/reasonably/long/path/to/a/resource HTTP/1.1\n";
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static long rssKb (pid_t pid)  {
+	stringstream path;
+	path << "/proc/" << pid << "/status";
+	ifstream in(path.str().c_str());
+	string line;
+
+	while (getline(in, line))
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return atol(line.c_str() + 6);
+
+	return 0;
+}
+
+static void echoThread (Socket s)  {
+	string line;
+
+	while ((line = s.readline()) != "")
+		s.send(line + "\n");
+}
+
+static Task<void> echoTask (Socket s)  {
+	string line;
+
+	while ((line = co_await s.asyncReadline()) != "")
+		co_await s.asyncSend(line + "\n");
+}
+
+static Task<void> acceptTask (ServerSocket& ss)  {
+	while (1)
+		spawn(echoTask(co_await ss.asyncAccept()));
+}
+
+static void coroCore (u_int16_t port)  {
+	Reactor reactor;
+	ServerSocket ss(port, 1024, "127.0.0.1", true);
+
+	spawn(acceptTask(ss));
+	reactor.run();
+}
+
+static void serve (const string& mode, u_int16_t port)  {
+	if (mode == "threads")  {
+		ServerSocket ss(port, 1024, "127.0.0.1");
+
+		while (1)
+			thread(echoThread, ss.accept()).detach();
+	}
+
+	vector<thread> cores;
+
+	for (u_int32_t i=0; i < thread::hardware_concurrency(); i++)
+		cores.push_back(thread(coroCore, port));
+
+	for (u_int32_t i=0; i < cores.size(); i++)
+		cores[i].join();
+}
+
+static Task<void> client (u_int16_t port, double until, long& requests)  {
+	Socket s;
+	co_await s.asyncConnect("127.0.0.1", port);
+
+	while (now() < until)  {
+		co_await s.asyncSend(request);
+		co_await s.asyncReadline();
+		requests++;
+	}
+}
+
+int main (int argc, char **argv)  {
+	if (argc < 2)  {
+		cerr << "Usage: " << argv[0] << " <threads|coro> [connections] [seconds] [port]\n";
+		return 1;
+	}
+
+	string mode = argv[1];
+	int nconn = (argc > 2) ? atoi(argv[2]) : 200;
+	double seconds = (argc > 3) ? atof(argv[3]) : 3.0;
+	u_int16_t port = (argc > 4) ? atoi(argv[4]) : 19990;
+	long requests = 0;
+	pid_t server;
+
+	if ((server = fork()) == 0)  {
+		serve(mode, port);
+		exit(0);
+	}
+
+	usleep(200000);
+
+	Reactor reactor;
+	double start = now();
+
+	for (int i=0; i < nconn; i++)
+		spawn(client(port, start + seconds, requests));
+
+	long rss = 0;
+
+	// Sample the server RSS halfway, with all the connections open
+	while (reactor.pending() > 0)  {
+		reactor.runOnce(100);
+
+		if (!rss && now() - start > seconds / 2)
+			rss = rssKb(server);
+	}
+
+	double elapsed = now() - start;
+	cout << mode << ": " << nconn << " connections, " << (long) (requests / elapsed) << " requests/s, server RSS = "
+		<< rss << " kB\n";
+
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return 0;
+}
+
@@ -0,0 +1,172 @@
+/**
+ * Connection benchmark: fork-per-connection vs EventLoop
+ *
+ * It starts a server on the loopback interface using either ServerSocket::accept(handler)
+ * (one process per connection) or an EventLoop (one process for all of them). The server
+ * says "ok" to each client and waits for it to hang up. The benchmark then measures:
+ *
+ * - connections/sec for short-lived connections (connect, read the greeting, close);
+ * - the RSS of the whole server (parent + children) while many idle connections are open.
+ *
+ * Usage: bench_eventloop <fork|epoll> [connections] [concurrent] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <csignal>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <usock.h>
+#include <usock_eventloop.h>
+
+using namespace std;
+using namespace usock;
+
+static void holdClient (Socket& s)  {
+	s << "ok\n";
+
+	// readline() only returns an empty string on EOF
+	while (!s.readline().empty());
+}
+
+class HoldHandler : public EventHandler  {
+public:
+	void onAccept (EventLoop& loop, Socket& s)  {
+		s.trySend("ok\n", 3);
+	}
+
+	void onReadable (EventLoop& loop, Socket& s)  {
+		char buf[256];
+		int n;
+
+		while ((n = s.tryRecv(buf, sizeof(buf))) > 0);
+
+		if (n == 0)
+			loop.close(s);
+	}
+};
+
+static long rssKb (pid_t pid)  {
+	stringstream path;
+	path << "/proc/" << pid << "/status";
+	ifstream in(path.str().c_str());
+	string line;
+
+	while (getline(in, line))
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return atol(line.c_str() + 6);
+
+	return 0;
+}
+
+// RSS of a process and all its direct children
+static long treeRssKb (pid_t pid, int *nprocs)  {
+	long total = rssKb(pid);
+	DIR *dir = opendir("/proc");
+	struct dirent *d;
+	*nprocs = 1;
+
+	while (dir && (d = readdir(dir)))  {
+		pid_t child = atoi(d->d_name);
+
+		if (child <= 0)
+			continue;
+
+		stringstream path;
+		path << "/proc/" << child << "/stat";
+		ifstream in(path.str().c_str());
+		string comm, state;
+		pid_t ppid = 0;
+		int tmp;
+
+		in >> tmp >> comm >> state >> ppid;
+
+		if (ppid == pid)  {
+			total += rssKb(child);
+			(*nprocs)++;
+		}
+	}
+
+	if (dir)
+		closedir(dir);
+
+	return total;
+}
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main (int argc, char **argv)  {
+	if (argc < 2)  {
+		cerr << "Usage: " << argv[0] << " <fork|epoll> [connections] [concurrent] [port]\n";
+		return 1;
+	}
+
+	string mode = argv[1];
+	int nconn = (argc > 2) ? atoi(argv[2]) : 2000;
+	int nconcurrent = (argc > 3) ? atoi(argv[3]) : 500;
+	u_int16_t port = (argc > 4) ? atoi(argv[4]) : 19999;
+	pid_t server;
+
+	if ((server = fork()) == 0)  {
+		// Children of the fork model are never reaped by the library
+		signal(SIGCHLD, SIG_IGN);
+		ServerSocket ss(port, 1024, "127.0.0.1");
+
+		if (mode == "fork")  {
+			while (1)
+				ss.accept(holdClient);
+		} else {
+			HoldHandler handler;
+			EventLoop loop;
+			loop.add(ss, handler);
+			loop.run();
+		}
+
+		exit(0);
+	}
+
+	usleep(200000);
+	double start = now();
+
+	for (int i=0; i < nconn; i++)  {
+		Socket s("127.0.0.1", port);
+		s.readline();
+		s.close();
+	}
+
+	double elapsed = now() - start;
+	cout << mode << ": " << nconn << " connections in " << elapsed << "s ("
+		<< (int) (nconn / elapsed) << " conn/s)\n";
+
+	vector<Socket*> idle;
+
+	for (int i=0; i < nconcurrent; i++)  {
+		idle.push_back(new Socket("127.0.0.1", port));
+		idle.back()->readline();
+	}
+
+	int nprocs;
+	long rss = treeRssKb(server, &nprocs);
+	cout << mode << ": " << nconcurrent << " idle connections, server RSS = " << rss << " kB over "
+		<< nprocs << " process(es)\n";
+
+	for (u_int32_t i=0; i < idle.size(); i++)
+		delete idle[i];
+
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+	return 0;
+}
+
@@ -0,0 +1,118 @@
+/**
+ * Packet parser benchmark: PacketParser views vs copying the headers into structs
+ *
+ * It builds a TCP, an UDP and an ICMP packet through RawSocket and PacketTemplate, then parses
+ * them over and over: first copying the headers into struct iphdr/tcphdr/... (what the examples
+ * used to do), then through PacketParser, then through PacketParser verifying all the checksums.
+ *
+ * Usage: bench_parser [packets]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sys/time.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
+#include <usock.h>
+#include <usock_packet.h>
+#include <usock_parser.h>
+
+using namespace std;
+using namespace usock;
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned long copyHeaders (const u_int8_t* pkt)  {
+	struct iphdr ip;
+	memcpy (&ip, pkt, sizeof(ip));
+
+	const u_int8_t *l4 = pkt + (ip.ihl << 2);
+
+	if (ip.protocol == IPPROTO_TCP)  {
+		struct tcphdr tcp;
+		memcpy (&tcp, l4, sizeof(tcp));
+		return ntohs(tcp.dest);
+	}
+
+	if (ip.protocol == IPPROTO_UDP)  {
+		struct udphdr udp;
+		memcpy (&udp, l4, sizeof(udp));
+		return ntohs(udp.dest);
+	}
+
+	struct icmphdr icmp;
+	memcpy (&icmp, l4, sizeof(icmp));
+	return icmp.type;
+}
+
+static unsigned long viewHeaders (PacketParser& p, const u_int8_t* pkt, u_int32_t len, bool check)  {
+	if (!p.parse(pkt, len) || (check && !p.checksumValid()))
+		return 0;
+
+	if (p.tcp().valid())
+		return p.tcp().dstPort();
+
+	if (p.udp().valid())
+		return p.udp().dstPort();
+
+	return p.icmp().type();
+}
+
+static void report (const char *name, long n, double elapsed, unsigned long sum)  {
+	cout << name << (long) (n / elapsed) << " packets/s (" << sum << ")\n";
+}
+
+int main (int argc, char **argv)  {
+	long n = (argc > 1) ? atol(argv[1]) : 30000000;
+	u_int8_t payload[64] = { 0 };
+	PacketTemplate t[3];
+	RawSocket s("lo");
+
+	s.setPayload(payload, sizeof(payload));
+	s.buildIPv4("127.0.0.1", "127.0.0.1", RawSocket::tcp);
+	s.buildTCP(1234, 80, TH_SYN);
+	t[0] = PacketTemplate(s);
+
+	s.buildIPv4("127.0.0.1", "127.0.0.1", RawSocket::udp);
+	s.buildUDP(1234, 53);
+	t[1] = PacketTemplate(s);
+
+	s.buildIPv4("127.0.0.1", "127.0.0.1", RawSocket::icmp);
+	s.buildICMPv4(ICMP_ECHO);
+	t[2] = PacketTemplate(s);
+
+	PacketParser p;
+	unsigned long sum = 0;
+	double start = now();
+
+	for (long i=0; i < n; i++)
+		sum += copyHeaders(t[i % 3].data());
+
+	report("struct copies:        ", n, now() - start, sum);
+
+	sum = 0;
+	start = now();
+
+	for (long i=0; i < n; i++)
+		sum += viewHeaders(p, t[i % 3].data(), t[i % 3].length(), false);
+
+	report("PacketParser:         ", n, now() - start, sum);
+
+	sum = 0;
+	start = now();
+
+	for (long i=0; i < n; i++)
+		sum += viewHeaders(p, t[i % 3].data(), t[i % 3].length(), true);
+
+	report("PacketParser+checksum:", n, now() - start, sum);
+	return 0;
+}
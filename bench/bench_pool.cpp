@@ -0,0 +1,94 @@
+/**
+ * Receive buffer benchmark: new[]/delete[] vs BufferPool
+ *
+ * A number of threads get and release buffers of the sizes a receive path asks for (a mix
+ * of small and packet-sized ones), keeping a few of them alive for a while as a parser or
+ * a forwarding queue would, first through new[]/delete[], then through a BufferPool. It
+ * reports the buffer rate of both and the counters of the pool.
+ *
+ * Usage: bench_pool [threads] [buffers per thread]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <sys/time.h>
+#include <usock.h>
+
+using namespace std;
+using namespace usock;
+
+#define	HELD	64
+
+static const u_int32_t sizes[] = { 64, 200, 576, 1024, 1500, 4096, 9000, 65535 };
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void churnNew (long n)  {
+	vector<char*> held(HELD, (char*) NULL);
+
+	for (long i=0; i < n; i++)  {
+		u_int32_t slot = (i * 7) % HELD;
+		delete[] held[slot];
+		held[slot] = new char[sizes[i % 8]];
+		held[slot][0] = 1;
+	}
+
+	for (int i=0; i < HELD; i++)
+		delete[] held[i];
+}
+
+static void churnPool (BufferPool *pool, long n)  {
+	vector<Buffer> held(HELD);
+
+	for (long i=0; i < n; i++)  {
+		u_int32_t slot = (i * 7) % HELD;
+		held[slot] = pool->get(sizes[i % 8]);
+		held[slot].data()[0] = 1;
+	}
+}
+
+int main (int argc, char **argv)  {
+	int nthreads = (argc > 1) ? atoi(argv[1]) : 4;
+	long n = (argc > 2) ? atol(argv[2]) : 2000000;
+	BufferPool pool;
+	vector<thread> threads;
+	double start, elapsed;
+
+	start = now();
+
+	for (int i=0; i < nthreads; i++)
+		threads.push_back(thread(churnNew, n));
+
+	for (int i=0; i < nthreads; i++)
+		threads[i].join();
+
+	elapsed = now() - start;
+	cout << "new[]/delete[]: " << (long) (nthreads * n / elapsed) << " buffers/s\n";
+
+	threads.clear();
+	start = now();
+
+	for (int i=0; i < nthreads; i++)
+		threads.push_back(thread(churnPool, &pool, n));
+
+	for (int i=0; i < nthreads; i++)
+		threads[i].join();
+
+	elapsed = now() - start;
+	cout << "BufferPool:     " << (long) (nthreads * n / elapsed) << " buffers/s\n";
+
+	BufferPoolStats st = pool.stats();
+	cout << "allocs " << st.allocs << ", cache hits " << st.cacheHits << ", refills " << st.refills
+		<< ", slabs " << st.slabs << " (" << st.reserved / 1024 << " KB), in use " << st.inUse << "\n";
+
+	return 0;
+}
+
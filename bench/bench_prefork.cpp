@@ -0,0 +1,107 @@
+/**
+ * Process-per-connection benchmark: ServerSocket::accept(handler) vs PreforkPool
+ *
+ * A server process on the loopback interface greets each client with a line, either from a
+ * process forked for each connection, or from a PreforkPool of worker processes, accepting on
+ * the shared listener or getting the connections from the master over SCM_RIGHTS. The client
+ * opens the connections one after another and reads the greeting, so the rate reflects the
+ * latency added on the connection path. The pool workers are recycled every [requests]
+ * connections, and the pool counters are printed when it stops.
+ *
+ * Usage: bench_prefork [connections] [workers] [requests] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <usock.h>
+#include <usock_prefork.h>
+
+using namespace std;
+using namespace usock;
+
+static PreforkPool *pool = NULL;
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void greet (Socket& s)  {
+	s << "hello\n";
+}
+
+static void onTerm (int sig)  {
+	if (pool)
+		pool->stop();
+}
+
+static pid_t serve (int mode, u_int16_t port, int nconn, u_int32_t nworkers, u_int32_t requests)  {
+	pid_t pid;
+
+	cout.flush();
+
+	if ((pid = fork()) != 0)
+		return pid;
+
+	ServerSocket ss(port, 128, "127.0.0.1");
+
+	if (mode == 0)  {
+		for (int i=0; i < nconn; i++)
+			ss.accept(greet);
+
+		while (wait(NULL) > 0);
+		exit(0);
+	}
+
+	PreforkPool p(ss, greet, nworkers, requests, (mode == 1) ? PreforkPool::shared : PreforkPool::handoff);
+	pool = &p;
+	signal(SIGTERM, onTerm);
+	p.run();
+
+	PreforkStats st = p.stats();
+	cout << "  " << st.spawned << " workers spawned, " << st.recycled << " recycled, " << st.lost << " lost, "
+		<< st.handoffs << " connections handed off\n";
+	exit(0);
+}
+
+int main (int argc, char **argv)  {
+	int nconn = (argc > 1) ? atoi(argv[1]) : 5000;
+	u_int32_t nworkers = (argc > 2) ? atoi(argv[2]) : 4;
+	u_int32_t requests = (argc > 3) ? atoi(argv[3]) : 1000;
+	u_int16_t port = (argc > 4) ? atoi(argv[4]) : 19994;
+	const char *names[] = { "fork per connection", "prefork, shared     ", "prefork, handoff    " };
+
+	for (int mode=0; mode < 3; mode++)  {
+		pid_t server = serve(mode, port + mode, nconn, nworkers, requests);
+		int ok = 0;
+
+		usleep(200000);
+		double start = now();
+
+		for (int i=0; i < nconn; i++)  {
+			Socket s("127.0.0.1", port + mode);
+
+			if (s.readline() == "hello")
+				ok++;
+		}
+
+		double elapsed = now() - start;
+		cout << names[mode] << ": " << ok << "/" << nconn << " connections in " << elapsed << "s ("
+			<< (long) (nconn / elapsed) << " connections/s)\n";
+
+		if (mode > 0)
+			kill(server, SIGTERM);
+
+		waitpid(server, NULL, 0);
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,75 @@
+/**
+ * Probe engine benchmark: ping sweep of many hosts
+ *
+ * It sends an echo request to each address of a range through a ProbeEngine, and reports
+ * how long the sweep took and how many targets answered. The default range lies in 127.0.0.0/8,
+ * whose addresses are all answered by the loopback interface. It needs root privileges.
+ *
+ * Usage: bench_probe [targets] [probes/s] [first address] [interface]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <netinet/ip_icmp.h>
+#include <usock.h>
+#include <usock_probe.h>
+
+using namespace std;
+using namespace usock;
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+class Sweep : public ProbeHandler  {
+public:
+	long replies, errors, timeouts;
+	double rtt;
+
+	Sweep() : replies(0), errors(0), timeouts(0), rtt(0.0)  {}
+
+	void onReply (const ProbeResult& r)  {
+		if (r.icmpType == ICMP_ECHOREPLY)
+			replies++;
+		else
+			errors++;
+
+		rtt += r.rtt;
+	}
+
+	void onTimeout (const ProbeResult& r)  {
+		timeouts++;
+	}
+};
+
+int main (int argc, char **argv)  {
+	int ntargets = (argc > 1) ? atoi(argv[1]) : 10000;
+	double rate = (argc > 2) ? atof(argv[2]) : 20000.0;
+	u_int32_t first = ntohl(inet_addr((argc > 3) ? argv[3] : "127.0.0.1"));
+	string iface = (argc > 4) ? argv[4] : "lo";
+
+	Sweep sweep;
+	ProbeEngine probes(sweep, rate, PROBE_TIMEOUT, (iface == "lo") ? "127.0.0.1" : "", iface);
+
+	for (int i=0; i < ntargets; i++)
+		probes.ping(htonl(first + i), i);
+
+	double start = now();
+	probes.run();
+	double elapsed = now() - start;
+
+	cout << ntargets << " targets in " << elapsed << "s (" << (long) (ntargets / elapsed) << " probes/s): "
+		<< sweep.replies << " replies, " << sweep.errors << " ICMP errors, " << sweep.timeouts << " timeouts";
+
+	if (sweep.replies + sweep.errors)
+		cout << ", average RTT " << sweep.rtt / (sweep.replies + sweep.errors) * 1000 << "ms";
+
+	cout << endl;
+	return 0;
+}
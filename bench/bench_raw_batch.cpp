@@ -0,0 +1,84 @@
+/**
+ * Raw transmit benchmark: one sendto() per packet vs sendmmsg() batches vs a TPACKET_V3 TX ring
+ *
+ * It sends UDP packets compiled into a PacketTemplate (a different source port each time)
+ * to the discard port of 127.0.0.1, through RawSocket::write(), then RawSocket::queue() and
+ * flush(), then a TxRing on the interface (loopback by default; on a veth pair pass the
+ * interface and the destination addresses). It must be run as root.
+ *
+ * Usage: bench_raw_batch [packets] [interface] [src address] [dst address] [dst MAC]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <sys/time.h>
+#include <usock.h>
+#include <usock_packet.h>
+#include <usock_ring.h>
+
+using namespace std;
+using namespace usock;
+
+#define	PAYLOAD_SIZE	32
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void report (const char *name, int npkts, double elapsed)  {
+	cout << name << (long) (npkts / elapsed) << " packets/s\n";
+}
+
+int main (int argc, char **argv)  {
+	int npkts = (argc > 1) ? atoi(argv[1]) : 500000;
+	string iface = (argc > 2) ? argv[2] : "lo";
+	string src = (argc > 3) ? argv[3] : "127.0.0.1";
+	string dst = (argc > 4) ? argv[4] : "127.0.0.1";
+	string mac = (argc > 5) ? argv[5] : "";
+	char payload[PAYLOAD_SIZE] = { 0 };
+	double start;
+
+	RawSocket s(iface);
+	s.buildIPv4(dst, src, IPPROTO_UDP);
+	s.buildUDP(1024, 9);
+	s.setPayload(payload, sizeof(payload));
+	PacketTemplate t(s);
+
+	start = now();
+
+	for (int i=0; i < npkts; i++)  {
+		t.setSrcPort(1024 + (i & 0x7fff));
+		s.write(t);
+	}
+
+	report("write():         ", npkts, now() - start);
+	start = now();
+
+	for (int i=0; i < npkts; i++)  {
+		t.setSrcPort(1024 + (i & 0x7fff));
+		s.queue(t);
+	}
+
+	s.flush();
+	report("queue()/flush(): ", npkts, now() - start);
+
+	TxRing ring(s, mac);
+	start = now();
+
+	for (int i=0; i < npkts; i++)  {
+		t.setSrcPort(1024 + (i & 0x7fff));
+		ring.queue(t);
+
+		if (ring.queued() == ring.capacity() / 2)
+			ring.flush();
+	}
+
+	ring.flush();
+	report("TxRing:          ", npkts, now() - start);
+	return 0;
+}
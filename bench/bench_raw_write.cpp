@@ -0,0 +1,121 @@
+/**
+ * Raw socket benchmark: one socket and one set of buffers per packet vs RawSocket::write()
+ *
+ * It sends UDP packets with a small payload to the discard port of the loopback interface,
+ * first the way RawSocket::write() used to (a new raw socket and a heap copy of the packet
+ * for each packet and each checksum), then through RawSocket::write(), which reuses the
+ * descriptor and the packet buffer of the socket. It must be run as root.
+ *
+ * Usage: bench_raw_write [packets]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sys/time.h>
+#include <usock.h>
+
+using namespace std;
+using namespace usock;
+
+#define	PAYLOAD_SIZE	32
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static u_int16_t csum (u_int16_t *buf, int nwords)  {
+	u_int32_t sum;
+
+	for (sum = 0; nwords > 0; nwords--)
+		sum += *buf++;
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return ~sum;
+}
+
+// What a write() used to cost: a packet allocation, a scratch copy for each checksum and a new descriptor
+static void oldWrite (const u_int8_t *head, u_int32_t head_len, const u_int8_t *payload, u_int32_t payload_len)  {
+	u_int32_t len = head_len + payload_len;
+	u_int8_t *pkt = new u_int8_t[len];
+	int opt = 1, sd;
+
+	memcpy (pkt, head, head_len);
+	memcpy (pkt + head_len, payload, payload_len);
+
+	u_int8_t *buf = new u_int8_t[len];
+	memcpy (buf, pkt, len);
+	((struct iphdr*) pkt)->check = csum((u_int16_t*) buf, len >> 1);
+	delete [] buf;
+
+	buf = new u_int8_t[len];
+	memcpy (buf, pkt, len);
+	((struct udphdr*) (pkt + sizeof(struct iphdr)))->check = csum((u_int16_t*) buf, len >> 1);
+	delete [] buf;
+
+	if ((sd = socket(AF_INET, SOCK_RAW, IPPROTO_UDP)) < 0)  {
+		cerr << "socket error (are you root?)\n";
+		exit(1);
+	}
+
+	setsockopt(sd, IPPROTO_IP, IP_HDRINCL, &opt, sizeof(opt));
+
+	struct sockaddr_in sin;
+	memset (&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = ((struct iphdr*) pkt)->daddr;
+	sendto(sd, pkt, len, 0, (struct sockaddr*) &sin, sizeof(sin));
+
+	// The old code didn't even close it
+	close(sd);
+	delete [] pkt;
+}
+
+int main (int argc, char **argv)  {
+	int npkts = (argc > 1) ? atoi(argv[1]) : 200000;
+	u_int8_t payload[PAYLOAD_SIZE] = { 0 };
+	u_int8_t head[sizeof(struct iphdr) + sizeof(struct udphdr)];
+	struct iphdr *ip = (struct iphdr*) head;
+	struct udphdr *udp = (struct udphdr*) (head + sizeof(struct iphdr));
+	double start, elapsed;
+
+	memset (head, 0, sizeof(head));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 32;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = ip->daddr = inet_addr("127.0.0.1");
+	udp->source = htons(1234);
+	udp->dest = htons(9);
+	udp->len = htons(sizeof(struct udphdr) + sizeof(payload));
+
+	start = now();
+
+	for (int i=0; i < npkts; i++)
+		oldWrite(head, sizeof(head), payload, sizeof(payload));
+
+	elapsed = now() - start;
+	cout << "socket per packet: " << (long) (npkts / elapsed) << " packets/s\n";
+
+	RawSocket s("lo");
+	s.buildIPv4("127.0.0.1", "127.0.0.1", IPPROTO_UDP);
+	s.buildUDP(1234, 9);
+	s.setPayload(payload, sizeof(payload));
+	start = now();
+
+	for (int i=0; i < npkts; i++)
+		s.write();
+
+	elapsed = now() - start;
+	cout << "RawSocket::write:  " << (long) (npkts / elapsed) << " packets/s\n";
+	return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * Line protocol benchmark: buffered Socket::readline() vs one recv() per byte
+ *
+ * A child process writes a number of HTTP-header-like lines on a loopback TCP connection,
+ * and the parent reads them back, first with a byte-by-byte reader (what readline() used to
+ * do), then with Socket::readline(). The recv() calls are counted by wrapping the libc symbol.
+ *
+ * Usage: bench_readline [lines] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <usock.h>
+
+using namespace std;
+using namespace usock;
+
+static unsigned long nrecv = 0;
+
+extern "C" ssize_t recv (int fd, void *buf, size_t len, int flags)  {
+	typedef ssize_t (*recv_t)(int, void*, size_t, int);
+	static recv_t real_recv = NULL;
+
+	if (!real_recv)
+		real_recv = (recv_t) dlsym(RTLD_NEXT, "recv");
+
+	nrecv++;
+	return real_recv(fd, buf, len, flags);
+}
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static string naiveReadline (Socket& s)  {
+	string line;
+	char c;
+
+	while (recv(s.getDescriptor(), &c, 1, 0) == 1 && c != '\n')
+		if (c != '\r')
+			line += c;
+
+	return line;
+}
+
+static void serve (u_int16_t port, int nlines)  {
+	ServerSocket ss(port, DEFAULT_MAXCON, "127.0.0.1");
+
+	for (int round=0; round < 2; round++)  {
+		Socket s = ss.accept();
+		string chunk;
+
+		for (int i=0; i < nlines; i++)  {
+			chunk += "X-Benchmark-Header: some reasonably long header value\r\n";
+
+			if (chunk.length() > 16384)  {
+				s.send(chunk);
+				chunk.clear();
+			}
+		}
+
+		chunk += "\r\n";
+		s.send(chunk);
+		s.close();
+	}
+}
+
+static void report (const char *name, int nlines, double elapsed)  {
+	cout << name << ": " << nlines << " lines in " << elapsed << "s, "
+		<< (long) (nlines / elapsed) << " lines/s, "
+		<< (double) nrecv / nlines << " recv() calls/line\n";
+}
+
+int main (int argc, char **argv)  {
+	int nlines = (argc > 1) ? atoi(argv[1]) : 100000;
+	u_int16_t port = (argc > 2) ? atoi(argv[2]) : 19998;
+	pid_t server;
+
+	if ((server = fork()) == 0)  {
+		serve(port, nlines);
+		exit(0);
+	}
+
+	usleep(200000);
+
+	{
+		Socket s("127.0.0.1", port);
+		double start = now();
+		nrecv = 0;
+
+		for (int i=0; i < nlines; i++)
+			naiveReadline(s);
+
+		report("byte-by-byte", nlines, now() - start);
+	}
+
+	{
+		Socket s("127.0.0.1", port);
+		double start = now();
+		nrecv = 0;
+
+		for (int i=0; i < nlines; i++)
+			s.readline();
+
+		report("buffered    ", nlines, now() - start);
+	}
+
+	waitpid(server, NULL, 0);
+	return 0;
+}
+
@@ -0,0 +1,103 @@
+/**
+ * File serving benchmark: read() + Socket::send() vs Socket::sendFile()
+ *
+ * It creates a temporary file and serves it over a loopback TCP connection, first by
+ * reading it in memory and sending it through Socket::send(const std::string&), then
+ * through Socket::sendFile(). The client drains the connection and reports the throughput.
+ *
+ * Usage: bench_sendfile [size in MB] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <usock.h>
+
+using namespace std;
+using namespace usock;
+
+#define	CHUNK_SIZE	65536
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void serve (u_int16_t port, const char *path)  {
+	ServerSocket ss(port, DEFAULT_MAXCON, "127.0.0.1");
+
+	{
+		Socket s = ss.accept();
+		int fd = open(path, O_RDONLY);
+		char buf[CHUNK_SIZE];
+		string content;
+		ssize_t n;
+
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			content.append(buf, n);
+
+		s.send(content);
+		close(fd);
+	}
+
+	{
+		Socket s = ss.accept();
+		s.sendFile(path);
+	}
+}
+
+static double drain (u_int16_t port, long size)  {
+	Socket s("127.0.0.1", port);
+	char buf[CHUNK_SIZE];
+	struct iovec iov = { buf, sizeof(buf) };
+	long total = 0;
+	u_int32_t n;
+	double start = now();
+
+	while (total < size && (n = s.recv(&iov, 1)) > 0)
+		total += n;
+
+	return now() - start;
+}
+
+int main (int argc, char **argv)  {
+	long mb = (argc > 1) ? atol(argv[1]) : 256;
+	u_int16_t port = (argc > 2) ? atoi(argv[2]) : 19996;
+	char path[] = "/tmp/usock_bench_XXXXXX";
+	char buf[CHUNK_SIZE];
+	int fd = mkstemp(path);
+	pid_t server;
+
+	for (int i=0; i < (int) sizeof(buf); i++)
+		buf[i] = i;
+
+	for (long i=0; i < mb * 1024 * 1024 / CHUNK_SIZE; i++)
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			return 1;
+
+	close(fd);
+
+	if ((server = fork()) == 0)  {
+		serve(port, path);
+		exit(0);
+	}
+
+	usleep(200000);
+	double t1 = drain(port, mb * 1024 * 1024);
+	cout << "read+send: " << mb << " MB in " << t1 << "s (" << mb / t1 << " MB/s)\n";
+
+	double t2 = drain(port, mb * 1024 * 1024);
+	cout << "sendFile:  " << mb << " MB in " << t2 << "s (" << mb / t2 << " MB/s)\n";
+
+	waitpid(server, NULL, 0);
+	unlink(path);
+	return 0;
+}
+
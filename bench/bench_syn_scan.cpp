@@ -0,0 +1,96 @@
+/**
+ * Stateless SYN prober benchmark: SynScanner vs one connect() per port
+ *
+ * It checks a range of TCP ports of a host, first with a blocking connect() on a new socket
+ * for each port (the plain syscalls are used, as Socket throws on a refused connection), then
+ * with a SynScanner, and reports how long each took and how many ports were found open.
+ * It needs root privileges.
+ *
+ * Usage: bench_syn_scan [ports] [SYNs/s] [host] [interface]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <usock.h>
+#include <usock_probe.h>
+
+using namespace std;
+using namespace usock;
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+class Ports : public ScanHandler  {
+public:
+	long open, closed;
+	double rtt;
+
+	Ports() : open(0), closed(0), rtt(0.0)  {}
+
+	void onResult (const ScanResult& r)  {
+		if (r.open)
+			open++;
+		else
+			closed++;
+
+		rtt += r.rtt;
+	}
+};
+
+int main (int argc, char **argv)  {
+	int nports = (argc > 1) ? atoi(argv[1]) : 10000;
+	double rate = (argc > 2) ? atof(argv[2]) : 100000.0;
+	string host = (argc > 3) ? argv[3] : "127.0.0.1";
+	string iface = (argc > 4) ? argv[4] : "lo";
+	struct sockaddr_in sin;
+	long open = 0;
+
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(host.c_str());
+
+	double start = now();
+
+	for (int port=1; port <= nports; port++)  {
+		int sd = socket(AF_INET, SOCK_STREAM, 0);
+		sin.sin_port = htons(port);
+
+		if (connect(sd, (struct sockaddr*) &sin, sizeof(sin)) == 0)
+			open++;
+
+		close(sd);
+	}
+
+	double elapsed = now() - start;
+	cout << "connect():   " << nports << " ports in " << elapsed << "s, " << open << " open\n";
+
+	Ports ports;
+	SynScanner scanner(ports, rate, PROBE_TIMEOUT, (iface == "lo") ? "127.0.0.1" : "", iface);
+
+	for (int port=1; port <= nports; port++)
+		scanner.add(sin.sin_addr.s_addr, port);
+
+	start = now();
+
+	while (scanner.step() > 0);
+
+	elapsed = now() - start;
+	scanner.run();
+
+	cout << "SynScanner:  " << nports << " ports in " << elapsed << "s (plus " << PROBE_TIMEOUT << "s for the late answers), "
+		<< ports.open << " open, " << ports.closed << " closed";
+
+	if (ports.open + ports.closed)
+		cout << ", average RTT " << ports.rtt / (ports.open + ports.closed) * 1e6 << "us";
+
+	cout << endl;
+	return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * UDP benchmark: one datagram per syscall vs recvmmsg/sendmmsg batches
+ *
+ * Send side: it sends a number of small datagrams to a loopback socket, first one per
+ * UDPSocket::send() call, then through UDPSocket::sendBatch().
+ * Receive side: a child process floods the receiver through sendBatch() for a few seconds,
+ * while the parent receives through UDPSocket::recv() and then through UDPSocket::recvBatch().
+ *
+ * Usage: bench_udp_batch [packets] [batch size] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <usock.h>
+
+using namespace std;
+using namespace usock;
+
+#define	PKT_SIZE	64
+#define	RECV_SECONDS	2.0
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void flood (u_int16_t port, u_int32_t nbatch)  {
+	UDPSocket s;
+	DatagramBatch batch(nbatch, PKT_SIZE);
+	struct sockaddr_in to;
+	char pkt[PKT_SIZE] = { 0 };
+
+	to.sin_family = AF_INET;
+	to.sin_port = htons(port);
+	to.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	while (1)  {
+		while (batch.append(pkt, sizeof(pkt), (struct sockaddr*) &to, sizeof(to)));
+		s.sendBatch(batch);
+	}
+}
+
+int main (int argc, char **argv)  {
+	int npkts = (argc > 1) ? atoi(argv[1]) : 1000000;
+	u_int32_t nbatch = (argc > 2) ? atoi(argv[2]) : 64;
+	u_int16_t port = (argc > 3) ? atoi(argv[3]) : 19997;
+	char pkt[PKT_SIZE] = { 0 };
+	double start, elapsed;
+
+	UDPSocket rx;
+	int rcvbuf = 4 << 20;
+	rx.setSockOpt(SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	rx.bind(port);
+
+	UDPSocket tx;
+	struct sockaddr_in to;
+	to.sin_family = AF_INET;
+	to.sin_port = htons(port);
+	to.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	// The receiver is non-blocking and nobody reads: we only measure the sender here
+	rx.setBlocking(false);
+	start = now();
+
+	for (int i=0; i < npkts; i++)
+		tx.send(pkt, sizeof(pkt), "127.0.0.1", port);
+
+	elapsed = now() - start;
+	cout << "send, single: " << (long) (npkts / elapsed) << " packets/s\n";
+
+	DatagramBatch out(nbatch, PKT_SIZE);
+	start = now();
+
+	for (int i=0; i < npkts; i += nbatch)  {
+		while (out.append(pkt, sizeof(pkt), (struct sockaddr*) &to, sizeof(to)));
+		tx.sendBatch(out);
+	}
+
+	elapsed = now() - start;
+	cout << "send, batch:  " << (long) (npkts / elapsed) << " packets/s\n";
+
+	for (int mode=0; mode < 2; mode++)  {
+		pid_t child;
+		rx.setBlocking(true);
+
+		if ((child = fork()) == 0)  {
+			flood(port, nbatch);
+			exit(0);
+		}
+
+		DatagramBatch in(nbatch, PKT_SIZE);
+		long received = 0;
+		start = now();
+
+		while ((elapsed = now() - start) < RECV_SECONDS)  {
+			if (mode == 0)  {
+				rx.recv(pkt, sizeof(pkt));
+				received++;
+			} else
+				received += rx.recvBatch(in);
+		}
+
+		kill(child, SIGKILL);
+		waitpid(child, NULL, 0);
+
+		cout << ((mode == 0) ? "recv, single: " : "recv, batch:  ") << (long) (received / elapsed) << " packets/s\n";
+
+		// Drop what's left in the socket buffer before the next round
+		rx.setBlocking(false);
+		while (recv(rx.getDescriptor(), pkt, sizeof(pkt), 0) > 0);
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,222 @@
+/**
+ * Echo benchmark: blocking sockets vs UringLoop on epoll vs UringLoop on io_uring
+ *
+ * It starts an echo server on the loopback interface, in a child process, either as a
+ * blocking recv()/send() loop in a thread for each connection, or as a UringLoop in epoll
+ * mode, or as a UringLoop on io_uring. A number of client threads keep their connection
+ * busy with ping-pong messages for a few seconds, and the benchmark reports the message
+ * rate, the syscalls made by the server for each message and the p50/p99 round-trip
+ * time. The syscalls are counted by wrapping the libc symbols, as bench_readline does.
+ *
+ * Usage: bench_uring <blocking|epoll|uring> [connections] [seconds] [message size] [port]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cstdarg>
+#include <cstdlib>
+#include <csignal>
+#include <dlfcn.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <usock.h>
+#include <usock_uring.h>
+
+using namespace std;
+using namespace usock;
+
+struct Shared  {
+	unsigned long syscalls;
+	int uring;
+};
+
+// Only the server process counts its syscalls, in memory shared with the parent
+static Shared *shared = NULL;
+static bool counting = false;
+
+#define	WRAP(ret, name, params, args)  \
+	extern "C" ret name params  {  \
+		typedef ret (*fn_t) params;  \
+		static fn_t real = NULL;  \
+		if (!real)  \
+			real = (fn_t) dlsym(RTLD_NEXT, #name);  \
+		if (counting)  \
+			__sync_fetch_and_add(&shared->syscalls, 1);  \
+		return real args;  \
+	}
+
+WRAP(ssize_t, recv, (int fd, void *buf, size_t len, int flags), (fd, buf, len, flags))
+WRAP(ssize_t, send, (int fd, const void *buf, size_t len, int flags), (fd, buf, len, flags))
+WRAP(ssize_t, recvfrom, (int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *alen), (fd, buf, len, flags, addr, alen))
+WRAP(ssize_t, sendto, (int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t alen), (fd, buf, len, flags, addr, alen))
+WRAP(ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags), (fd, msg, flags))
+WRAP(ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags), (fd, msg, flags))
+WRAP(int, accept, (int fd, struct sockaddr *addr, socklen_t *len), (fd, addr, len))
+WRAP(int, accept4, (int fd, struct sockaddr *addr, socklen_t *len, int flags), (fd, addr, len, flags))
+WRAP(int, epoll_wait, (int epfd, struct epoll_event *ev, int max, int timeout), (epfd, ev, max, timeout))
+WRAP(int, epoll_ctl, (int epfd, int op, int fd, struct epoll_event *ev), (epfd, op, fd, ev))
+WRAP(int, poll, (struct pollfd *fds, nfds_t n, int timeout), (fds, n, timeout))
+
+// io_uring_setup(), io_uring_enter() and io_uring_register() go through syscall()
+extern "C" long syscall (long nr, ...)  {
+	typedef long (*syscall_t)(long, ...);
+	static syscall_t real_syscall = NULL;
+	va_list ap;
+	long a[6];
+
+	if (!real_syscall)
+		real_syscall = (syscall_t) dlsym(RTLD_NEXT, "syscall");
+
+	va_start(ap, nr);
+
+	for (int i=0; i < 6; i++)
+		a[i] = va_arg(ap, long);
+
+	va_end(ap);
+
+	if (counting)
+		__sync_fetch_and_add(&shared->syscalls, 1);
+
+	return real_syscall(nr, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+class EchoHandler : public UringHandler  {
+public:
+	void onData (UringLoop& loop, Socket& s, const char* data, u_int32_t len)  {
+		loop.send(s, data, len);
+	}
+};
+
+static double now()  {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void echoThread (Socket s)  {
+	char buf[URING_BUFSIZE];
+	struct iovec iov = { buf, sizeof(buf) };
+	u_int32_t n;
+
+	while ((n = s.recv(&iov, 1)) > 0)
+		s.send(buf, n);
+}
+
+static void serve (const string& mode, u_int16_t port)  {
+	ServerSocket ss(port, DEFAULT_MAXCON, "127.0.0.1");
+	counting = true;
+
+	if (mode == "blocking")  {
+		while (1)
+			thread(echoThread, ss.accept()).detach();
+	}
+
+	EchoHandler handler;
+	UringLoop loop(URING_ENTRIES, URING_BUFFERS, URING_BUFSIZE, mode == "uring");
+
+	shared->uring = loop.usingUring();
+	loop.add(ss, handler);
+	loop.run();
+}
+
+static void client (u_int16_t port, u_int32_t size, double until, vector<double>& rtt)  {
+	Socket s("127.0.0.1", port);
+	string msg(size, 'x');
+	char buf[URING_BUFSIZE];
+
+	while (now() < until)  {
+		double start = now();
+		u_int32_t got = 0;
+
+		s.send(msg);
+
+		while (got < size)  {
+			struct iovec iov = { buf, sizeof(buf) };
+			u_int32_t n = s.recv(&iov, 1);
+
+			if (n == 0)
+				return;
+
+			got += n;
+		}
+
+		rtt.push_back(now() - start);
+	}
+}
+
+int main (int argc, char **argv)  {
+	if (argc < 2)  {
+		cerr << "Usage: " << argv[0] << " <blocking|epoll|uring> [connections] [seconds] [message size] [port]\n";
+		return 1;
+	}
+
+	string mode = argv[1];
+	int nconn = (argc > 2) ? atoi(argv[2]) : 16;
+	double seconds = (argc > 3) ? atof(argv[3]) : 5;
+	u_int32_t size = (argc > 4) ? atoi(argv[4]) : 64;
+	u_int16_t port = (argc > 5) ? atoi(argv[5]) : 19988;
+	pid_t server;
+
+	if (size < 1 || size > URING_BUFSIZE)
+		size = 64;
+
+	shared = (Shared*) mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	shared->syscalls = 0;
+	shared->uring = 0;
+
+	if ((server = fork()) == 0)  {
+		serve(mode, port);
+		exit(0);
+	}
+
+	usleep(200000);
+
+	vector< vector<double> > rtt(nconn);
+	vector<thread> clients;
+	unsigned long before = shared->syscalls;
+	double start = now();
+
+	for (int i=0; i < nconn; i++)
+		clients.push_back(thread(client, port, size, start + seconds, ref(rtt[i])));
+
+	for (int i=0; i < nconn; i++)
+		clients[i].join();
+
+	double elapsed = now() - start;
+	unsigned long syscalls = shared->syscalls - before;
+	kill(server, SIGKILL);
+	waitpid(server, NULL, 0);
+
+	vector<double> all;
+
+	for (int i=0; i < nconn; i++)
+		all.insert(all.end(), rtt[i].begin(), rtt[i].end());
+
+	if (all.empty())  {
+		cerr << "No message was echoed\n";
+		return 1;
+	}
+
+	sort(all.begin(), all.end());
+
+	if (mode == "uring" && !shared->uring)
+		cout << "io_uring is not available, the loop fell back to epoll\n";
+
+	cout << mode << ": " << nconn << " connections, " << (long) (all.size() / elapsed) << " messages/s, "
+		<< (double) syscalls / all.size() << " syscalls/message, p50 "
+		<< all[all.size() / 2] * 1e6 << " us, p99 "
+		<< all[all.size() * 99 / 100] * 1e6 << " us\n";
+
+	return 0;
+}
+
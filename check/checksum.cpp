@@ -0,0 +1,174 @@
+/**
+ * Internet checksum check: every kernel compiled in and supported by the running CPU
+ * (scalar, SSE2, AVX2) is called directly and compared against a plain 16-bit reference,
+ * over random lengths, offsets and alignments, with and without a running sum. Then the
+ * dispatched csum()/csumPartial() and the incremental updates are checked as well.
+ *
+ * It exits with 1 on the first mismatch. Run it through `make check`.
+ *
+ * Usage: check_checksum [rounds per kernel] [random seed, to replay a failure]
+ *
+ * by BlackLight, (C) 2009
+ */
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <usock_checksum.h>
+
+using namespace std;
+using namespace usock;
+
+// What RawSocket::csum() used to do, plus the odd tail
+static u_int16_t reference (const u_int8_t *buf, u_int32_t len)  {
+	u_int32_t sum = 0;
+	u_int16_t w;
+
+	for (; len > 1; len -= 2, buf += 2)  {
+		memcpy (&w, buf, 2);
+		sum += w;
+
+		if (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	if (len)  {
+		w = 0;
+		memcpy (&w, buf, 1);
+		sum += w;
+	}
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (u_int16_t) ~sum;
+}
+
+// 0x0000 and 0xffff are the same value in one's complement
+static bool same (u_int16_t a, u_int16_t b)  {
+	return a == b || ((a == 0 || a == 0xffff) && (b == 0 || b == 0xffff));
+}
+
+// Mostly short and packet-sized buffers, sometimes up to the whole buffer
+static u_int32_t randomLength (u_int32_t max)  {
+	switch (rand() % 4)  {
+		case 0:
+			return rand() % 256;
+		case 1:
+			return rand() % 9001;
+		default:
+			return rand() % max;
+	}
+}
+
+static bool checkKernel (const char *name, CsumKernelFn fn, vector<u_int8_t>& data, long rounds)  {
+	for (long i=0; i < rounds; i++)  {
+		u_int32_t off = rand() % 64;
+		u_int32_t len = randomLength(data.size() - off);
+		const u_int8_t *p = &data[off];
+		u_int16_t ref = reference(p, len);
+
+		if (csumFold(fn(p, len, 0)) != ref)  {
+			cerr << name << ": mismatch, offset " << off << ", length " << len << endl;
+			return false;
+		}
+
+		// The same buffer summed in two chunks, the first one of even length
+		u_int32_t split = (rand() % (len + 1)) & ~1U;
+
+		if (csumFold(fn(p + split, len - split, fn(p, split, 0))) != ref)  {
+			cerr << name << ": chained mismatch, offset " << off << ", length " << len
+				<< ", split " << split << endl;
+			return false;
+		}
+
+		// Any running sum, up to 0xffffffff, must be carried into the result
+		u_int32_t seed = (rand() % 8) ? (u_int32_t) rand() * 2654435761U : 0xffffffffU;
+		u_int64_t expect = (u_int64_t) seed + (u_int16_t) ~ref;
+
+		if (!same(csumFold(fn(p, len, seed)), csumFold((u_int32_t) ((expect & 0xffffffff) + (expect >> 32)))))  {
+			cerr << name << ": mismatch with running sum " << seed << ", offset " << off
+				<< ", length " << len << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool checkDispatch (vector<u_int8_t>& data, long rounds)  {
+	for (long i=0; i < rounds; i++)  {
+		u_int32_t off = rand() % 64;
+		u_int32_t len = randomLength(data.size() - off);
+		u_int8_t *p = &data[off];
+		u_int16_t ref = reference(p, len);
+
+		if (csum(p, len) != ref || csumFold(csumPartial(p, len)) != ref)  {
+			cerr << csumKernel() << ": dispatch mismatch, offset " << off << ", length " << len << endl;
+			return false;
+		}
+
+		// Change a 16-bit field at the beginning and a 32-bit one further on, and update the checksum
+		if (len >= 8)  {
+			u_int32_t at = 2 + 2 * (rand() % ((len - 4) / 2));
+			u_int16_t old16, new16 = rand();
+			u_int32_t old32, new32 = rand();
+
+			memcpy (&old16, p, 2);
+			memcpy (p, &new16, 2);
+			memcpy (&old32, p + at, 4);
+			memcpy (p + at, &new32, 4);
+
+			if (!same(csumUpdate32(csumUpdate16(ref, old16, new16), old32, new32), reference(p, len)))  {
+				cerr << "incremental mismatch: offset " << off << ", length " << len << endl;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int main (int argc, char **argv)  {
+	long rounds = (argc > 1) ? atol(argv[1]) : 20000;
+	const char *kernels[] = { "scalar", "sse2", "avx2" };
+	unsigned seed = (argc > 2) ? atol(argv[2]) : time(NULL);
+	vector<u_int8_t> data(262144 + 64);
+
+	cout << "seed " << seed << endl;
+	srand(seed);
+
+	for (u_int32_t k=0; k < sizeof(kernels) / sizeof(kernels[0]); k++)  {
+		CsumKernelFn fn = csumKernelByName(kernels[k]);
+
+		if (!fn)  {
+			cout << kernels[k] << ": not supported, skipped" << endl;
+			continue;
+		}
+
+		// Random bytes, then all ones to push every carry to its limit
+		for (u_int32_t i=0; i < data.size(); i++)
+			data[i] = rand();
+
+		if (!checkKernel(kernels[k], fn, data, rounds))
+			return 1;
+
+		memset (&data[0], 0xff, data.size());
+
+		if (!checkKernel(kernels[k], fn, data, rounds / 10))
+			return 1;
+
+		cout << kernels[k] << ": ok" << endl;
+	}
+
+	for (u_int32_t i=0; i < data.size(); i++)
+		data[i] = rand();
+
+	if (!checkDispatch(data, rounds))
+		return 1;
+
+	cout << "csum() through " << csumKernel() << ": ok" << endl;
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <iostream>
 #include <memory.h>
 #include <usock.h>
+#include <usock_parser.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 
@@ -28,6 +29,7 @@ int main(int argc, char **argv)  {
 	s.buildIPv4(s.getHostByName(argv[1]), s.getIPv4addr(), RawSocket::icmp);
 	s.buildICMPv4(ICMP_ECHO);
 	s.setPayload(payload, sizeof(payload));
+	s.setFilter(PacketFilter().icmpType(ICMP_ECHOREPLY));
 	
 	cout << "Sending a ping request to " << argv[1] << endl;
 	s.setTimeout(1.0);
@@ -35,12 +37,18 @@ int main(int argc, char **argv)  {
 	try  {
 		s.write();
 		
-		unsigned char* buf = (unsigned char*) s.read(64, argv[1]);
-		struct iphdr ip;
-		memcpy (&ip, buf, sizeof(struct iphdr));
-		string addr = s.ntoa(ip.saddr);
-
-		cout << "Reply from " << addr << endl;
+		// The whole packet, and its length
+		Buffer buf = s.readBuffer(0, argv[1]);
+		PacketParser reply;
+
+		if (!reply.parse((const u_int8_t*) buf.data(), buf.size()) || reply.protocol() != IPPROTO_ICMP
+				|| !reply.icmp().valid())  {
+			cerr << "Malformed reply from " << argv[1] << endl;
+			return 1;
+		}
+
+		cout << "Reply from " << s.ntoa(reply.ipv4().src()) << ", icmp_seq=" << reply.icmp().seq()
+			<< " ttl=" << (int) reply.ipv4().ttl() << endl;
 	}
 
 	catch (exception e)  {
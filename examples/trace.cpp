@@ -1,21 +1,36 @@
 /**
  * A simple traceroute program
  * It just requires the host to traceroute, usock does anything else.
+ * All the hops are probed at once through a ProbeEngine, and printed when the answers are in.
  * by BlackLight, (C) 2009
  */
 
 #include <iostream>
 #include <string>
 #include <cstdlib>
-#include <memory.h>
 #include <usock.h>
-#include <netinet/ip.h>
+#include <usock_probe.h>
 #include <netinet/ip_icmp.h>
-#include <sys/time.h>
 
 using namespace std;
 using namespace usock;
 
+class Hops : public ProbeHandler  {
+public:
+	ProbeResult hop[PROBE_MAX_HOPS + 1];
+	bool answered[PROBE_MAX_HOPS + 1];
+
+	Hops()  {
+		for (int i=0; i <= PROBE_MAX_HOPS; i++)
+			answered[i] = false;
+	}
+
+	void onReply (const ProbeResult& r)  {
+		hop[r.ttl] = r;
+		answered[r.ttl] = true;
+	}
+};
+
 int main(int argc, char **argv)  {
 	if (!argv[1])  {
 		cerr << "Usage: " << argv[0] << " <host>\n";
@@ -24,63 +39,32 @@ int main(int argc, char **argv)  {
 
 	RawSocket s;
 	string addr = s.getHostByName(argv[1]);
-	s.close();
 
 	if (addr.empty())  {
 		cerr << "Unable to resolve " << argv[1] << endl;
 		return 1;
 	}
 
-	u_int8_t payload[56];
-
-	for (int i=0; i < sizeof(payload); i++)
-		payload[i] = i;
+	Hops hops;
+	ProbeEngine probes(hops, 100.0, 3.0);
 
-	bool ended = false;
-	struct timeval t1, t2;
 	cout << "Tracerouting " << argv[1] << " (" << addr << ")\n\n";
+	probes.trace(addr);
+	probes.run();
 
-	for (int i=1; !ended; i++)  {
-		s = RawSocket();
-		s.buildIPv4(addr, s.getIPv4addr(), RawSocket::icmp, i);
-		s.buildICMPv4(ICMP_ECHO);
-		s.setPayload(payload, sizeof(payload));
-		s.write();
-
-		gettimeofday (&t1, NULL);
-		bool recvd = false;
-		
-		while (!recvd)  {
-			try  {
-				struct iphdr ip;
-				struct icmphdr icmp;
-
-				u_int8_t* pkt = (u_int8_t*) s.read(sizeof(struct iphdr)+sizeof(struct icmphdr));
-				memcpy (&ip, pkt, sizeof(struct iphdr));
-				memcpy (&icmp, pkt+sizeof(struct iphdr), sizeof(struct icmphdr));
-
-				if (ip.protocol == RawSocket::icmp ||
-						(icmp.type == ICMP_ECHOREPLY && !(addr.compare(s.ntoa(ip.saddr)))) )  {
-						
-					gettimeofday (&t2, NULL);
-					time_t interval = (t2.tv_sec - t1.tv_sec)*1000 + (t2.tv_usec - t1.tv_usec)/1000;
-					
-					cout << i << ":\t" << s.ntoa(ip.saddr) << " (" << s.getHostByAddr(s.ntoa(ip.saddr)) << ")"
-						<< " - reached in " << interval << "ms\n";
-					
-					recvd = true;
-
-					if (icmp.type == ICMP_ECHOREPLY)
-						ended = true;
-				}
-			}
-			
-			catch (exception e)  {}
+	for (int i=1; i <= PROBE_MAX_HOPS; i++)  {
+		if (!hops.answered[i])  {
+			cout << i << ":\t*\n";
+			continue;
 		}
 
-		s.close();
+		string from = s.ntoa(hops.hop[i].from);
+		cout << i << ":\t" << from << " (" << s.getHostByAddr(from) << ")"
+			<< " - reached in " << (int) (hops.hop[i].rtt * 1000) << "ms\n";
+
+		if (hops.hop[i].icmpType != ICMP_TIME_EXCEEDED)
+			break;
 	}
 
 	return 0;
 }
-
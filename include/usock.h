@@ -50,10 +50,20 @@
 #define __USOCK_H
 
 #include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <ctime>
 #include <string>
+#include <vector>
+#include "usock_filter.h"
+#include "usock_buffer.h"
 
 #define	BUFRECV_SIZE	1024
 #define	DEFAULT_MAXCON	10
+#define	CONNECT_STAGGER	0.25
+#define	RAW_BATCH_SIZE	64
+#define	RAW_BACKOFF_MIN	50000
+#define	RAW_BACKOFF_MAX	10000000
 
 #ifndef	__FAVOR_BSD
 #define TH_FIN	 0x01
@@ -70,9 +80,100 @@
 
 namespace usock  {
 
+/**
+ * @class Endpoint
+ * @brief An IPv4 or IPv6 address and port, resolved once and then reused by the socket methods
+ * taking it, with no more lookups or address conversions on each call
+ * @author BlackLight
+ */
+class Endpoint  {
+
+private:
+	///@brief Socket address (sockaddr_in or sockaddr_in6)
+	struct sockaddr_storage sa;
+
+	///@brief Length of the socket address (0 for an empty endpoint)
+	socklen_t len;
+
+public:
+	/**
+	 * @brief Build an empty endpoint
+	 */
+	Endpoint() throw();
+
+	/**
+	 * @brief Build an endpoint resolving a host name through the default Resolver
+	 * @param host Host name/address
+	 * @param port Port
+	 * @param family Address family (AF_INET, AF_INET6, default: AF_UNSPEC, the first address found)
+	 */
+	Endpoint (const std::string& host, u_int16_t port, int family = AF_UNSPEC) throw();
+
+	/**
+	 * @brief Build an endpoint from a socket address
+	 * @param addr Socket address (sockaddr_in or sockaddr_in6)
+	 * @param len addr's length
+	 */
+	Endpoint (const struct sockaddr* addr, socklen_t len) throw();
+
+	/**
+	 * @brief Resolve a host name into all of its endpoints, through the default Resolver
+	 * @param host Host name/address
+	 * @param port Port
+	 * @param family Address family (AF_INET, AF_INET6, default: AF_UNSPEC, both)
+	 * @return The endpoints, in the order given by the resolver (empty if the name couldn't be resolved)
+	 */
+	static std::vector<Endpoint> resolve (const std::string& host, u_int16_t port, int family = AF_UNSPEC) throw();
+
+	/**
+	 * @brief Return true if the endpoint holds no address
+	 */
+	bool empty() const throw();
+
+	/**
+	 * @brief Return the address family (AF_INET or AF_INET6, AF_UNSPEC for an empty endpoint)
+	 */
+	int family() const throw();
+
+	/**
+	 * @brief Return true if the endpoint is an IPv4 address mapped into IPv6 (::ffff:a.b.c.d),
+	 * as the clients of a dual-stack socket are seen
+	 */
+	bool isV4Mapped() const throw();
+
+	/**
+	 * @brief Return the numeric address, as a string (IPv4-mapped addresses are returned in the IPv4 form)
+	 */
+	std::string host() const throw();
+
+	/**
+	 * @brief Return the port
+	 */
+	u_int16_t port() const throw();
+
+	/**
+	 * @brief Return the socket address, ready to be passed to connect()/sendto()
+	 */
+	const struct sockaddr* addr() const throw();
+
+	/**
+	 * @brief Return the length of the socket address
+	 */
+	socklen_t length() const throw();
+
+	/**
+	 * @brief Return the endpoint as "address:port" ("[address]:port" for IPv6)
+	 */
+	std::string toString() const throw();
+
+	bool operator== (const Endpoint& e) const throw();
+	bool operator!= (const Endpoint& e) const throw();
+};
+
 /**
  * @class BaseSocket
- * @brief Class for describing basic sockets
+ * @brief Class for describing basic sockets. A socket owns its descriptor, and closes it when it's destroyed:
+ * sockets can't be copied, but they can be moved (returned by value, or kept in a std::vector)
  * @author BlackLight
  */
 class BaseSocket  {
@@ -93,11 +194,119 @@ protected:
 	///@brief Optional timeout for connect/send/receive operations (default: no timeout, timeout = 0.0)
 	double timeout;
 
+	///@brief Input buffer, filled by readline() and drained by the receive methods
+	std::vector<char> rbuf;
+
+	///@brief Offset of the first unread byte and of the end of the buffered data inside rbuf
+	u_int32_t rbuf_head, rbuf_tail;
+
+	///@brief Sender of the last datagram read into the input buffer, and its length
+	struct sockaddr_storage rbuf_from;
+	socklen_t rbuf_fromlen;
+
 	/**
 	 * @brief Empty BaseSocket constructor - ONLY used inside the children classes
 	 * to initialize a Socket object using an already existen socket descriptor
 	 */
-	BaseSocket()  {}
+	BaseSocket() : sd(-1), timeout(0.0), rbuf_head(0), rbuf_tail(0), rbuf_fromlen(0)  {}
+
+	/**
+	 * @brief Move up to size already buffered bytes into buf
+	 * @return Number of bytes moved (0 if the input buffer is empty)
+	 */
+	u_int32_t drain (void* buf, u_int32_t size) throw();
+
+	/**
+	 * @brief Make room for at least room more bytes at the end of the input buffer, compacting
+	 * the unread bytes at its beginning and growing it if needed
+	 */
+	void makeRoom (u_int32_t room) throw();
+
+	/**
+	 * @brief Read a new chunk of data from the socket into the input buffer (just one recv() call).
+	 * The sender of a datagram is kept in rbuf_from
+	 * @return Number of bytes read, 0 on EOF
+	 */
+	int fill() throw();
+
+	/**
+	 * @brief Compute the absolute deadline (CLOCK_MONOTONIC) for an operation starting now
+	 * @param ts timespec structure that will hold the deadline
+	 * @return &ts, or NULL if no timeout is set on the socket
+	 */
+	const struct timespec* deadline (struct timespec& ts) throw();
+
+	/**
+	 * @brief Wait through poll() until the socket is ready for the specified events
+	 * @param events poll() events to wait for (POLLIN, POLLOUT)
+	 * @param deadline Absolute deadline as returned by deadline(), or NULL to wait forever
+	 */
+	void waitFor (short events, const struct timespec* deadline) throw();
+
+	/**
+	 * @brief Receive a buffer through a single recvfrom() call, waiting up to the socket timeout
+	 * if no data is available yet
+	 * @param until Deadline shared by several calls, as returned by deadline(), used instead of
+	 * a new one (default: NULL)
+	 * @return Number of bytes received, 0 on EOF or if the connection was reset
+	 */
+	ssize_t recvWait (void* buf, size_t size, int flags = 0, struct sockaddr* from = NULL, socklen_t* fromlen = NULL,
+			const struct timespec* until = NULL) throw();
+
+	/**
+	 * @brief Send a whole buffer, resuming partial writes and waiting up to the socket timeout
+	 * whenever the socket buffer is full
+	 */
+	void sendWait (const void* buf, size_t size, int flags = 0, const struct sockaddr* to = NULL, socklen_t tolen = 0) throw();
+
+	/**
+	 * @brief Same as recvWait(), through recvmsg()
+	 */
+	ssize_t recvMsgWait (struct msghdr* msg, int flags = 0) throw();
+
+	/**
+	 * @brief Same as sendWait(), through sendmsg(). Partial stream writes are resumed from the first unsent byte,
+	 * without copying the buffers (msg itself is left untouched)
+	 */
+	void sendMsgWait (const struct msghdr* msg, int flags = 0) throw();
+
+	/**
+	 * @brief Move the already buffered bytes into a list of buffers
+	 * @return Number of bytes moved
+	 */
+	u_int32_t drain (const struct iovec* iov, int iovcnt) throw();
+
+	/**
+	 * @brief Replace the socket descriptor with a new one of another address family (same type and protocol),
+	 * if it doesn't match the family of an endpoint we're going to use
+	 * @param family Address family
+	 */
+	void reopen (int family) throw();
+
+	/**
+	 * @brief Return the address of an endpoint in the form accepted by the socket: an IPv4 endpoint is
+	 * mapped into IPv6 (::ffff:a.b.c.d) when the socket is a dual-stack IPv6 one
+	 * @param ep Endpoint
+	 * @param tmp Storage for the mapped address, if needed
+	 * @param len Will hold the address length
+	 */
+	const struct sockaddr* peerAddr (const Endpoint& ep, struct sockaddr_storage& tmp, socklen_t& len) throw();
+
+	/**
+	 * @brief Read a line through the input buffer, scanning whole chunks for the line terminator
+	 * @return The line, without CR/LF characters ("\r" for an empty line, "" on EOF)
+	 */
+	std::string bufferedReadline() throw();
+
+	/**
+	 * @brief Take the next line out of the input buffer, if it holds a whole one (or eof is set)
+	 * @param line String that will hold the line, as bufferedReadline() returns it
+	 * @param scanned Number of buffered bytes already known not to hold a line terminator (0 for a new line),
+	 * updated when no line is taken, so that the next call only scans the bytes received in the meantime
+	 * @param eof Whether the stream is over: whatever is left is taken as the last line
+	 * @return true if a line was taken, false if more data is needed
+	 */
+	bool takeLine (std::string& line, u_int32_t& scanned, bool eof) throw();
 
 public:
 	///@brief Enum for describing possible socket targets
@@ -146,20 +355,53 @@ public:
 	 */
 	~BaseSocket();
 
+	/**
+	 * @brief Sockets own their descriptor, so they can't be copied: move them instead
+	 */
+	BaseSocket (const BaseSocket&) = delete;
+	BaseSocket& operator= (const BaseSocket&) = delete;
+
+	/**
+	 * @brief Take over the descriptor (and the buffered input) of another socket, which is left closed
+	 */
+	BaseSocket (BaseSocket&& s) noexcept;
+
+	/**
+	 * @brief Close the socket descriptor, then take over the one of another socket, which is left closed
+	 */
+	BaseSocket& operator= (BaseSocket&& s) noexcept;
+
+	/**
+	 * @brief Give up the ownership of the socket descriptor: the socket is left closed, and won't close it
+	 * @return The descriptor (-1 if the socket was already closed). The input already buffered is dropped
+	 */
+	int release() noexcept;
+
 	/**
 	 * @brief Close the socket descriptor
 	 */
 	void close();
 
 	/**
-	 * @brief Wrap method around gethostbyname() function
+	 * @brief Return the underlying socket descriptor (-1 if the socket has been closed)
+	 */
+	int getDescriptor() throw();
+
+	/**
+	 * @brief Return the number of bytes already received and buffered, but not read yet
+	 */
+	u_int32_t pending() throw();
+
+	/**
+	 * @brief Resolve a host name into an IP address, through the cache of the default Resolver
 	 * @param name Host name
+	 * @param family Address family (default: AF_INET; AF_INET6, or AF_UNSPEC for the first address of either family)
 	 * @return IP address of our host name, if found, an empty string otherwise
 	 */
-	std::string getHostByName (const std::string& name) throw();
+	std::string getHostByName (const std::string& name, int family = AF_INET) throw();
 
 	/**
-	 * @brief Wrap method around gethostbyaddr() function
+	 * @brief Resolve an IPv4 address into a host name, through the cache of the default Resolver
 	 * @param addr IPv4 address as a string
 	 * @return The hostname associated to addr, if found, an empty otherwise
 	 */
@@ -177,6 +419,16 @@ public:
 	 */
 	bool isBlocking() throw();
 
+	/**
+	 * @brief Return the local endpoint of the socket (empty if it is not bound)
+	 */
+	Endpoint localEndpoint() throw();
+
+	/**
+	 * @brief Return the remote endpoint of the socket (empty if it is not connected)
+	 */
+	Endpoint remoteEndpoint() throw();
+
 	/**
 	 * @brief Return the local address assigned to a socket descriptor
 	 */
@@ -208,7 +460,8 @@ public:
 	void setSockOpt (int level, int optname, void* optval, socklen_t optlen) throw();
 
 	/**
-	 * @brief Set a timeout (in seconds) on the socket
+	 * @brief Set a timeout (in seconds) on the socket. While a timeout is set the socket descriptor stays non-blocking,
+	 * and each operation waits for it through poll() until its deadline
 	 * @param timeout Second we're going to wait. It's a double value, so you can specify decimal digits to have a granularity precision
 	 * bigger than the seconds
 	 */
@@ -222,6 +475,12 @@ public:
 	
 };
 
+class ConnectOp;
+class RecvOp;
+class SendOp;
+class ReadlineOp;
+class AcceptOp;
+
 /**
  * @class Socket
  * @brief Class for building TCP sockets
@@ -236,7 +495,8 @@ public:
 	Socket() throw();
 
 	/**
-	 * @brief Constructor for the Socket class using an already existent socket descriptor
+	 * @brief Constructor for the Socket class using an already existent socket descriptor. The socket takes
+	 * the ownership of the descriptor, and closes it when it's destroyed (unless it's release()d first)
 	 * @param sd Socket descriptor
 	 * @param timeout Timeout to be set on the socket
 	 */
@@ -251,12 +511,29 @@ public:
 	Socket (const std::string& host, u_int16_t port, double timeout = 0.0) throw();
 
 	/**
-	 * @brief Create a TCP connection on the socket
+	 * @brief Create a TCP connection on the socket, trying all the IPv4/IPv6 addresses of the host
+	 * as connect(const std::vector<Endpoint>&) does
 	 * @param host Host name/address
 	 * @param port Remote port
 	 */
 	void connect (const std::string& host, u_int16_t port) throw();
 
+	/**
+	 * @brief Create a TCP connection on the socket, towards an already resolved endpoint
+	 * @param ep Remote endpoint
+	 */
+	void connect (const Endpoint& ep) throw();
+
+	/**
+	 * @brief Create a TCP connection towards the first of some endpoints which answers (Happy Eyeballs,
+	 * RFC 8305): the address families are alternated, and a new attempt is started every CONNECT_STAGGER
+	 * seconds, or as soon as the previous one fails, while the older ones are still in progress.
+	 * The socket descriptor is replaced by the one which connected first, so the options set on the socket
+	 * before (setSockOpt(), setsockopt()) are lost, except for the timeout: set them once connected
+	 * @param eps Remote endpoints, in order of preference
+	 */
+	void connect (const std::vector<Endpoint>& eps) throw();
+
 	/**
 	 * @brief Send a string onto a TCP socket
 	 * @param buf String to send
@@ -270,6 +547,33 @@ public:
 	 */
 	void send (const void* buf, u_int32_t size) throw();
 
+	/**
+	 * @brief Send a list of buffers onto a TCP socket (e.g. a header and a body) through a single
+	 * sendmsg() call, without joining them first
+	 * @param iov Buffers to be sent
+	 * @param iovcnt Number of buffers
+	 */
+	void send (const struct iovec* iov, int iovcnt) throw();
+
+	/**
+	 * @brief Send the content of a file onto a TCP socket without copying it through user space (sendfile()),
+	 * falling back on a pipe and splice() when the file doesn't support sendfile()
+	 * @param fd File descriptor
+	 * @param offset Offset of the first byte to be sent (default: 0)
+	 * @param length Number of bytes to be sent (default: 0, everything up to the end of the file)
+	 * @return Number of bytes sent (less than length only if the file is shorter)
+	 */
+	off_t sendFile (int fd, off_t offset = 0, off_t length = 0) throw();
+
+	/**
+	 * @brief Send the content of a file onto a TCP socket without copying it through user space
+	 * @param path File path
+	 * @param offset Offset of the first byte to be sent (default: 0)
+	 * @param length Number of bytes to be sent (default: 0, everything up to the end of the file)
+	 * @return Number of bytes sent
+	 */
+	off_t sendFile (const std::string& path, off_t offset = 0, off_t length = 0) throw();
+
 	/**
 	 * @brief Overloaded operator to send a buffer onto a TCP socket
 	 * @param buf Stuff to be sent
@@ -300,11 +604,92 @@ public:
 	 */
 	void recv (void* buf, u_int32_t size) throw();
 
+	/**
+	 * @brief Receive data from a TCP socket into a list of buffers, filled in order, through a single recvmsg() call
+	 * @param iov Buffers where the read stuff will be placed
+	 * @param iovcnt Number of buffers
+	 * @return Number of bytes read (0 on EOF)
+	 */
+	u_int32_t recv (const struct iovec* iov, int iovcnt) throw();
+
+	/**
+	 * @brief Receive at most nbytes bytes from a TCP socket into a buffer of the default BufferPool, through a
+	 * single recv() call. The buffer can be kept, sliced and passed around without copying the bytes
+	 * @param nbytes Maximum number of bytes to be read (default: BUFRECV_SIZE)
+	 * @return The bytes read (an empty buffer on EOF)
+	 */
+	Buffer recvBuffer (u_int32_t nbytes = BUFRECV_SIZE) throw();
+
+	/**
+	 * @brief Receive at most size bytes from a non-blocking socket, without waiting for them
+	 * @param buf Buffer where the read stuff will be placed
+	 * @param size buf's size
+	 * @return Number of bytes read, 0 if the peer closed the connection, -1 if no data is available yet
+	 */
+	int tryRecv (void* buf, u_int32_t size);
+
+	/**
+	 * @brief Send at most size bytes onto a non-blocking socket, without waiting for buffer space
+	 * @param buf Buffer to be sent
+	 * @param size buf's size
+	 * @return Number of bytes actually queued, -1 if the socket buffer is full
+	 */
+	int trySend (const void* buf, u_int32_t size);
+
 	/**
 	 * @brief Read an ASCII line from the socket
 	 * @return String containing the read line
 	 */
 	std::string readline() throw();
+
+	/**
+	 * @brief Read an ASCII line from a non-blocking socket, without waiting for it
+	 * @param line String that will hold the line, as readline() would return it
+	 * @return true if a whole line (or the end of the stream) was read, false if no whole line is available yet
+	 * (the partial line stays buffered)
+	 */
+	bool tryReadline (std::string& line);
+
+	/**
+	 * @brief Awaitable connect (see usock_async.h), towards an already resolved endpoint.
+	 * The socket is made non-blocking, and stays so
+	 * @param ep Remote endpoint
+	 */
+	ConnectOp asyncConnect (const Endpoint& ep) throw();
+
+	/**
+	 * @brief Awaitable connect. The host name is resolved before, synchronously
+	 * @param host Host name/address
+	 * @param port Remote port
+	 */
+	ConnectOp asyncConnect (const std::string& host, u_int16_t port) throw();
+
+	/**
+	 * @brief Awaitable receive of at most size bytes on a non-blocking socket, resuming with the number of bytes read
+	 * (0 if the peer closed the connection)
+	 * @param buf Buffer where the read stuff will be placed
+	 * @param size buf's size
+	 */
+	RecvOp asyncRecv (void* buf, u_int32_t size) throw();
+
+	/**
+	 * @brief Awaitable send of a whole buffer on a non-blocking socket. The buffer must stay valid until it resumes
+	 * @param buf Buffer to be sent
+	 * @param size buf's size
+	 */
+	SendOp asyncSend (const void* buf, u_int32_t size) throw();
+	SendOp asyncSend (const std::string& buf) throw();
+
+	/**
+	 * @brief Awaitable readline on a non-blocking socket, resuming with the line as readline() would return it
+	 */
+	ReadlineOp asyncReadline() throw();
+
+private:
+	/**
+	 * @brief splice()-based fallback for sendFile()
+	 */
+	off_t spliceFile (int fd, off_t offset, off_t length) throw();
 };
 
 /**
@@ -318,11 +703,9 @@ private:
 	///@brief Maximum number of connections allowed at the same moment
 	u_int32_t maxconn;
 
-	///@brief Array with the process identifiers of the open client connections
-	//int *client_pid;
-
-	///@brief Number of the currently open client connections
-	//u_int32_t client_index;
+	///@brief Processes started by accept(handler) and not reaped yet. Only these are waited for, so the
+	///exit status of the other children of the process (e.g. PreforkPool workers) is left alone
+	std::vector<pid_t> children;
 
 public:
 	/**
@@ -330,8 +713,10 @@ public:
 	 * @param port Port the server will listen onto
 	 * @param m Maximum number of allowed connections (default = DEFAULT_MAXCON)
 	 * @param addr Address the socket will listen from, as string (default = INADDR_ANY)
+	 * @param reuseport If true, set SO_REUSEPORT before binding, so that more server sockets can listen
+	 * on the same port and the kernel will spread the incoming connections among them (default = false)
 	 */
-	ServerSocket (u_int16_t port, u_int32_t m = DEFAULT_MAXCON, const std::string& addr = "") throw();
+	ServerSocket (u_int16_t port, u_int32_t m = DEFAULT_MAXCON, const std::string& addr = "", bool reuseport = false) throw();
 
 	/**
 	 * @brief Wrap around accept() function
@@ -341,12 +726,25 @@ public:
 
 	/**
 	 * @brief Wrap around accept() function, allowing you to manage multiple connection on your server socket,
-	 * with a process for each of them
+	 * with a process for each of them. The finished processes are reaped on the next call, and no more than
+	 * maxconn of them run at once: the call waits for one to exit first. See PreforkPool (usock_prefork.h)
+	 * for a pool of processes started once
 	 * @param handler Pointer to the function that will be called to manage each connection. The socket parameter
 	 * s in it will be the descriptor of the client socket just opened
 	 */
 	void accept(void (*handler)(Socket& s)) throw();
 
+	/**
+	 * @brief Awaitable accept (see usock_async.h), resuming with the new connection, already non-blocking.
+	 * The listener is made non-blocking
+	 */
+	AcceptOp asyncAccept() throw();
+
+	/**
+	 * @brief Return the maximum number of connections allowed at the same moment
+	 */
+	u_int32_t getMaxConn() throw();
+
 	/**
 	 * @brief Bind ServerSocket onto a port
 	 * @param port Port
@@ -359,6 +757,118 @@ public:
 	void listen() throw();
 };
 
+/**
+ * @class DatagramBatch
+ * @brief Pre-allocated array of datagrams, each one with its own buffer, length and remote address,
+ * used by UDPSocket::recvBatch() and UDPSocket::sendBatch() to move many datagrams with a single syscall
+ * @author BlackLight
+ */
+class DatagramBatch  {
+
+	friend class UDPSocket;
+	friend class UringLoop;
+
+private:
+	///@brief Buffers of all the datagrams, one after the other
+	std::vector<u_int8_t> storage;
+
+	///@brief Headers passed to recvmmsg()/sendmmsg()
+	std::vector<struct mmsghdr> hdrs;
+
+	///@brief One iovec for each datagram, pointing inside storage
+	std::vector<struct iovec> iovs;
+
+	///@brief Remote address of each datagram
+	std::vector<struct sockaddr_storage> addrs;
+
+	///@brief Size of the buffer of each datagram
+	u_int32_t slot;
+
+	///@brief Number of datagrams currently held
+	u_int32_t count;
+
+	///@brief Prepare the headers for a recvmmsg() call
+	void prepareRecv() throw();
+
+	///@brief Drop the first n datagrams, moving the others to the front (their buffers aren't copied)
+	void consume (u_int32_t n) throw();
+
+public:
+	/**
+	 * @brief DatagramBatch constructor
+	 * @param n Maximum number of datagrams in the batch (default: 64)
+	 * @param size Maximum size of each datagram (default: 2048)
+	 */
+	DatagramBatch (u_int32_t n = 64, u_int32_t size = 2048) throw();
+
+	/**
+	 * @brief Batches can't be copied: their headers point into their own buffers, which a copy would share
+	 */
+	DatagramBatch (const DatagramBatch&) = delete;
+	DatagramBatch& operator= (const DatagramBatch&) = delete;
+
+	/**
+	 * @brief Return the maximum number of datagrams in the batch
+	 */
+	u_int32_t capacity() throw();
+
+	/**
+	 * @brief Return the number of datagrams currently held by the batch
+	 */
+	u_int32_t size() throw();
+
+	/**
+	 * @brief Empty the batch (the buffers are kept)
+	 */
+	void clear() throw();
+
+	/**
+	 * @brief Return the buffer of the i-th datagram
+	 */
+	void* data (u_int32_t i) throw();
+
+	/**
+	 * @brief Return the length of the i-th datagram
+	 */
+	u_int32_t length (u_int32_t i) throw();
+
+	/**
+	 * @brief Return true if the i-th received datagram was longer than the batch slot, and was truncated
+	 */
+	bool truncated (u_int32_t i) throw();
+
+	/**
+	 * @brief Return the remote address of the i-th datagram
+	 */
+	const struct sockaddr* addr (u_int32_t i) throw();
+
+	/**
+	 * @brief Return the remote host of the i-th datagram, as a string
+	 */
+	std::string host (u_int32_t i) throw();
+
+	/**
+	 * @brief Return the remote port of the i-th datagram
+	 */
+	u_int16_t port (u_int32_t i) throw();
+
+	/**
+	 * @brief Queue a datagram to be sent through UDPSocket::sendBatch()
+	 * @param buf Buffer to be sent (it's copied inside the batch)
+	 * @param len buf's length
+	 * @param to Destination address
+	 * @param tolen to's length
+	 * @return false if the batch is full
+	 */
+	bool append (const void* buf, u_int32_t len, const struct sockaddr* to, socklen_t tolen) throw();
+
+	/**
+	 * @brief Queue a datagram to be sent towards an endpoint through UDPSocket::sendBatch()
+	 * @return false if the batch is full
+	 */
+	bool append (const void* buf, u_int32_t len, const Endpoint& to) throw();
+};
+
 /**
  * @class UDPSocket
  * @brief Class for managing UDP sockets
@@ -391,7 +901,46 @@ public:
 	void send (const void* buf, u_int32_t size, const std::string& host, u_int16_t port) throw();
 
 	/**
-	 * @brief Bind an UDP socket onto a port
+	 * @brief Send a datagram made of a list of buffers onto an UDP socket, through a single sendmsg() call
+	 * @param iov Buffers the datagram is made of
+	 * @param iovcnt Number of buffers
+	 * @param host Remote host name/address
+	 * @param port Remote port
+	 */
+	void send (const struct iovec* iov, int iovcnt, const std::string& host, u_int16_t port) throw();
+
+	/**
+	 * @brief Send a binary buffer onto an UDP socket, towards an already resolved endpoint
+	 * @param buf Binary buffer to be sent
+	 * @param size buf's size
+	 * @param ep Remote endpoint
+	 */
+	void send (const void* buf, u_int32_t size, const Endpoint& ep) throw();
+
+	/**
+	 * @brief Send a string onto an UDP socket, towards an already resolved endpoint
+	 * @param buf String to be sent
+	 * @param ep Remote endpoint
+	 */
+	void send (const std::string& buf, const Endpoint& ep) throw();
+
+	/**
+	 * @brief Send a binary buffer onto a connected UDP socket (see connect()), through a plain send()
+	 * @param buf Binary buffer to be sent
+	 * @param size buf's size
+	 */
+	void send (const void* buf, u_int32_t size) throw();
+
+	/**
+	 * @brief Connect an UDP socket to an endpoint: all the datagrams will be sent there through send(buf, size),
+	 * and only the datagrams coming from there will be received
+	 * @param ep Remote endpoint
+	 */
+	void connect (const Endpoint& ep) throw();
+
+	/**
+	 * @brief Bind an UDP socket onto a port. An IPv6 socket is bound in dual-stack mode (IPV6_V6ONLY off),
+	 * so it receives the IPv4 datagrams too
 	 * @param port Port to listen onto
 	 */
 	void bind (u_int16_t port) throw();
@@ -405,6 +954,51 @@ public:
 	 */
 	void recv (void* buf, u_int32_t size, const std::string& host = "", u_int16_t port = 0) throw();
 
+	/**
+	 * @brief Receive a datagram from an UDP socket into a list of buffers, filled in order
+	 * @param iov Buffers where we're going to place our data
+	 * @param iovcnt Number of buffers
+	 * @return Number of bytes received
+	 */
+	u_int32_t recv (const struct iovec* iov, int iovcnt) throw();
+
+	/**
+	 * @brief Receive a datagram from an UDP socket, together with the endpoint it comes from
+	 * @param buf Buffer where we're going to place our data
+	 * @param size buf's size
+	 * @param from Endpoint that will hold the sender address
+	 * @return Number of bytes received
+	 */
+	u_int32_t recv (void* buf, u_int32_t size, Endpoint& from) throw();
+
+	/**
+	 * @brief Receive a datagram from an UDP socket into a buffer of the default BufferPool
+	 * @param size Maximum size of the datagram (default: BUFRECV_SIZE); a longer one is truncated
+	 * @param from Optional endpoint that will hold the sender address
+	 * @return The datagram
+	 */
+	Buffer recvBuffer (u_int32_t size = BUFRECV_SIZE, Endpoint* from = NULL) throw();
+
+	/**
+	 * @brief Receive as many datagrams as available, up to the batch capacity, through a single recvmmsg() call.
+	 * It waits (up to the socket timeout) only for the first one. A datagram longer than the batch slot is
+	 * truncated, and flagged by DatagramBatch::truncated()
+	 * @param batch Batch that will hold the datagrams (its previous content is dropped)
+	 * @return Number of datagrams received
+	 */
+	u_int32_t recvBatch (DatagramBatch& batch) throw();
+
+	/**
+	 * @brief Send all the datagrams queued in a batch through sendmmsg(), and empty it. The datagrams are
+	 * removed from the batch as they are sent, so if it throws the batch only holds the ones left to send:
+	 * a datagram refused by the kernel (EMSGSIZE, EACCES...) is dropped before the exception is thrown,
+	 * so that sendBatch() can be called again for the others.
+	 * On a dual-stack (AF_INET6) socket, IPv4 destinations are sent as IPv4-mapped addresses, as in send()
+	 * @param batch Batch of datagrams to be sent
+	 * @return Number of datagrams sent
+	 */
+	u_int32_t sendBatch (DatagramBatch& batch) throw();
+
 	/**
 	 * @brief Receive an ASCII string from an UDP socket
 	 * @param host Remote host name/address
@@ -420,8 +1014,44 @@ public:
 	 * @return String received
 	 */
 	std::string readline(const std::string& host = "", u_int16_t port = 0) throw();
+
+private:
+	/**
+	 * @brief Return the address family the host names are resolved into for this socket
+	 */
+	int resolveFamily() throw();
+};
+
+/**
+ * @class Xorshift
+ * @brief Fast, non-cryptographic pseudo-random generator (Marsaglia's xorshift128), used for the
+ * sequence numbers of the raw packets instead of rand(), which is slow, global and reseeded per packet
+ * @author BlackLight
+ */
+class Xorshift  {
+
+private:
+	u_int32_t s[4];
+
+public:
+	/**
+	 * @brief Build a generator seeded from the clock, the process ID and the object address
+	 */
+	Xorshift() throw();
+
+	/**
+	 * @brief Seed the generator, for reproducible sequences
+	 */
+	void seed (u_int32_t value) throw();
+
+	/**
+	 * @brief Return the next 32-bit pseudo-random number
+	 */
+	u_int32_t next() throw();
 };
 
+class PacketTemplate;
+
 /**
  * @class RawSocket
  * @brief Class for managing raw sockets
@@ -437,12 +1067,87 @@ private:
 	u_int8_t head[1024];
 
 	///@brief Payload for the packet
-	u_int8_t *payload;
+	std::vector<u_int8_t> payload;
+
+	///@brief Outgoing packet, assembled by write() and reused by the next ones
+	std::vector<u_int8_t> pkt;
+
+	///@brief Header length
+	int head_len;
+
+	///@brief IP protocol the raw socket descriptor has been opened for (-1 if it's not open)
+	int raw_proto;
+
+	bool is_IPv4, is_IPv6, is_TCP, is_UDP, is_ICMPv4, is_ICMPv6;
+
+	///@brief Generator for the random TCP sequence numbers
+	Xorshift rng;
+
+	///@brief Packets queued by queue(), back to back
+	std::vector<u_int8_t> txbuf;
+
+	///@brief Offset of each queued packet inside txbuf (plus the end of the last one)
+	std::vector<u_int32_t> txoff;
+
+	///@brief Destination of each queued packet (struct sockaddr_in or struct sockaddr_in6)
+	std::vector<struct sockaddr_storage> txdst;
+
+	///@brief Message headers and buffers for sendmmsg(), rebuilt by flush()
+	std::vector<struct mmsghdr> txmsg;
+	std::vector<struct iovec> txiov;
+
+	///@brief Buffer the packets are received into by read()
+	std::vector<u_int8_t> rxbuf;
+
+	///@brief Filter set through setFilter()
+	PacketFilter filter;
+
+	///@brief Source address read() is filtering on, in the kernel (INADDR_ANY for none)
+	in_addr_t filterFrom;
+
+	/**
+	 * @brief Attach filter (narrowed to filterFrom) to the raw descriptor, or detach it if there's nothing to filter
+	 */
+	void applyFilter() throw();
+
+	/**
+	 * @brief Receive a packet for read() or readBuffer()
+	 * @return Number of bytes received, or -1 if the socket has no IPv4 protocol yet
+	 */
+	ssize_t receive (void* buf, u_int32_t size, const std::string& host) throw();
+
+	/**
+	 * @brief Append a packet to the transmit queue, flushing it when RAW_BATCH_SIZE packets are queued
+	 */
+	void enqueue (const u_int8_t* pkt, u_int32_t len, const struct sockaddr_storage& to) throw();
+
+	/**
+	 * @brief Drop the first n packets of the transmit queue
+	 */
+	void dequeue (u_int32_t n) throw();
+
+	/**
+	 * @brief Assemble the packet built so far into pkt, computing the lengths and checksums left to 0 in place
+	 * @param to Will hold the destination of the packet (struct sockaddr_in or struct sockaddr_in6)
+	 * @return Packet length (0 if there's no IPv4/IPv6 header)
+	 */
+	u_int32_t assemble (struct sockaddr_storage& to) throw();
+
+	friend class PacketTemplate;
 
-	///@brief Header and payload length
-	int head_len, payload_len;
+	/**
+	 * @brief Open the raw socket descriptor (IP_HDRINCL) for an IP protocol, unless it's already open for it.
+	 * The descriptor is kept across the write() and read() calls. An IPv6 descriptor is always opened for
+	 * IPPROTO_RAW, which is send-only and implies that the packets carry their own IPv6 header
+	 * @param proto IP protocol
+	 * @param family Address family of the packets (default: AF_INET)
+	 */
+	void openRaw (int proto, int family = AF_INET) throw();
 
-	bool is_IPv4, is_TCP, is_UDP, is_ICMPv4;
+	/**
+	 * @brief Open the raw descriptor needed to send a packet assembled by assemble() or compiled into a template
+	 */
+	void openFor (const u_int8_t* pkt) throw();
 
 public:
 	/**
@@ -451,14 +1156,18 @@ public:
 	 */
 	RawSocket (std::string i = "") throw();
 
-	~RawSocket();
-
 	/**
 	 * @brief Get the IPv4 address associated to the network interface
 	 * @return IPv4 address, if the interface is valid, up and running
 	 */
 	std::string getIPv4addr() throw();
 
+	/**
+	 * @brief Get the IPv6 address associated to the network interface (a global one if there's any, link-local otherwise)
+	 * @return IPv6 address, if the interface has one
+	 */
+	std::string getIPv6addr() throw();
+
 	/**
 	 * @brief Get the HW address associated to the network interface
 	 * @return The HW/MAC address, if the interface is valid, up and running
@@ -466,7 +1175,7 @@ public:
 	std::string getHWaddr() throw();
 
 	/**
-	 * @brief Compute the checksum of a buffer
+	 * @brief Compute the checksum of a buffer (see usock::csum() in usock_checksum.h for odd lengths)
 	 * @param buf Buffer
 	 * @param nwords Number of 16-bits words inside buf
 	 * @return Checksum
@@ -488,12 +1197,26 @@ public:
 	void buildIPv4 (std::string dst, std::string src = "", u_int8_t proto = IPPROTO_TCP, u_int8_t ttl = 32, u_int16_t len = 0,
 			u_int8_t tos = 0, u_int16_t id = 0, u_int16_t frag = 0, u_int16_t sum = 0);
 
+	/**
+	 * @brief Build an IPv6 header for the raw socket. The TCP, UDP and ICMPv6 checksums of the packet will
+	 * then be computed on the IPv6 pseudo-header, and the packet is sent through an AF_INET6 raw socket
+	 * @param dst Destination address
+	 * @param src Source address (default: IPv6 address associated to the network interface)
+	 * @param next Next header, i.e. the transport protocol (default: TCP)
+	 * @param hops Hop limit (default: 32)
+	 * @param plen Payload length, i.e. everything after the IPv6 header (default: auto-computed)
+	 * @param tclass Traffic class (default: 0)
+	 * @param flow Flow label, 20 bits (default: 0)
+	 */
+	void buildIPv6 (std::string dst, std::string src = "", u_int8_t next = IPPROTO_TCP, u_int8_t hops = 32, u_int16_t plen = 0,
+			u_int8_t tclass = 0, u_int32_t flow = 0);
+
 	/**
 	 * @brief Build a TCP header for the raw socket
 	 * @param sport Source port
 	 * @param dport Destination port
 	 * @param flags TCP flags
-	 * @param seq Sequence number (default: randomly generated)
+	 * @param seq Sequence number, in network byte order (default: randomly generated)
 	 * @param ack ACK number (default: 0)
 	 * @param window Window size (default: 16)
 	 * @param urgent Urgent pointer (default: 0)
@@ -521,6 +1244,17 @@ public:
 	 */
 	void buildICMPv4 (u_int8_t type, u_int16_t id = 0x100, u_int16_t seq = 0x100, u_int8_t code = 0, u_int16_t sum = 0);
 
+	/**
+	 * @brief Build an ICMPv6 header for the raw socket, after an IPv6 header. The echo ID and sequence number are laid
+	 * out as for ICMPv4, and the checksum covers the IPv6 pseudo-header. It throws if buildIPv6() wasn't called first
+	 * @param type ICMPv6 type (e.g. ICMP6_ECHO_REQUEST)
+	 * @param id Packet ID, in network byte order (default: 0x100)
+	 * @param seq Sequence number, in network byte order (default: 0x100)
+	 * @param code ICMPv6 code (default: 0)
+	 * @param sum ICMPv6 checksum (default: auto-computed)
+	 */
+	void buildICMPv6 (u_int8_t type, u_int16_t id = 0x100, u_int16_t seq = 0x100, u_int8_t code = 0, u_int16_t sum = 0);
+
 	/**
 	 * @brief Set a binary payload for the raw socket
 	 * @param payload Binary payload
@@ -535,16 +1269,77 @@ public:
 	void setPayload (std::string payload);
 
 	/**
-	 * @brief Write the raw packet onto the network interface
+	 * @brief Write the raw packet onto the network interface. The packet is assembled in a buffer kept
+	 * by the socket, the checksums left to 0 are computed in place, and it's sent through a raw
+	 * descriptor opened on the first call
 	 */
 	void write() throw();
 
 	/**
-	 * @brief Read binary data from the raw socket
-	 * @param len Number of bytes to be read (default: get the buffer size from the tot_len field of IP header)
-	 * @param host Host name/address we're going to receive our packet from (default: any)
+	 * @brief Write a packet compiled into a template (see usock_packet.h) onto the network interface
+	 * @param t Packet template
+	 */
+	void write (const PacketTemplate& t) throw();
+
+	/**
+	 * @brief Queue the packet built so far for a batched write instead of sending it now. The queued packets
+	 * are sent by flush() through sendmmsg(), RAW_BATCH_SIZE per syscall, and flushed anyway as soon as
+	 * RAW_BATCH_SIZE of them are queued. IPv4 and IPv6 packets can be queued together, but each change of
+	 * family inside the queue costs a new raw descriptor
+	 */
+	void queue() throw();
+
+	/**
+	 * @brief Queue a packet compiled into a template for a batched write (see queue())
+	 * @param t Packet template
+	 */
+	void queue (const PacketTemplate& t) throw();
+
+	/**
+	 * @brief Send all the queued packets. The packets leave the queue as they're sent: if it throws, the packets
+	 * sent so far and the one which failed are gone, and the others are still queued. When the device queue is full
+	 * (ENOBUFS), it backs off from RAW_BACKOFF_MIN to RAW_BACKOFF_MAX nanoseconds between the attempts
+	 * @return Number of packets sent
+	 */
+	u_int32_t flush() throw();
+
+	/**
+	 * @brief Return the number of packets queued and not sent yet
+	 */
+	u_int32_t queued() throw();
+
+	/**
+	 * @brief Return the network interface associated to the raw socket
+	 */
+	std::string getInterface() throw();
+
+	/**
+	 * @brief Read a packet from the raw socket, for the IP protocol of the packet built so far. The packet is
+	 * received into a buffer kept by the socket: don't free it, and copy it if you need it after the next read().
+	 * Only IPv4 packets are received: IPv6 raw sockets don't hand out the IPv6 header. For a capture at high rate,
+	 * see RxRing (usock_ring.h)
+	 * @param len Number of bytes to be read (default: the whole packet)
+	 * @param host Host name/address we're going to receive our packet from: packets from other hosts are dropped by
+	 * a filter in the kernel (default: any). It throws if the name doesn't resolve to an IPv4 address
+	 * @return The packet, starting at its IP header, or NULL if the socket has no IPv4 protocol yet
 	 */
 	void* read (u_int32_t len = 0, const std::string& host = "") throw();
+
+	/**
+	 * @brief Same as read(), but the packet is received into a buffer of the default BufferPool, which
+	 * stays valid after the next read and can be kept or handed to another thread without a copy
+	 * @param len Maximum number of bytes to be read (default: the whole packet)
+	 * @param host Host name/address we're going to receive our packet from (default: any)
+	 * @return The packet, starting at its IP header, or an empty buffer if the socket has no IPv4 protocol yet
+	 */
+	Buffer readBuffer (u_int32_t len = 0, const std::string& host = "") throw();
+
+	/**
+	 * @brief Set a filter for the packets received by read() (see usock_filter.h). The kernel drops the packets
+	 * which don't match it, before they're queued on the socket. An empty PacketFilter removes the filter
+	 * @param f Packet filter
+	 */
+	void setFilter (const PacketFilter& f) throw();
 };
 }
 
@@ -0,0 +1,330 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_ASYNC_H
+#define __USOCK_ASYNC_H
+
+#include <atomic>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include "usock.h"
+
+#define	REACTOR_MAXEVENTS	256
+
+namespace usock  {
+
+class Reactor;
+
+/**
+ * @class AsyncOp
+ * @brief Base of the awaitable socket operations returned by Socket::asyncRecv() and the like.
+ * co_await first tries the operation right away; if it would block, the coroutine is suspended and the
+ * operation is registered onto the Reactor of the thread, which tries it again whenever the descriptor
+ * gets ready, and resumes the coroutine once it's done, failed, or past the deadline given by the socket
+ * timeout. The operation is kept inside the coroutine frame, so nothing is allocated per await.
+ * Only the coroutine handle is C++20, and it's taken as a template parameter: this header is plain C++11,
+ * see usock_coro.h for the coroutine type
+ * @author BlackLight
+ */
+class AsyncOp  {
+
+	friend class Reactor;
+
+protected:
+	///@brief Socket the operation works on
+	Socket *sock;
+
+	///@brief poll() event the operation waits for (POLLIN or POLLOUT)
+	short events;
+
+	///@brief Absolute deadline (CLOCK_MONOTONIC), if timed
+	struct timespec when;
+	bool timed;
+
+	///@brief errno of a failed operation (0 if it succeeded), and the message of the exception it will throw
+	int err;
+	const char *what;
+
+	///@brief Reactor the operation is registered onto (NULL if it's not waiting), and descriptor it waits on
+	Reactor *reactor;
+	int fd;
+
+	///@brief Position inside the deadline heap of the reactor
+	u_int32_t heapIndex;
+
+	///@brief Resumes the suspended coroutine
+	void (*resumeFn)(void*);
+	void *coro;
+
+	template <typename H> static void resumeHandle (void* addr)  { H::from_address(addr).resume(); }
+
+	/**
+	 * @param s Socket
+	 * @param events POLLIN or POLLOUT
+	 * @param deadline Absolute deadline, or NULL for none
+	 */
+	AsyncOp (Socket* s, short events, const struct timespec* deadline) throw();
+
+	/**
+	 * @brief Try the operation without blocking
+	 * @return true if it's over (done or failed, see err), false if it would block
+	 */
+	virtual bool attempt() = 0;
+
+	/**
+	 * @brief Record a failure of the operation (from errno)
+	 * @return true
+	 */
+	bool fail (const char* what) throw();
+
+	/**
+	 * @brief Register the operation onto the reactor of the thread
+	 * @return false if it can't be registered (the coroutine then goes on, and err is set)
+	 */
+	bool suspend (void (*fn)(void*), void* coro) throw();
+
+	/**
+	 * @brief Throw a SocketException if the operation failed
+	 */
+	void check();
+
+public:
+	virtual ~AsyncOp();
+
+	bool await_ready()  { return attempt(); }
+
+	template <typename H> bool await_suspend (H h)  { return suspend(&resumeHandle<H>, h.address()); }
+};
+
+/**
+ * @class ConnectOp
+ * @brief Awaitable non-blocking connect(), returned by Socket::asyncConnect()
+ * @author BlackLight
+ */
+class ConnectOp : public AsyncOp  {
+
+private:
+	struct sockaddr_storage addr;
+	socklen_t len;
+	bool started;
+
+	bool attempt();
+
+public:
+	ConnectOp (Socket* s, const struct sockaddr* addr, socklen_t len, const struct timespec* deadline) throw();
+
+	void await_resume()  { check(); }
+};
+
+/**
+ * @class RecvOp
+ * @brief Awaitable receive, returned by Socket::asyncRecv(). It resumes with the number of bytes read
+ * (0 if the peer closed the connection)
+ * @author BlackLight
+ */
+class RecvOp : public AsyncOp  {
+
+private:
+	void *buf;
+	u_int32_t size;
+	int n;
+
+	bool attempt();
+
+public:
+	RecvOp (Socket* s, void* buf, u_int32_t size, const struct timespec* deadline) throw();
+
+	u_int32_t await_resume()  { check(); return n; }
+};
+
+/**
+ * @class SendOp
+ * @brief Awaitable send of a whole buffer, returned by Socket::asyncSend(). The buffer must stay valid until it resumes
+ * @author BlackLight
+ */
+class SendOp : public AsyncOp  {
+
+private:
+	const char *buf;
+	u_int32_t size, sent;
+
+	bool attempt();
+
+public:
+	SendOp (Socket* s, const void* buf, u_int32_t size, const struct timespec* deadline) throw();
+
+	void await_resume()  { check(); }
+};
+
+/**
+ * @class ReadlineOp
+ * @brief Awaitable readline, returned by Socket::asyncReadline(). It resumes with the line, as Socket::readline()
+ * would return it ("\r" for an empty line, "" on EOF)
+ * @author BlackLight
+ */
+class ReadlineOp : public AsyncOp  {
+
+private:
+	std::string line;
+
+	bool attempt();
+
+public:
+	ReadlineOp (Socket* s, const struct timespec* deadline) throw();
+
+	std::string await_resume()  { check(); return line; }
+};
+
+/**
+ * @class AcceptOp
+ * @brief Awaitable accept, returned by ServerSocket::asyncAccept(). It resumes with the new connection (non-blocking)
+ * @author BlackLight
+ */
+class AcceptOp : public AsyncOp  {
+
+private:
+	int newfd;
+
+	bool attempt();
+
+public:
+	AcceptOp (ServerSocket* s, const struct timespec* deadline) throw();
+
+	Socket await_resume()  { check(); return Socket(newfd); }
+};
+
+/**
+ * @class Reactor
+ * @brief Single-threaded epoll reactor driving the awaitable socket operations of a thread. The descriptors
+ * are armed one-shot for the operations waiting on them only, and the deadlines are kept in a heap.
+ * For a thread-per-core server, run a Reactor in each thread, each one with its own ServerSocket listening
+ * on the same port (SO_REUSEPORT)
+ * @author BlackLight
+ */
+class Reactor  {
+
+private:
+	struct Slot  {
+		AsyncOp *reader;
+		AsyncOp *writer;
+	};
+
+	///@brief epoll descriptor, and eventfd used by stop()
+	int epfd, wakefd;
+
+	///@brief Flag cleared by stop(), and set again once run() has returned because of it
+	std::atomic<bool> running;
+
+	///@brief Number of operations waiting
+	u_int32_t npending;
+
+	///@brief Operations waiting on each descriptor
+	std::vector<Slot> slots;
+
+	///@brief Timed operations, as a binary heap ordered by deadline
+	std::vector<AsyncOp*> timers;
+
+	Reactor (const Reactor&);
+	Reactor& operator= (const Reactor&);
+
+	bool arm (int fd) throw();
+	void unlink (AsyncOp* op) throw();
+	void complete (AsyncOp* op);
+	void heapUp (u_int32_t i) throw();
+	void heapDown (u_int32_t i) throw();
+
+public:
+	/**
+	 * @brief Reactor constructor. The first reactor built in a thread becomes the one of the thread
+	 */
+	Reactor() throw();
+
+	~Reactor();
+
+	/**
+	 * @brief Register a suspended operation
+	 * @return false if it can't be waited for
+	 */
+	bool wait (AsyncOp* op) throw();
+
+	/**
+	 * @brief Unregister an operation without resuming it
+	 */
+	void cancel (AsyncOp* op) throw();
+
+	/**
+	 * @brief Wait for the descriptors to get ready, or for the next deadline, and resume the coroutines whose
+	 * operations are over. The reactor becomes the one of the calling thread
+	 * @param timeout Maximum time to wait, in milliseconds (default: -1, until something happens)
+	 * @return Number of events
+	 */
+	int runOnce (int timeout = -1);
+
+	/**
+	 * @brief Run the reactor until stop() is called or no operation is waiting anymore.
+	 * A stop() called before run() makes it return straight away
+	 */
+	void run();
+
+	/**
+	 * @brief Make run() return. It can be called from another thread, or from a signal handler
+	 */
+	void stop() throw();
+
+	/**
+	 * @brief Return the number of operations waiting
+	 */
+	u_int32_t pending() throw();
+
+	/**
+	 * @brief Return the reactor of the calling thread (NULL if none)
+	 */
+	static Reactor* current() throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,249 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_BUFFER_H
+#define __USOCK_BUFFER_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define	POOL_CLASSES	5
+#define	POOL_SLAB_SIZE	262144
+#define	POOL_CACHE_SIZE	32
+
+namespace usock  {
+
+class BufferPool;
+struct BufferBlock;
+
+/**
+ * @class Buffer
+ * @brief Handle to a block of a BufferPool, holding received bytes. The handles are reference counted:
+ * copying one (or taking a slice()) shares the same bytes, and the block goes back to its pool when the
+ * last handle is destroyed. The handles can be passed to other threads, but the bytes aren't protected:
+ * don't change them while another thread reads them
+ * @author BlackLight
+ */
+class Buffer  {
+
+private:
+	BufferBlock *block;
+	char *ptr;
+	u_int32_t len;
+	u_int32_t cap;
+
+	Buffer (BufferBlock* b, char* data, u_int32_t size, u_int32_t capacity) throw();
+	friend class BufferPool;
+
+public:
+	/**
+	 * @brief Build an empty handle, holding no block
+	 */
+	Buffer() throw();
+
+	Buffer (const Buffer& b) throw();
+	Buffer (Buffer&& b) throw();
+	Buffer& operator= (const Buffer& b) throw();
+	Buffer& operator= (Buffer&& b) throw();
+	~Buffer();
+
+	///@brief Bytes held by the buffer
+	char* data() throw()  { return ptr; }
+	const char* data() const throw()  { return ptr; }
+
+	///@brief Number of bytes held by the buffer
+	u_int32_t size() const throw()  { return len; }
+
+	///@brief Number of bytes the buffer can hold from data(), without a new block
+	u_int32_t capacity() const throw()  { return cap; }
+
+	bool empty() const throw()  { return len == 0; }
+
+	/**
+	 * @brief Change the number of bytes held by the buffer, up to its capacity()
+	 */
+	void resize (u_int32_t size) throw();
+
+	/**
+	 * @brief Return a handle to a part of the buffer, sharing its bytes (no copy)
+	 * @param offset Offset of the first byte, clamped to size()
+	 * @param size Number of bytes, clamped to what's left after offset
+	 */
+	Buffer slice (u_int32_t offset, u_int32_t size) const throw();
+
+	/**
+	 * @brief Copy the bytes into a string, NUL bytes included
+	 */
+	std::string str() const;
+
+	/**
+	 * @brief Return the number of handles sharing the block (0 for an empty handle)
+	 */
+	u_int32_t refs() const throw();
+
+	/**
+	 * @brief Drop the reference to the block, and leave the handle empty
+	 */
+	void release() throw();
+};
+
+///@brief Counters exposed by BufferPool::stats()
+struct BufferPoolStats  {
+	///@brief Buffers handed out by get()
+	unsigned long allocs;
+
+	///@brief Buffers given back to the pool
+	unsigned long frees;
+
+	///@brief Buffers handed out straight from the cache of the calling thread
+	unsigned long cacheHits;
+
+	///@brief Trips to the shared free lists, under the pool lock, to fill or empty a thread cache
+	unsigned long refills;
+
+	///@brief Buffers larger than the largest size class, allocated on their own
+	unsigned long oversize;
+
+	///@brief Slabs allocated
+	unsigned long slabs;
+
+	///@brief Bytes held by the slabs
+	unsigned long reserved;
+
+	///@brief Buffers currently held by some handle
+	unsigned long inUse;
+};
+
+/**
+ * @class BufferPool
+ * @brief Thread-safe pool of receive buffers, in a few size classes (256 bytes to 64 KB). The buffers are
+ * carved out of large slabs, which are only given back when the pool is destroyed, and each thread keeps a
+ * small cache of free buffers for each class, so that most get() and release() calls take no lock.
+ * Socket::recvBuffer(), UDPSocket::recvBuffer() and RawSocket::readBuffer() take their buffers from the
+ * default pool. A pool must outlive its buffers and the threads which used it
+ * @author BlackLight
+ */
+class BufferPool  {
+
+private:
+	struct Cache;
+
+	///@brief Free blocks shared by all the threads, one list for each class
+	BufferBlock *freeList[POOL_CLASSES];
+
+	///@brief Slabs the blocks are carved from
+	std::vector<char*> slabs;
+
+	///@brief Caches of the threads which used the pool
+	std::vector<Cache*> caches;
+
+	pthread_mutex_t lock;
+	pthread_key_t key;
+
+	u_int32_t slabSize;
+
+	///@brief Maximum number of free buffers of each class cached by a thread
+	u_int32_t cacheLimit[POOL_CLASSES];
+
+	///@brief Counters of the threads which are gone, and of the oversize buffers
+	BufferPoolStats counters;
+
+	BufferPool (const BufferPool&);
+	BufferPool& operator= (const BufferPool&);
+
+	Cache* cache() throw();
+	void refill (Cache* c, u_int32_t cls) throw();
+	void spill (Cache* c, u_int32_t cls, u_int32_t n) throw();
+	void release (BufferBlock* b) throw();
+	static void dropCache (void *arg);
+	friend class Buffer;
+
+public:
+	/**
+	 * @brief BufferPool constructor
+	 * @param slabSize Size of the slabs the buffers are carved from (default = POOL_SLAB_SIZE)
+	 * @param cacheSize Maximum number of free buffers of a class cached by each thread (default = POOL_CACHE_SIZE).
+	 * The large classes cache fewer of them
+	 */
+	BufferPool (u_int32_t slabSize = POOL_SLAB_SIZE, u_int32_t cacheSize = POOL_CACHE_SIZE) throw();
+
+	/**
+	 * @brief Destroyer for the BufferPool class. It frees all the slabs
+	 */
+	~BufferPool();
+
+	/**
+	 * @brief Get a buffer able to hold at least size bytes
+	 * @param size Number of bytes; the buffer's size() is set to it
+	 * @return A handle to the buffer
+	 */
+	Buffer get (u_int32_t size) throw();
+
+	/**
+	 * @brief Return the pool counters, summed over all the threads
+	 */
+	BufferPoolStats stats() throw();
+
+	/**
+	 * @brief Return the size of a class
+	 */
+	static u_int32_t classSize (u_int32_t cls) throw();
+
+	/**
+	 * @brief Return the pool used by the socket classes
+	 */
+	static BufferPool& getDefault() throw();
+
+	/**
+	 * @brief Replace the pool used by the socket classes (NULL restores the built-in one).
+	 * The caller keeps the ownership of p
+	 */
+	static void setDefault (BufferPool* p) throw();
+};
+}
+
+#endif
+
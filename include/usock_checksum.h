@@ -0,0 +1,117 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_CHECKSUM_H
+#define __USOCK_CHECKSUM_H
+
+#include <sys/types.h>
+
+namespace usock  {
+
+/**
+ * @brief Compute the partial one's complement sum of a buffer (Internet checksum, RFC 1071), not folded
+ * nor complemented yet, so that more buffers (e.g. a pseudo-header and a segment) can be summed together.
+ * It goes through the fastest kernel available on the running CPU (AVX2, SSE2 or 64-bit scalar)
+ * @param buf Buffer (no alignment required)
+ * @param len buf's length. An odd trailing byte is padded with a zero; when chaining more buffers, all of them
+ * but the last one must have an even length
+ * @param sum Partial sum of the previous buffers (default: 0)
+ * @return Partial sum, to be passed to the next call or to csumFold()
+ */
+u_int32_t csumPartial (const void* buf, u_int32_t len, u_int32_t sum = 0) throw();
+
+/**
+ * @brief Same as csumPartial(), through the portable 64-bit scalar kernel only
+ */
+u_int32_t csumPartialScalar (const void* buf, u_int32_t len, u_int32_t sum = 0) throw();
+
+/**
+ * @brief Fold a partial sum into the final 16-bit checksum, ready to be stored in a header
+ * @param sum Partial sum, as returned by csumPartial()
+ */
+u_int16_t csumFold (u_int32_t sum) throw();
+
+/**
+ * @brief Compute the Internet checksum of a buffer
+ * @param buf Buffer
+ * @param len buf's length (it can be odd)
+ */
+u_int16_t csum (const void* buf, u_int32_t len) throw();
+
+/**
+ * @brief Update a checksum after a 16-bit field of the checksummed data changed, without summing the data
+ * again (RFC 1624, eqn. 3). Both the values are taken as they're stored in the packet (network byte order)
+ * @param check Old checksum
+ * @param from Old value of the field
+ * @param to New value of the field
+ * @return New checksum
+ */
+u_int16_t csumUpdate16 (u_int16_t check, u_int16_t from, u_int16_t to) throw();
+
+/**
+ * @brief Same as csumUpdate16(), for a 32-bit field aligned on a 16-bit boundary (e.g. an IPv4 address or a TCP
+ * sequence number)
+ */
+u_int16_t csumUpdate32 (u_int16_t check, u_int32_t from, u_int32_t to) throw();
+
+/**
+ * @brief Return the name of the kernel used by csumPartial() on this CPU ("avx2", "sse2" or "scalar")
+ */
+const char* csumKernel() throw();
+
+/**
+ * @brief Signature of a csumPartial() kernel
+ */
+typedef u_int32_t (*CsumKernelFn)(const void* buf, u_int32_t len, u_int32_t sum);
+
+/**
+ * @brief Look up a kernel by name, to call it directly (e.g. to check it against a reference)
+ * @param name "scalar", "sse2" or "avx2"
+ * @return The kernel, or NULL if it wasn't compiled in or the running CPU doesn't support it
+ */
+CsumKernelFn csumKernelByName (const char* name) throw();
+}
+
+#endif
+
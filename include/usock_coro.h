@@ -0,0 +1,212 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_CORO_H
+#define __USOCK_CORO_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "usock_coro.h needs C++20 coroutines (compile with -std=c++20)"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include "usock_async.h"
+
+namespace usock  {
+
+template <typename T> class Task;
+
+/**
+ * @class TaskPromiseBase
+ * @brief Part of the promise of a Task which doesn't depend on its result type
+ * @author BlackLight
+ */
+class TaskPromiseBase  {
+
+public:
+	///@brief Coroutine awaiting the task, resumed when it's over
+	std::coroutine_handle<> continuation;
+
+	///@brief Exception thrown by the task, rethrown to the awaiting coroutine
+	std::exception_ptr error;
+
+	struct FinalAwaiter  {
+		bool await_ready() noexcept  { return false; }
+
+		// Symmetric transfer: the awaiting coroutine goes on without growing the stack
+		template <typename P> std::coroutine_handle<> await_suspend (std::coroutine_handle<P> h) noexcept  {
+			std::coroutine_handle<> c = h.promise().continuation;
+			return c ? c : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept  {}
+	};
+
+	std::suspend_always initial_suspend() noexcept  { return std::suspend_always(); }
+	FinalAwaiter final_suspend() noexcept  { return FinalAwaiter(); }
+	void unhandled_exception() noexcept  { error = std::current_exception(); }
+};
+
+template <typename T> class TaskResult  {
+
+protected:
+	std::optional<T> value;
+
+public:
+	void return_value (T v)  { value.emplace(std::move(v)); }
+	T result()  { return std::move(*value); }
+};
+
+template <> class TaskResult<void>  {
+
+public:
+	void return_void()  {}
+	void result()  {}
+};
+
+/**
+ * @class Task
+ * @brief Coroutine returning a T (or nothing), started when it's awaited by another coroutine, e.g.
+ *
+ * Task<void> echo (Socket s)  {
+ * 	string line;
+ * 	while ((line = co_await s.asyncReadline()) != "")
+ * 		co_await s.asyncSend(line + "\n");
+ * }
+ *
+ * The socket operations suspend it without allocating anything; the frame of the task itself
+ * is the only allocation. An exception thrown by the task is rethrown to the awaiting coroutine.
+ * See spawn() to start a task from plain code
+ * @author BlackLight
+ */
+template <typename T = void> class Task  {
+
+public:
+	class promise_type : public TaskPromiseBase, public TaskResult<T>  {
+
+	public:
+		Task get_return_object()  { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+	};
+
+private:
+	std::coroutine_handle<promise_type> h;
+
+	explicit Task (std::coroutine_handle<promise_type> h) noexcept : h(h)  {}
+
+public:
+	Task (Task&& t) noexcept : h(std::exchange(t.h, nullptr))  {}
+
+	Task& operator= (Task&& t) noexcept  {
+		if (this != &t)  {
+			if (h)
+				h.destroy();
+
+			h = std::exchange(t.h, nullptr);
+		}
+
+		return *this;
+	}
+
+	Task (const Task&) = delete;
+	Task& operator= (const Task&) = delete;
+
+	///@brief Destroy the coroutine frame (a task destroyed while suspended cancels its pending socket operation)
+	~Task()  {
+		if (h)
+			h.destroy();
+	}
+
+	bool await_ready() noexcept  { return !h || h.done(); }
+
+	std::coroutine_handle<> await_suspend (std::coroutine_handle<> c) noexcept  {
+		h.promise().continuation = c;
+		return h;
+	}
+
+	T await_resume()  {
+		if (h.promise().error)
+			std::rethrow_exception(h.promise().error);
+
+		return h.promise().result();
+	}
+};
+
+/**
+ * @class SpawnedTask
+ * @brief Frame of a detached task started by spawn(), freed as soon as it's over
+ * @author BlackLight
+ */
+class SpawnedTask  {
+
+public:
+	class promise_type  {
+
+	public:
+		SpawnedTask get_return_object() noexcept  { return SpawnedTask(); }
+		std::suspend_never initial_suspend() noexcept  { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept  { return std::suspend_never(); }
+		void return_void() noexcept  {}
+		void unhandled_exception() noexcept  {}
+	};
+};
+
+inline SpawnedTask spawnTask (Task<void> t)  {
+	try  {
+		co_await t;
+	}
+
+	catch (...)  {}
+}
+
+/**
+ * @brief Start a task, detached: it runs until its first suspension, and then goes on inside the
+ * Reactor of the thread. Its exceptions are dropped (handle them inside the task)
+ */
+inline void spawn (Task<void> t)  { spawnTask(std::move(t)); }
+}
+
+#endif
+
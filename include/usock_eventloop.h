@@ -0,0 +1,267 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_EVENTLOOP_H
+#define __USOCK_EVENTLOOP_H
+
+#include <atomic>
+#include <vector>
+#include "usock.h"
+
+#define	EVENTLOOP_MAXEVENTS	256
+
+namespace usock  {
+
+class EventLoop;
+
+/**
+ * @class EventHandler
+ * @brief Callbacks invoked by an EventLoop on the sockets registered onto it.
+ * Unlike the plain function pointer taken by ServerSocket::accept(), a handler is an object,
+ * so any per-server state can be kept inside the derived class
+ * @author BlackLight
+ */
+class EventHandler  {
+
+public:
+	virtual ~EventHandler()  {}
+
+	/**
+	 * @brief Called when a new client connection has been accepted on a registered ServerSocket
+	 * @param loop Event loop the new connection has been registered onto
+	 * @param s Client socket (non-blocking, owned by the loop)
+	 */
+	virtual void onAccept (EventLoop& loop, Socket& s)  {}
+
+	/**
+	 * @brief Called when new data is available on the socket. The loop is edge-triggered,
+	 * so the handler should read (e.g. through Socket::tryRecv) until no more data is available.
+	 * tryRecv() returning 0 means the peer shut down its side: it may still wait for a reply, so the
+	 * socket stays open until the handler closes it through EventLoop::close()
+	 */
+	virtual void onReadable (EventLoop& loop, Socket& s)  {}
+
+	/**
+	 * @brief Called when the socket can accept new data to be sent (edge-triggered as well)
+	 */
+	virtual void onWritable (EventLoop& loop, Socket& s)  {}
+
+	/**
+	 * @brief Called once when the connection is dropped, either because of a reset or an error on it or
+	 * because EventLoop::close() was called on it. The socket is still valid inside the callback
+	 */
+	virtual void onClosed (EventLoop& loop, Socket& s)  {}
+};
+
+/**
+ * @class EventLoop
+ * @brief Edge-triggered epoll event loop, allowing a single process to manage thousands of
+ * concurrent non-blocking connections instead of forking a process for each of them
+ * @author BlackLight
+ */
+class EventLoop  {
+
+private:
+	struct Entry;
+
+	///@brief epoll descriptor
+	int epfd;
+
+	///@brief eventfd descriptor used by stop() to wake up a loop blocked in another thread
+	int wakefd;
+
+	///@brief Descriptor kept in reserve, given up to accept and drop a connection when we run out of them
+	int sparefd;
+
+	///@brief Flag cleared by stop(), and set again once run() has returned because of it
+	std::atomic<bool> running;
+
+	///@brief Number of registered sockets (server sockets included)
+	u_int32_t nentries;
+
+	///@brief Registered entries, indexed by socket descriptor
+	std::vector<Entry*> entries;
+
+	///@brief Entries closed during the current iteration, freed at its end
+	std::vector<Entry*> closed;
+
+	EventLoop (const EventLoop&);
+	EventLoop& operator= (const EventLoop&);
+
+	bool attach (Entry *e) throw();
+	void acceptAll (Entry *e);
+	void dispatch (Entry *e, u_int32_t events);
+	void drop (Entry *e);
+
+public:
+	/**
+	 * @brief EventLoop constructor (it creates the epoll descriptor)
+	 */
+	EventLoop() throw();
+
+	/**
+	 * @brief Destroyer for the EventLoop class. All the client sockets still owned by the loop are closed
+	 */
+	~EventLoop();
+
+	/**
+	 * @brief Register a listening server socket onto the loop. Each accepted connection will be
+	 * made non-blocking, registered onto the loop with the same handler and notified through
+	 * handler.onAccept(). The server socket is not owned by the loop
+	 * @param ss Server socket (it must already be listening)
+	 * @param handler Handler for the accepted connections
+	 */
+	void add (ServerSocket& ss, EventHandler& handler) throw();
+
+	/**
+	 * @brief Register an already connected socket onto the loop. The socket is made non-blocking,
+	 * and it's not owned by the loop
+	 * @param s Socket
+	 * @param handler Handler for the socket events
+	 */
+	void add (Socket& s, EventHandler& handler) throw();
+
+	/**
+	 * @brief Remove a socket from the loop, call its onClosed() handler and close its descriptor.
+	 * Sockets accepted by the loop are destroyed as soon as the current iteration ends
+	 * @param s Socket to be closed
+	 */
+	void close (Socket& s);
+
+	/**
+	 * @brief Wait for events and dispatch them once
+	 * @param timeout Maximum time to wait, in milliseconds (default: -1, wait forever)
+	 * @return Number of events dispatched
+	 */
+	int runOnce (int timeout = -1);
+
+	/**
+	 * @brief Dispatch events until stop() is called or no socket is registered anymore.
+	 * A stop() called before run() makes it return straight away
+	 */
+	void run();
+
+	/**
+	 * @brief Make run() return after the current iteration. It can be safely called from another
+	 * thread, or from a signal handler
+	 */
+	void stop() throw();
+
+	/**
+	 * @brief Return the number of sockets currently registered onto the loop
+	 */
+	u_int32_t size() throw();
+};
+
+/**
+ * @class AcceptorPool
+ * @brief Pool of threads, each one with its own EventLoop and its own ServerSocket listening on the
+ * same port through SO_REUSEPORT. The kernel spreads the incoming connections among the listeners,
+ * so that accept throughput scales with the number of cores. The handler callbacks are called
+ * concurrently by the different threads, while each connection always lives in the same thread
+ * @author BlackLight
+ */
+class AcceptorPool  {
+
+private:
+	struct Worker;
+
+	///@brief Threads of the pool
+	std::vector<Worker*> workers;
+
+	///@brief Whether each thread should be pinned to a core
+	bool pin;
+
+	AcceptorPool (const AcceptorPool&);
+	AcceptorPool& operator= (const AcceptorPool&);
+
+	static void* workerMain (void *arg);
+
+public:
+	/**
+	 * @brief AcceptorPool constructor. It opens the listening sockets, but no thread is started before start()
+	 * @param port Port the server will listen onto
+	 * @param handler Handler for the accepted connections, shared among all the threads
+	 * @param nthreads Number of listeners/threads (default: 0, one for each online CPU)
+	 * @param m Maximum number of pending connections on each listener (default = DEFAULT_MAXCON)
+	 * @param addr Address the sockets will listen from, as string (default = INADDR_ANY)
+	 * @param pin Pin the i-th thread to the i-th core (default = true)
+	 */
+	AcceptorPool (u_int16_t port, EventHandler& handler, u_int32_t nthreads = 0, u_int32_t m = DEFAULT_MAXCON,
+			const std::string& addr = "", bool pin = true) throw();
+
+	/**
+	 * @brief Destroyer for the AcceptorPool class. It stops the threads, if still running, and closes the listeners
+	 */
+	~AcceptorPool();
+
+	/**
+	 * @brief Start a thread for each listener
+	 */
+	void start() throw();
+
+	/**
+	 * @brief Ask all the event loops to stop, and wait for the threads to terminate
+	 */
+	void stop() throw();
+
+	/**
+	 * @brief Wait for the threads to terminate
+	 */
+	void join() throw();
+
+	/**
+	 * @brief Return the number of threads in the pool
+	 */
+	u_int32_t size() throw();
+
+	/**
+	 * @brief Return the event loop driven by the i-th thread
+	 */
+	EventLoop& loop (u_int32_t i) throw();
+};
+}
+
+#endif
+
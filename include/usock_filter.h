@@ -0,0 +1,181 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_FILTER_H
+#define __USOCK_FILTER_H
+
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include <string>
+#include <vector>
+
+#define	FILTER_SNAPLEN	0xffff
+
+namespace usock  {
+
+/**
+ * @class PacketFilter
+ * @brief Builder for classic BPF programs matching IPv4 packets, to be attached to a socket (SO_ATTACH_FILTER)
+ * so that the kernel drops the unwanted packets before they're queued, copied or wake anybody up.
+ * The predicates are chained in AND, and they work on the sockets whose packets start at the IP header:
+ * RawSocket and RxRing. Ports and ICMP fields are only matched on unfragmented packets (or first fragments).
+ * All the values are taken in host byte order, the addresses are in_addr_t (network byte order)
+ * @author BlackLight
+ */
+class PacketFilter  {
+
+private:
+	///@brief An instruction, with its jumps as relative offsets or REJECT
+	struct Insn  {
+		u_int16_t code;
+		int jt, jf;
+		u_int32_t k;
+	};
+
+	///@brief The predicates compiled so far
+	std::vector<Insn> insns;
+
+	///@brief Bytes of the matching packets accepted by the program
+	u_int32_t snaplen;
+
+	void emit (u_int16_t code, u_int32_t k, int jt = 0, int jf = 0) throw();
+
+	/**
+	 * @brief Match the packets of an IP protocol, then load the IP header length into X (for the transport header)
+	 * @param proto IP protocol
+	 * @param alt Alternative IP protocol (-1 for none)
+	 */
+	void transport (u_int8_t proto, int alt = -1) throw();
+
+	/**
+	 * @brief Load a field and match it against a value
+	 * @param load BPF load instruction (size and addressing mode)
+	 * @param off Offset of the field
+	 * @param value Value to be matched
+	 * @param other Offset of a second field which may match the value instead (-1 for none)
+	 */
+	void match (u_int16_t load, u_int32_t off, u_int32_t value, int other = -1) throw();
+
+	static in_addr_t resolve (const std::string& host) throw();
+
+public:
+	/**
+	 * @brief Build a filter matching all the IPv4 packets
+	 * @param snaplen Bytes of each matching packet passed to the socket (default: FILTER_SNAPLEN, all)
+	 */
+	PacketFilter (u_int32_t snaplen = FILTER_SNAPLEN) throw();
+
+	/**
+	 * @brief Match an IP protocol (IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP...)
+	 */
+	PacketFilter& protocol (u_int8_t proto) throw();
+
+	/**
+	 * @brief Match a source address
+	 */
+	PacketFilter& srcHost (in_addr_t addr) throw();
+	PacketFilter& srcHost (const std::string& host) throw();
+
+	/**
+	 * @brief Match a destination address
+	 */
+	PacketFilter& dstHost (in_addr_t addr) throw();
+	PacketFilter& dstHost (const std::string& host) throw();
+
+	/**
+	 * @brief Match an address, either as source or as destination
+	 */
+	PacketFilter& host (in_addr_t addr) throw();
+	PacketFilter& host (const std::string& host) throw();
+
+	/**
+	 * @brief Match a TCP/UDP source port
+	 */
+	PacketFilter& srcPort (u_int16_t port) throw();
+
+	/**
+	 * @brief Match a TCP/UDP destination port
+	 */
+	PacketFilter& dstPort (u_int16_t port) throw();
+
+	/**
+	 * @brief Match a TCP/UDP port, either as source or as destination
+	 */
+	PacketFilter& port (u_int16_t port) throw();
+
+	/**
+	 * @brief Match an ICMP type (it implies protocol(IPPROTO_ICMP))
+	 */
+	PacketFilter& icmpType (u_int8_t type) throw();
+
+	/**
+	 * @brief Match the ID of ICMP echo requests/replies (it implies protocol(IPPROTO_ICMP)). The other ICMP
+	 * types are rejected
+	 */
+	PacketFilter& icmpId (u_int16_t id) throw();
+
+	/**
+	 * @brief Return true if the filter has no predicate (it matches every IPv4 packet)
+	 */
+	bool empty() const throw();
+
+	/**
+	 * @brief Return the compiled BPF program
+	 */
+	std::vector<struct sock_filter> program() const throw();
+
+	/**
+	 * @brief Attach the filter to a socket descriptor, replacing the one attached before
+	 */
+	void attach (int sd) const throw();
+
+	/**
+	 * @brief Remove the filter attached to a socket descriptor, if any
+	 */
+	static void detach (int sd) throw();
+};
+}
+
+#endif
+
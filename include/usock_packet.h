@@ -0,0 +1,216 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_PACKET_H
+#define __USOCK_PACKET_H
+
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include "usock.h"
+
+namespace usock  {
+
+/**
+ * @class PacketTemplate
+ * @brief A raw IPv4 or IPv6 packet compiled once from a RawSocket, and then changed field by field before each write.
+ * Each setter stores the new value and patches the IP and transport checksums incrementally (RFC 1624),
+ * so a new variant of the packet costs a few stores instead of rebuilding and summing it again.
+ * All the values are taken in host byte order, the addresses are in_addr_t/in6_addr (network byte order)
+ * @author BlackLight
+ */
+class PacketTemplate  {
+
+private:
+	///@brief The packet, checksums included
+	std::vector<u_int8_t> pkt;
+
+	///@brief Offset of the transport header
+	u_int32_t l4off;
+
+	///@brief Transport protocol
+	u_int8_t proto;
+
+	///@brief true if the packet is IPv6
+	bool ipv6;
+
+	///@brief Generator for randomSeq()
+	Xorshift rng;
+
+	/**
+	 * @brief Store a 16-bit word (network byte order) at an offset of the packet, and update the checksums covering it
+	 * @param off Offset of the word (even)
+	 * @param value New value
+	 * @param pseudo true if the word is part of the TCP/UDP pseudo-header too
+	 */
+	void set16 (u_int32_t off, u_int16_t value, bool pseudo) throw();
+
+	/**
+	 * @brief Same as set16(), for a 32-bit word
+	 */
+	void set32 (u_int32_t off, u_int32_t value, bool pseudo) throw();
+
+	/**
+	 * @brief Return the offset of the checksum of the transport header (0 if there's no checksum to keep)
+	 */
+	u_int32_t l4check() throw();
+
+	/**
+	 * @brief Throw an exception if the transport protocol of the packet isn't one of those specified
+	 */
+	void expect (int proto1, int proto2 = -1) throw();
+
+	/**
+	 * @brief Throw an exception if the packet isn't IPv6 (v6 = true) or IPv4 (v6 = false)
+	 */
+	void expectFamily (bool v6) throw();
+
+	/**
+	 * @brief Store an IPv6 address at an offset of the packet, and update the transport checksum
+	 */
+	void setAddr6 (u_int32_t off, const struct in6_addr& addr) throw();
+
+public:
+	/**
+	 * @brief Build an empty template
+	 */
+	PacketTemplate() throw();
+
+	/**
+	 * @brief Compile the packet built on a RawSocket (buildIPv4()/buildIPv6(), buildTCP()/buildUDP()/buildICMPv4()/buildICMPv6(), setPayload())
+	 * into a template, computing its lengths and checksums
+	 * @param s Raw socket
+	 */
+	explicit PacketTemplate (RawSocket& s) throw();
+
+	/**
+	 * @brief Return the packet, ready to be sent
+	 */
+	const u_int8_t* data() const throw();
+
+	/**
+	 * @brief Return the packet length
+	 */
+	u_int32_t length() const throw();
+
+	/**
+	 * @brief Set the IPv4 source address
+	 */
+	void setSrc (in_addr_t addr) throw();
+
+	/**
+	 * @brief Set the IPv4 destination address
+	 */
+	void setDst (in_addr_t addr) throw();
+
+	/**
+	 * @brief Set the IPv6 source address
+	 */
+	void setSrc (const struct in6_addr& addr) throw();
+
+	/**
+	 * @brief Set the IPv6 destination address
+	 */
+	void setDst (const struct in6_addr& addr) throw();
+
+	/**
+	 * @brief Set the IPv4/IPv6 destination address, as a string
+	 */
+	void setDst (const std::string& addr) throw();
+
+	/**
+	 * @brief Set the IPv4 Time To Live, or the IPv6 hop limit
+	 */
+	void setTTL (u_int8_t ttl) throw();
+
+	/**
+	 * @brief Set the IPv4 datagram ID (0 lets the kernel choose it)
+	 */
+	void setId (u_int16_t id) throw();
+
+	/**
+	 * @brief Set the TCP/UDP source port
+	 */
+	void setSrcPort (u_int16_t port) throw();
+
+	/**
+	 * @brief Set the TCP/UDP destination port
+	 */
+	void setDstPort (u_int16_t port) throw();
+
+	/**
+	 * @brief Set the TCP sequence number
+	 */
+	void setSeq (u_int32_t seq) throw();
+
+	/**
+	 * @brief Set a random TCP sequence number
+	 * @return The sequence number set
+	 */
+	u_int32_t randomSeq() throw();
+
+	/**
+	 * @brief Set the TCP acknowledgment number
+	 */
+	void setAck (u_int32_t ack) throw();
+
+	/**
+	 * @brief Set the ICMP/ICMPv6 echo ID
+	 */
+	void setICMPId (u_int16_t id) throw();
+
+	/**
+	 * @brief Set the ICMP/ICMPv6 echo sequence number
+	 */
+	void setICMPSeq (u_int16_t seq) throw();
+
+	/**
+	 * @brief Seed the generator used by randomSeq(), for reproducible sequences
+	 */
+	void seed (u_int32_t value) throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,367 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_PARSER_H
+#define __USOCK_PARSER_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <cstring>
+
+#define	IPV6_MAX_EXT_HEADERS	8
+
+namespace usock  {
+
+/**
+ * @class HeaderView
+ * @brief Base of the header views: a header and what follows it, inside a buffer owned by somebody else.
+ * A view is built by parse(), which checks the bounds once; after that, the field getters read straight from the
+ * buffer, byte by byte (no alignment required), and return the values in host byte order
+ * @author BlackLight
+ */
+class HeaderView  {
+
+protected:
+	///@brief Start of the header (NULL if the view is not valid)
+	const u_int8_t *p;
+
+	///@brief Bytes of the header and of its payload inside the buffer
+	u_int32_t len;
+
+	///@brief Header length
+	u_int32_t hlen;
+
+	static u_int16_t get16 (const u_int8_t* b) throw()  { return (u_int16_t) ((b[0] << 8) | b[1]); }
+	static u_int32_t get32 (const u_int8_t* b) throw()  { return ((u_int32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]; }
+
+	bool fail() throw()  { p = NULL; len = hlen = 0; return false; }
+
+public:
+	HeaderView() throw() : p(NULL), len(0), hlen(0)  {}
+
+	///@brief Return true if the view was parsed successfully
+	bool valid() const throw()  { return p != NULL; }
+
+	///@brief Return the start of the header
+	const u_int8_t* data() const throw()  { return p; }
+
+	///@brief Return the bytes of the header and of its payload
+	u_int32_t length() const throw()  { return len; }
+
+	///@brief Return the header length, options included
+	u_int32_t headerLength() const throw()  { return hlen; }
+
+	///@brief Return what follows the header
+	const u_int8_t* payload() const throw()  { return p + hlen; }
+
+	///@brief Return the length of what follows the header
+	u_int32_t payloadLength() const throw()  { return len - hlen; }
+};
+
+/**
+ * @class EthernetView
+ * @brief View over an Ethernet header, 802.1Q/802.1ad VLAN tags included
+ * @author BlackLight
+ */
+class EthernetView : public HeaderView  {
+
+private:
+	u_int16_t ethType, vlanId;
+
+public:
+	EthernetView() throw() : ethType(0), vlanId(0)  {}
+
+	/**
+	 * @brief Parse an Ethernet frame
+	 * @return true if the header fits in the buffer
+	 */
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	///@brief Return the destination MAC address (6 bytes)
+	const u_int8_t* dst() const throw()  { return p; }
+
+	///@brief Return the source MAC address (6 bytes)
+	const u_int8_t* src() const throw()  { return p + 6; }
+
+	///@brief Return the EtherType of the payload, after the VLAN tags (ETH_P_IP, ETH_P_IPV6...)
+	u_int16_t type() const throw()  { return ethType; }
+
+	///@brief Return the ID of the outer VLAN tag (0 if the frame is untagged)
+	u_int16_t vlan() const throw()  { return vlanId; }
+};
+
+/**
+ * @class IPv4View
+ * @brief View over an IPv4 header, options included. The payload stops at the total length, so the
+ * padding of short Ethernet frames is left out
+ * @author BlackLight
+ */
+class IPv4View : public HeaderView  {
+
+public:
+	/**
+	 * @brief Parse an IPv4 packet
+	 * @return true if it's an IPv4 header, and it fits in the buffer
+	 */
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	u_int8_t tos() const throw()  { return p[1]; }
+	u_int16_t totalLength() const throw()  { return get16(p + 2); }
+	u_int16_t id() const throw()  { return get16(p + 4); }
+
+	///@brief Return the fragment offset, in bytes
+	u_int16_t fragOffset() const throw()  { return (get16(p + 6) & 0x1fff) << 3; }
+	bool moreFragments() const throw()  { return p[6] & 0x20; }
+	bool dontFragment() const throw()  { return p[6] & 0x40; }
+
+	///@brief Return true if the packet is a fragment (the first one included)
+	bool isFragment() const throw()  { return (get16(p + 6) & 0x3fff) != 0; }
+
+	u_int8_t ttl() const throw()  { return p[8]; }
+	u_int8_t protocol() const throw()  { return p[9]; }
+	u_int16_t checksum() const throw()  { return get16(p + 10); }
+
+	///@brief Return the source address (network byte order)
+	in_addr_t src() const throw()  { in_addr_t a; memcpy(&a, p + 12, 4); return a; }
+
+	///@brief Return the destination address (network byte order)
+	in_addr_t dst() const throw()  { in_addr_t a; memcpy(&a, p + 16, 4); return a; }
+
+	///@brief Return the options, if any
+	const u_int8_t* options() const throw()  { return p + 20; }
+	u_int32_t optionsLength() const throw()  { return hlen - 20; }
+
+	///@brief Return true if the capture holds less than the total length
+	bool truncated() const throw()  { return len < totalLength(); }
+
+	/**
+	 * @brief Verify the header checksum (computed on each call)
+	 */
+	bool checksumValid() const throw();
+};
+
+/**
+ * @class IPv6View
+ * @brief View over an IPv6 header and its chain of extension headers (hop-by-hop, routing, fragment,
+ * destination options, authentication), which are counted in the header length
+ * @author BlackLight
+ */
+class IPv6View : public HeaderView  {
+
+private:
+	u_int8_t upper;
+	u_int16_t frag;
+	bool fragmented;
+
+public:
+	IPv6View() throw() : upper(0), frag(0), fragmented(false)  {}
+
+	/**
+	 * @brief Parse an IPv6 packet, walking its extension headers (IPV6_MAX_EXT_HEADERS at most)
+	 * @return true if it's an IPv6 header, and the header chain fits in the buffer
+	 */
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	u_int8_t trafficClass() const throw()  { return (u_int8_t) (get16(p) >> 4); }
+	u_int32_t flowLabel() const throw()  { return get32(p) & 0xfffff; }
+
+	///@brief Return the length of the packet (fixed header + payload length field)
+	u_int32_t totalLength() const throw()  { return 40 + get16(p + 4); }
+
+	///@brief Return the Next Header field of the fixed header
+	u_int8_t nextHeader() const throw()  { return p[6]; }
+
+	///@brief Return the protocol after the extension headers (IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMPV6...)
+	u_int8_t protocol() const throw()  { return upper; }
+
+	u_int8_t hopLimit() const throw()  { return p[7]; }
+
+	struct in6_addr src() const throw()  { struct in6_addr a; memcpy(&a, p + 8, 16); return a; }
+	struct in6_addr dst() const throw()  { struct in6_addr a; memcpy(&a, p + 24, 16); return a; }
+
+	///@brief Return true if the packet carries a fragment header
+	bool isFragment() const throw()  { return fragmented; }
+
+	///@brief Return the fragment offset, in bytes
+	u_int16_t fragOffset() const throw()  { return frag; }
+
+	bool truncated() const throw()  { return len < totalLength(); }
+};
+
+/**
+ * @class TCPView
+ * @brief View over a TCP header, options included
+ * @author BlackLight
+ */
+class TCPView : public HeaderView  {
+
+public:
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	u_int16_t srcPort() const throw()  { return get16(p); }
+	u_int16_t dstPort() const throw()  { return get16(p + 2); }
+	u_int32_t seq() const throw()  { return get32(p + 4); }
+	u_int32_t ack() const throw()  { return get32(p + 8); }
+
+	///@brief Return the flags (TH_FIN, TH_SYN, TH_RST, TH_PUSH, TH_ACK, TH_URG)
+	u_int8_t flags() const throw()  { return p[13]; }
+
+	u_int16_t window() const throw()  { return get16(p + 14); }
+	u_int16_t checksum() const throw()  { return get16(p + 16); }
+	u_int16_t urgent() const throw()  { return get16(p + 18); }
+
+	const u_int8_t* options() const throw()  { return p + 20; }
+	u_int32_t optionsLength() const throw()  { return hlen - 20; }
+};
+
+/**
+ * @class UDPView
+ * @brief View over an UDP header. The payload stops at the UDP length
+ * @author BlackLight
+ */
+class UDPView : public HeaderView  {
+
+public:
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	u_int16_t srcPort() const throw()  { return get16(p); }
+	u_int16_t dstPort() const throw()  { return get16(p + 2); }
+	u_int16_t udpLength() const throw()  { return get16(p + 4); }
+	u_int16_t checksum() const throw()  { return get16(p + 6); }
+};
+
+/**
+ * @class ICMPView
+ * @brief View over an ICMP or ICMPv6 header. The payload starts after the first 8 bytes: the echo data,
+ * or the packet quoted by an error message (which can be parsed on its own)
+ * @author BlackLight
+ */
+class ICMPView : public HeaderView  {
+
+public:
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	u_int8_t type() const throw()  { return p[0]; }
+	u_int8_t code() const throw()  { return p[1]; }
+	u_int16_t checksum() const throw()  { return get16(p + 2); }
+
+	///@brief Return the echo ID (echo requests/replies)
+	u_int16_t id() const throw()  { return get16(p + 4); }
+
+	///@brief Return the echo sequence number (echo requests/replies)
+	u_int16_t seq() const throw()  { return get16(p + 6); }
+};
+
+/**
+ * @class PacketParser
+ * @brief Zero-copy parser for a received packet: it decodes the link, network and transport headers into
+ * views over the caller's buffer, without copying nor allocating anything. The buffer must outlive the parser.
+ * Checksums are only verified on request
+ * @author BlackLight
+ */
+class PacketParser  {
+
+private:
+	EthernetView ethView;
+	IPv4View ip4View;
+	IPv6View ip6View;
+	TCPView tcpView;
+	UDPView udpView;
+	ICMPView icmpView;
+
+	///@brief Transport protocol
+	u_int8_t proto;
+
+	bool network (const u_int8_t* buf, u_int32_t size) throw();
+	void transport (u_int8_t proto, const u_int8_t* buf, u_int32_t size) throw();
+
+public:
+	PacketParser() throw();
+
+	/**
+	 * @brief Parse a packet starting at the network header (as read from a RawSocket, or captured by a RxRing)
+	 * @param buf Packet
+	 * @param size buf's length
+	 * @return true if an IPv4 or IPv6 header was found
+	 */
+	bool parse (const u_int8_t* buf, u_int32_t size) throw();
+
+	/**
+	 * @brief Parse a frame starting at the Ethernet header
+	 * @return true if an IPv4 or IPv6 header was found after the Ethernet header
+	 */
+	bool parseEthernet (const u_int8_t* buf, u_int32_t size) throw();
+
+	const EthernetView& ethernet() const throw()  { return ethView; }
+	const IPv4View& ipv4() const throw()  { return ip4View; }
+	const IPv6View& ipv6() const throw()  { return ip6View; }
+	const TCPView& tcp() const throw()  { return tcpView; }
+	const UDPView& udp() const throw()  { return udpView; }
+
+	///@brief Return the ICMP or ICMPv6 view
+	const ICMPView& icmp() const throw()  { return icmpView; }
+
+	///@brief Return the transport protocol (0 if the packet has no IP header, or it's a non-first fragment).
+	///The TCP/UDP/ICMP view is only valid if its header fits in the buffer
+	u_int8_t protocol() const throw()  { return proto; }
+
+	///@brief Return the payload of the innermost parsed header
+	const u_int8_t* payload() const throw();
+	u_int32_t payloadLength() const throw();
+
+	/**
+	 * @brief Verify the checksum of the transport header and its payload (pseudo-header included for TCP, UDP
+	 * and ICMPv6). It fails on a truncated capture, whose segment can't be summed
+	 */
+	bool transportChecksumValid() const throw();
+
+	/**
+	 * @brief Verify all the checksums of the packet (IPv4 header and transport)
+	 */
+	bool checksumValid() const throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,220 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_PREFORK_H
+#define __USOCK_PREFORK_H
+
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <vector>
+#include "usock.h"
+
+#define	PREFORK_GRACE	5.0
+
+namespace usock  {
+
+///@brief Counters exposed by PreforkPool::stats()
+struct PreforkStats  {
+	///@brief Worker processes started, respawns included
+	unsigned long spawned;
+
+	///@brief Workers which exited on their own after maxRequests connections
+	unsigned long recycled;
+
+	///@brief Workers which crashed or were killed, and had to be replaced
+	unsigned long lost;
+
+	///@brief Connections passed to a worker (handoff mode only)
+	unsigned long handoffs;
+};
+
+/**
+ * @class PreforkPool
+ * @brief Fixed pool of pre-forked worker processes serving the connections of a ServerSocket, one at a
+ * time each, with the same handler taken by ServerSocket::accept(). Unlike accept(handler), no process is
+ * created on the connection path, and at most as many connections as workers are served at once (the
+ * others wait in the listen backlog). The workers either accept on the listener they share (shared mode),
+ * or get the connections accepted by the master process over a UNIX socket (SCM_RIGHTS, handoff mode),
+ * which only passes them to idle workers. A worker exits after maxRequests connections, and the master
+ * replaces it, as well as any worker that crashed: the children are reaped through a signalfd
+ * @author BlackLight
+ */
+class PreforkPool  {
+
+public:
+	enum Mode  {
+		///@brief The workers call accept() on the shared listener
+		shared,
+
+		///@brief The master accepts, and passes each connection to an idle worker
+		handoff
+	};
+
+private:
+	struct Worker  {
+		pid_t pid;
+
+		///@brief Master end of the UNIX socket shared with the worker (-1 if none)
+		int chan;
+
+		///@brief The worker is waiting for a connection (handoff mode)
+		bool idle;
+	};
+
+	///@brief Worker processes, by slot
+	std::vector<Worker> workers;
+
+	ServerSocket *server;
+	void (*handler)(Socket&);
+	u_int32_t maxRequests;
+	Mode mode;
+
+	///@brief signalfd receiving SIGCHLD, and eventfd waking up run() on stop()
+	int sigfd, wakefd;
+
+	///@brief Signal mask of the master before start() blocked SIGCHLD
+	sigset_t oldmask;
+
+	///@brief File status flags of the listener before start()
+	int lflags;
+
+	bool running;
+
+	///@brief Set by stop(), possibly from a signal handler, and only cleared once run() is over
+	volatile sig_atomic_t stopping;
+	PreforkStats counters;
+
+	///@brief Descriptors polled by step(), and the slot of each worker channel among them
+	std::vector<struct pollfd> pfds;
+	std::vector<u_int32_t> pslot;
+
+	PreforkPool (const PreforkPool&);
+	PreforkPool& operator= (const PreforkPool&);
+
+	/**
+	 * @brief Fork the worker of a slot
+	 */
+	void spawn (u_int32_t i) throw();
+
+	/**
+	 * @brief Body of a worker process: serve connections until maxRequests, or until the master stops the pool
+	 */
+	void serve (int chan) throw();
+
+	/**
+	 * @brief Reap the exited workers, and replace them unless the pool is stopping
+	 */
+	void reap() throw();
+
+	/**
+	 * @brief Accept the pending connections and pass them to the idle workers (handoff mode)
+	 */
+	void dispatch() throw();
+
+	/**
+	 * @brief Stop the workers (SIGTERM, then SIGKILL after PREFORK_GRACE seconds) and wait for them
+	 */
+	void terminate() throw();
+
+public:
+	/**
+	 * @brief PreforkPool constructor. No process is started before start()
+	 * @param s Listening server socket
+	 * @param handler Function called in a worker process for each connection. The connection is closed when it returns
+	 * @param nworkers Number of worker processes, never more than the maxconn of s (default: 0, one for each online CPU)
+	 * @param maxRequests Connections served by a worker before it's replaced by a new one (default: 0, never)
+	 * @param mode How the connections reach the workers (default: shared)
+	 */
+	PreforkPool (ServerSocket& s, void (*handler)(Socket&), u_int32_t nworkers = 0, u_int32_t maxRequests = 0,
+			Mode mode = shared) throw();
+
+	/**
+	 * @brief Destroyer for the PreforkPool class. It stops the workers, if still running
+	 */
+	~PreforkPool();
+
+	/**
+	 * @brief Start the workers. SIGCHLD is blocked in the calling thread, and received through a signalfd: call it
+	 * before starting other threads, or block SIGCHLD in them too
+	 */
+	void start() throw();
+
+	/**
+	 * @brief Wait for the exited workers to be reaped and, in handoff mode, for connections to be dispatched
+	 * and workers to be done with theirs, then handle them
+	 * @param timeout Maximum time to wait, in milliseconds (default: -1, forever)
+	 * @return Number of events handled (0 on timeout)
+	 */
+	int step (int timeout = -1) throw();
+
+	/**
+	 * @brief Start the workers if needed, and keep the pool running until stop(). The workers are then terminated
+	 */
+	void run() throw();
+
+	/**
+	 * @brief Ask run() to return. It can be called from another thread or from a signal handler
+	 */
+	void stop() throw();
+
+	/**
+	 * @brief Return the number of running workers
+	 */
+	u_int32_t size() throw();
+
+	/**
+	 * @brief Return the number of workers serving a connection (handoff mode only)
+	 */
+	u_int32_t busy() throw();
+
+	/**
+	 * @brief Return the pool counters
+	 */
+	PreforkStats stats() throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,420 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_PROBE_H
+#define __USOCK_PROBE_H
+
+#include <netinet/in.h>
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+#include "usock.h"
+#include "usock_packet.h"
+
+#define	PROBE_RATE		10000.0
+#define	PROBE_BURST		RAW_BATCH_SIZE
+#define	PROBE_TIMEOUT		1.0
+#define	PROBE_TABLE_SIZE	16384
+#define	PROBE_MAX_HOPS		30
+
+namespace usock  {
+
+/**
+ * @class RateLimiter
+ * @brief Token bucket, pacing the probes of ProbeEngine and SynScanner
+ * @author BlackLight
+ */
+class RateLimiter  {
+
+private:
+	///@brief Rate (tokens/s), size of the bucket and current level
+	double rate, burst, tokens;
+
+	///@brief Last refill
+	struct timespec last;
+
+public:
+	/**
+	 * @brief RateLimiter constructor. The bucket starts full
+	 * @param rate Tokens per second
+	 * @param burst Size of the bucket
+	 */
+	RateLimiter (double rate, double burst) throw();
+
+	/**
+	 * @brief Add the tokens earned since the last refill
+	 * @param now Current time (CLOCK_MONOTONIC)
+	 */
+	void refill (const struct timespec& now) throw();
+
+	/**
+	 * @brief Take a token, if there's one
+	 * @return true if a token was taken
+	 */
+	bool take() throw();
+
+	/**
+	 * @brief Return the seconds left before the next token is available (0 if there's one already)
+	 */
+	double wait() throw();
+};
+
+///@brief Outcome of a probe, passed to the ProbeHandler callbacks
+struct ProbeResult  {
+	///@brief Target of the probe (network byte order)
+	in_addr_t dst;
+
+	///@brief Host which answered: the target itself, or a router on the way (network byte order, 0 on timeout)
+	in_addr_t from;
+
+	///@brief TTL the probe was sent with
+	u_int8_t ttl;
+
+	///@brief Type and code of the ICMP answer (ICMP_ECHOREPLY, ICMP_TIME_EXCEEDED, ICMP_DEST_UNREACH)
+	u_int8_t icmpType, icmpCode;
+
+	///@brief Round-trip time, in seconds
+	double rtt;
+
+	///@brief Value passed by the caller along with the probe
+	u_int32_t tag;
+};
+
+/**
+ * @class ProbeHandler
+ * @brief Callbacks invoked by a ProbeEngine when a probe is answered or expires
+ * @author BlackLight
+ */
+class ProbeHandler  {
+
+public:
+	virtual ~ProbeHandler()  {}
+
+	/**
+	 * @brief Called for each answer matched to a probe: an echo reply from the target, or an ICMP error
+	 * (time exceeded, destination unreachable) quoting the probe, from a router on the way
+	 */
+	virtual void onReply (const ProbeResult& r) = 0;
+
+	/**
+	 * @brief Called when a probe got no answer within the timeout
+	 */
+	virtual void onTimeout (const ProbeResult& r)  {}
+};
+
+/**
+ * @class ProbeEngine
+ * @brief Asynchronous ICMP echo prober, for sweeping many hosts or tracing many paths at once.
+ * The probes are echo requests patched from a single PacketTemplate and sent in batches through a RawSocket,
+ * paced by a token bucket. The replies come back on the same raw socket, and they're matched to the probes
+ * in flight through a table indexed by the ICMP sequence number (the echo ID is the same for the whole engine):
+ * echo replies directly, ICMP errors through the header of the probe they quote
+ * @author BlackLight
+ */
+class ProbeEngine  {
+
+private:
+	///@brief A probe, queued or in flight
+	struct Probe  {
+		in_addr_t dst;
+		u_int8_t ttl;
+		u_int32_t tag;
+		u_int16_t seq;
+		bool used;
+		struct timespec sent;
+	};
+
+	RawSocket s;
+	PacketTemplate t;
+	ProbeHandler& handler;
+
+	///@brief Probes in flight, indexed by sequence number (modulo the table size)
+	std::vector<Probe> table;
+
+	///@brief Probes waiting for a token or for a free slot in the table
+	std::deque<Probe> todo;
+
+	///@brief Sequence numbers of the probes in flight, in the order they were sent (and so in the order they expire)
+	std::deque<u_int16_t> inflight;
+
+	///@brief Echo ID of the engine, and next sequence number
+	u_int16_t id, seq;
+
+	///@brief Number of probes in flight
+	u_int32_t active;
+
+	///@brief Pacing of the probes
+	RateLimiter limiter;
+
+	///@brief Time a probe is waited for
+	double timeout;
+
+	///@brief Whether the receive buffer of the raw descriptor has been enlarged already
+	bool tuned;
+
+	///@brief Buffer for the answers
+	std::vector<u_int8_t> buf;
+
+	ProbeEngine (const ProbeEngine&);
+	ProbeEngine& operator= (const ProbeEngine&);
+
+	void send (const struct timespec& now) throw();
+	void receive (const struct timespec& now) throw();
+	void expire (const struct timespec& now) throw();
+	void match (const u_int8_t* pkt, u_int32_t len, const struct timespec& now) throw();
+
+public:
+	/**
+	 * @brief ProbeEngine constructor
+	 * @param h Handler for the answers
+	 * @param rate Maximum number of probes per second (default: PROBE_RATE)
+	 * @param timeout Time a probe is waited for, in seconds (default: PROBE_TIMEOUT)
+	 * @param src Source address of the probes (default: the address of the network interface)
+	 * @param iface Network interface (default: the first available, up and running network interface != lo)
+	 * @param burst Probes which can be sent back to back after an idle time (default: PROBE_BURST)
+	 */
+	ProbeEngine (ProbeHandler& h, double rate = PROBE_RATE, double timeout = PROBE_TIMEOUT, const std::string& src = "",
+			const std::string& iface = "", u_int32_t burst = PROBE_BURST) throw();
+
+	/**
+	 * @brief Queue an echo request
+	 * @param dst Target address (network byte order)
+	 * @param tag Value passed back in the ProbeResult (default: 0)
+	 * @param ttl TTL of the probe (default: 64)
+	 */
+	void ping (in_addr_t dst, u_int32_t tag = 0, u_int8_t ttl = 64) throw();
+
+	/**
+	 * @brief Queue an echo request to a host name/address. It throws if the name doesn't resolve to an IPv4 address
+	 */
+	void ping (const std::string& host, u_int32_t tag = 0, u_int8_t ttl = 64) throw();
+
+	/**
+	 * @brief Queue the probes of a traceroute, one for each TTL from 1 to maxHops, all of them sent at once.
+	 * Each hop answers with ICMP_TIME_EXCEEDED, and the target with ICMP_ECHOREPLY to the probes which reach it
+	 * @param dst Target address (network byte order)
+	 * @param maxHops Highest TTL (default: PROBE_MAX_HOPS)
+	 * @param tag Value passed back in the ProbeResults (default: 0)
+	 */
+	void trace (in_addr_t dst, u_int8_t maxHops = PROBE_MAX_HOPS, u_int32_t tag = 0) throw();
+
+	/**
+	 * @brief Queue the probes of a traceroute to a host name/address. It throws if the name doesn't resolve to an IPv4 address
+	 */
+	void trace (const std::string& host, u_int8_t maxHops = PROBE_MAX_HOPS, u_int32_t tag = 0) throw();
+
+	/**
+	 * @brief Send the probes allowed by the rate limit, wait up to maxWait seconds for the answers, and
+	 * invoke the callbacks for the answers and the expired probes
+	 * @param maxWait Maximum time to wait (0 doesn't wait; default: until something happens)
+	 * @return Number of probes still queued or in flight
+	 */
+	u_int32_t step (double maxWait = -1.0) throw();
+
+	/**
+	 * @brief Call step() until every probe is answered or expired
+	 */
+	void run() throw();
+
+	/**
+	 * @brief Return the number of probes queued or in flight
+	 */
+	u_int32_t pending() throw();
+
+	/**
+	 * @brief Return the raw socket descriptor (-1 before the first probe is sent), e.g. to poll() it from another loop
+	 */
+	int getDescriptor() throw();
+};
+
+///@brief Answer to a SYN probe, passed to ScanHandler::onResult()
+struct ScanResult  {
+	///@brief Target address (network byte order)
+	in_addr_t dst;
+
+	///@brief Target port
+	u_int16_t port;
+
+	///@brief true if the port answered with SYN+ACK, false if it answered with RST
+	bool open;
+
+	///@brief TTL of the answer
+	u_int8_t ttl;
+
+	///@brief Round-trip time, in seconds
+	double rtt;
+};
+
+/**
+ * @class ScanHandler
+ * @brief Callback invoked by a SynScanner for each answer
+ * @author BlackLight
+ */
+class ScanHandler  {
+
+public:
+	virtual ~ScanHandler()  {}
+
+	/**
+	 * @brief Called for each SYN probe answered within the timeout. Targets which don't answer produce no result
+	 */
+	virtual void onResult (const ScanResult& r) = 0;
+};
+
+/**
+ * @class SynScanner
+ * @brief Stateless TCP SYN prober, for checking the reachability and the connect latency of many ports/hosts.
+ * The SYNs are patched from a single PacketTemplate and sent in batches through a RawSocket, paced by a
+ * token bucket, and the SYN+ACK/RST answers come back on the same raw socket (filtered in the kernel on the
+ * source port of the scanner). No state is kept for the probes in flight: the sequence number of each SYN holds
+ * its send time in 16 bits and a 16-bit keyed MAC (SipHash) of the target and of that time, so the answer
+ * (acknowledging it) is validated and timed on its own; a forged answer gets through once in 65536. The send
+ * time ticks are scaled to the timeout, so the RTT resolution is between timeout / 32768 and timeout / 16384
+ * (32 us for a 1 s timeout). The kernel resets the half-open connections on its own, as it knows nothing about them
+ * @author BlackLight
+ */
+class SynScanner  {
+
+private:
+	struct Target  {
+		in_addr_t dst;
+		u_int16_t port;
+	};
+
+	RawSocket s;
+	PacketTemplate t;
+	ScanHandler& handler;
+	RateLimiter limiter;
+
+	///@brief Targets not probed yet
+	std::deque<Target> todo;
+
+	///@brief Secret key of the sequence number MACs
+	u_int64_t key[2];
+
+	///@brief Send time tick stamped in the SYNs, as a power of two of microseconds
+	u_int32_t tickShift;
+
+	///@brief Source port of the probes
+	u_int16_t sport;
+
+	///@brief Time an answer is waited for
+	double timeout;
+
+	///@brief Time the last probe was sent (tv_sec = 0 if none was)
+	struct timespec lastSent;
+
+	///@brief Whether the receive buffer of the raw descriptor has been enlarged already
+	bool tuned;
+
+	///@brief Buffer for the answers
+	std::vector<u_int8_t> buf;
+
+	SynScanner (const SynScanner&);
+	SynScanner& operator= (const SynScanner&);
+
+	u_int16_t mac (in_addr_t dst, u_int16_t port, u_int16_t stamp) const throw();
+	u_int16_t stamp (const struct timespec& ts) const throw();
+	void send (const struct timespec& now) throw();
+	void receive (const struct timespec& now) throw();
+
+public:
+	/**
+	 * @brief SynScanner constructor
+	 * @param h Handler for the answers
+	 * @param rate Maximum number of SYNs per second (default: PROBE_RATE)
+	 * @param timeout Time an answer is waited for, in seconds (default: PROBE_TIMEOUT)
+	 * @param src Source address of the probes (default: the address of the network interface)
+	 * @param iface Network interface (default: the first available, up and running network interface != lo)
+	 * @param sport Source port of the probes (default: a random one)
+	 * @param burst SYNs which can be sent back to back after an idle time (default: PROBE_BURST)
+	 */
+	SynScanner (ScanHandler& h, double rate = PROBE_RATE, double timeout = PROBE_TIMEOUT, const std::string& src = "",
+			const std::string& iface = "", u_int16_t sport = 0, u_int32_t burst = PROBE_BURST) throw();
+
+	/**
+	 * @brief Queue a target
+	 * @param dst Target address (network byte order)
+	 * @param port Target port
+	 */
+	void add (in_addr_t dst, u_int16_t port) throw();
+
+	/**
+	 * @brief Queue a target by host name/address. It throws if the name doesn't resolve to an IPv4 address
+	 */
+	void add (const std::string& host, u_int16_t port) throw();
+
+	/**
+	 * @brief Send the SYNs allowed by the rate limit, wait up to maxWait seconds for the answers, and
+	 * invoke the callback for them
+	 * @param maxWait Maximum time to wait (0 doesn't wait; default: until something happens, or the timeout of the last SYN expires)
+	 * @return Number of targets not probed yet
+	 */
+	u_int32_t step (double maxWait = -1.0) throw();
+
+	/**
+	 * @brief Call step() until every target is probed and the timeout of the last SYN expired
+	 */
+	void run() throw();
+
+	/**
+	 * @brief Return true if every target is probed and the timeout of the last SYN expired
+	 */
+	bool finished() throw();
+
+	/**
+	 * @brief Return the source port of the probes
+	 */
+	u_int16_t getSourcePort() throw();
+
+	/**
+	 * @brief Return the raw socket descriptor (-1 before the first SYN is sent)
+	 */
+	int getDescriptor() throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,266 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_RESOLVER_H
+#define __USOCK_RESOLVER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <ctime>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#define	RESOLVER_MAXENTRIES	1024
+#define	RESOLVER_TTL		60.0
+#define	RESOLVER_NEGATIVE_TTL	5.0
+
+namespace usock  {
+
+/**
+ * @class ResolverBackend
+ * @brief Interface for the name lookups performed by a Resolver on a cache miss.
+ * The default backend is based on getaddrinfo()/getnameinfo()
+ * @author BlackLight
+ */
+class ResolverBackend  {
+
+public:
+	virtual ~ResolverBackend()  {}
+
+	/**
+	 * @brief Resolve a host name. It can be called by more threads at the same time
+	 * @param name Host name
+	 * @param family Address family (AF_INET, AF_INET6 or AF_UNSPEC for both)
+	 * @param addrs Vector that will hold the addresses found (port = 0)
+	 * @return true if the name was resolved, false otherwise
+	 */
+	virtual bool lookup (const std::string& name, int family, std::vector<struct sockaddr_storage>& addrs);
+
+	/**
+	 * @brief Resolve an address back into a host name
+	 * @param addr Address
+	 * @param name String that will hold the host name
+	 * @return true if a name was found, false otherwise
+	 */
+	virtual bool reverse (const struct sockaddr_storage& addr, std::string& name);
+};
+
+/**
+ * @class ResolverCallback
+ * @brief Callback for the asynchronous lookups started by Resolver::resolveAsync()
+ * @author BlackLight
+ */
+class ResolverCallback  {
+
+public:
+	virtual ~ResolverCallback()  {}
+
+	/**
+	 * @brief Called by a resolver thread when the lookup is done (addrs is empty if the name couldn't be resolved)
+	 */
+	virtual void onResolved (const std::string& name, const std::vector<struct sockaddr_storage>& addrs) = 0;
+};
+
+///@brief Counters exposed by Resolver::stats()
+struct ResolverStats  {
+	///@brief Lookups answered by the cache
+	unsigned long hits;
+
+	///@brief Lookups answered by the cache with a cached failure
+	unsigned long negativeHits;
+
+	///@brief Lookups which had to go through the backend
+	unsigned long misses;
+
+	///@brief Entries dropped to stay within the size bound
+	unsigned long evictions;
+
+	///@brief Entries currently held by the cache
+	unsigned long entries;
+};
+
+/**
+ * @class Resolver
+ * @brief Thread-safe cache for name and reverse lookups, with a TTL, caching of failures and an LRU size bound.
+ * BaseSocket::getHostByName() and BaseSocket::getHostByAddr() go through the default resolver
+ * @author BlackLight
+ */
+class Resolver  {
+
+private:
+	///@brief Cache key: address family of a name lookup (-1 for a reverse lookup) and name/address
+	typedef std::pair<int, std::string> Key;
+
+	struct Entry  {
+		std::vector<struct sockaddr_storage> addrs;
+		std::string name;
+		struct timespec expires;
+		std::list<Key>::iterator lru;
+	};
+
+	struct Job  {
+		std::string name;
+		int family;
+		ResolverCallback *callback;
+	};
+
+	///@brief Cached entries, by key
+	std::map<Key, Entry> cache;
+
+	///@brief Keys, from the most to the least recently used
+	std::list<Key> lru;
+
+	///@brief Keys being looked up by the backend: the other lookups of the same key wait for them on done
+	std::set<Key> pending;
+
+	///@brief Pending asynchronous lookups
+	std::deque<Job> jobs;
+
+	///@brief Worker threads for the asynchronous lookups
+	std::vector<pthread_t> threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+
+	///@brief Held for reading around each backend call, and for writing by setBackend()
+	pthread_rwlock_t backendLock;
+
+	ResolverBackend *backend;
+	ResolverBackend defaultBackend;
+	ResolverStats counters;
+
+	u_int32_t maxEntries;
+	u_int32_t nthreads;
+	double ttl;
+	double negativeTtl;
+	bool stopping;
+
+	Resolver (const Resolver&);
+	Resolver& operator= (const Resolver&);
+
+	/**
+	 * @brief Look up a key in the cache, waiting for a backend lookup of the same key already in progress.
+	 * On a miss the key is marked as pending, and the caller has to look it up and store() it
+	 */
+	bool find (const Key& key, Entry& e) throw();
+	void store (const Key& key, Entry& e, bool found) throw();
+	static void* workerMain (void *arg);
+
+public:
+	/**
+	 * @brief Resolver constructor
+	 * @param maxEntries Maximum number of cached entries (default = RESOLVER_MAXENTRIES)
+	 * @param ttl Lifetime of a successful lookup, in seconds (default = RESOLVER_TTL)
+	 * @param negativeTtl Lifetime of a failed lookup, in seconds (default = RESOLVER_NEGATIVE_TTL)
+	 * @param nthreads Number of threads serving the asynchronous lookups, started on the first one (default = 2)
+	 */
+	Resolver (u_int32_t maxEntries = RESOLVER_MAXENTRIES, double ttl = RESOLVER_TTL,
+			double negativeTtl = RESOLVER_NEGATIVE_TTL, u_int32_t nthreads = 2) throw();
+
+	/**
+	 * @brief Destroyer for the Resolver class. It waits for the worker threads, dropping the pending lookups
+	 */
+	~Resolver();
+
+	/**
+	 * @brief Replace the backend used on cache misses (NULL restores the default one). The cache is flushed.
+	 * It waits for the lookups in progress, so the previous backend can be destroyed once it returns
+	 */
+	void setBackend (ResolverBackend* b) throw();
+
+	/**
+	 * @brief Resolve a host name, through the cache
+	 * @param name Host name or numeric address (numeric addresses never touch the cache)
+	 * @param addrs Vector that will hold the addresses found (port = 0)
+	 * @param family Address family (AF_INET, AF_INET6, or AF_UNSPEC for both, default)
+	 * @return true if the name was resolved, false otherwise
+	 */
+	bool resolve (const std::string& name, std::vector<struct sockaddr_storage>& addrs, int family = AF_UNSPEC) throw();
+
+	/**
+	 * @brief Resolve an address back into a host name, through the cache
+	 * @param addr Numeric IPv4/IPv6 address
+	 * @return The host name, or an empty string if none was found
+	 */
+	std::string reverse (const std::string& addr) throw();
+
+	/**
+	 * @brief Resolve a host name in background, on one of the resolver threads, and store it in the cache
+	 * @param name Host name
+	 * @param family Address family (default: AF_UNSPEC)
+	 * @param callback Optional callback, called by the resolver thread when the lookup is done
+	 */
+	void resolveAsync (const std::string& name, int family = AF_UNSPEC, ResolverCallback* callback = NULL) throw();
+
+	/**
+	 * @brief Drop all the cached entries
+	 */
+	void flush() throw();
+
+	/**
+	 * @brief Return the cache counters
+	 */
+	ResolverStats stats() throw();
+
+	/**
+	 * @brief Return the resolver used by the socket classes
+	 */
+	static Resolver& getDefault() throw();
+
+	/**
+	 * @brief Replace the resolver used by the socket classes (NULL restores the built-in one).
+	 * The caller keeps the ownership of r
+	 */
+	static void setDefault (Resolver* r) throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,300 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_RING_H
+#define __USOCK_RING_H
+
+#include <sys/types.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "usock.h"
+
+#define	TXRING_FRAMES		1024
+#define	RING_FRAME_SIZE		2048
+#define	RING_BLOCK_SIZE		(1 << 16)
+#define	RXRING_BLOCKS		64
+#define	RXRING_RETIRE_MS	10
+
+namespace usock  {
+
+/**
+ * @class TxRing
+ * @brief Transmit ring for raw IPv4 and IPv6 packets on a network interface, over an AF_PACKET socket with a
+ * memory-mapped TPACKET_V3 ring (PACKET_MMAP). The packets are copied straight into the frames shared with
+ * the kernel, and a whole ring of them is sent with a single send() call. The kernel builds the link-layer
+ * header, towards a fixed hardware address (the next hop)
+ * @author BlackLight
+ */
+class TxRing  {
+
+private:
+	///@brief AF_PACKET socket descriptor
+	int sd;
+
+	///@brief The mapped ring
+	u_int8_t *ring;
+
+	///@brief Size of the mapped ring
+	size_t size;
+
+	///@brief Geometry of the ring
+	u_int32_t blockSize, frameSize, framesPerBlock, frameNr;
+
+	///@brief Next frame to be filled, and number of frames filled since the last flush()
+	u_int32_t head, pending;
+
+	///@brief Link-layer destination of the packets
+	struct sockaddr_ll sll;
+
+	TxRing (const TxRing&);
+	TxRing& operator= (const TxRing&);
+
+	void open (const std::string& iface, const std::string& hwaddr, u_int32_t frames, u_int32_t fsize) throw();
+	struct tpacket3_hdr* frame (u_int32_t i) throw();
+
+public:
+	/**
+	 * @brief Build a transmit ring on a network interface
+	 * @param iface Network interface
+	 * @param hwaddr Hardware address the frames are sent to, as "aa:bb:cc:dd:ee:ff": the MAC address of the
+	 * gateway or of the target host (default: the broadcast address; not needed on loopback or point-to-point links)
+	 * @param frames Number of frames in the ring (default: TXRING_FRAMES)
+	 * @param fsize Size of each frame, header included: it limits the packet size (default: RING_FRAME_SIZE)
+	 */
+	TxRing (const std::string& iface, const std::string& hwaddr = "", u_int32_t frames = TXRING_FRAMES,
+			u_int32_t fsize = RING_FRAME_SIZE) throw();
+
+	/**
+	 * @brief Build a transmit ring on the network interface of a raw socket
+	 * @param s Raw socket
+	 * @param hwaddr Hardware address the frames are sent to (see above)
+	 * @param frames Number of frames in the ring (default: TXRING_FRAMES)
+	 * @param fsize Size of each frame (default: RING_FRAME_SIZE)
+	 */
+	TxRing (RawSocket& s, const std::string& hwaddr = "", u_int32_t frames = TXRING_FRAMES,
+			u_int32_t fsize = RING_FRAME_SIZE) throw();
+
+	/**
+	 * @brief Destroyer for the TxRing class. Unsent packets are dropped
+	 */
+	~TxRing();
+
+	/**
+	 * @brief Copy a raw IPv4 or IPv6 packet into the next free frame of the ring. If the ring is full, the queued
+	 * packets are flushed and we wait for the kernel to release a frame. A send() gives all its frames the same
+	 * ethertype, so the queued packets are also flushed when a packet of the other family comes
+	 * @param pkt IPv4 or IPv6 packet, header included (the family is taken from its version field)
+	 * @param len pkt's length
+	 */
+	void queue (const void* pkt, u_int32_t len) throw();
+
+	/**
+	 * @brief Copy a packet compiled into a template into the next free frame of the ring
+	 */
+	void queue (const PacketTemplate& t) throw();
+
+	/**
+	 * @brief Hand all the queued frames to the kernel, through a single send() call
+	 * @return Number of packets sent
+	 */
+	u_int32_t flush() throw();
+
+	/**
+	 * @brief Return the number of packets queued and not flushed yet
+	 */
+	u_int32_t queued() throw();
+
+	/**
+	 * @brief Return the number of frames in the ring
+	 */
+	u_int32_t capacity() throw();
+
+	/**
+	 * @brief Return the AF_PACKET socket descriptor
+	 */
+	int getDescriptor() throw();
+};
+
+/**
+ * @brief A packet captured by a RxRing. It points straight into the ring, and it's valid until the
+ * next call to RxRing::next() or RxRing::release()
+ */
+struct PacketView  {
+	///@brief Packet data, starting at the network header (the link-layer header is stripped)
+	const u_int8_t *data;
+
+	///@brief Captured length
+	u_int32_t len;
+
+	///@brief Length of the packet on the wire
+	u_int32_t wireLen;
+
+	///@brief Capture time, set by the kernel
+	struct timespec ts;
+
+	///@brief Index of the network interface the packet was captured on
+	int ifindex;
+
+	///@brief Protocol of the network header (ETH_P_IP, ETH_P_IPV6...), in host byte order
+	u_int16_t protocol;
+
+	///@brief Packet type (PACKET_HOST, PACKET_BROADCAST, PACKET_OUTGOING...)
+	u_int8_t pktType;
+};
+
+///@brief Counters exposed by RxRing::stats()
+struct RxStats  {
+	///@brief Packets seen by the ring, the dropped ones included
+	u_int32_t packets;
+
+	///@brief Packets dropped because the ring was full
+	u_int32_t drops;
+
+	///@brief Times the ring was found full
+	u_int32_t freezes;
+};
+
+/**
+ * @class RxRing
+ * @brief Capture engine over an AF_PACKET socket with a memory-mapped TPACKET_V3 receive ring (PACKET_MMAP).
+ * The kernel fills blocks of packets in memory shared with the process, and next() hands a whole block of
+ * them out as zero-copy views, without a syscall or a copy per packet. A block is handed out when it's
+ * full, or when the retire timeout expires on a partially filled one
+ * @author BlackLight
+ */
+class RxRing  {
+
+private:
+	///@brief AF_PACKET socket descriptor
+	int sd;
+
+	///@brief The mapped ring
+	u_int8_t *ring;
+
+	///@brief Size of the mapped ring
+	size_t size;
+
+	///@brief Geometry of the ring
+	u_int32_t blockSize, blockNr;
+
+	///@brief Next block to be read
+	u_int32_t current;
+
+	///@brief Whether the block before current is still held by the process
+	bool held;
+
+	///@brief Counters collected so far (the kernel resets them on each read)
+	RxStats counters;
+
+	RxRing (const RxRing&);
+	RxRing& operator= (const RxRing&);
+
+	void open (const std::string& iface, u_int16_t proto, bool outgoing, u_int32_t blocks, u_int32_t bsize, u_int32_t retire) throw();
+	struct tpacket_block_desc* block (u_int32_t i) throw();
+
+public:
+	/**
+	 * @brief Build a receive ring on a network interface
+	 * @param iface Network interface (default: all the interfaces)
+	 * @param proto Link-layer protocol to capture, as ETH_P_* (default: ETH_P_ALL, every protocol)
+	 * @param outgoing Whether the packets sent by this host are captured too (default: false)
+	 * @param blocks Number of blocks in the ring (default: RXRING_BLOCKS)
+	 * @param bsize Size of each block, rounded up to a power of two (default: RING_BLOCK_SIZE)
+	 * @param retire Milliseconds after which a partially filled block is handed out anyway (default: RXRING_RETIRE_MS)
+	 */
+	RxRing (const std::string& iface = "", u_int16_t proto = ETH_P_ALL, bool outgoing = false, u_int32_t blocks = RXRING_BLOCKS,
+			u_int32_t bsize = RING_BLOCK_SIZE, u_int32_t retire = RXRING_RETIRE_MS) throw();
+
+	/**
+	 * @brief Build a receive ring for the IPv4 packets on the network interface of a raw socket
+	 * @param s Raw socket
+	 * @param blocks Number of blocks in the ring (default: RXRING_BLOCKS)
+	 * @param bsize Size of each block (default: RING_BLOCK_SIZE)
+	 * @param retire Block retire timeout, in milliseconds (default: RXRING_RETIRE_MS)
+	 */
+	RxRing (RawSocket& s, u_int32_t blocks = RXRING_BLOCKS, u_int32_t bsize = RING_BLOCK_SIZE,
+			u_int32_t retire = RXRING_RETIRE_MS) throw();
+
+	/**
+	 * @brief Destroyer for the RxRing class
+	 */
+	~RxRing();
+
+	/**
+	 * @brief Give the block handed out by the last next() back to the kernel, and wait for the next one
+	 * @param pkts Vector that will hold the views of the packets in the block (cleared first)
+	 * @param timeout Maximum time to wait, in seconds: 0 doesn't wait, a negative value waits forever (default)
+	 * @return Number of packets in pkts (0 if the timeout expired)
+	 */
+	u_int32_t next (std::vector<PacketView>& pkts, double timeout = -1.0) throw();
+
+	/**
+	 * @brief Give the block handed out by the last next() back to the kernel. The views in it are no longer valid
+	 */
+	void release() throw();
+
+	/**
+	 * @brief Set a filter for the captured packets (see usock_filter.h), so that the kernel only copies the
+	 * matching ones into the ring. An empty PacketFilter removes the filter
+	 * @param f Packet filter
+	 */
+	void setFilter (const PacketFilter& f) throw();
+
+	/**
+	 * @brief Return the capture counters, since the ring was built
+	 */
+	RxStats stats() throw();
+
+	/**
+	 * @brief Return the AF_PACKET socket descriptor (e.g. for setsockopt() or poll())
+	 */
+	int getDescriptor() throw();
+};
+}
+
+#endif
+
@@ -0,0 +1,265 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#ifndef __USOCK_URING_H
+#define __USOCK_URING_H
+
+#include <atomic>
+#include <vector>
+#include "usock.h"
+
+#define	URING_ENTRIES	256
+#define	URING_BUFFERS	256
+#define	URING_BUFSIZE	4096
+#define	URING_UDP_BATCH	64
+
+namespace usock  {
+
+class UringLoop;
+
+/**
+ * @class UringHandler
+ * @brief Callbacks invoked by a UringLoop on the sockets registered onto it. Unlike EventHandler,
+ * the data is handed to the handler already received
+ * @author BlackLight
+ */
+class UringHandler  {
+
+public:
+	virtual ~UringHandler()  {}
+
+	/**
+	 * @brief Called when a new client connection has been accepted on a registered ServerSocket
+	 * @param loop Loop the new connection has been registered onto
+	 * @param s Client socket (non-blocking, owned by the loop)
+	 */
+	virtual void onAccept (UringLoop& loop, Socket& s)  {}
+
+	/**
+	 * @brief Called when data has been received on a TCP socket
+	 * @param data Received data. It lives in a buffer of the loop, only valid inside the callback
+	 * @param len Length of the data
+	 */
+	virtual void onData (UringLoop& loop, Socket& s, const char* data, u_int32_t len)  {}
+
+	/**
+	 * @brief Called when a datagram has been received on a UDP socket
+	 * @param data Datagram, only valid inside the callback
+	 * @param len Length of the datagram
+	 * @param from Remote address
+	 * @param fromlen from's length
+	 */
+	virtual void onDatagram (UringLoop& loop, UDPSocket& s, const char* data, u_int32_t len,
+			const struct sockaddr* from, socklen_t fromlen)  {}
+
+	/**
+	 * @brief Called once when a TCP connection is dropped, either because the peer hung up or
+	 * because UringLoop::close() was called on it. The socket is still valid inside the callback
+	 */
+	virtual void onClosed (UringLoop& loop, Socket& s)  {}
+};
+
+///@brief Counters exposed by UringLoop::stats()
+struct UringStats  {
+	///@brief io_uring_enter() calls (epoll mode: epoll_wait() calls)
+	unsigned long enters;
+
+	///@brief Requests submitted to the ring (epoll mode: recv/send/accept calls)
+	unsigned long submitted;
+
+	///@brief Completions reaped from the ring (epoll mode: events)
+	unsigned long completions;
+
+	///@brief Receives stopped because the buffer ring was empty, and re-armed
+	unsigned long bufferStalls;
+};
+
+/**
+ * @class UringLoop
+ * @brief Event loop on io_uring, for the servers where even epoll plus a recv()/send() per message costs too many syscalls.
+ * Registered server sockets get a multishot accept, and connected and UDP sockets a multishot receive into a
+ * ring of buffers provided to the kernel, so a single request keeps delivering connections and data. The sends
+ * queued by send() are submitted all together with the next wait: a busy loop moves any number of messages with a
+ * single io_uring_enter() per iteration. When the kernel can't do all of this (multishot receives need Linux 6.0)
+ * the loop falls back on epoll, with the same callbacks
+ * @author BlackLight
+ */
+class UringLoop  {
+
+private:
+	struct Ring;
+	struct Entry;
+
+	///@brief io_uring rings (NULL in epoll mode)
+	Ring *ring;
+
+	///@brief epoll descriptor (epoll mode), and eventfd used by stop()
+	int epfd, wakefd;
+
+	///@brief Flag cleared by stop(), and set again once run() has returned because of it
+	std::atomic<bool> running;
+
+	///@brief Number of registered sockets (server sockets included)
+	u_int32_t nentries;
+
+	///@brief Registered entries, indexed by socket descriptor
+	std::vector<Entry*> entries;
+
+	///@brief Closed entries, freed once they've got no request in flight anymore
+	std::vector<Entry*> closed;
+
+	///@brief Entries with queued sends, flushed before the next wait
+	std::vector<Entry*> dirty;
+
+	///@brief Receive buffer (epoll mode)
+	std::vector<char> rxbuf;
+
+	u_int32_t bufsize;
+	UringStats counters;
+
+	UringLoop (const UringLoop&);
+	UringLoop& operator= (const UringLoop&);
+
+	bool setupRing (u_int32_t entries, u_int32_t nbufs);
+	void armWake() throw();
+	Entry* attach (BaseSocket* s, int kind, UringHandler& handler) throw();
+	Entry* lookup (BaseSocket& s, int kind) throw();
+	void arm (Entry* e) throw();
+	void flush (Entry* e);
+	void drop (Entry* e);
+	void complete (Entry* e, int op, int res, u_int32_t flags);
+	void dispatch (Entry* e, u_int32_t events);
+	void acceptAll (Entry* e);
+
+public:
+	/**
+	 * @brief UringLoop constructor
+	 * @param entries Size of the submission queue (default = URING_ENTRIES)
+	 * @param nbufs Number of receive buffers provided to the kernel, a power of 2 (default = URING_BUFFERS)
+	 * @param bufsize Size of each receive buffer (default = URING_BUFSIZE)
+	 * @param uring Use io_uring if the kernel supports it (default), or always epoll
+	 */
+	UringLoop (u_int32_t entries = URING_ENTRIES, u_int32_t nbufs = URING_BUFFERS, u_int32_t bufsize = URING_BUFSIZE,
+			bool uring = true) throw();
+
+	/**
+	 * @brief Destroyer for the UringLoop class. The requests in flight are cancelled, and all the client
+	 * sockets still owned by the loop are closed
+	 */
+	~UringLoop();
+
+	/**
+	 * @brief Return true if the loop runs on io_uring, false if it fell back on epoll
+	 */
+	bool usingUring() throw();
+
+	/**
+	 * @brief Register a listening server socket onto the loop. Each accepted connection is registered
+	 * onto the loop with the same handler, and notified through handler.onAccept()
+	 * @param ss Server socket (it must already be listening, and it's not owned by the loop)
+	 * @param handler Handler for the accepted connections
+	 */
+	void add (ServerSocket& ss, UringHandler& handler) throw();
+
+	/**
+	 * @brief Register an already connected socket onto the loop (not owned by the loop)
+	 */
+	void add (Socket& s, UringHandler& handler) throw();
+
+	/**
+	 * @brief Register a bound UDP socket onto the loop (not owned by the loop)
+	 */
+	void add (UDPSocket& s, UringHandler& handler) throw();
+
+	/**
+	 * @brief Queue data to be sent on a registered TCP socket. The data is copied, and goes out with the
+	 * other sends queued during the same iteration, in order
+	 */
+	void send (Socket& s, const void* buf, u_int32_t len) throw();
+
+	/**
+	 * @brief Queue a datagram to be sent on a registered UDP socket. It's copied as well, so it can't be
+	 * larger than the receive buffers
+	 */
+	void send (UDPSocket& s, const void* buf, u_int32_t len, const struct sockaddr* to, socklen_t tolen) throw();
+
+	/**
+	 * @brief Remove a TCP socket from the loop, call its onClosed() handler and close its descriptor.
+	 * The queued data which hasn't been sent yet is dropped
+	 */
+	void close (Socket& s);
+
+	/**
+	 * @brief Submit the queued requests, wait for completions (or events) and dispatch them once
+	 * @param timeout Maximum time to wait, in milliseconds (default: -1, wait forever)
+	 * @return Number of completions dispatched
+	 */
+	int runOnce (int timeout = -1);
+
+	/**
+	 * @brief Dispatch completions until stop() is called or no socket is registered anymore.
+	 * A stop() called before run() makes it return straight away
+	 */
+	void run();
+
+	/**
+	 * @brief Make run() return after the current iteration. It can be called from another thread,
+	 * or from a signal handler
+	 */
+	void stop() throw();
+
+	/**
+	 * @brief Return the number of sockets currently registered onto the loop
+	 */
+	u_int32_t size() throw();
+
+	/**
+	 * @brief Return the loop counters
+	 */
+	UringStats stats() throw();
+};
+}
+
+#endif
+
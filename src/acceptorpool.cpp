@@ -0,0 +1,152 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "usock.h"
+#include "usock_eventloop.h"
+#include "usock_exception.h"
+
+using std::string;
+using namespace usock;
+
+struct AcceptorPool::Worker  {
+	ServerSocket *server;
+	EventLoop *loop;
+	pthread_t thread;
+	bool started;
+	int cpu;
+};
+
+AcceptorPool::AcceptorPool (u_int16_t port, EventHandler& handler, u_int32_t nthreads, u_int32_t m,
+		const string& addr, bool pin) throw()  {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu < 1)
+		ncpu = 1;
+
+	if (!nthreads)
+		nthreads = ncpu;
+
+	this->pin = pin;
+
+	for (u_int32_t i=0; i < nthreads; i++)  {
+		Worker *w = new Worker;
+		w->server = new ServerSocket(port, m, addr, true);
+		w->loop = new EventLoop;
+		w->loop->add(*(w->server), handler);
+		w->started = false;
+		w->cpu = i % ncpu;
+		workers.push_back(w);
+	}
+}
+
+AcceptorPool::~AcceptorPool()  {
+	stop();
+
+	for (u_int32_t i=0; i < workers.size(); i++)  {
+		delete workers[i]->loop;
+		delete workers[i]->server;
+		delete workers[i];
+	}
+}
+
+void* AcceptorPool::workerMain (void *arg)  {
+	Worker *w = (Worker*) arg;
+	w->loop->run();
+	return NULL;
+}
+
+void AcceptorPool::start() throw()  {
+	for (u_int32_t i=0; i < workers.size(); i++)  {
+		Worker *w = workers[i];
+
+		if (w->started)
+			continue;
+
+		pthread_attr_t attr;
+		int ret = -1;
+
+		// The thread is created on its core, rather than moved there once it's already running
+		if (pin)  {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(w->cpu, &set);
+
+			pthread_attr_init(&attr);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			ret = pthread_create(&(w->thread), &attr, workerMain, w);
+			pthread_attr_destroy(&attr);
+		}
+
+		// Pinning is only an optimization: run unpinned if the CPU isn't available
+		if (ret != 0 && pthread_create(&(w->thread), NULL, workerMain, w) != 0)
+			throw SocketException("thread creation failed");
+
+		w->started = true;
+	}
+}
+
+void AcceptorPool::stop() throw()  {
+	for (u_int32_t i=0; i < workers.size(); i++)
+		if (workers[i]->started)
+			workers[i]->loop->stop();
+
+	join();
+}
+
+void AcceptorPool::join() throw()  {
+	for (u_int32_t i=0; i < workers.size(); i++)  {
+		if (workers[i]->started)  {
+			pthread_join(workers[i]->thread, NULL);
+			workers[i]->started = false;
+		}
+	}
+}
+
+u_int32_t AcceptorPool::size() throw()  { return workers.size(); }
+
+EventLoop& AcceptorPool::loop (u_int32_t i) throw()  { return *(workers.at(i)->loop); }
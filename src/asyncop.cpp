@@ -0,0 +1,221 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "usock.h"
+#include "usock_async.h"
+#include "usock_exception.h"
+
+using std::string;
+using namespace usock;
+
+AsyncOp::AsyncOp (Socket* s, short events, const struct timespec* deadline) throw()  {
+	sock = s;
+	this->events = events;
+	timed = (deadline != NULL);
+	err = 0;
+	what = NULL;
+	reactor = NULL;
+	fd = -1;
+	heapIndex = 0;
+	resumeFn = NULL;
+	coro = NULL;
+
+	if (timed)
+		when = *deadline;
+}
+
+AsyncOp::~AsyncOp()  {
+	// A coroutine destroyed while suspended
+	if (reactor)
+		reactor->cancel(this);
+}
+
+bool AsyncOp::fail (const char* what) throw()  {
+	err = errno;
+	this->what = what;
+	return true;
+}
+
+bool AsyncOp::suspend (void (*fn)(void*), void* coro) throw()  {
+	Reactor *r = Reactor::current();
+
+	if (!r)  {
+		errno = EINVAL;
+		fail("no reactor running in this thread");
+		return false;
+	}
+
+	resumeFn = fn;
+	this->coro = coro;
+	return r->wait(this);
+}
+
+void AsyncOp::check()  {
+	if (err)  {
+		errno = err;
+		throw SocketException(what);
+	}
+}
+
+ConnectOp::ConnectOp (Socket* s, const struct sockaddr* addr, socklen_t len, const struct timespec* deadline) throw()
+		: AsyncOp(s, POLLOUT, deadline)  {
+	memcpy (&this->addr, addr, len);
+	this->len = len;
+	started = false;
+}
+
+bool ConnectOp::attempt()  {
+	int sd = sock->getDescriptor();
+
+	if (!started)  {
+		started = true;
+
+		if (::connect(sd, (struct sockaddr*) &addr, len) == 0)
+			return true;
+
+		// EINTR: the connection still goes on in background
+		if (errno == EINPROGRESS || errno == EINTR)
+			return false;
+
+		return fail("connect exception");
+	}
+
+	int e = 0;
+	socklen_t elen = sizeof(e);
+
+	if (::getsockopt(sd, SOL_SOCKET, SO_ERROR, &e, &elen) < 0)
+		return fail("getsockopt error");
+
+	if (e)  {
+		errno = e;
+		return fail("connect exception");
+	}
+
+	return true;
+}
+
+RecvOp::RecvOp (Socket* s, void* buf, u_int32_t size, const struct timespec* deadline) throw()
+		: AsyncOp(s, POLLIN, deadline)  {
+	this->buf = buf;
+	this->size = size;
+	n = 0;
+}
+
+bool RecvOp::attempt()  {
+	try  {
+		n = sock->tryRecv(buf, size);
+	}
+
+	catch (SocketException& e)  {
+		return fail("recv exception");
+	}
+
+	return (n >= 0);
+}
+
+SendOp::SendOp (Socket* s, const void* buf, u_int32_t size, const struct timespec* deadline) throw()
+		: AsyncOp(s, POLLOUT, deadline)  {
+	this->buf = (const char*) buf;
+	this->size = size;
+	sent = 0;
+}
+
+bool SendOp::attempt()  {
+	while (sent < size)  {
+		int n;
+
+		try  {
+			n = sock->trySend(buf + sent, size - sent);
+		}
+
+		catch (SocketException& e)  {
+			return fail("send exception");
+		}
+
+		if (n < 0)
+			return false;
+
+		sent += n;
+	}
+
+	return true;
+}
+
+ReadlineOp::ReadlineOp (Socket* s, const struct timespec* deadline) throw()
+		: AsyncOp(s, POLLIN, deadline)  {}
+
+bool ReadlineOp::attempt()  {
+	try  {
+		return sock->tryReadline(line);
+	}
+
+	catch (SocketException& e)  {
+		return fail("recv exception");
+	}
+}
+
+AcceptOp::AcceptOp (ServerSocket* s, const struct timespec* deadline) throw()
+		: AsyncOp(s, POLLIN, deadline)  {
+	newfd = -1;
+}
+
+bool AcceptOp::attempt()  {
+	while ((newfd = ::accept4(sock->getDescriptor(), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)  {
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return false;
+
+		return fail("accept error");
+	}
+
+	return true;
+}
+
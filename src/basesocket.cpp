@@ -43,15 +43,22 @@
  */
 
 #include <sstream>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <cstring>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "usock.h"
 #include "usock_exception.h"
+#include "usock_resolver.h"
 
 #include "raii.hh"
 
@@ -64,34 +71,72 @@ BaseSocket::BaseSocket (int domain, int type, int protocol, double timeout) thro
 	this->type = type;
 	this->protocol = protocol;
 	this->timeout = timeout;
+	rbuf_head = 0;
+	rbuf_tail = 0;
+	rbuf_fromlen = 0;
 	
 	if ((sd = socket(domain, type, protocol)) < 0)
 		throw SocketException("socket error");
+
+	if (timeout > 0.0)
+		setBlocking(false);
 }
 
 BaseSocket::~BaseSocket()  { close(); }
 
-string BaseSocket::getHostByName (const string& name) throw()  {
-	char* addr = new char[INET6_ADDRSTRLEN];
-	raii_array<char> addr_holder(addr);
-	struct hostent *host;
+BaseSocket::BaseSocket (BaseSocket&& s) noexcept : sd(s.sd), domain(s.domain), type(s.type), protocol(s.protocol),
+		timeout(s.timeout), rbuf(std::move(s.rbuf)), rbuf_head(s.rbuf_head), rbuf_tail(s.rbuf_tail),
+		rbuf_from(s.rbuf_from), rbuf_fromlen(s.rbuf_fromlen)  {
+	s.sd = -1;
+	s.rbuf_head = s.rbuf_tail = 0;
+}
+
+BaseSocket& BaseSocket::operator= (BaseSocket&& s) noexcept  {
+	if (this == &s)
+		return *this;
+
+	close();
+	sd = s.sd;
+	domain = s.domain;
+	type = s.type;
+	protocol = s.protocol;
+	timeout = s.timeout;
+	rbuf = std::move(s.rbuf);
+	rbuf_head = s.rbuf_head;
+	rbuf_tail = s.rbuf_tail;
+	rbuf_from = s.rbuf_from;
+	rbuf_fromlen = s.rbuf_fromlen;
+
+	s.sd = -1;
+	s.rbuf_head = s.rbuf_tail = 0;
+	return *this;
+}
+
+int BaseSocket::release() noexcept  {
+	int fd = sd;
+
+	sd = -1;
+	rbuf_head = rbuf_tail = 0;
+	return fd;
+}
+
+string BaseSocket::getHostByName (const string& name, int family) throw()  {
+	std::vector<struct sockaddr_storage> addrs;
+	char addr[INET6_ADDRSTRLEN];
 
-	if (! (host = gethostbyname(name.c_str())) )
+	if (!Resolver::getDefault().resolve(name, addrs, family))
 		return string();
 
-	snprintf (addr, INET6_ADDRSTRLEN, "%u.%u.%u.%u",
-			(unsigned char) host->h_addr[0],
-			(unsigned char) host->h_addr[1],
-			(unsigned char) host->h_addr[2],
-			(unsigned char) host->h_addr[3]);
+	if (addrs[0].ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*) &addrs[0])->sin6_addr, addr, sizeof(addr));
+	else
+		inet_ntop(AF_INET, &((struct sockaddr_in*) &addrs[0])->sin_addr, addr, sizeof(addr));
 
 	return string(addr);
 }
 
 string BaseSocket::getHostByAddr (const string& addr) throw()  {
 	unsigned int tmp[4];
-	struct hostent *host;
-	in_addr_t inaddr = inet_addr(addr.c_str());
 
 	if (sscanf(addr.c_str(), "%u.%u.%u.%u", &tmp[0], &tmp[1], &tmp[2], &tmp[3]) != 4)
 		throw SocketException("invalid IPv4 address");
@@ -100,13 +145,24 @@ string BaseSocket::getHostByAddr (const string& addr) throw()  {
 		if (tmp[i] > 255)
 			throw SocketException("invalid IPv4 address");
 
-	if (! (host = gethostbyaddr(&inaddr, 4, AF_INET)))
-		return string();
+	return Resolver::getDefault().reverse(addr);
+}
 
-	if (host->h_name)
-		return string(host->h_name);
-	else
-		return string();
+void BaseSocket::reopen (int family) throw()  {
+	int new_sd;
+
+	if (family == domain || family == AF_UNSPEC)
+		return;
+
+	if ((new_sd = socket(family, type, protocol)) < 0)
+		throw SocketException("socket error");
+
+	close();
+	sd = new_sd;
+	domain = family;
+
+	if (timeout > 0.0)
+		setBlocking(false);
 }
 
 void BaseSocket::getSockOpt (int level, int optname, void* optval, socklen_t* optlen) throw()  {
@@ -119,62 +175,68 @@ void BaseSocket::setSockOpt (int level, int optname, void* optval, socklen_t opt
 		throw SocketException("setsockopt error");
 }
 
-void BaseSocket::close()  { ::close(sd); }
+void BaseSocket::close()  {
+	if (sd >= 0)  {
+		::close(sd);
+		sd = -1;
+	}
+}
+
+int BaseSocket::getDescriptor() throw()  { return sd; }
 
-string BaseSocket::remoteAddr() throw()  {
-	struct in_addr addr;
-	struct sockaddr_in sock;
-	socklen_t len = sizeof(struct sockaddr_in);
+Endpoint BaseSocket::remoteEndpoint() throw()  {
+	struct sockaddr_storage sock;
+	socklen_t len = sizeof(sock);
 
 	if (getpeername(sd, (struct sockaddr*) &sock, &len) < 0)  {
-		if (errno == ENOTCONN) return string();
+		if (errno == ENOTCONN) return Endpoint();
 		else throw SocketException("getpeername exception");
 	}
 
-	addr.s_addr = sock.sin_addr.s_addr;
-	return string(inet_ntoa(addr));
+	return Endpoint((struct sockaddr*) &sock, len);
 }
 
-string BaseSocket::localAddr() throw()  {
-	struct in_addr addr;
-	struct sockaddr_in sock;
-	socklen_t len = sizeof(struct sockaddr_in);
+Endpoint BaseSocket::localEndpoint() throw()  {
+	struct sockaddr_storage sock;
+	socklen_t len = sizeof(sock);
 
 	if (getsockname(sd, (struct sockaddr*) &sock, &len) < 0)  {
-		if (errno == ENOTCONN) return string();
+		if (errno == ENOTCONN) return Endpoint();
 		else throw SocketException("getsockname exception");
 	}
 
-	addr.s_addr = sock.sin_addr.s_addr;
-	return string(inet_ntoa(addr));
+	return Endpoint((struct sockaddr*) &sock, len);
 }
 
-u_int16_t BaseSocket::remotePort() throw()  {
-	struct sockaddr_in sock;
-	socklen_t len = sizeof(struct sockaddr_in);
+string BaseSocket::remoteAddr() throw()  { return remoteEndpoint().host(); }
 
-	if (getpeername(sd, (struct sockaddr*) &sock, &len) < 0)  {
-		if (errno == ENOTCONN) return 0;
-		else throw SocketException("getpeername exception");
-	}
+string BaseSocket::localAddr() throw()  { return localEndpoint().host(); }
 
-	return htons(sock.sin_port);
-}
+u_int16_t BaseSocket::remotePort() throw()  { return remoteEndpoint().port(); }
 
-u_int16_t BaseSocket::localPort() throw()  {
-	struct sockaddr_in sock;
-	socklen_t len = sizeof(struct sockaddr_in);
+u_int16_t BaseSocket::localPort() throw()  { return localEndpoint().port(); }
 
-	if (getsockname(sd, (struct sockaddr*) &sock, &len) < 0)  {
-		if (errno == ENOTCONN) return 0;
-		else throw SocketException("getsockname exception");
+const struct sockaddr* BaseSocket::peerAddr (const Endpoint& ep, struct sockaddr_storage& tmp, socklen_t& len) throw()  {
+	if (domain != AF_INET6 || ep.family() != AF_INET)  {
+		len = ep.length();
+		return ep.addr();
 	}
 
-	return htons(sock.sin_port);
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &tmp;
+	const struct sockaddr_in *sin = (const struct sockaddr_in*) ep.addr();
+
+	memset (&tmp, 0, sizeof(tmp));
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port = sin->sin_port;
+	sin6->sin6_addr.s6_addr[10] = 0xff;
+	sin6->sin6_addr.s6_addr[11] = 0xff;
+	memcpy (&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+	len = sizeof(struct sockaddr_in6);
+	return (struct sockaddr*) &tmp;
 }
 
 void BaseSocket::setBlocking (bool f) throw()  {
-	u_int32_t flags;
+	int flags;
 	
 	if ((flags = fcntl(sd, F_GETFL)) < 0)
 		throw SocketException("fcntl exception");
@@ -189,12 +251,12 @@ void BaseSocket::setBlocking (bool f) throw()  {
 }
 
 bool BaseSocket::isBlocking() throw()  {
-	u_int32_t flags;
+	int flags;
 
 	if ((flags = fcntl(sd, F_GETFL, 0)) < 0)
 		throw SocketException("fcntl exception");
 
-	return ((flags & O_NONBLOCK) ? true : false);
+	return ((flags & O_NONBLOCK) ? false : true);
 }
 
 string BaseSocket::ntoa (in_addr_t addr) throw()  {
@@ -208,5 +270,286 @@ string BaseSocket::ntoa (in_addr_t addr) throw()  {
 	return string(str);
 }
 
-void BaseSocket::setTimeout (double timeout) throw()  { this->timeout = timeout; }
+void BaseSocket::setTimeout (double timeout) throw()  {
+	if (sd >= 0 && (timeout > 0.0) != (this->timeout > 0.0))
+		setBlocking(timeout <= 0.0);
+
+	this->timeout = timeout;
+}
+
+const struct timespec* BaseSocket::deadline (struct timespec& ts) throw()  {
+	if (timeout <= 0.0)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += (time_t) timeout;
+	ts.tv_nsec += (long) ((timeout - (double) ((time_t) timeout)) * 1e9);
+
+	if (ts.tv_nsec >= 1000000000L)  {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	return &ts;
+}
+
+void BaseSocket::waitFor (short events, const struct timespec* deadline) throw()  {
+	struct pollfd pfd;
+	int ret, ms = -1;
+
+	pfd.fd = sd;
+	pfd.events = events;
+
+	do  {
+		if (deadline)  {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			double left = (double) (deadline->tv_sec - now.tv_sec) + (deadline->tv_nsec - now.tv_nsec) / 1e9;
+
+			if (left <= 0.0)  {
+				errno = ETIMEDOUT;
+				throw SocketException("connection timeout");
+			}
+
+			// Round up, or we'd spin on poll(0) during the last millisecond
+			ms = (int) ceil(left * 1000.0);
+		}
+
+		ret = poll(&pfd, 1, ms);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		throw SocketException("poll exception");
+
+	if (!ret)  {
+		errno = ETIMEDOUT;
+		throw SocketException("connection timeout");
+	}
+}
+
+ssize_t BaseSocket::recvWait (void* buf, size_t size, int flags, struct sockaddr* from, socklen_t* fromlen,
+		const struct timespec* until) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = until;
+	ssize_t n;
+
+	while ((n = ::recvfrom(sd, buf, size, flags, from, fromlen)) < 0)  {
+		if (errno == EINTR)
+			continue;
+
+		// A reset connection is reported as EOF, as the readers always did
+		if (errno == ECONNRESET && type == sock_stream)
+			return 0;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw SocketException("recv exception");
+
+		// The deadline is only computed when we actually have to wait
+		if (!dl && timeout > 0.0)
+			dl = deadline(ts);
+
+		waitFor(POLLIN, dl);
+	}
+
+	return n;
+}
+
+void BaseSocket::sendWait (const void* buf, size_t size, int flags, const struct sockaddr* to, socklen_t tolen) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	const char *p = (const char*) buf;
+	ssize_t n;
+
+	while (1)  {
+		if ((n = ::sendto(sd, p, size, flags | MSG_NOSIGNAL, to, tolen)) < 0)  {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				throw SocketException("send exception");
+
+			if (!dl && timeout > 0.0)
+				dl = deadline(ts);
+
+			waitFor(POLLOUT, dl);
+			continue;
+		}
+
+		// Datagrams are sent as a whole, streams may need more rounds
+		if (type != sock_stream || (size_t) n >= size)
+			break;
+
+		p += n;
+		size -= n;
+	}
+}
+
+ssize_t BaseSocket::recvMsgWait (struct msghdr* msg, int flags) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	ssize_t n;
+
+	while ((n = ::recvmsg(sd, msg, flags)) < 0)  {
+		if (errno == EINTR)
+			continue;
+
+		if (errno == ECONNRESET && type == sock_stream)
+			return 0;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw SocketException("recv exception");
+
+		if (!dl && timeout > 0.0)
+			dl = deadline(ts);
+
+		waitFor(POLLIN, dl);
+	}
+
+	return n;
+}
+
+void BaseSocket::sendMsgWait (const struct msghdr* msg, int flags) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	struct msghdr m = *msg;
+	std::vector<struct iovec> rest;
+	ssize_t n;
+
+	while (1)  {
+		if ((n = ::sendmsg(sd, &m, flags | MSG_NOSIGNAL)) < 0)  {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				throw SocketException("send exception");
+
+			if (!dl && timeout > 0.0)
+				dl = deadline(ts);
+
+			waitFor(POLLOUT, dl);
+			continue;
+		}
+
+		if (type != sock_stream)
+			break;
+
+		// Skip the buffers which have been sent completely
+		while (m.msg_iovlen > 0 && (size_t) n >= m.msg_iov[0].iov_len)  {
+			n -= m.msg_iov[0].iov_len;
+			m.msg_iov++;
+			m.msg_iovlen--;
+		}
+
+		if (!m.msg_iovlen)
+			break;
+
+		// The caller's iovec array is const: the first partial write copies the remaining entries
+		if (rest.empty())  {
+			rest.assign(m.msg_iov, m.msg_iov + m.msg_iovlen);
+			m.msg_iov = &rest[0];
+		}
+
+		m.msg_iov[0].iov_base = (char*) m.msg_iov[0].iov_base + n;
+		m.msg_iov[0].iov_len -= n;
+	}
+}
+
+u_int32_t BaseSocket::pending() throw()  { return rbuf_tail - rbuf_head; }
+
+u_int32_t BaseSocket::drain (const struct iovec* iov, int iovcnt) throw()  {
+	u_int32_t n = 0;
+
+	for (int i=0; i < iovcnt && pending(); i++)
+		n += drain(iov[i].iov_base, iov[i].iov_len);
+
+	return n;
+}
+
+u_int32_t BaseSocket::drain (void* buf, u_int32_t size) throw()  {
+	u_int32_t n = std::min(size, rbuf_tail - rbuf_head);
+
+	if (!n)
+		return 0;
+
+	memcpy (buf, &rbuf[rbuf_head], n);
+	rbuf_head += n;
+
+	if (rbuf_head == rbuf_tail)
+		rbuf_head = rbuf_tail = 0;
+
+	return n;
+}
+
+void BaseSocket::makeRoom (u_int32_t room) throw()  {
+	if (rbuf.size() - rbuf_tail >= room)
+		return;
+
+	// Compact the unread bytes at the beginning of the buffer, and grow it if they're still too many
+	if (rbuf_head > 0)  {
+		memmove (&rbuf[0], &rbuf[rbuf_head], rbuf_tail - rbuf_head);
+		rbuf_tail -= rbuf_head;
+		rbuf_head = 0;
+	}
+
+	if (rbuf.size() - rbuf_tail < room)
+		rbuf.resize(std::max((u_int32_t) rbuf.size() * 2, rbuf_tail + room));
+}
+
+int BaseSocket::fill() throw()  {
+	// A datagram must fit in the buffer as a whole, or its tail would be lost
+	ssize_t n;
+
+	makeRoom((type == sock_dgram) ? 0x10000 : BUFRECV_SIZE);
+
+	if (type == sock_dgram)  {
+		rbuf_fromlen = sizeof(rbuf_from);
+		n = recvWait(&rbuf[rbuf_tail], rbuf.size() - rbuf_tail, 0, (struct sockaddr*) &rbuf_from, &rbuf_fromlen);
+	} else
+		n = recvWait(&rbuf[rbuf_tail], rbuf.size() - rbuf_tail);
+	rbuf_tail += n;
+	return (int) n;
+}
+
+bool BaseSocket::takeLine (string& line, u_int32_t& scanned, bool eof) throw()  {
+	u_int32_t avail = rbuf_tail - rbuf_head;
+	const char *start = rbuf.data() + rbuf_head;
+	const char *eol = (avail > scanned) ? (const char*) memchr(start + scanned, '\n', avail - scanned) : NULL;
+
+	if (!eol && !eof)  {
+		// Keep the partial line buffered, and only scan the new bytes on the next round
+		scanned = avail;
+		return false;
+	}
+
+	u_int32_t len = (eol) ? (u_int32_t) (eol - start) : avail;
+	line.assign(start, len);
+	rbuf_head += (eol) ? len + 1 : len;
+
+	if (rbuf_head == rbuf_tail)
+		rbuf_head = rbuf_tail = 0;
+
+	if (line.find('\r') != string::npos)
+		line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+
+	// An empty line is "\r", so that it can't be taken for the end of the stream
+	if (line.length() < 1 && eol)
+		line = "\r";
+
+	return true;
+}
+
+string BaseSocket::bufferedReadline() throw()  {
+	string line;
+	u_int32_t scanned = 0;
+
+	while (!takeLine(line, scanned, false))  {
+		if (fill() < 1)  {
+			takeLine(line, scanned, true);
+			break;
+		}
+	}
+
+	return line;
+}
 
@@ -0,0 +1,386 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "usock.h"
+
+using std::string;
+using namespace usock;
+
+namespace usock  {
+
+///@brief Header of a buffer, followed by its bytes. Free blocks are chained through 'next'
+struct BufferBlock  {
+	BufferPool *pool;
+	BufferBlock *next;
+	u_int32_t refs;
+	u_int32_t cls;
+	u_int32_t capacity;
+};
+}
+
+///@brief Free blocks and counters of a thread. The counters are only written by their thread
+struct BufferPool::Cache  {
+	BufferPool *pool;
+	BufferBlock *head[POOL_CLASSES];
+	u_int32_t count[POOL_CLASSES];
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long hits;
+	unsigned long refills;
+};
+
+static const u_int32_t classSizes[POOL_CLASSES] = { 256, 1024, 4096, 16384, 65536 };
+
+// Keep the bytes of each block 16-byte aligned
+static const u_int32_t headerSize = (sizeof(BufferBlock) + 15) & ~15;
+
+static BufferPool *current = NULL;
+static BufferPool *builtin = NULL;
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static void createBuiltin()  { builtin = new BufferPool(); }
+
+static inline char* bytes (BufferBlock* b)  { return (char*) b + headerSize; }
+
+// Only the owner thread writes a cache counter: no need for a locked increment
+static inline void bump (unsigned long& c)  {
+	__atomic_store_n(&c, c + 1, __ATOMIC_RELAXED);
+}
+
+static u_int32_t classOf (u_int32_t size)  {
+	for (u_int32_t i=0; i < POOL_CLASSES; i++)
+		if (size <= classSizes[i])
+			return i;
+
+	return POOL_CLASSES;
+}
+
+Buffer::Buffer() throw()  : block(NULL), ptr(NULL), len(0), cap(0)  {}
+
+Buffer::Buffer (BufferBlock* b, char* data, u_int32_t size, u_int32_t capacity) throw()
+	: block(b), ptr(data), len(size), cap(capacity)  {}
+
+Buffer::Buffer (const Buffer& b) throw()  : block(b.block), ptr(b.ptr), len(b.len), cap(b.cap)  {
+	if (block)
+		__atomic_fetch_add(&block->refs, 1, __ATOMIC_RELAXED);
+}
+
+Buffer::Buffer (Buffer&& b) throw()  : block(b.block), ptr(b.ptr), len(b.len), cap(b.cap)  {
+	b.block = NULL;
+	b.ptr = NULL;
+	b.len = b.cap = 0;
+}
+
+Buffer& Buffer::operator= (const Buffer& b) throw()  {
+	// Take the new reference first, in case both handles share the block
+	if (b.block)
+		__atomic_fetch_add(&b.block->refs, 1, __ATOMIC_RELAXED);
+
+	release();
+	block = b.block;
+	ptr = b.ptr;
+	len = b.len;
+	cap = b.cap;
+	return *this;
+}
+
+Buffer& Buffer::operator= (Buffer&& b) throw()  {
+	if (this != &b)  {
+		release();
+		block = b.block;
+		ptr = b.ptr;
+		len = b.len;
+		cap = b.cap;
+		b.block = NULL;
+		b.ptr = NULL;
+		b.len = b.cap = 0;
+	}
+
+	return *this;
+}
+
+Buffer::~Buffer()  { release(); }
+
+void Buffer::resize (u_int32_t size) throw()  { len = std::min(size, cap); }
+
+Buffer Buffer::slice (u_int32_t offset, u_int32_t size) const throw()  {
+	Buffer s(*this);
+
+	offset = std::min(offset, len);
+	s.ptr += offset;
+	s.len = s.cap = std::min(size, len - offset);
+	return s;
+}
+
+string Buffer::str() const  { return string(ptr ? ptr : "", len); }
+
+u_int32_t Buffer::refs() const throw()  {
+	return block ? __atomic_load_n(&block->refs, __ATOMIC_RELAXED) : 0;
+}
+
+void Buffer::release() throw()  {
+	// The only handle can't be copied by anybody else meanwhile: skip the locked decrement
+	if (block && (__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) == 1 ||
+			__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0))
+		block->pool->release(block);
+
+	block = NULL;
+	ptr = NULL;
+	len = cap = 0;
+}
+
+BufferPool::BufferPool (u_int32_t slabSize, u_int32_t cacheSize) throw()  {
+	for (u_int32_t i=0; i < POOL_CLASSES; i++)
+		freeList[i] = NULL;
+
+	memset (&counters, 0, sizeof(counters));
+	pthread_mutex_init(&lock, NULL);
+	pthread_key_create(&key, dropCache);
+
+	this->slabSize = slabSize;
+
+	// Don't let a thread sit on more than half a slab of the large buffers
+	for (u_int32_t i=0; i < POOL_CLASSES; i++)
+		cacheLimit[i] = std::max(2U, std::min(cacheSize, slabSize / (2 * classSizes[i])));
+}
+
+BufferPool::~BufferPool()  {
+	// The caches of the other threads are dropped here: their destructor won't be called anymore
+	pthread_key_delete(key);
+
+	for (size_t i=0; i < caches.size(); i++)
+		delete caches[i];
+
+	for (size_t i=0; i < slabs.size(); i++)
+		delete[] slabs[i];
+
+	pthread_mutex_destroy(&lock);
+}
+
+u_int32_t BufferPool::classSize (u_int32_t cls) throw()  {
+	return (cls < POOL_CLASSES) ? classSizes[cls] : 0;
+}
+
+BufferPool::Cache* BufferPool::cache() throw()  {
+	Cache *c = (Cache*) pthread_getspecific(key);
+
+	if (c)
+		return c;
+
+	c = new Cache();
+	c->pool = this;
+	c->allocs = c->frees = c->hits = c->refills = 0;
+
+	for (u_int32_t i=0; i < POOL_CLASSES; i++)  {
+		c->head[i] = NULL;
+		c->count[i] = 0;
+	}
+
+	pthread_setspecific(key, c);
+	pthread_mutex_lock(&lock);
+	caches.push_back(c);
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+void BufferPool::refill (Cache* c, u_int32_t cls) throw()  {
+	u_int32_t n = cacheLimit[cls] / 2;
+
+	pthread_mutex_lock(&lock);
+
+	if (!freeList[cls])  {
+		// A whole number of blocks in each slab: the tail of the large classes would be lost
+		u_int32_t stride = headerSize + classSizes[cls];
+		u_int32_t size = std::max(1U, slabSize / stride) * stride;
+		char *slab = new char[size];
+
+		slabs.push_back(slab);
+		counters.slabs++;
+		counters.reserved += size;
+
+		for (u_int32_t off=0; off + stride <= size; off += stride)  {
+			BufferBlock *b = new (slab + off) BufferBlock();
+			b->pool = this;
+			b->cls = cls;
+			b->capacity = classSizes[cls];
+			b->next = freeList[cls];
+			freeList[cls] = b;
+		}
+	}
+
+	while (n-- && freeList[cls])  {
+		BufferBlock *b = freeList[cls];
+		freeList[cls] = b->next;
+		b->next = c->head[cls];
+		c->head[cls] = b;
+		c->count[cls]++;
+	}
+
+	pthread_mutex_unlock(&lock);
+	bump(c->refills);
+}
+
+void BufferPool::spill (Cache* c, u_int32_t cls, u_int32_t n) throw()  {
+	pthread_mutex_lock(&lock);
+
+	while (n-- && c->head[cls])  {
+		BufferBlock *b = c->head[cls];
+		c->head[cls] = b->next;
+		c->count[cls]--;
+		b->next = freeList[cls];
+		freeList[cls] = b;
+	}
+
+	pthread_mutex_unlock(&lock);
+	bump(c->refills);
+}
+
+void BufferPool::dropCache (void *arg)  {
+	Cache *c = (Cache*) arg;
+	BufferPool *p = c->pool;
+
+	for (u_int32_t i=0; i < POOL_CLASSES; i++)
+		p->spill(c, i, c->count[i]);
+
+	pthread_mutex_lock(&p->lock);
+	p->counters.allocs += c->allocs;
+	p->counters.frees += c->frees;
+	p->counters.cacheHits += c->hits;
+	p->counters.refills += c->refills;
+	p->caches.erase(std::find(p->caches.begin(), p->caches.end(), c));
+	pthread_mutex_unlock(&p->lock);
+	delete c;
+}
+
+Buffer BufferPool::get (u_int32_t size) throw()  {
+	u_int32_t cls = classOf(size);
+	BufferBlock *b;
+
+	if (cls == POOL_CLASSES)  {
+		b = new (new char[headerSize + size]) BufferBlock();
+		b->pool = this;
+		b->cls = cls;
+		b->capacity = size;
+
+		pthread_mutex_lock(&lock);
+		counters.allocs++;
+		counters.oversize++;
+		pthread_mutex_unlock(&lock);
+	} else {
+		Cache *c = cache();
+
+		if (c->head[cls])
+			bump(c->hits);
+		else
+			refill(c, cls);
+
+		b = c->head[cls];
+		c->head[cls] = b->next;
+		c->count[cls]--;
+		bump(c->allocs);
+	}
+
+	b->refs = 1;
+	return Buffer(b, bytes(b), size, b->capacity);
+}
+
+void BufferPool::release (BufferBlock* b) throw()  {
+	u_int32_t cls = b->cls;
+
+	if (cls == POOL_CLASSES)  {
+		b->~BufferBlock();
+		delete[] (char*) b;
+
+		pthread_mutex_lock(&lock);
+		counters.frees++;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	// A buffer freed by another thread goes into the cache of that thread
+	Cache *c = cache();
+
+	b->next = c->head[cls];
+	c->head[cls] = b;
+	c->count[cls]++;
+	bump(c->frees);
+
+	if (c->count[cls] > cacheLimit[cls])
+		spill(c, cls, c->count[cls] - cacheLimit[cls] / 2);
+}
+
+BufferPoolStats BufferPool::stats() throw()  {
+	BufferPoolStats s;
+
+	pthread_mutex_lock(&lock);
+	s = counters;
+
+	for (size_t i=0; i < caches.size(); i++)  {
+		s.allocs += __atomic_load_n(&caches[i]->allocs, __ATOMIC_RELAXED);
+		s.frees += __atomic_load_n(&caches[i]->frees, __ATOMIC_RELAXED);
+		s.cacheHits += __atomic_load_n(&caches[i]->hits, __ATOMIC_RELAXED);
+		s.refills += __atomic_load_n(&caches[i]->refills, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	// Counters of different threads are read one after the other: don't underflow
+	s.inUse = (s.allocs > s.frees) ? s.allocs - s.frees : 0;
+	return s;
+}
+
+BufferPool& BufferPool::getDefault() throw()  {
+	if (current)
+		return *current;
+
+	pthread_once(&builtin_once, createBuiltin);
+	return *builtin;
+}
+
+void BufferPool::setDefault (BufferPool* p) throw()  { current = p; }
+
@@ -0,0 +1,222 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define	USOCK_CSUM_X86
+#endif
+
+#include "usock_checksum.h"
+
+using namespace usock;
+
+typedef CsumKernelFn csum_kernel;
+
+// Fold a 64-bit accumulator into 32 bits, keeping it congruent modulo 0xffff
+static u_int32_t fold64 (u_int64_t sum)  {
+	sum = (sum & 0xffffffffUL) + (sum >> 32);
+	sum = (sum & 0xffffffffUL) + (sum >> 32);
+	return (u_int32_t) sum;
+}
+
+u_int32_t usock::csumPartialScalar (const void* buf, u_int32_t len, u_int32_t sum) throw()  {
+	const u_int8_t *p = (const u_int8_t*) buf;
+	u_int64_t acc = sum;
+	u_int32_t w[8];
+	u_int16_t h;
+
+	// Since 2^16 = 1 (mod 0xffff), 32-bit words can be summed instead of 16-bit ones
+	for (; len >= 32; len -= 32, p += 32)  {
+		memcpy (w, p, 32);
+		acc += (u_int64_t) w[0] + w[1] + w[2] + w[3] + w[4] + w[5] + w[6] + w[7];
+	}
+
+	for (; len >= 4; len -= 4, p += 4)  {
+		memcpy (w, p, 4);
+		acc += w[0];
+	}
+
+	if (len >= 2)  {
+		memcpy (&h, p, 2);
+		acc += h;
+		p += 2;
+		len -= 2;
+	}
+
+	// The odd trailing byte is the first byte of a 16-bit word padded with a zero
+	if (len)  {
+		h = 0;
+		memcpy (&h, p, 1);
+		acc += h;
+	}
+
+	return fold64(acc);
+}
+
+#ifdef USOCK_CSUM_X86
+__attribute__((target("sse2")))
+static u_int32_t csumPartialSSE2 (const void* buf, u_int32_t len, u_int32_t sum)  {
+	const u_int8_t *p = (const u_int8_t*) buf;
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	u_int64_t lanes[2];
+
+	// Each 32-bit word is widened into a 64-bit lane, so the accumulators never overflow
+	for (; len >= 32; len -= 32, p += 32)  {
+		__m128i a = _mm_loadu_si128((const __m128i*) p);
+		__m128i b = _mm_loadu_si128((const __m128i*) (p + 16));
+
+		acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+		acc2 = _mm_add_epi64(acc2, _mm_unpacklo_epi32(b, zero));
+		acc3 = _mm_add_epi64(acc3, _mm_unpackhi_epi32(b, zero));
+	}
+
+	acc0 = _mm_add_epi64(_mm_add_epi64(acc0, acc1), _mm_add_epi64(acc2, acc3));
+	_mm_storeu_si128((__m128i*) lanes, acc0);
+	return csumPartialScalar(p, len, fold64((u_int64_t) sum + fold64(lanes[0]) + fold64(lanes[1])));
+}
+
+__attribute__((target("avx2")))
+static u_int32_t csumPartialAVX2 (const void* buf, u_int32_t len, u_int32_t sum)  {
+	const u_int8_t *p = (const u_int8_t*) buf;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	u_int64_t lanes[4];
+
+	for (; len >= 64; len -= 64, p += 64)  {
+		__m256i a = _mm256_loadu_si256((const __m256i*) p);
+		__m256i b = _mm256_loadu_si256((const __m256i*) (p + 32));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+		acc2 = _mm256_add_epi64(acc2, _mm256_unpacklo_epi32(b, zero));
+		acc3 = _mm256_add_epi64(acc3, _mm256_unpackhi_epi32(b, zero));
+	}
+
+	acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+	_mm256_storeu_si256((__m256i*) lanes, acc0);
+	sum = fold64((u_int64_t) sum + fold64(lanes[0]) + fold64(lanes[1]) + fold64(lanes[2]) + fold64(lanes[3]));
+	return csumPartialSSE2(p, len, sum);
+}
+#endif
+
+static const char *kernel_name = "scalar";
+
+static csum_kernel pickKernel()  {
+#ifdef USOCK_CSUM_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))  {
+		kernel_name = "avx2";
+		return csumPartialAVX2;
+	}
+
+	if (__builtin_cpu_supports("sse2"))  {
+		kernel_name = "sse2";
+		return csumPartialSSE2;
+	}
+#endif
+	return csumPartialScalar;
+}
+
+// Chosen once, when the library is loaded
+static csum_kernel kernel = pickKernel();
+
+u_int32_t usock::csumPartial (const void* buf, u_int32_t len, u_int32_t sum) throw()  {
+	// Short buffers (headers) don't pay for the vector setup
+	if (len < 256)
+		return csumPartialScalar(buf, len, sum);
+
+	return kernel(buf, len, sum);
+}
+
+u_int16_t usock::csumFold (u_int32_t sum) throw()  {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (u_int16_t) ~sum;
+}
+
+u_int16_t usock::csum (const void* buf, u_int32_t len) throw()  {
+	return csumFold(csumPartial(buf, len));
+}
+
+u_int16_t usock::csumUpdate16 (u_int16_t check, u_int16_t from, u_int16_t to) throw()  {
+	// HC' = ~(~HC + ~m + m')
+	u_int32_t sum = (u_int16_t) ~check;
+
+	sum += (u_int16_t) ~from;
+	sum += to;
+	return csumFold(sum);
+}
+
+u_int16_t usock::csumUpdate32 (u_int16_t check, u_int32_t from, u_int32_t to) throw()  {
+	u_int32_t sum = (u_int16_t) ~check;
+
+	sum += (u_int16_t) ~(from >> 16);
+	sum += (u_int16_t) ~(from & 0xffff);
+	sum += to >> 16;
+	sum += to & 0xffff;
+	return csumFold(sum);
+}
+
+const char* usock::csumKernel() throw()  { return kernel_name; }
+
+CsumKernelFn usock::csumKernelByName (const char* name) throw()  {
+	if (!strcmp(name, "scalar"))
+		return csumPartialScalar;
+#ifdef USOCK_CSUM_X86
+	__builtin_cpu_init();
+
+	if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2"))
+		return csumPartialSSE2;
+
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+		return csumPartialAVX2;
+#endif
+	return NULL;
+}
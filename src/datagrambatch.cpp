@@ -0,0 +1,169 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstring>
+#include <algorithm>
+#include <arpa/inet.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+
+using std::string;
+using namespace usock;
+
+DatagramBatch::DatagramBatch (u_int32_t n, u_int32_t size) throw()  {
+	if (!n || !size)  {
+		errno = EINVAL;
+		throw SocketException("invalid batch size");
+	}
+
+	slot = size;
+	count = 0;
+	storage.resize((size_t) n * size);
+	hdrs.resize(n);
+	iovs.resize(n);
+	addrs.resize(n);
+
+	memset (&hdrs[0], 0, n * sizeof(struct mmsghdr));
+
+	for (u_int32_t i=0; i < n; i++)  {
+		iovs[i].iov_base = &storage[(size_t) i * size];
+		iovs[i].iov_len = size;
+		hdrs[i].msg_hdr.msg_iov = &iovs[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+		hdrs[i].msg_hdr.msg_name = &addrs[i];
+		hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+}
+
+void DatagramBatch::prepareRecv() throw()  {
+	for (u_int32_t i=0; i < hdrs.size(); i++)  {
+		iovs[i].iov_len = slot;
+		hdrs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		hdrs[i].msg_hdr.msg_flags = 0;
+		hdrs[i].msg_len = 0;
+	}
+
+	count = 0;
+}
+
+void DatagramBatch::consume (u_int32_t n) throw()  {
+	if (n >= count)  {
+		count = 0;
+		return;
+	}
+
+	// The slots are rotated instead of copied: the payloads stay where they are, and the buffers
+	// of the dropped datagrams go after the remaining ones, ready for the next append()
+	std::rotate(iovs.begin(), iovs.begin() + n, iovs.begin() + count);
+	std::rotate(addrs.begin(), addrs.begin() + n, addrs.begin() + count);
+
+	for (u_int32_t i=n; i < count; i++)  {
+		hdrs[i-n].msg_hdr.msg_namelen = hdrs[i].msg_hdr.msg_namelen;
+		hdrs[i-n].msg_len = 0;
+	}
+
+	count -= n;
+}
+
+u_int32_t DatagramBatch::capacity() throw()  { return hdrs.size(); }
+
+u_int32_t DatagramBatch::size() throw()  { return count; }
+
+void DatagramBatch::clear() throw()  { count = 0; }
+
+void* DatagramBatch::data (u_int32_t i) throw()  { return iovs.at(i).iov_base; }
+
+u_int32_t DatagramBatch::length (u_int32_t i) throw()  {
+	return (i < count) ? iovs[i].iov_len : 0;
+}
+
+bool DatagramBatch::truncated (u_int32_t i) throw()  {
+	return (i < count) && (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC);
+}
+
+const struct sockaddr* DatagramBatch::addr (u_int32_t i) throw()  { return (struct sockaddr*) &addrs.at(i); }
+
+string DatagramBatch::host (u_int32_t i) throw()  {
+	char str[INET6_ADDRSTRLEN];
+	const struct sockaddr_storage& a = addrs.at(i);
+
+	if (a.ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*) &a)->sin6_addr, str, sizeof(str));
+	else
+		inet_ntop(AF_INET, &((struct sockaddr_in*) &a)->sin_addr, str, sizeof(str));
+
+	return string(str);
+}
+
+u_int16_t DatagramBatch::port (u_int32_t i) throw()  {
+	const struct sockaddr_storage& a = addrs.at(i);
+
+	if (a.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6*) &a)->sin6_port);
+
+	return ntohs(((struct sockaddr_in*) &a)->sin_port);
+}
+
+bool DatagramBatch::append (const void* buf, u_int32_t len, const struct sockaddr* to, socklen_t tolen) throw()  {
+	if (count >= hdrs.size())
+		return false;
+
+	if (len > slot || tolen > sizeof(struct sockaddr_storage))  {
+		errno = EMSGSIZE;
+		throw SocketException("datagram too big for the batch");
+	}
+
+	memcpy (iovs[count].iov_base, buf, len);
+	memcpy (&addrs[count], to, tolen);
+	iovs[count].iov_len = len;
+	hdrs[count].msg_hdr.msg_namelen = tolen;
+	hdrs[count].msg_len = 0;
+	count++;
+	return true;
+}
+
+bool DatagramBatch::append (const void* buf, u_int32_t len, const Endpoint& to) throw()  {
+	return append(buf, len, to.addr(), to.length());
+}
@@ -0,0 +1,157 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstring>
+#include <sstream>
+#include <arpa/inet.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_resolver.h"
+
+using std::string;
+using std::stringstream;
+using namespace usock;
+
+Endpoint::Endpoint() throw()  {
+	memset (&sa, 0, sizeof(sa));
+	sa.ss_family = AF_UNSPEC;
+	len = 0;
+}
+
+Endpoint::Endpoint (const string& host, u_int16_t port, int family) throw()  {
+	std::vector<Endpoint> eps = resolve(host, port, family);
+
+	if (eps.empty())  {
+		errno = EHOSTUNREACH;
+		throw SocketException("unable to resolve host");
+	}
+
+	*this = eps[0];
+}
+
+std::vector<Endpoint> Endpoint::resolve (const string& host, u_int16_t port, int family) throw()  {
+	std::vector<struct sockaddr_storage> addrs;
+	std::vector<Endpoint> eps;
+
+	if (!Resolver::getDefault().resolve(host, addrs, family))
+		return eps;
+
+	for (u_int32_t i=0; i < addrs.size(); i++)  {
+		if (addrs[i].ss_family == AF_INET6)  {
+			((struct sockaddr_in6*) &addrs[i])->sin6_port = htons(port);
+			eps.push_back(Endpoint((struct sockaddr*) &addrs[i], sizeof(struct sockaddr_in6)));
+		} else {
+			((struct sockaddr_in*) &addrs[i])->sin_port = htons(port);
+			eps.push_back(Endpoint((struct sockaddr*) &addrs[i], sizeof(struct sockaddr_in)));
+		}
+	}
+
+	return eps;
+}
+
+Endpoint::Endpoint (const struct sockaddr* addr, socklen_t len) throw()  {
+	if (len > sizeof(sa))  {
+		errno = EINVAL;
+		throw SocketException("invalid socket address");
+	}
+
+	memset (&sa, 0, sizeof(sa));
+	memcpy (&sa, addr, len);
+	this->len = len;
+}
+
+bool Endpoint::empty() const throw()  { return (len == 0); }
+
+int Endpoint::family() const throw()  { return sa.ss_family; }
+
+bool Endpoint::isV4Mapped() const throw()  {
+	return (sa.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*) &sa)->sin6_addr));
+}
+
+string Endpoint::host() const throw()  {
+	char str[INET6_ADDRSTRLEN];
+
+	if (isV4Mapped())
+		inet_ntop(AF_INET, &((struct sockaddr_in6*) &sa)->sin6_addr.s6_addr[12], str, sizeof(str));
+	else if (sa.ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*) &sa)->sin6_addr, str, sizeof(str));
+	else if (sa.ss_family == AF_INET)
+		inet_ntop(AF_INET, &((struct sockaddr_in*) &sa)->sin_addr, str, sizeof(str));
+	else
+		return string();
+
+	return string(str);
+}
+
+u_int16_t Endpoint::port() const throw()  {
+	if (sa.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6*) &sa)->sin6_port);
+
+	if (sa.ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in*) &sa)->sin_port);
+
+	return 0;
+}
+
+const struct sockaddr* Endpoint::addr() const throw()  { return (const struct sockaddr*) &sa; }
+
+socklen_t Endpoint::length() const throw()  { return len; }
+
+string Endpoint::toString() const throw()  {
+	stringstream ss;
+
+	if (sa.ss_family == AF_INET6 && !isV4Mapped())
+		ss << "[" << host() << "]:" << port();
+	else
+		ss << host() << ":" << port();
+
+	return ss.str();
+}
+
+bool Endpoint::operator== (const Endpoint& e) const throw()  {
+	return (len == e.len && !memcmp(&sa, &e.sa, len));
+}
+
+bool Endpoint::operator!= (const Endpoint& e) const throw()  { return !(*this == e); }
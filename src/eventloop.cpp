@@ -0,0 +1,297 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "usock.h"
+#include "usock_eventloop.h"
+#include "usock_exception.h"
+
+using namespace usock;
+
+struct EventLoop::Entry  {
+	int fd;
+	Socket *sock;
+	ServerSocket *server;
+	EventHandler *handler;
+	bool owned;
+	bool dead;
+};
+
+EventLoop::EventLoop() throw()  {
+	struct epoll_event ev;
+
+	running = true;
+	nentries = 0;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		throw SocketException("epoll_create error");
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		throw SocketException("eventfd error");
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+		throw SocketException("epoll_ctl error");
+
+	sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+EventLoop::~EventLoop()  {
+	for (u_int32_t i=0; i < entries.size(); i++)  {
+		if (entries[i])  {
+			if (entries[i]->owned)
+				delete entries[i]->sock;
+
+			delete entries[i];
+		}
+	}
+
+	for (u_int32_t i=0; i < closed.size(); i++)  {
+		if (closed[i]->owned)
+			delete closed[i]->sock;
+
+		delete closed[i];
+	}
+
+	if (sparefd >= 0)
+		::close(sparefd);
+
+	::close(wakefd);
+	::close(epfd);
+}
+
+bool EventLoop::attach (Entry *e) throw()  {
+	struct epoll_event ev;
+
+	ev.events = (e->server) ? EPOLLIN : (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+	ev.data.ptr = e;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0)
+		return false;
+
+	if ((u_int32_t) e->fd >= entries.size())
+		entries.resize(e->fd + 1, NULL);
+
+	entries[e->fd] = e;
+	nentries++;
+	return true;
+}
+
+void EventLoop::add (ServerSocket& ss, EventHandler& handler) throw()  {
+	Entry *e = new Entry;
+
+	ss.setBlocking(false);
+	e->fd = ss.getDescriptor();
+	e->sock = &ss;
+	e->server = &ss;
+	e->handler = &handler;
+	e->owned = false;
+	e->dead = false;
+
+	if (!attach(e))  {
+		delete e;
+		throw SocketException("epoll_ctl error");
+	}
+}
+
+void EventLoop::add (Socket& s, EventHandler& handler) throw()  {
+	Entry *e = new Entry;
+
+	s.setBlocking(false);
+	e->fd = s.getDescriptor();
+	e->sock = &s;
+	e->server = NULL;
+	e->handler = &handler;
+	e->owned = false;
+	e->dead = false;
+
+	if (!attach(e))  {
+		delete e;
+		throw SocketException("epoll_ctl error");
+	}
+}
+
+void EventLoop::drop (Entry *e)  {
+	if (e->dead)
+		return;
+
+	e->dead = true;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+	entries[e->fd] = NULL;
+	nentries--;
+	closed.push_back(e);
+
+	e->handler->onClosed(*this, *(e->sock));
+	e->sock->close();
+}
+
+void EventLoop::close (Socket& s)  {
+	int fd = s.getDescriptor();
+
+	if (fd < 0 || (u_int32_t) fd >= entries.size() || !entries[fd])
+		return;
+
+	drop(entries[fd]);
+}
+
+void EventLoop::acceptAll (Entry *e)  {
+	while (!e->dead)  {
+		int new_sd = ::accept4(e->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (new_sd < 0)  {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// Out of descriptors: the listener is level-triggered and would fire again at once. Give
+			// up the spare descriptor for a moment to accept the connection, and drop it
+			if ((errno == EMFILE || errno == ENFILE) && sparefd >= 0)  {
+				::close(sparefd);
+
+				if ((new_sd = ::accept4(e->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+					::close(new_sd);
+
+				sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+				if (new_sd >= 0)
+					continue;
+			}
+
+			// EAGAIN means the accept queue has been drained
+			break;
+		}
+
+		Entry *c = new Entry;
+		c->fd = new_sd;
+		c->sock = new Socket(new_sd);
+		c->server = NULL;
+		c->handler = e->handler;
+		c->owned = true;
+		c->dead = false;
+
+		if (!attach(c))  {
+			delete c->sock;
+			delete c;
+			continue;
+		}
+
+		c->handler->onAccept(*this, *(c->sock));
+	}
+}
+
+void EventLoop::dispatch (Entry *e, u_int32_t events)  {
+	if (e->server)  {
+		acceptAll(e);
+		return;
+	}
+
+	// A peer which shut down its side may still wait for a reply: the handler gets the EOF through
+	// tryRecv() returning 0, and closes the socket when it's done
+	if (events & (EPOLLIN | EPOLLPRI | EPOLLRDHUP))
+		e->handler->onReadable(*this, *(e->sock));
+
+	if (!e->dead && (events & EPOLLOUT))
+		e->handler->onWritable(*this, *(e->sock));
+
+	if (!e->dead && (events & (EPOLLHUP | EPOLLERR)))
+		drop(e);
+}
+
+int EventLoop::runOnce (int timeout)  {
+	struct epoll_event events[EVENTLOOP_MAXEVENTS];
+	int n;
+
+	if ((n = epoll_wait(epfd, events, EVENTLOOP_MAXEVENTS, timeout)) < 0)  {
+		if (errno == EINTR)
+			return 0;
+
+		throw SocketException("epoll_wait error");
+	}
+
+	for (int i=0; i < n; i++)  {
+		Entry *e = (Entry*) events[i].data.ptr;
+
+		if (!e)  {
+			eventfd_t val;
+			eventfd_read(wakefd, &val);
+			continue;
+		}
+
+		if (!e->dead)
+			dispatch(e, events[i].events);
+	}
+
+	for (u_int32_t i=0; i < closed.size(); i++)  {
+		if (closed[i]->owned)
+			delete closed[i]->sock;
+
+		delete closed[i];
+	}
+
+	closed.clear();
+	return n;
+}
+
+void EventLoop::run()  {
+	while (running && nentries > 0)
+		runOnce();
+
+	// The stop() which made us return is consumed, so that the loop can be run again
+	if (!running)
+		running = true;
+}
+
+void EventLoop::stop() throw()  {
+	running = false;
+	eventfd_write(wakefd, 1);
+}
+
+u_int32_t EventLoop::size() throw()  { return nentries; }
+
@@ -0,0 +1,240 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/ip_icmp.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_filter.h"
+
+using std::string;
+using std::vector;
+using namespace usock;
+
+// Jump target of the instructions which reject the packet
+#define	REJECT	-1
+
+// Offsets inside the IPv4 header
+#define	IPOFF_FRAG	6
+#define	IPOFF_PROTO	9
+#define	IPOFF_SRC	12
+#define	IPOFF_DST	16
+
+PacketFilter::PacketFilter (u_int32_t snaplen) throw()  {
+	this->snaplen = snaplen;
+}
+
+void PacketFilter::emit (u_int16_t code, u_int32_t k, int jt, int jf) throw()  {
+	Insn i;
+
+	i.code = code;
+	i.k = k;
+	i.jt = jt;
+	i.jf = jf;
+	insns.push_back(i);
+}
+
+void PacketFilter::match (u_int16_t load, u_int32_t off, u_int32_t value, int other) throw()  {
+	emit(load, off);
+
+	if (other >= 0)  {
+		emit(BPF_JMP | BPF_JEQ | BPF_K, value, 2, 0);
+		emit(load, other);
+	}
+
+	emit(BPF_JMP | BPF_JEQ | BPF_K, value, 0, REJECT);
+}
+
+void PacketFilter::transport (u_int8_t proto, int alt) throw()  {
+	emit(BPF_LD | BPF_B | BPF_ABS, IPOFF_PROTO);
+
+	if (alt >= 0)
+		emit(BPF_JMP | BPF_JEQ | BPF_K, alt, 1, 0);
+
+	emit(BPF_JMP | BPF_JEQ | BPF_K, proto, 0, REJECT);
+
+	// Only the first fragment holds the transport header
+	emit(BPF_LD | BPF_H | BPF_ABS, IPOFF_FRAG);
+	emit(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, REJECT, 0);
+
+	// X = 4 * (IP header length)
+	emit(BPF_LDX | BPF_B | BPF_MSH, 0);
+}
+
+in_addr_t PacketFilter::resolve (const string& host) throw()  {
+	// It throws if the name doesn't resolve to an IPv4 address
+	Endpoint ep(host, 0, AF_INET);
+	return ((const struct sockaddr_in*) ep.addr())->sin_addr.s_addr;
+}
+
+PacketFilter& PacketFilter::protocol (u_int8_t proto) throw()  {
+	match(BPF_LD | BPF_B | BPF_ABS, IPOFF_PROTO, proto);
+	return *this;
+}
+
+PacketFilter& PacketFilter::srcHost (in_addr_t addr) throw()  {
+	match(BPF_LD | BPF_W | BPF_ABS, IPOFF_SRC, ntohl(addr));
+	return *this;
+}
+
+PacketFilter& PacketFilter::srcHost (const string& host) throw()  {
+	return srcHost(resolve(host));
+}
+
+PacketFilter& PacketFilter::dstHost (in_addr_t addr) throw()  {
+	match(BPF_LD | BPF_W | BPF_ABS, IPOFF_DST, ntohl(addr));
+	return *this;
+}
+
+PacketFilter& PacketFilter::dstHost (const string& host) throw()  {
+	return dstHost(resolve(host));
+}
+
+PacketFilter& PacketFilter::host (in_addr_t addr) throw()  {
+	match(BPF_LD | BPF_W | BPF_ABS, IPOFF_SRC, ntohl(addr), IPOFF_DST);
+	return *this;
+}
+
+PacketFilter& PacketFilter::host (const string& host) throw()  {
+	return this->host(resolve(host));
+}
+
+PacketFilter& PacketFilter::srcPort (u_int16_t port) throw()  {
+	transport(IPPROTO_TCP, IPPROTO_UDP);
+	match(BPF_LD | BPF_H | BPF_IND, 0, port);
+	return *this;
+}
+
+PacketFilter& PacketFilter::dstPort (u_int16_t port) throw()  {
+	transport(IPPROTO_TCP, IPPROTO_UDP);
+	match(BPF_LD | BPF_H | BPF_IND, 2, port);
+	return *this;
+}
+
+PacketFilter& PacketFilter::port (u_int16_t port) throw()  {
+	transport(IPPROTO_TCP, IPPROTO_UDP);
+	match(BPF_LD | BPF_H | BPF_IND, 0, port, 2);
+	return *this;
+}
+
+PacketFilter& PacketFilter::icmpType (u_int8_t type) throw()  {
+	transport(IPPROTO_ICMP);
+	match(BPF_LD | BPF_B | BPF_IND, 0, type);
+	return *this;
+}
+
+PacketFilter& PacketFilter::icmpId (u_int16_t id) throw()  {
+	transport(IPPROTO_ICMP);
+
+	// Only echo requests and replies have an ID: in the other types the same bytes mean something else
+	emit(BPF_LD | BPF_B | BPF_IND, 0);
+	emit(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 1, 0);
+	emit(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, REJECT);
+	match(BPF_LD | BPF_H | BPF_IND, 4, id);
+	return *this;
+}
+
+bool PacketFilter::empty() const throw()  {
+	return insns.empty();
+}
+
+vector<struct sock_filter> PacketFilter::program() const throw()  {
+	vector<Insn> code;
+	vector<struct sock_filter> prog;
+
+	// IPv4 packets only
+	Insn ver[3] = {
+		{ BPF_LD | BPF_B | BPF_ABS, 0, 0, 0 },
+		{ BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xf0 },
+		{ BPF_JMP | BPF_JEQ | BPF_K, 0, REJECT, 0x40 },
+	};
+
+	code.insert(code.end(), ver, ver + 3);
+	code.insert(code.end(), insns.begin(), insns.end());
+
+	// Accept, then reject
+	size_t reject = code.size() + 1;
+
+	for (size_t i=0; i < code.size(); i++)  {
+		struct sock_filter f;
+		int jt = (code[i].jt == REJECT) ? (int) (reject - i - 1) : code[i].jt;
+		int jf = (code[i].jf == REJECT) ? (int) (reject - i - 1) : code[i].jf;
+
+		// Classic BPF jumps are 8 bits long
+		if (jt > 255 || jf > 255)
+			throw SocketException("packet filter too long");
+
+		f.code = code[i].code;
+		f.jt = jt;
+		f.jf = jf;
+		f.k = code[i].k;
+		prog.push_back(f);
+	}
+
+	struct sock_filter accept = { BPF_RET | BPF_K, 0, 0, snaplen };
+	struct sock_filter drop = { BPF_RET | BPF_K, 0, 0, 0 };
+	prog.push_back(accept);
+	prog.push_back(drop);
+	return prog;
+}
+
+void PacketFilter::attach (int sd) const throw()  {
+	vector<struct sock_filter> prog = program();
+	struct sock_fprog fprog;
+
+	fprog.len = prog.size();
+	fprog.filter = &prog[0];
+
+	if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+		throw SocketException("unable to attach the packet filter");
+}
+
+void PacketFilter::detach (int sd) throw()  {
+	int dummy = 0;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy)) < 0 && errno != ENOENT)
+		throw SocketException("unable to detach the packet filter");
+}
@@ -0,0 +1,349 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <arpa/inet.h>
+
+#include "usock_checksum.h"
+#include "usock_parser.h"
+
+using namespace usock;
+
+#define	ETH_HLEN	14
+#define	ETH_P_IP	0x0800
+#define	ETH_P_IPV6	0x86dd
+#define	ETH_P_8021Q	0x8100
+#define	ETH_P_8021AD	0x88a8
+
+bool EthernetView::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (size < ETH_HLEN)
+		return fail();
+
+	p = buf;
+	len = size;
+	hlen = ETH_HLEN;
+	vlanId = 0;
+	ethType = get16(buf + 12);
+
+	// Each tag is a TCI followed by the EtherType of what comes next
+	while (ethType == ETH_P_8021Q || ethType == ETH_P_8021AD)  {
+		if (size < hlen + 4)
+			return fail();
+
+		if (!vlanId)
+			vlanId = get16(buf + hlen) & 0x0fff;
+
+		ethType = get16(buf + hlen + 2);
+		hlen += 4;
+	}
+
+	return true;
+}
+
+bool IPv4View::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (size < 20 || (buf[0] >> 4) != 4)
+		return fail();
+
+	u_int32_t ihl = (buf[0] & 0x0f) << 2;
+	u_int32_t total = get16(buf + 2);
+
+	if (ihl < 20 || ihl > size || total < ihl)
+		return fail();
+
+	p = buf;
+	hlen = ihl;
+	len = (total < size) ? total : size;
+	return true;
+}
+
+bool IPv4View::checksumValid() const throw()  {
+	return csum(p, hlen) == 0;
+}
+
+bool IPv6View::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (size < 40 || (buf[0] >> 4) != 6)
+		return fail();
+
+	u_int32_t total = 40 + get16(buf + 4);
+	u_int32_t off = 40;
+	u_int8_t nh = buf[6];
+	bool more = true;
+
+	p = buf;
+	len = (total < size) ? total : size;
+	frag = 0;
+	fragmented = false;
+
+	for (int i=0; more && i < IPV6_MAX_EXT_HEADERS; i++)  {
+		u_int32_t l;
+
+		if (nh != IPPROTO_HOPOPTS && nh != IPPROTO_ROUTING && nh != IPPROTO_DSTOPTS &&
+				nh != IPPROTO_FRAGMENT && nh != IPPROTO_AH)
+			break;
+
+		if (off + 8 > len)
+			return fail();
+
+		if (nh == IPPROTO_FRAGMENT)  {
+			l = 8;
+			frag = get16(buf + off + 2) & 0xfff8;
+			fragmented = true;
+		} else if (nh == IPPROTO_AH)
+			l = (buf[off + 1] + 2) << 2;
+		else
+			l = (buf[off + 1] + 1) << 3;
+
+		nh = buf[off];
+		off += l;
+	}
+
+	if (off > len)
+		return fail();
+
+	hlen = off;
+	upper = nh;
+	return true;
+}
+
+bool TCPView::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (size < 20)
+		return fail();
+
+	u_int32_t doff = (buf[12] >> 4) << 2;
+
+	if (doff < 20 || doff > size)
+		return fail();
+
+	p = buf;
+	len = size;
+	hlen = doff;
+	return true;
+}
+
+bool UDPView::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (size < 8)
+		return fail();
+
+	u_int32_t ulen = get16(buf + 4);
+
+	if (ulen < 8)
+		return fail();
+
+	p = buf;
+	len = (ulen < size) ? ulen : size;
+	hlen = 8;
+	return true;
+}
+
+bool ICMPView::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (size < 8)
+		return fail();
+
+	p = buf;
+	len = size;
+	hlen = 8;
+	return true;
+}
+
+PacketParser::PacketParser() throw() : proto(0)  {}
+
+void PacketParser::transport (u_int8_t proto, const u_int8_t* buf, u_int32_t size) throw()  {
+	this->proto = proto;
+
+	switch (proto)  {
+		case IPPROTO_TCP:
+			tcpView.parse(buf, size);
+			break;
+
+		case IPPROTO_UDP:
+			udpView.parse(buf, size);
+			break;
+
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			icmpView.parse(buf, size);
+			break;
+	}
+}
+
+bool PacketParser::network (const u_int8_t* buf, u_int32_t size) throw()  {
+	ip4View = IPv4View();
+	ip6View = IPv6View();
+	tcpView = TCPView();
+	udpView = UDPView();
+	icmpView = ICMPView();
+	proto = 0;
+
+	if (size < 1)
+		return false;
+
+	if ((buf[0] >> 4) == 4)  {
+		if (!ip4View.parse(buf, size))
+			return false;
+
+		// Only the first fragment holds the transport header
+		if (!ip4View.fragOffset())
+			transport(ip4View.protocol(), ip4View.payload(), ip4View.payloadLength());
+
+		return true;
+	}
+
+	if ((buf[0] >> 4) == 6)  {
+		if (!ip6View.parse(buf, size))
+			return false;
+
+		if (!ip6View.fragOffset())
+			transport(ip6View.protocol(), ip6View.payload(), ip6View.payloadLength());
+
+		return true;
+	}
+
+	return false;
+}
+
+bool PacketParser::parse (const u_int8_t* buf, u_int32_t size) throw()  {
+	ethView = EthernetView();
+	return network(buf, size);
+}
+
+bool PacketParser::parseEthernet (const u_int8_t* buf, u_int32_t size) throw()  {
+	if (!ethView.parse(buf, size) || (ethView.type() != ETH_P_IP && ethView.type() != ETH_P_IPV6))  {
+		network(NULL, 0);
+		return false;
+	}
+
+	return network(ethView.payload(), ethView.payloadLength());
+}
+
+const u_int8_t* PacketParser::payload() const throw()  {
+	if (tcpView.valid())
+		return tcpView.payload();
+
+	if (udpView.valid())
+		return udpView.payload();
+
+	if (icmpView.valid())
+		return icmpView.payload();
+
+	if (ip4View.valid())
+		return ip4View.payload();
+
+	if (ip6View.valid())
+		return ip6View.payload();
+
+	return (ethView.valid()) ? ethView.payload() : NULL;
+}
+
+u_int32_t PacketParser::payloadLength() const throw()  {
+	if (tcpView.valid())
+		return tcpView.payloadLength();
+
+	if (udpView.valid())
+		return udpView.payloadLength();
+
+	if (icmpView.valid())
+		return icmpView.payloadLength();
+
+	if (ip4View.valid())
+		return ip4View.payloadLength();
+
+	if (ip6View.valid())
+		return ip6View.payloadLength();
+
+	return (ethView.valid()) ? ethView.payloadLength() : 0;
+}
+
+bool PacketParser::transportChecksumValid() const throw()  {
+	const HeaderView *l4;
+	u_int8_t pseudo[40];
+	u_int32_t plen, seglen;
+
+	if (tcpView.valid())
+		l4 = &tcpView;
+	else if (udpView.valid())
+		l4 = &udpView;
+	else if (icmpView.valid())
+		l4 = &icmpView;
+	else
+		return false;
+
+	seglen = (udpView.valid()) ? udpView.udpLength() : l4->length();
+
+	// Part of the segment wasn't captured
+	if ((ip4View.valid() && ip4View.truncated()) || (ip6View.valid() && ip6View.truncated()) || l4->length() < seglen)
+		return false;
+
+	if (ip4View.valid())  {
+		// ICMP has no pseudo-header, and UDP over IPv4 may go without a checksum
+		if (proto == IPPROTO_ICMP)
+			return csum(l4->data(), seglen) == 0;
+
+		if (proto == IPPROTO_UDP && !udpView.checksum())
+			return true;
+
+		memcpy (pseudo, ip4View.data() + 12, 8);
+		pseudo[8] = 0;
+		pseudo[9] = proto;
+		pseudo[10] = seglen >> 8;
+		pseudo[11] = seglen & 0xff;
+		plen = 12;
+	} else  {
+		memcpy (pseudo, ip6View.data() + 8, 32);
+		pseudo[32] = seglen >> 24;
+		pseudo[33] = (seglen >> 16) & 0xff;
+		pseudo[34] = (seglen >> 8) & 0xff;
+		pseudo[35] = seglen & 0xff;
+		pseudo[36] = pseudo[37] = pseudo[38] = 0;
+		pseudo[39] = proto;
+		plen = 40;
+	}
+
+	return csumFold(csumPartial(l4->data(), seglen, csumPartial(pseudo, plen))) == 0;
+}
+
+bool PacketParser::checksumValid() const throw()  {
+	if (ip4View.valid() && !ip4View.checksumValid())
+		return false;
+
+	return transportChecksumValid();
+}
@@ -0,0 +1,285 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_checksum.h"
+#include "usock_packet.h"
+
+using std::string;
+using namespace usock;
+
+// Offsets of the IPv4 header fields
+#define	IPOFF_ID	4
+#define	IPOFF_TTL	8
+#define	IPOFF_PROTO	9
+#define	IPOFF_CHECK	10
+#define	IPOFF_SADDR	12
+#define	IPOFF_DADDR	16
+
+// Offsets of the IPv6 header fields
+#define	IP6OFF_NEXT	6
+#define	IP6OFF_SADDR	8
+#define	IP6OFF_DADDR	24
+
+PacketTemplate::PacketTemplate() throw() : l4off(0), proto(0), ipv6(false)  {}
+
+PacketTemplate::PacketTemplate (RawSocket& s) throw()  {
+	struct sockaddr_storage to;
+	u_int32_t len = s.assemble(to);
+
+	if (!len)
+		throw SocketException("no IP packet has been built on the raw socket");
+
+	pkt.assign(s.pkt.begin(), s.pkt.begin() + len);
+	ipv6 = (pkt[0] >> 4) == 6;
+
+	if (ipv6)  {
+		l4off = sizeof(struct ip6_hdr);
+		proto = pkt[IP6OFF_NEXT];
+	} else {
+		l4off = (pkt[0] & 0x0f) << 2;
+		proto = pkt[IPOFF_PROTO];
+	}
+}
+
+const u_int8_t* PacketTemplate::data() const throw()  { return (pkt.empty()) ? NULL : &pkt[0]; }
+
+u_int32_t PacketTemplate::length() const throw()  { return pkt.size(); }
+
+u_int32_t PacketTemplate::l4check() throw()  {
+	switch (proto)  {
+		case IPPROTO_TCP:    return l4off + 16;
+		case IPPROTO_UDP:    return l4off + 6;
+		case IPPROTO_ICMP:   return l4off + 2;
+		case IPPROTO_ICMPV6: return l4off + 2;
+	}
+
+	return 0;
+}
+
+void PacketTemplate::expect (int proto1, int proto2) throw()  {
+	if (pkt.empty() || (proto != proto1 && proto != proto2))
+		throw SocketException("the packet template has no such field");
+}
+
+void PacketTemplate::set16 (u_int32_t off, u_int16_t value, bool pseudo) throw()  {
+	u_int16_t old, check;
+	u_int32_t c;
+
+	if (off + 2 > pkt.size())
+		throw SocketException("the packet template has no such field");
+
+	memcpy (&old, &pkt[off], 2);
+
+	if (old == value)
+		return;
+
+	memcpy (&pkt[off], &value, 2);
+
+	if (off < l4off && !ipv6)  {
+		memcpy (&check, &pkt[IPOFF_CHECK], 2);
+		check = csumUpdate16(check, old, value);
+		memcpy (&pkt[IPOFF_CHECK], &check, 2);
+	}
+
+	// ICMP has no pseudo-header (ICMPv6 has one)
+	if ((off >= l4off || (pseudo && proto != IPPROTO_ICMP)) && (c = l4check()) && c + 2 <= pkt.size())  {
+		memcpy (&check, &pkt[c], 2);
+		check = csumUpdate16(check, old, value);
+
+		if (!check && proto == IPPROTO_UDP)
+			check = 0xffff;
+
+		memcpy (&pkt[c], &check, 2);
+	}
+}
+
+void PacketTemplate::set32 (u_int32_t off, u_int32_t value, bool pseudo) throw()  {
+	u_int32_t old, c;
+	u_int16_t check;
+
+	if (off + 4 > pkt.size())
+		throw SocketException("the packet template has no such field");
+
+	memcpy (&old, &pkt[off], 4);
+
+	if (old == value)
+		return;
+
+	memcpy (&pkt[off], &value, 4);
+
+	if (off < l4off && !ipv6)  {
+		memcpy (&check, &pkt[IPOFF_CHECK], 2);
+		check = csumUpdate32(check, old, value);
+		memcpy (&pkt[IPOFF_CHECK], &check, 2);
+	}
+
+	if ((off >= l4off || (pseudo && proto != IPPROTO_ICMP)) && (c = l4check()) && c + 2 <= pkt.size())  {
+		memcpy (&check, &pkt[c], 2);
+		check = csumUpdate32(check, old, value);
+
+		if (!check && proto == IPPROTO_UDP)
+			check = 0xffff;
+
+		memcpy (&pkt[c], &check, 2);
+	}
+}
+
+void PacketTemplate::expectFamily (bool v6) throw()  {
+	if (pkt.empty() || ipv6 != v6)
+		throw SocketException("the packet template has no such field");
+}
+
+void PacketTemplate::setAddr6 (u_int32_t off, const struct in6_addr& addr) throw()  {
+	u_int32_t word;
+
+	expectFamily(true);
+
+	for (u_int32_t i=0; i < sizeof(addr); i += 4)  {
+		memcpy (&word, (const u_int8_t*) &addr + i, 4);
+		set32(off + i, word, true);
+	}
+}
+
+void PacketTemplate::setSrc (in_addr_t addr) throw()  {
+	expectFamily(false);
+	set32(IPOFF_SADDR, addr, true);
+}
+
+void PacketTemplate::setDst (in_addr_t addr) throw()  {
+	expectFamily(false);
+	set32(IPOFF_DADDR, addr, true);
+}
+
+void PacketTemplate::setSrc (const struct in6_addr& addr) throw()  { setAddr6(IP6OFF_SADDR, addr); }
+
+void PacketTemplate::setDst (const struct in6_addr& addr) throw()  { setAddr6(IP6OFF_DADDR, addr); }
+
+void PacketTemplate::setDst (const string& addr) throw()  {
+	struct in_addr in;
+	struct in6_addr in6;
+
+	if (ipv6)  {
+		if (inet_pton(AF_INET6, addr.c_str(), &in6) != 1)
+			throw SocketException("invalid IPv6 address");
+
+		setDst(in6);
+		return;
+	}
+
+	if (!inet_aton(addr.c_str(), &in))
+		throw SocketException("invalid IPv4 address");
+
+	setDst(in.s_addr);
+}
+
+void PacketTemplate::setTTL (u_int8_t ttl) throw()  {
+	// The TTL shares its 16-bit word with the protocol, the IPv6 hop limit with the next header
+	u_int8_t word[2];
+	u_int16_t value;
+
+	if (pkt.empty())
+		throw SocketException("the packet template has no such field");
+
+	if (ipv6)  {
+		word[0] = pkt[IP6OFF_NEXT];
+		word[1] = ttl;
+	} else {
+		word[0] = ttl;
+		word[1] = pkt[IPOFF_PROTO];
+	}
+
+	memcpy (&value, word, 2);
+	set16((ipv6) ? IP6OFF_NEXT : IPOFF_TTL, value, false);
+}
+
+void PacketTemplate::setId (u_int16_t id) throw()  {
+	expectFamily(false);
+	set16(IPOFF_ID, htons(id), false);
+}
+
+void PacketTemplate::setSrcPort (u_int16_t port) throw()  {
+	expect(IPPROTO_TCP, IPPROTO_UDP);
+	set16(l4off, htons(port), false);
+}
+
+void PacketTemplate::setDstPort (u_int16_t port) throw()  {
+	expect(IPPROTO_TCP, IPPROTO_UDP);
+	set16(l4off + 2, htons(port), false);
+}
+
+void PacketTemplate::setSeq (u_int32_t seq) throw()  {
+	expect(IPPROTO_TCP);
+	set32(l4off + 4, htonl(seq), false);
+}
+
+u_int32_t PacketTemplate::randomSeq() throw()  {
+	u_int32_t seq = rng.next();
+
+	setSeq(seq);
+	return seq;
+}
+
+void PacketTemplate::setAck (u_int32_t ack) throw()  {
+	expect(IPPROTO_TCP);
+	set32(l4off + 8, htonl(ack), false);
+}
+
+void PacketTemplate::setICMPId (u_int16_t id) throw()  {
+	expect(IPPROTO_ICMP, IPPROTO_ICMPV6);
+	set16(l4off + 4, htons(id), false);
+}
+
+void PacketTemplate::setICMPSeq (u_int16_t seq) throw()  {
+	expect(IPPROTO_ICMP, IPPROTO_ICMPV6);
+	set16(l4off + 6, htons(seq), false);
+}
+
+void PacketTemplate::seed (u_int32_t value) throw()  { rng.seed(value); }
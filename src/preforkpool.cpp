@@ -0,0 +1,542 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_prefork.h"
+
+using namespace usock;
+
+// Set by SIGTERM in a worker: it's checked between two connections
+static volatile sig_atomic_t quit = 0;
+
+static void onTerm (int sig)  { quit = 1; }
+
+// Pass a descriptor over a UNIX socket (SCM_RIGHTS)
+static bool sendFd (int chan, int fd)  {
+	union  {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *c;
+
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy (CMSG_DATA(c), &fd, sizeof(int));
+
+	return sendmsg(chan, &msg, MSG_NOSIGNAL) == 1;
+}
+
+// Receive a descriptor sent by sendFd(), -1 if the master closed the socket
+static int recvFd (int chan)  {
+	union  {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+	struct cmsghdr *c;
+	ssize_t n;
+	int fd;
+
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+
+	if ((n = recvmsg(chan, &msg, 0)) <= 0)  {
+		if (!n)
+			errno = EPIPE;
+
+		return -1;
+	}
+
+	if (!(c = CMSG_FIRSTHDR(&msg)) || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)  {
+		errno = EPROTO;
+		return -1;
+	}
+
+	memcpy (&fd, CMSG_DATA(c), sizeof(int));
+	return fd;
+}
+
+PreforkPool::PreforkPool (ServerSocket& s, void (*handler)(Socket&), u_int32_t nworkers, u_int32_t maxRequests,
+		Mode mode) throw()  {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	Worker w = { 0, -1, false };
+
+	if (ncpu < 1)
+		ncpu = 1;
+
+	if (!nworkers)
+		nworkers = ncpu;
+
+	// One connection per worker: the pool serves no more than maxconn of them at once
+	if (nworkers > s.getMaxConn())
+		nworkers = s.getMaxConn();
+
+	if (!nworkers)
+		nworkers = 1;
+
+	server = &s;
+	this->handler = handler;
+	this->maxRequests = maxRequests;
+	this->mode = mode;
+
+	workers.assign(nworkers, w);
+	memset (&counters, 0, sizeof(counters));
+
+	sigfd = -1;
+	lflags = -1;
+	running = false;
+	stopping = 0;
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		throw SocketException("eventfd error");
+}
+
+PreforkPool::~PreforkPool()  {
+	if (running)
+		terminate();
+
+	::close(wakefd);
+}
+
+void PreforkPool::start() throw()  {
+	sigset_t set;
+	int sd = server->getDescriptor();
+
+	if (running)
+		return;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+
+	if (pthread_sigmask(SIG_BLOCK, &set, &oldmask) != 0)
+		throw SocketException("sigprocmask error");
+
+	if ((sigfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		throw SocketException("signalfd error");
+
+	// Only the master accepts: a connection reset between poll() and accept() mustn't block it
+	if (mode == handoff)  {
+		if ((lflags = fcntl(sd, F_GETFL)) < 0 || fcntl(sd, F_SETFL, lflags | O_NONBLOCK) < 0)
+			throw SocketException("fcntl exception");
+	}
+
+	running = true;
+
+	for (u_int32_t i=0; i < workers.size(); i++)
+		spawn(i);
+}
+
+void PreforkPool::spawn (u_int32_t i) throw()  {
+	int sv[2] = { -1, -1 };
+	pid_t pid;
+
+	if (mode == handoff && socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		throw SocketException("socketpair error");
+
+	// Or the output buffered so far would be written by the child too
+	fflush(NULL);
+
+	if ((pid = fork()) < 0)
+		throw SocketException("process creation failed");
+
+	if (!pid)  {
+		struct sigaction sa;
+
+		pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+		::close(sigfd);
+		::close(wakefd);
+
+		for (u_int32_t j=0; j < workers.size(); j++)
+			if (workers[j].chan >= 0)
+				::close(workers[j].chan);
+
+		if (mode == handoff)  {
+			::close(sv[0]);
+			::close(server->getDescriptor());
+		}
+
+		memset (&sa, 0, sizeof(sa));
+		sa.sa_handler = onTerm;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGTERM, &sa, NULL);
+
+		serve(sv[1]);
+
+		// The objects of the master aren't ours to destroy
+		fflush(NULL);
+		_exit(0);
+	}
+
+	if (sv[1] >= 0)
+		::close(sv[1]);
+
+	workers[i].pid = pid;
+	workers[i].chan = sv[0];
+	workers[i].idle = true;
+	counters.spawned++;
+}
+
+void PreforkPool::serve (int chan) throw()  {
+	u_int32_t served = 0;
+	char ready = 0;
+	int fd;
+
+	while (!quit && (!maxRequests || served < maxRequests))  {
+		if ((fd = (mode == handoff) ? recvFd(chan) : ::accept(server->getDescriptor(), NULL, NULL)) < 0)  {
+			// SIGTERM is checked by the loop, an aborted connection is just skipped
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			return;
+		}
+
+		{
+			Socket client(fd);
+			handler(client);
+		}
+
+		served++;
+
+		// Tell the master we're idle again, unless we're done
+		if (mode == handoff && (!maxRequests || served < maxRequests) && send(chan, &ready, 1, MSG_NOSIGNAL) < 0)
+			return;
+	}
+}
+
+void PreforkPool::reap() throw()  {
+	struct signalfd_siginfo si;
+	int st;
+
+	// More SIGCHLDs may be merged into one: the workers are checked one by one anyway
+	while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+
+	for (u_int32_t i=0; i < workers.size(); i++)  {
+		Worker& w = workers[i];
+
+		if (w.pid <= 0 || waitpid(w.pid, &st, WNOHANG) != w.pid)
+			continue;
+
+		if (WIFEXITED(st) && !WEXITSTATUS(st))
+			counters.recycled++;
+		else
+			counters.lost++;
+
+		if (w.chan >= 0)
+			::close(w.chan);
+
+		w.pid = 0;
+		w.chan = -1;
+		w.idle = false;
+
+		if (!stopping)
+			spawn(i);
+	}
+}
+
+void PreforkPool::dispatch() throw()  {
+	u_int32_t i = 0;
+	int fd;
+
+	while (1)  {
+		for (; i < workers.size() && !(workers[i].idle && workers[i].chan >= 0); i++);
+
+		if (i == workers.size())
+			return;
+
+		if ((fd = ::accept(server->getDescriptor(), NULL, NULL)) < 0)  {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// EAGAIN: no more pending connections
+			return;
+		}
+
+		// A worker that died in the meantime is skipped, it will be reaped and replaced
+		for (; i < workers.size(); i++)  {
+			Worker& w = workers[i];
+
+			if (!w.idle || w.chan < 0)
+				continue;
+
+			if (sendFd(w.chan, fd))  {
+				w.idle = false;
+				counters.handoffs++;
+				break;
+			}
+
+			::close(w.chan);
+			w.chan = -1;
+			w.idle = false;
+		}
+
+		::close(fd);
+	}
+}
+
+int PreforkPool::step (int timeout) throw()  {
+	struct pollfd p;
+	bool idle = false;
+	int n;
+
+	if (!running)
+		start();
+
+	pfds.clear();
+	pslot.clear();
+	p.events = POLLIN;
+	p.revents = 0;
+
+	p.fd = wakefd;
+	pfds.push_back(p);
+	p.fd = sigfd;
+	pfds.push_back(p);
+
+	if (mode == handoff)  {
+		for (u_int32_t i=0; i < workers.size(); i++)  {
+			if (workers[i].chan < 0)
+				continue;
+
+			if (workers[i].idle)  {
+				idle = true;
+				continue;
+			}
+
+			p.fd = workers[i].chan;
+			pfds.push_back(p);
+			pslot.push_back(i);
+		}
+
+		// With no idle worker, the connections wait in the backlog
+		if (idle)  {
+			p.fd = server->getDescriptor();
+			pfds.push_back(p);
+		}
+	}
+
+	if ((n = poll(&pfds[0], pfds.size(), timeout)) < 0)  {
+		if (errno == EINTR)
+			return 0;
+
+		throw SocketException("poll error");
+	}
+
+	if (pfds[0].revents)  {
+		eventfd_t val;
+		eventfd_read(wakefd, &val);
+	}
+
+	// The channels go first: a worker respawned by reap() may get the descriptor number of an old one
+	for (u_int32_t i=0; i < pslot.size(); i++)  {
+		Worker& w = workers[pslot[i]];
+		char buf[16];
+		ssize_t r;
+
+		if (!pfds[i+2].revents)
+			continue;
+
+		if ((r = recv(w.chan, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			w.idle = true;
+		else if (r == 0 || errno != EAGAIN)  {
+			// The worker is exiting: SIGCHLD will follow
+			::close(w.chan);
+			w.chan = -1;
+		}
+	}
+
+	if (pfds[1].revents)
+		reap();
+
+	if (idle && pfds.back().revents)
+		dispatch();
+
+	return n;
+}
+
+void PreforkPool::run() throw()  {
+	if (!running)
+		start();
+
+	while (!stopping)
+		step(-1);
+
+	terminate();
+
+	// The pool can be started again: a stop() which came before run() has been honoured by now
+	stopping = 0;
+}
+
+void PreforkPool::stop() throw()  {
+	stopping = 1;
+	eventfd_write(wakefd, 1);
+}
+
+void PreforkPool::terminate() throw()  {
+	struct timespec now, dl;
+	struct pollfd p;
+	struct signalfd_siginfo si;
+	u_int32_t alive;
+	int st;
+
+	stopping = 1;
+
+	// A worker blocked on its channel returns as soon as it's closed, the others get SIGTERM
+	for (u_int32_t i=0; i < workers.size(); i++)  {
+		if (workers[i].chan >= 0)  {
+			::close(workers[i].chan);
+			workers[i].chan = -1;
+		}
+
+		if (workers[i].pid > 0)
+			kill(workers[i].pid, SIGTERM);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &dl);
+	dl.tv_sec += (time_t) PREFORK_GRACE;
+
+	while (1)  {
+		alive = 0;
+
+		for (u_int32_t i=0; i < workers.size(); i++)  {
+			if (workers[i].pid <= 0)
+				continue;
+
+			if (waitpid(workers[i].pid, &st, WNOHANG) == workers[i].pid)
+				workers[i].pid = 0;
+			else
+				alive++;
+		}
+
+		if (!alive)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		// Out of grace: whoever is still serving a connection is killed
+		if (now.tv_sec > dl.tv_sec || (now.tv_sec == dl.tv_sec && now.tv_nsec >= dl.tv_nsec))  {
+			for (u_int32_t i=0; i < workers.size(); i++)  {
+				if (workers[i].pid > 0)  {
+					kill(workers[i].pid, SIGKILL);
+					waitpid(workers[i].pid, &st, 0);
+					workers[i].pid = 0;
+				}
+			}
+
+			break;
+		}
+
+		p.fd = sigfd;
+		p.events = POLLIN;
+
+		if (poll(&p, 1, 100) > 0)
+			while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+	}
+
+	for (u_int32_t i=0; i < workers.size(); i++)
+		workers[i].idle = false;
+
+	if (mode == handoff && lflags >= 0)
+		fcntl(server->getDescriptor(), F_SETFL, lflags);
+
+	::close(sigfd);
+	sigfd = -1;
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	running = false;
+}
+
+u_int32_t PreforkPool::size() throw()  {
+	u_int32_t n = 0;
+
+	for (u_int32_t i=0; i < workers.size(); i++)
+		if (workers[i].pid > 0)
+			n++;
+
+	return n;
+}
+
+u_int32_t PreforkPool::busy() throw()  {
+	u_int32_t n = 0;
+
+	if (mode != handoff)
+		return 0;
+
+	for (u_int32_t i=0; i < workers.size(); i++)
+		if (workers[i].pid > 0 && !workers[i].idle)
+			n++;
+
+	return n;
+}
+
+PreforkStats PreforkPool::stats() throw()  { return counters; }
+
@@ -0,0 +1,299 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_packet.h"
+#include "usock_parser.h"
+#include "usock_probe.h"
+
+using std::string;
+using namespace usock;
+
+#define	PROBE_RCVBUF	(4 << 20)
+
+namespace  {
+	double elapsed (const struct timespec& from, const struct timespec& to)  {
+		return (double) (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+	}
+}
+
+ProbeEngine::ProbeEngine (ProbeHandler& h, double rate, double timeout, const string& src, const string& iface, u_int32_t burst) throw()
+	: s(iface), handler(h), limiter(rate, burst)  {
+	Xorshift rng;
+
+	if (timeout <= 0.0)
+		throw SocketException("invalid probe timeout");
+
+	this->timeout = timeout;
+	active = 0;
+	tuned = false;
+	seq = 0;
+	id = (u_int16_t) rng.next();
+
+	table.resize(PROBE_TABLE_SIZE);
+	buf.resize(IP_MAXPACKET);
+
+	for (size_t i=0; i < table.size(); i++)
+		table[i].used = false;
+
+	// A single echo request, whose destination, TTL and sequence number are patched for each probe
+	s.buildIPv4("127.0.0.1", (src.empty()) ? s.getIPv4addr() : src, RawSocket::icmp);
+	s.buildICMPv4(ICMP_ECHO, htons(id), 0);
+	t = PacketTemplate(s);
+}
+
+void ProbeEngine::ping (in_addr_t dst, u_int32_t tag, u_int8_t ttl) throw()  {
+	Probe p;
+
+	p.dst = dst;
+	p.ttl = ttl;
+	p.tag = tag;
+	p.seq = 0;
+	p.used = false;
+	todo.push_back(p);
+}
+
+void ProbeEngine::ping (const string& host, u_int32_t tag, u_int8_t ttl) throw()  {
+	// An unresolved name must throw: inet_addr("") would be INADDR_NONE, the broadcast address
+	Endpoint ep(host, 0, AF_INET);
+	ping(((const struct sockaddr_in*) ep.addr())->sin_addr.s_addr, tag, ttl);
+}
+
+void ProbeEngine::trace (in_addr_t dst, u_int8_t maxHops, u_int32_t tag) throw()  {
+	for (u_int32_t ttl=1; ttl <= maxHops; ttl++)
+		ping(dst, tag, ttl);
+}
+
+void ProbeEngine::trace (const string& host, u_int8_t maxHops, u_int32_t tag) throw()  {
+	Endpoint ep(host, 0, AF_INET);
+	trace(((const struct sockaddr_in*) ep.addr())->sin_addr.s_addr, maxHops, tag);
+}
+
+void ProbeEngine::send (const struct timespec& now) throw()  {
+	limiter.refill(now);
+
+	while (!todo.empty())  {
+		Probe& slot = table[seq & (PROBE_TABLE_SIZE - 1)];
+
+		// The table is full at this sequence number: wait for the old probe to be answered or to expire
+		if (slot.used || !limiter.take())
+			break;
+
+		slot = todo.front();
+		todo.pop_front();
+
+		slot.seq = seq++;
+		slot.used = true;
+		slot.sent = now;
+
+		t.setDst(slot.dst);
+		t.setTTL(slot.ttl);
+		t.setICMPSeq(slot.seq);
+		s.queue(t);
+
+		inflight.push_back(slot.seq);
+		active++;
+	}
+
+	s.flush();
+
+	// The descriptor is opened by the first flush: make room for the answers of a whole sweep
+	if (!tuned && s.getDescriptor() >= 0)  {
+		int size = PROBE_RCVBUF;
+
+		if (setsockopt(s.getDescriptor(), SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+			setsockopt(s.getDescriptor(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+		tuned = true;
+	}
+}
+
+void ProbeEngine::match (const u_int8_t* pkt, u_int32_t len, const struct timespec& now) throw()  {
+	PacketParser outer, inner;
+	const ICMPView *echo;
+	in_addr_t dst;
+
+	if (!outer.parse(pkt, len) || !outer.ipv4().valid() || outer.protocol() != IPPROTO_ICMP || !outer.icmp().valid())
+		return;
+
+	const ICMPView& icmp = outer.icmp();
+
+	if (icmp.type() == ICMP_ECHOREPLY)  {
+		echo = &icmp;
+		dst = outer.ipv4().src();
+	} else if (icmp.type() == ICMP_TIME_EXCEEDED || icmp.type() == ICMP_DEST_UNREACH)  {
+		// The error quotes the IP header of the probe and the first 8 bytes after it
+		if (!inner.parse(icmp.payload(), icmp.payloadLength()) || !inner.ipv4().valid() ||
+				inner.protocol() != IPPROTO_ICMP || !inner.icmp().valid() || inner.icmp().type() != ICMP_ECHO)
+			return;
+
+		echo = &inner.icmp();
+		dst = inner.ipv4().dst();
+	} else
+		return;
+
+	u_int16_t eid = echo->id();
+	u_int16_t eseq = echo->seq();
+	Probe& p = table[eseq & (PROBE_TABLE_SIZE - 1)];
+
+	if (eid != id || !p.used || p.seq != eseq || p.dst != dst)
+		return;
+
+	ProbeResult r;
+	r.dst = p.dst;
+	r.from = outer.ipv4().src();
+	r.ttl = p.ttl;
+	r.icmpType = icmp.type();
+	r.icmpCode = icmp.code();
+	r.rtt = elapsed(p.sent, now);
+	r.tag = p.tag;
+
+	// Its entry in inflight is dropped by expire(), when it gets to the front
+	p.used = false;
+	active--;
+	handler.onReply(r);
+}
+
+void ProbeEngine::receive (const struct timespec& now) throw()  {
+	int sd = s.getDescriptor();
+	ssize_t n;
+
+	if (sd < 0)
+		return;
+
+	while ((n = ::recv(sd, &buf[0], buf.size(), MSG_DONTWAIT)) > 0)
+		match(&buf[0], n, now);
+
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		throw SocketException("recv exception");
+}
+
+void ProbeEngine::expire (const struct timespec& now) throw()  {
+	while (!inflight.empty())  {
+		Probe& p = table[inflight.front() & (PROBE_TABLE_SIZE - 1)];
+
+		if (p.used && p.seq == inflight.front())  {
+			if (elapsed(p.sent, now) < timeout)
+				break;
+
+			ProbeResult r;
+			r.dst = p.dst;
+			r.from = 0;
+			r.ttl = p.ttl;
+			r.icmpType = 0;
+			r.icmpCode = 0;
+			r.rtt = elapsed(p.sent, now);
+			r.tag = p.tag;
+
+			p.used = false;
+			active--;
+			inflight.pop_front();
+			handler.onTimeout(r);
+			continue;
+		}
+
+		inflight.pop_front();
+	}
+}
+
+u_int32_t ProbeEngine::step (double maxWait) throw()  {
+	struct timespec now;
+	struct pollfd pfd;
+	double wait = maxWait;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	send(now);
+
+	if (!pending() && maxWait < 0.0)
+		return 0;
+
+	// Wake up for the next token, or for the next probe to expire
+	if (!todo.empty() && !table[seq & (PROBE_TABLE_SIZE - 1)].used)  {
+		double next = limiter.wait();
+
+		if (wait < 0.0 || next < wait)
+			wait = next;
+	}
+
+	if (!inflight.empty())  {
+		double next = timeout - elapsed(table[inflight.front() & (PROBE_TABLE_SIZE - 1)].sent, now);
+
+		if (wait < 0.0 || next < wait)
+			wait = next;
+	}
+
+	pfd.fd = s.getDescriptor();
+	pfd.events = POLLIN;
+
+	ret = poll(&pfd, (pfd.fd >= 0) ? 1 : 0, (wait < 0.0) ? -1 : (int) ceil(((wait > 0.0) ? wait : 0.0) * 1000.0));
+
+	if (ret < 0 && errno != EINTR)
+		throw SocketException("poll exception");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	receive(now);
+	expire(now);
+	return pending();
+}
+
+void ProbeEngine::run() throw()  {
+	while (step() > 0);
+}
+
+u_int32_t ProbeEngine::pending() throw()  {
+	return todo.size() + active;
+}
+
+int ProbeEngine::getDescriptor() throw()  { return s.getDescriptor(); }
@@ -1,6 +1,8 @@
 #ifndef USOCK_RAII_HH
 #define USOCK_RAII_HH
 
+#include <unistd.h>
+
 
 namespace usock
 {
@@ -19,5 +21,19 @@ namespace usock
         T* m_array;
     };
 
+    struct raii_fd
+    {
+        raii_fd(int fd) :
+            m_fd(fd)
+        {  }
+        ~raii_fd() {
+            if (m_fd >= 0)
+                ::close(m_fd);
+        }
+
+    private:
+        int m_fd;
+    };
+
 }
 #endif // USOCK_RAII_HH
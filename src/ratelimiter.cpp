@@ -0,0 +1,79 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_probe.h"
+
+using namespace usock;
+
+RateLimiter::RateLimiter (double rate, double burst) throw()  {
+	if (rate <= 0.0)
+		throw SocketException("invalid rate");
+
+	this->rate = rate;
+	this->burst = (burst >= 1.0) ? burst : 1.0;
+	tokens = this->burst;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+void RateLimiter::refill (const struct timespec& now) throw()  {
+	tokens += ((double) (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9) * rate;
+	last = now;
+
+	if (tokens > burst)
+		tokens = burst;
+}
+
+bool RateLimiter::take() throw()  {
+	if (tokens < 1.0)
+		return false;
+
+	tokens -= 1.0;
+	return true;
+}
+
+double RateLimiter::wait() throw()  {
+	return (tokens >= 1.0) ? 0.0 : (1.0 - tokens) / rate;
+}
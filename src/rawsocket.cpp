@@ -43,11 +43,15 @@
  */
 
 #include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <net/ethernet.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <ifaddrs.h>
 
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
@@ -57,6 +61,8 @@
 
 #include "usock.h"
 #include "usock_exception.h"
+#include "usock_checksum.h"
+#include "usock_packet.h"
 
 #include "raii.hh"
 
@@ -79,6 +85,14 @@ struct pseudohdr  {
 	u_int16_t len;
 };
 
+struct pseudohdr6  {
+	struct in6_addr src;
+	struct in6_addr dst;
+	u_int32_t len;
+	u_int8_t  zero[3];
+	u_int8_t  next;
+};
+
 RawSocket::RawSocket (string i) throw()  {	
 	if (!(i.empty()))
 		iface = i;
@@ -115,17 +129,75 @@ RawSocket::RawSocket (string i) throw()  {
 	}
 
 	is_IPv4 = false;
+	is_IPv6 = false;
 	is_TCP  = false;
 	is_UDP  = false;
 	is_ICMPv4 = false;
+	is_ICMPv6 = false;
 
 	head_len=0;
-	payload_len=0;
-	payload = 0;
+	raw_proto = -1;
+	filterFrom = any;
+	domain = inet;
+	type = sock_raw;
+	protocol = raw;
 }
 
-RawSocket::~RawSocket() {
-	delete [] payload;
+void RawSocket::openRaw (int proto, int family) throw()  {
+	int opt = 1;
+
+	// IPPROTO_RAW is the only IPv6 raw socket taking the whole packet
+	if (family == inet6)
+		proto = raw;
+
+	if (sd >= 0 && proto == raw_proto && family == domain)
+		return;
+
+	close();
+
+	if ((sd = socket(family, sock_raw, proto)) < 0)
+		throw SocketException("socket error");
+
+	raw_proto = proto;
+	protocol = proto;
+	domain = family;
+
+	if (family == inet && ::setsockopt(sd, IPPROTO_IP, IP_HDRINCL, &opt, sizeof(opt)) < 0)
+		throw SocketException("setsockopt error");
+
+	if (timeout > 0.0)
+		setBlocking(false);
+
+	if (family == inet && (!filter.empty() || filterFrom != any))
+		applyFilter();
+}
+
+void RawSocket::openFor (const u_int8_t* pkt) throw()  {
+	if ((pkt[0] >> 4) == 6)
+		openRaw(raw, inet6);
+	else
+		openRaw(pkt[9], inet);
+}
+
+void RawSocket::applyFilter() throw()  {
+	if (filter.empty() && filterFrom == any)  {
+		PacketFilter::detach(sd);
+		return;
+	}
+
+	PacketFilter f = filter;
+
+	if (filterFrom != any)
+		f.srcHost(filterFrom);
+
+	f.attach(sd);
+}
+
+void RawSocket::setFilter (const PacketFilter& f) throw()  {
+	filter = f;
+
+	if (sd >= 0 && domain == inet)
+		applyFilter();
 }
 
 string RawSocket::getIPv4addr() throw()  {
@@ -148,6 +220,37 @@ string RawSocket::getIPv4addr() throw()  {
 	return string(inet_ntoa(sin->sin_addr));
 }
 
+string RawSocket::getIPv6addr() throw()  {
+	struct ifaddrs *ifa, *i;
+	char addr[INET6_ADDRSTRLEN] = { 0 };
+
+	if (getifaddrs(&ifa) < 0)
+		throw SocketException("getifaddrs error");
+
+	for (i = ifa; i; i = i->ifa_next)  {
+		if (!i->ifa_addr || i->ifa_addr->sa_family != inet6 || iface != i->ifa_name)
+			continue;
+
+		const struct in6_addr *a = &((struct sockaddr_in6*) i->ifa_addr)->sin6_addr;
+
+		// Take a link-local address only if nothing better comes
+		if (IN6_IS_ADDR_LINKLOCAL(a) && addr[0])
+			continue;
+
+		inet_ntop(inet6, a, addr, sizeof(addr));
+
+		if (!IN6_IS_ADDR_LINKLOCAL(a))
+			break;
+	}
+
+	freeifaddrs(ifa);
+
+	if (!addr[0])
+		throw SocketException ("could not fetch a valid IPv6 address for the specified network interface");
+
+	return string(addr);
+}
+
 string RawSocket::getHWaddr() throw()  {
 	int raw;
 	
@@ -183,6 +286,7 @@ void RawSocket::buildIPv4 (string dst, string src, u_int8_t proto, u_int8_t ttl,
 
 	struct iphdr ip;
 	is_IPv4 = true;
+	is_IPv6 = is_TCP = is_UDP = is_ICMPv4 = is_ICMPv6 = false;
 
 	if (src.empty())
 		src = getIPv4addr();
@@ -199,8 +303,32 @@ void RawSocket::buildIPv4 (string dst, string src, u_int8_t proto, u_int8_t ttl,
 	ip.saddr = inet_addr(src.c_str());
 	ip.daddr = inet_addr(dst.c_str());
 
+	// A new IP header starts a new packet, the transport header will follow it
 	memcpy (head, &ip, sizeof(struct iphdr));
-	head_len += sizeof(struct iphdr);
+	head_len = sizeof(struct iphdr);
+}
+
+void RawSocket::buildIPv6 (string dst, string src, u_int8_t next, u_int8_t hops, u_int16_t plen,
+		u_int8_t tclass, u_int32_t flow)  {
+
+	struct ip6_hdr ip6;
+	is_IPv6 = true;
+	is_IPv4 = is_TCP = is_UDP = is_ICMPv4 = is_ICMPv6 = false;
+
+	if (src.empty())
+		src = getIPv6addr();
+
+	if (inet_pton(inet6, dst.c_str(), &ip6.ip6_dst) != 1 || inet_pton(inet6, src.c_str(), &ip6.ip6_src) != 1)
+		throw SocketException("invalid IPv6 address");
+
+	// Version (4 bits), traffic class (8 bits), flow label (20 bits)
+	ip6.ip6_flow = htonl((6 << 28) | (tclass << 20) | (flow & 0xfffff));
+	ip6.ip6_plen = htons(plen);
+	ip6.ip6_nxt = next;
+	ip6.ip6_hlim = hops;
+
+	memcpy (head, &ip6, sizeof(struct ip6_hdr));
+	head_len = sizeof(struct ip6_hdr);
 }
 
 void RawSocket::buildICMPv4 (u_int8_t type, u_int16_t id, u_int16_t seq, u_int8_t code, u_int16_t sum)  {
@@ -210,11 +338,32 @@ void RawSocket::buildICMPv4 (u_int8_t type, u_int16_t id, u_int16_t seq, u_int8_
 	icmp.type = type;
 	icmp.code = code;
 	icmp.checksum = sum;
-	icmp.id = 1;
+	icmp.id = id;
 	icmp.sequence = seq;
 
 	memcpy (head + ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)), &icmp, sizeof(struct icmp_hdr));
-	head_len += sizeof(struct icmp_hdr);
+	head_len = ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)) + sizeof(struct icmp_hdr);
+}
+
+void RawSocket::buildICMPv6 (u_int8_t type, u_int16_t id, u_int16_t seq, u_int8_t code, u_int16_t sum)  {
+	struct icmp_hdr icmp;
+
+	// It goes right after an IPv6 header, and its checksum needs the IPv6 pseudo-header
+	if (!is_IPv6)  {
+		errno = EINVAL;
+		throw SocketException("an ICMPv6 header needs an IPv6 header before it");
+	}
+
+	is_ICMPv6 = true;
+
+	icmp.type = type;
+	icmp.code = code;
+	icmp.checksum = sum;
+	icmp.id = id;
+	icmp.sequence = seq;
+
+	memcpy (head + sizeof(struct ip6_hdr), &icmp, sizeof(struct icmp_hdr));
+	head_len = sizeof(struct ip6_hdr) + sizeof(struct icmp_hdr);
 }
 
 void RawSocket::buildUDP (u_int16_t sport, u_int16_t dport, u_int16_t len, u_int16_t sum)  {
@@ -227,7 +376,7 @@ void RawSocket::buildUDP (u_int16_t sport, u_int16_t dport, u_int16_t len, u_int
 	udp.check = sum;
 
 	memcpy (head + ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)), &udp, sizeof(struct udphdr));
-	head_len += sizeof(struct udphdr);
+	head_len = ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)) + sizeof(struct udphdr);
 }
 
 void RawSocket::buildTCP (u_int16_t sport, u_int16_t dport, u_int8_t flags, u_int32_t seq, u_int32_t ack,
@@ -240,11 +389,7 @@ void RawSocket::buildTCP (u_int16_t sport, u_int16_t dport, u_int8_t flags, u_in
 	tcp.source = htons(sport);
 	tcp.dest = htons(dport);
 
-	if (!seq)  {
-		srand(time(NULL));
-		tcp.seq = htonl(rand());
-	} else
-		tcp.seq = seq;
+	tcp.seq = (seq) ? seq : htonl(rng.next());
 
 	tcp.ack_seq = ack;
 	tcp.doff = 5;
@@ -261,16 +406,11 @@ void RawSocket::buildTCP (u_int16_t sport, u_int16_t dport, u_int8_t flags, u_in
 	tcp.urg_ptr = urgent;
 
 	memcpy (head + ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)), &tcp, sizeof(struct tcphdr));
-	head_len += sizeof(struct tcphdr);
+	head_len = ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)) + sizeof(struct tcphdr);
 }
 
 void RawSocket::setPayload (const void *payload, int length)  {
-	if(length > payload_len) {
-		delete [] this->payload;
-		this->payload = new u_int8_t[length];
-	}
-	payload_len = length;
-	memcpy (this->payload, payload, length);
+	this->payload.assign((const u_int8_t*) payload, (const u_int8_t*) payload + length);
 }
 
 void RawSocket::setPayload (string payload)  {
@@ -278,260 +418,389 @@ void RawSocket::setPayload (string payload)  {
 }
 
 u_int16_t RawSocket::csum (u_int16_t *buf, int nwords)  {
-	u_int32_t sum;
+	return usock::csum(buf, nwords << 1);
+}
 
-	for (sum = 0; nwords > 0; nwords--)
-		sum += *buf++;
+// Sum of the TCP/UDP pseudo-header
+static u_int32_t pseudoSum (const struct iphdr *ip, u_int32_t l4len)  {
+	struct pseudohdr pseudo;
 
-	sum = (sum >> 16) + (sum & 0xffff);
-	sum += (sum >> 16);
-	return ~sum;
+	pseudo.src = ip->saddr;
+	pseudo.dst = ip->daddr;
+	pseudo.padd = 0;
+	pseudo.proto = ip->protocol;
+	pseudo.len = htons(l4len);
+	return csumPartial((const u_int8_t*) &pseudo, sizeof(pseudo), 0);
 }
 
-void RawSocket::write() throw()  {
-	u_int32_t len = head_len + payload_len;
-	u_int8_t *pkt = new u_int8_t[len];
-	raii_array<u_int8_t> pkt_holder(pkt);
-	u_int32_t opt = 1;
-	
-	struct iphdr ip;
-	struct tcphdr tcp;
-	struct udphdr udp;
-	struct icmp_hdr icmp;
+// Sum of the IPv6 pseudo-header, for TCP, UDP and ICMPv6
+static u_int32_t pseudoSum6 (const struct ip6_hdr *ip6, u_int8_t next, u_int32_t l4len)  {
+	struct pseudohdr6 pseudo;
+
+	pseudo.src = ip6->ip6_src;
+	pseudo.dst = ip6->ip6_dst;
+	pseudo.len = htonl(l4len);
+	pseudo.zero[0] = pseudo.zero[1] = pseudo.zero[2] = 0;
+	pseudo.next = next;
+	return csumPartial((const u_int8_t*) &pseudo, sizeof(pseudo), 0);
+}
+
+// Destination of an assembled packet, taken from its IPv4 or IPv6 header
+static void destination (const u_int8_t *p, struct sockaddr_storage& to)  {
+	memset (&to, 0, sizeof(to));
 
-	memcpy (pkt, head, head_len);
+	if ((p[0] >> 4) == 6)  {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &to;
 
-	if (payload_len > 0)
-		memcpy (pkt+head_len, payload, payload_len);
+		// The port must stay 0: on an IPv6 raw socket it would select the protocol
+		sin6->sin6_family = AF_INET6;
+		memcpy (&sin6->sin6_addr, &((const struct ip6_hdr*) p)->ip6_dst, sizeof(struct in6_addr));
+		return;
+	}
 
-	if (is_IPv4)  {
-		memcpy (&ip, head, sizeof(struct iphdr));
+	struct sockaddr_in *sin = (struct sockaddr_in*) &to;
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = ((const struct iphdr*) p)->daddr;
+}
 
-		if (!ip.tot_len)
-			ip.tot_len = head_len + payload_len;
+static socklen_t addrlen (const struct sockaddr_storage& to)  {
+	return (to.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
 
-		if (!ip.check)  {
-			u_int8_t *buf = new u_int8_t[sizeof(struct iphdr) + payload_len];
-			memcpy (buf, &ip, sizeof(struct iphdr));
-			memcpy (buf+sizeof(struct iphdr), payload, payload_len);
+u_int32_t RawSocket::assemble (struct sockaddr_storage& to) throw()  {
+	u_int32_t len = head_len + payload.size();
+	u_int32_t l3len = (is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr);
+	u_int32_t l4len = len - l3len;
 
-			ip.check = csum((u_int16_t*) buf, ip.tot_len >> 1);
-			memcpy (pkt, &ip, sizeof(struct iphdr));
-			delete [] buf;
-		}
-	}
+	if (!is_IPv4 && !is_IPv6)
+		return 0;
 
+	if (pkt.size() < len)
+		pkt.resize(len);
+
+	u_int8_t *p = &pkt[0];
+	u_int8_t *l4 = p + l3len;
+	struct iphdr *ip = (struct iphdr*) p;
+	struct ip6_hdr *ip6 = (struct ip6_hdr*) p;
+
+	memcpy (p, head, head_len);
+
+	if (!payload.empty())
+		memcpy (p + head_len, &payload[0], payload.size());
+
+	destination(p, to);
+
+	if (is_IPv4 && !ip->tot_len)
+		ip->tot_len = htons(len);
+
+	if (is_IPv6 && !ip6->ip6_plen)
+		ip6->ip6_plen = htons(l4len);
+
+	// The checksums are computed in place, on the final packet
 	if (is_ICMPv4)  {
-		memcpy (&icmp, head+sizeof(struct iphdr), sizeof(struct icmp_hdr));
+		struct icmp_hdr *icmp = (struct icmp_hdr*) l4;
 
-		if (!icmp.checksum)  {
-			int buflen = sizeof(struct icmp_hdr) + payload_len;
-			u_int8_t *buf = new u_int8_t[buflen];
-			memcpy (buf, &icmp, sizeof(struct icmp_hdr));
-			memcpy (buf+sizeof(struct icmp_hdr), payload, payload_len);
+		if (!icmp->checksum)
+			icmp->checksum = csumFold(csumPartial(l4, l4len, 0));
+	}
 
-			icmp.checksum = csum((u_int16_t*) buf, buflen >> 1);
-			memcpy (pkt+sizeof(struct iphdr), &icmp, sizeof(struct icmp_hdr));
-			delete [] buf;
-		}
+	// Unlike ICMPv4, ICMPv6 covers the pseudo-header too
+	if (is_ICMPv6)  {
+		struct icmp_hdr *icmp = (struct icmp_hdr*) l4;
+
+		if (!icmp->checksum)
+			icmp->checksum = csumFold(csumPartial(l4, l4len, pseudoSum6(ip6, IPPROTO_ICMPV6, l4len)));
 	}
 
 	if (is_UDP)  {
-		if (is_IPv4)
-			memcpy (&udp, head + sizeof(struct iphdr), sizeof(struct udphdr));
-		else
-			memcpy (&udp + sizeof(struct ip6_hdr), head, sizeof(struct udphdr));
-
-		if (!udp.len)
-			udp.len = htons(sizeof(struct udphdr) + payload_len);
-
-		if (!udp.check)  {
-			u_int32_t buflen = ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)) +
-				sizeof(struct udphdr) + payload_len;
-
-			u_int8_t *buf = new u_int8_t[buflen];
-			struct pseudohdr pseudo;
-
-			if (is_IPv4)  {
-				pseudo.src = ip.saddr;
-				pseudo.dst = ip.daddr;
-				pseudo.padd = (!(payload_len%2) || !payload_len) ? 0 : 1;
-				pseudo.proto = ip.protocol;
-				pseudo.len = htons(sizeof(struct udphdr) + payload_len);
-			}
+		struct udphdr *udp = (struct udphdr*) l4;
+		u_int32_t sum = (is_IPv4) ? pseudoSum(ip, l4len) : pseudoSum6(ip6, IPPROTO_UDP, l4len);
 
-			memcpy (buf, &pseudo, sizeof(struct pseudohdr));
-			memcpy (buf+sizeof(struct pseudohdr), &udp, sizeof(struct udphdr));
+		if (!udp->len)
+			udp->len = htons(l4len);
 
-			if (payload_len > 0)
-				memcpy (buf+sizeof(struct pseudohdr)+sizeof(struct udphdr), payload, payload_len);
+		// A computed UDP checksum of 0 is sent as 0xffff, 0 would mean "no checksum" (not even allowed on IPv6)
+		if (!udp->check && !(udp->check = csumFold(csumPartial(l4, l4len, sum))))
+			udp->check = 0xffff;
+	}
 
-			udp.check = csum((u_int16_t*) buf, buflen >> 1);
-			delete [] buf;
-		}
+	if (is_TCP)  {
+		struct tcphdr *tcp = (struct tcphdr*) l4;
+		u_int32_t sum = (is_IPv4) ? pseudoSum(ip, l4len) : pseudoSum6(ip6, IPPROTO_TCP, l4len);
 
-		if (is_IPv4)
-			memcpy (pkt+sizeof(struct iphdr), &udp, sizeof(struct udphdr));
-		else
-			memcpy (pkt+sizeof(struct ip6_hdr), &udp, sizeof(struct udphdr));
+		if (!tcp->check)
+			tcp->check = csumFold(csumPartial(l4, l4len, sum));
 	}
 
-	if (is_TCP)  {
-		if (is_IPv4)
-			memcpy (&tcp, head + sizeof(struct iphdr), sizeof(struct tcphdr));
-		else
-			memcpy (&tcp + sizeof(struct ip6_hdr), head, sizeof(struct tcphdr));
-
-		if (!tcp.check)  {
-			u_int32_t buflen = ((is_IPv4) ? sizeof(struct iphdr) : sizeof(struct ip6_hdr)) +
-				sizeof(struct tcphdr) + payload_len;
-
-			u_int8_t *buf = new u_int8_t[buflen];
-			struct pseudohdr pseudo;
-
-			if (is_IPv4)  {
-				pseudo.src = ip.saddr;
-				pseudo.dst = ip.daddr;
-				pseudo.padd = (!(payload_len%2) || !payload_len) ? 0 : 1;
-				pseudo.proto = ip.protocol;
-				pseudo.len = htons(sizeof(struct tcphdr) + payload_len);
-			}
+	// The IP checksum only covers the IP header, and IPv6 has none
+	if (is_IPv4 && !ip->check)
+		ip->check = csumFold(csumPartial(p, ip->ihl << 2, 0));
 
-			memcpy (buf, &pseudo, sizeof(struct pseudohdr));
-			memcpy (buf+sizeof(struct pseudohdr), &tcp, sizeof(struct tcphdr));
+	return len;
+}
 
-			if (payload_len > 0)
-				memcpy (buf+sizeof(struct pseudohdr)+sizeof(struct tcphdr), payload, payload_len);
+void RawSocket::write() throw()  {
+	struct sockaddr_storage to;
+	u_int32_t len = assemble(to);
 
-			tcp.check = csum((u_int16_t*) buf, buflen >> 1);
-			delete [] buf;
-		}
+	if (!len)
+		return;
+
+	openFor(&pkt[0]);
+	sendWait(&pkt[0], len, 0, (struct sockaddr*) &to, addrlen(to));
+}
+
+void RawSocket::write (const PacketTemplate& t) throw()  {
+	struct sockaddr_storage to;
+
+	if (t.length() < sizeof(struct iphdr))
+		throw SocketException("empty packet template");
+
+	destination(t.data(), to);
+	openFor(t.data());
+	sendWait(t.data(), t.length(), 0, (struct sockaddr*) &to, addrlen(to));
+}
+
+void RawSocket::enqueue (const u_int8_t* pkt, u_int32_t len, const struct sockaddr_storage& to) throw()  {
+	if (txoff.empty())
+		txoff.push_back(0);
+
+	txbuf.insert(txbuf.end(), pkt, pkt + len);
+	txoff.push_back(txbuf.size());
+	txdst.push_back(to);
+
+	if (txdst.size() >= RAW_BATCH_SIZE)
+		flush();
+}
+
+void RawSocket::queue() throw()  {
+	struct sockaddr_storage to;
+	u_int32_t len = assemble(to);
 
-		if (is_IPv4)
-			memcpy (pkt+sizeof(struct iphdr), &tcp, sizeof(struct tcphdr));
-		else
-			memcpy (pkt+sizeof(struct ip6_hdr), &tcp, sizeof(struct tcphdr));
+	if (len)
+		enqueue(&pkt[0], len, to);
+}
+
+void RawSocket::queue (const PacketTemplate& t) throw()  {
+	struct sockaddr_storage to;
+
+	if (t.length() < sizeof(struct iphdr))
+		throw SocketException("empty packet template");
+
+	destination(t.data(), to);
+	enqueue(t.data(), t.length(), to);
+}
+
+u_int32_t RawSocket::queued() throw()  { return txdst.size(); }
+
+void RawSocket::dequeue (u_int32_t n) throw()  {
+	if (n >= txdst.size())  {
+		txbuf.clear();
+		txoff.clear();
+		txdst.clear();
+		return;
 	}
-	
-	if (is_IPv4)  {
-		memcpy (&ip, head, sizeof(struct iphdr));
-		
-		if ((sd = socket(inet, sock_raw, ip.protocol)) < 0)
-			throw SocketException("socket error");
 
-		if (::setsockopt(sd, IPPROTO_IP, IP_HDRINCL, &opt, sizeof(opt)) < 0)
-			throw SocketException("setsockopt error");
+	u_int32_t base = txoff[n];
 
-		struct sockaddr_in sin;
-		sin.sin_family = inet;
+	txbuf.erase(txbuf.begin(), txbuf.begin() + base);
+	txoff.erase(txoff.begin(), txoff.begin() + n);
+	txdst.erase(txdst.begin(), txdst.begin() + n);
 
-		if (is_ICMPv4)
-			sin.sin_port = 0;
-		else  {
-			if (is_TCP)
-				sin.sin_port = tcp.dest;
-			else if (is_UDP)
-				sin.sin_port = udp.dest;
+	for (u_int32_t i=0; i < txoff.size(); i++)
+		txoff[i] -= base;
+}
+
+u_int32_t RawSocket::flush() throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	long backoff = RAW_BACKOFF_MIN;
+	u_int32_t total = 0;
+
+	while (!txdst.empty())  {
+		u_int32_t count = txdst.size(), sent = 0, end = 0;
+		int n, err = 0;
+
+		// The iovecs point into txbuf, which may have moved while growing or shrinking: they're only built now
+		txmsg.resize(count);
+		txiov.resize(count);
+		memset (&txmsg[0], 0, count * sizeof(struct mmsghdr));
+
+		for (u_int32_t i=0; i < count; i++)  {
+			txiov[i].iov_base = &txbuf[txoff[i]];
+			txiov[i].iov_len = txoff[i+1] - txoff[i];
+			txmsg[i].msg_hdr.msg_iov = &txiov[i];
+			txmsg[i].msg_hdr.msg_iovlen = 1;
+			txmsg[i].msg_hdr.msg_name = &txdst[i];
+			txmsg[i].msg_hdr.msg_namelen = addrlen(txdst[i]);
 		}
 
-		sin.sin_addr.s_addr = ip.daddr;
-
-		if (timeout == 0.0)  {
-			if (sendto(sd, pkt, len, 0, (struct sockaddr*) &sin, sizeof(struct sockaddr)) < 0)
-				throw SocketException("sendto error");
-		} else {
-			if (sendto(sd, pkt, len, 0, (struct sockaddr*) &sin, sizeof(struct sockaddr)) < 0)  {
-				if (errno == EINPROGRESS)  {
-					int ret;
-
-					do  {
-						struct timeval tv;
-						fd_set set;
-
-						tv.tv_sec = (int) timeout;
-						tv.tv_usec = (int) ((timeout*1000) - (double) (tv.tv_sec*1000));
-						FD_ZERO(&set);
-						FD_SET(sd, &set);
-
-						if ((ret = select(sd+1, NULL, &set, NULL, &tv)) < 0)  {
-							if (errno == EINTR)
-								throw SocketException("connection exception");
-						} else if (ret>0)
-							break;
-						else
-							throw SocketException("connection timeout");
-					} while(1);
-				} else
-					throw SocketException("connection exception");
+		while (sent < count)  {
+			// A run of packets of the same family goes through the same descriptor. With IP_HDRINCL
+			// the protocol of an IPv4 descriptor doesn't matter for sending
+			if (sent == end)  {
+				for (end = sent + 1; end < count && txdst[end].ss_family == txdst[sent].ss_family; end++);
+
+				if (sd < 0 || domain != txdst[sent].ss_family)
+					openFor(&txbuf[txoff[sent]]);
+			}
+
+			if ((n = sendmmsg(sd, &txmsg[sent], end - sent, 0)) >= 0)  {
+				sent += n;
+				backoff = RAW_BACKOFF_MIN;
+				continue;
 			}
+
+			if ((err = errno) == EINTR)
+				continue;
+
+			// sendmmsg() only fails on the first packet it's given: that one is dropped, the others stay queued
+			if (err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS)  {
+				dequeue(sent + 1);
+				errno = err;
+				throw SocketException("send exception");
+			}
+
+			break;
 		}
+
+		// What went out leaves the queue before waiting, so that a timeout leaves only the unsent packets there
+		dequeue(sent);
+		total += sent;
+
+		if (txdst.empty())
+			break;
+
+		if (!dl && timeout > 0.0)
+			dl = deadline(ts);
+
+		if (err == ENOBUFS)  {
+			// A full device queue doesn't make a raw socket unwritable, so poll() would return at once: back off
+			struct timespec pause = { 0, backoff };
+
+			nanosleep(&pause, NULL);
+			backoff = std::min(backoff * 2, (long) RAW_BACKOFF_MAX);
+
+			// It only throws once the deadline is over
+			if (dl)
+				waitFor(POLLOUT, dl);
+		} else
+			waitFor(POLLOUT, dl);
 	}
+
+	return total;
 }
 
-void* RawSocket::read (u_int32_t len, const string& host) throw()  {
-	u_int8_t *buf = NULL;
-
-	if (len)
-		buf = new u_int8_t[len];
+string RawSocket::getInterface() throw()  { return iface; }
 
+ssize_t RawSocket::receive (void* buf, u_int32_t size, const string& host) throw()  {
 	struct sockaddr_in sin;
-	int opt = 1;
-	socklen_t slen = sizeof(struct sockaddr_in);
+	struct timespec ts;
+	const struct timespec *dl;
+	socklen_t slen;
+	in_addr_t from = any;
+	int proto = is_IPv4 ? ((struct iphdr*) head)->protocol : raw_proto;
+	ssize_t n;
+
+	if (proto < 0 || is_IPv6 || (!is_IPv4 && domain != inet))
+		return -1;
+
+	openRaw(proto);
+
+	// An unresolved name must throw: inet_addr("") would be INADDR_NONE, and the filter would wait for
+	// packets from the broadcast address until the timeout
+	if (!host.empty())  {
+		Endpoint ep(host, 0, AF_INET);
+		from = ((const struct sockaddr_in*) ep.addr())->sin_addr.s_addr;
+	}
 
-	if (is_IPv4)  {
-		struct iphdr ip;
-		memcpy (&ip, head, sizeof(struct iphdr));
+	if (from != filterFrom)  {
+		filterFrom = from;
+		applyFilter();
+	}
 
-		if (!buf)  {
-			len = ip.tot_len;
-			buf = new u_int8_t[len];
-		}
+	// Packets queued before the filter was attached still have to be skipped here, all
+	// within the same deadline, or each one of them would restart the timeout
+	dl = deadline(ts);
 
-		if ((sd = socket(inet, sock_raw, ip.protocol)) < 0)
-			throw SocketException("socket error");
-	
-		if (::setsockopt(sd, IPPROTO_IP, IP_HDRINCL, &opt, sizeof(opt)) < 0)
-			throw SocketException("setsockopt error");
-
-		sin.sin_family = inet;
-		sin.sin_port = 0;
-
-		if (host.empty())
-			sin.sin_addr.s_addr = any;
-		else
-			sin.sin_addr.s_addr = inet_addr(getHostByName(host.c_str()).c_str());
-
-		if (timeout == 0.0)  {
-			if (recvfrom(sd, buf, len, 0, (struct sockaddr*) &sin, &slen) < 0)
-				throw SocketException("recvfrom error");
-		} else {
-			if (recvfrom(sd, buf, len, 0, (struct sockaddr*) &sin, &slen) < 0)  {
-				if (errno == EINPROGRESS)  {
-					int ret;
-
-					do  {
-						struct timeval tv;
-						fd_set set;
-
-						tv.tv_sec = (int) timeout;
-						tv.tv_usec = (int) ((timeout*1000) - (double) (tv.tv_sec*1000));
-						FD_ZERO(&set);
-						FD_SET(sd, &set);
-
-						if ((ret = select(sd+1, NULL, &set, NULL, &tv)) < 0)  {
-							if (errno == EINTR)
-								throw SocketException("connection exception");
-						} else if (ret>0)
-							break;
-						else
-							throw SocketException("connection timeout");
-					} while(1);
-				} else
-					throw SocketException("connection exception");
-			}
-		}
+	while (1)  {
+		slen = sizeof(sin);
+		n = recvWait(buf, size, 0, (struct sockaddr*) &sin, &slen, dl);
+
+		if (from == any || sin.sin_addr.s_addr == from)
+			break;
+
+		// Throws once the deadline is over, even if other packets keep coming
+		if (dl)
+			waitFor(POLLIN, dl);
 	}
 
-	return (void*) buf;
+	return n;
+}
+
+void* RawSocket::read (u_int32_t len, const string& host) throw()  {
+	u_int32_t want = (len) ? len : IP_MAXPACKET;
+	ssize_t n;
+
+	// The buffer never shrinks, so that asking for a smaller len doesn't cost a reallocation later
+	if (rxbuf.size() < want)
+		rxbuf.resize(want);
+
+	if ((n = receive(&rxbuf[0], want, host)) < 0)
+		return NULL;
+
+	// With an explicit len, the bytes after a shorter packet are zeroed, so that nothing of an older packet
+	// is left within len. With len = 0 they're not: the IP header of the packet tells where it ends
+	if (len && (u_int32_t) n < len)
+		memset (&rxbuf[n], 0, len - n);
+
+	return (void*) &rxbuf[0];
+}
+
+Buffer RawSocket::readBuffer (u_int32_t len, const string& host) throw()  {
+	Buffer b = BufferPool::getDefault().get(len ? len : IP_MAXPACKET);
+	ssize_t n = receive(b.data(), b.size(), host);
+
+	if (n < 0)
+		return Buffer();
+
+	b.resize(n);
+	return b;
 }
 
+
+Xorshift::Xorshift() throw()  {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s[0] = (u_int32_t) ts.tv_nsec;
+	s[1] = (u_int32_t) ts.tv_sec;
+	s[2] = (u_int32_t) getpid();
+	s[3] = (u_int32_t) (size_t) this;
+
+	// Nothing random in the seed bits yet: stir them a bit
+	for (int i=0; i < 16; i++)
+		next();
+}
+
+void Xorshift::seed (u_int32_t value) throw()  {
+	s[0] = value;
+	s[1] = value ^ 0x9e3779b9;
+	s[2] = value ^ 0x7f4a7c15;
+	s[3] = 0x6c078965;
+
+	for (int i=0; i < 16; i++)
+		next();
+}
+
+u_int32_t Xorshift::next() throw()  {
+	u_int32_t t = s[3];
+
+	t ^= t << 11;
+	t ^= t >> 8;
+	s[3] = s[2];
+	s[2] = s[1];
+	s[1] = s[0];
+	s[0] = t ^ s[0] ^ (s[0] >> 19);
+	return s[0];
+}
@@ -0,0 +1,327 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "usock.h"
+#include "usock_async.h"
+#include "usock_exception.h"
+
+using namespace usock;
+
+static thread_local Reactor *currentReactor = NULL;
+
+static bool before (const struct timespec& a, const struct timespec& b)  {
+	return (a.tv_sec < b.tv_sec) || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+Reactor::Reactor() throw()  {
+	struct epoll_event ev;
+
+	running = true;
+	npending = 0;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		throw SocketException("epoll_create error");
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		throw SocketException("eventfd error");
+
+	ev.events = EPOLLIN;
+	ev.data.fd = wakefd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+		throw SocketException("epoll_ctl error");
+
+	if (!currentReactor)
+		currentReactor = this;
+}
+
+Reactor::~Reactor()  {
+	// The operations still waiting are left suspended, and forget about us
+	for (u_int32_t i=0; i < slots.size(); i++)  {
+		if (slots[i].reader)
+			slots[i].reader->reactor = NULL;
+
+		if (slots[i].writer)
+			slots[i].writer->reactor = NULL;
+	}
+
+	if (currentReactor == this)
+		currentReactor = NULL;
+
+	::close(wakefd);
+	::close(epfd);
+}
+
+bool Reactor::arm (int fd) throw()  {
+	struct epoll_event ev;
+
+	ev.events = EPOLLONESHOT;
+	ev.data.fd = fd;
+
+	if (slots[fd].reader)
+		ev.events |= EPOLLIN;
+
+	if (slots[fd].writer)
+		ev.events |= EPOLLOUT;
+
+	// Most descriptors are registered once and re-armed on each wait
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return (errno == ENOENT && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+
+	return true;
+}
+
+void Reactor::heapUp (u_int32_t i) throw()  {
+	AsyncOp *op = timers[i];
+
+	while (i > 0)  {
+		u_int32_t parent = (i - 1) / 2;
+
+		if (!before(op->when, timers[parent]->when))
+			break;
+
+		timers[i] = timers[parent];
+		timers[i]->heapIndex = i;
+		i = parent;
+	}
+
+	timers[i] = op;
+	op->heapIndex = i;
+}
+
+void Reactor::heapDown (u_int32_t i) throw()  {
+	AsyncOp *op = timers[i];
+	u_int32_t n = timers.size();
+
+	while (2 * i + 1 < n)  {
+		u_int32_t child = 2 * i + 1;
+
+		if (child + 1 < n && before(timers[child + 1]->when, timers[child]->when))
+			child++;
+
+		if (!before(timers[child]->when, op->when))
+			break;
+
+		timers[i] = timers[child];
+		timers[i]->heapIndex = i;
+		i = child;
+	}
+
+	timers[i] = op;
+	op->heapIndex = i;
+}
+
+bool Reactor::wait (AsyncOp* op) throw()  {
+	int fd = op->sock->getDescriptor();
+
+	if (fd < 0)  {
+		errno = EBADF;
+		op->fail("reactor error");
+		return false;
+	}
+
+	if ((u_int32_t) fd >= slots.size())  {
+		Slot empty = { NULL, NULL };
+		slots.resize(fd + 1, empty);
+	}
+
+	AsyncOp *&slot = (op->events == POLLIN) ? slots[fd].reader : slots[fd].writer;
+
+	// A single operation of each kind at a time on a descriptor
+	if (slot)  {
+		errno = EBUSY;
+		op->fail("reactor error");
+		return false;
+	}
+
+	slot = op;
+
+	if (!arm(fd))  {
+		slot = NULL;
+		op->fail("epoll_ctl error");
+		return false;
+	}
+
+	if (op->timed)  {
+		timers.push_back(op);
+		heapUp(timers.size() - 1);
+	}
+
+	op->fd = fd;
+	op->reactor = this;
+	npending++;
+	return true;
+}
+
+void Reactor::unlink (AsyncOp* op) throw()  {
+	if (slots[op->fd].reader == op)
+		slots[op->fd].reader = NULL;
+	else if (slots[op->fd].writer == op)
+		slots[op->fd].writer = NULL;
+
+	if (op->timed)  {
+		u_int32_t i = op->heapIndex;
+		AsyncOp *last = timers.back();
+		timers.pop_back();
+
+		if (last != op)  {
+			timers[i] = last;
+			last->heapIndex = i;
+			heapUp(i);
+			heapDown(last->heapIndex);
+		}
+	}
+
+	op->reactor = NULL;
+	npending--;
+}
+
+void Reactor::cancel (AsyncOp* op) throw()  {
+	if (op->reactor == this)
+		unlink(op);
+}
+
+void Reactor::complete (AsyncOp* op)  {
+	unlink(op);
+	op->resumeFn(op->coro);
+}
+
+int Reactor::runOnce (int timeout)  {
+	struct epoll_event events[REACTOR_MAXEVENTS];
+	struct timespec now;
+	int n;
+
+	currentReactor = this;
+
+	if (!timers.empty())  {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		double left = (double) (timers[0]->when.tv_sec - now.tv_sec) + (timers[0]->when.tv_nsec - now.tv_nsec) / 1e9;
+		int ms = (left > 0.0) ? (int) ceil(left * 1000.0) : 0;
+
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+
+	if ((n = epoll_wait(epfd, events, REACTOR_MAXEVENTS, timeout)) < 0)  {
+		if (errno != EINTR)
+			throw SocketException("epoll_wait error");
+
+		n = 0;
+	}
+
+	for (int i=0; i < n; i++)  {
+		int fd = events[i].data.fd;
+		u_int32_t ev = events[i].events;
+
+		if (fd == wakefd)  {
+			eventfd_t val;
+			eventfd_read(wakefd, &val);
+			continue;
+		}
+
+		if ((u_int32_t) fd >= slots.size())
+			continue;
+
+		// Resuming a coroutine may register, cancel or complete other operations on the same descriptor,
+		// and grow the slots, so the slot is looked up again each time
+		AsyncOp *op = slots[fd].reader;
+
+		if (op && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) && op->attempt())
+			complete(op);
+
+		op = slots[fd].writer;
+
+		if (op && (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && op->attempt())
+			complete(op);
+
+		if ((slots[fd].reader || slots[fd].writer) && !arm(fd))  {
+			// The descriptor was closed under the feet of its waiters
+			while ((op = slots[fd].reader ? slots[fd].reader : slots[fd].writer))  {
+				op->fail("epoll_ctl error");
+				complete(op);
+			}
+		}
+	}
+
+	if (!timers.empty())  {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (!timers.empty() && !before(now, timers[0]->when))  {
+			AsyncOp *op = timers[0];
+
+			errno = ETIMEDOUT;
+			op->fail("connection timeout");
+			complete(op);
+		}
+	}
+
+	return n;
+}
+
+void Reactor::run()  {
+	while (running && npending > 0)
+		runOnce();
+
+	// The stop() which made us return is consumed, so that the reactor can be run again
+	if (!running)
+		running = true;
+}
+
+void Reactor::stop() throw()  {
+	running = false;
+	eventfd_write(wakefd, 1);
+}
+
+u_int32_t Reactor::pending() throw()  { return npending; }
+
+Reactor* Reactor::current() throw()  { return currentReactor; }
+
@@ -0,0 +1,374 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstring>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "usock.h"
+#include "usock_resolver.h"
+#include "usock_exception.h"
+
+using std::string;
+using std::vector;
+using namespace usock;
+
+static Resolver *current = NULL;
+static Resolver *builtin = NULL;
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static void createBuiltin()  { builtin = new Resolver(); }
+
+static void expiry (struct timespec& ts, double after)  {
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += (time_t) after;
+	ts.tv_nsec += (long) ((after - (double) ((time_t) after)) * 1e9);
+
+	if (ts.tv_nsec >= 1000000000L)  {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+}
+
+static bool expired (const struct timespec& ts)  {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec > ts.tv_sec || (now.tv_sec == ts.tv_sec && now.tv_nsec >= ts.tv_nsec));
+}
+
+// Parse a numeric IPv4/IPv6 address, so that it doesn't go through the cache at all
+static bool numeric (const string& name, struct sockaddr_storage& ss)  {
+	memset (&ss, 0, sizeof(ss));
+
+	struct sockaddr_in *sin = (struct sockaddr_in*) &ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &ss;
+
+	if (inet_pton(AF_INET, name.c_str(), &sin->sin_addr) == 1)  {
+		sin->sin_family = AF_INET;
+		return true;
+	}
+
+	if (inet_pton(AF_INET6, name.c_str(), &sin6->sin6_addr) == 1)  {
+		sin6->sin6_family = AF_INET6;
+		return true;
+	}
+
+	return false;
+}
+
+bool ResolverBackend::lookup (const string& name, int family, vector<struct sockaddr_storage>& addrs)  {
+	struct addrinfo hints, *res, *ai;
+
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(name.c_str(), NULL, &hints, &res) != 0)
+		return false;
+
+	for (ai = res; ai; ai = ai->ai_next)  {
+		struct sockaddr_storage ss;
+
+		if (ai->ai_addrlen > sizeof(ss))
+			continue;
+
+		memset (&ss, 0, sizeof(ss));
+		memcpy (&ss, ai->ai_addr, ai->ai_addrlen);
+		addrs.push_back(ss);
+	}
+
+	freeaddrinfo(res);
+	return !addrs.empty();
+}
+
+bool ResolverBackend::reverse (const struct sockaddr_storage& addr, string& name)  {
+	char host[NI_MAXHOST];
+	socklen_t len = (addr.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+	if (getnameinfo((const struct sockaddr*) &addr, len, host, sizeof(host), NULL, 0, NI_NAMEREQD) != 0)
+		return false;
+
+	name = host;
+	return true;
+}
+
+Resolver::Resolver (u_int32_t maxEntries, double ttl, double negativeTtl, u_int32_t nthreads) throw()  {
+	this->maxEntries = (maxEntries) ? maxEntries : 1;
+	this->ttl = ttl;
+	this->negativeTtl = negativeTtl;
+	this->nthreads = (nthreads) ? nthreads : 1;
+	backend = &defaultBackend;
+	stopping = false;
+	memset (&counters, 0, sizeof(counters));
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	pthread_cond_init(&done, NULL);
+
+	// setBackend() goes first, or a steady stream of lookups could keep it waiting forever
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&backendLock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+Resolver::~Resolver()  {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	jobs.clear();
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (u_int32_t i=0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_rwlock_destroy(&backendLock);
+	pthread_cond_destroy(&done);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void Resolver::setBackend (ResolverBackend* b) throw()  {
+	pthread_rwlock_wrlock(&backendLock);
+	backend = (b) ? b : &defaultBackend;
+	flush();
+	pthread_rwlock_unlock(&backendLock);
+}
+
+bool Resolver::find (const Key& key, Entry& e) throw()  {
+	bool found = false;
+	pthread_mutex_lock(&lock);
+
+	// Concurrent misses on the same key are served by a single backend lookup
+	while (pending.count(key))
+		pthread_cond_wait(&done, &lock);
+
+	std::map<Key, Entry>::iterator it = cache.find(key);
+
+	if (it != cache.end())  {
+		if (expired(it->second.expires))  {
+			lru.erase(it->second.lru);
+			cache.erase(it);
+		} else {
+			lru.splice(lru.begin(), lru, it->second.lru);
+			e = it->second;
+			found = true;
+
+			if (e.addrs.empty() && e.name.empty())
+				counters.negativeHits++;
+			else
+				counters.hits++;
+		}
+	}
+
+	if (!found)  {
+		pending.insert(key);
+		counters.misses++;
+	}
+
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+void Resolver::store (const Key& key, Entry& e, bool found) throw()  {
+	expiry(e.expires, (found) ? ttl : negativeTtl);
+	pthread_mutex_lock(&lock);
+
+	std::map<Key, Entry>::iterator it = cache.find(key);
+
+	if (it != cache.end())  {
+		lru.splice(lru.begin(), lru, it->second.lru);
+		e.lru = it->second.lru;
+		it->second = e;
+	} else {
+		lru.push_front(key);
+		e.lru = lru.begin();
+		cache[key] = e;
+	}
+
+	while (cache.size() > maxEntries)  {
+		cache.erase(lru.back());
+		lru.pop_back();
+		counters.evictions++;
+	}
+
+	pending.erase(key);
+	pthread_cond_broadcast(&done);
+	pthread_mutex_unlock(&lock);
+}
+
+bool Resolver::resolve (const string& name, vector<struct sockaddr_storage>& addrs, int family) throw()  {
+	struct sockaddr_storage ss;
+	Key key(family, name);
+	Entry e;
+	bool found;
+
+	addrs.clear();
+
+	if (numeric(name, ss))  {
+		if (family != AF_UNSPEC && family != ss.ss_family)
+			return false;
+
+		addrs.push_back(ss);
+		return true;
+	}
+
+	if (find(key, e))  {
+		addrs = e.addrs;
+		return !addrs.empty();
+	}
+
+	// The result is stored before setBackend() can flush the cache, so it can't outlive the backend
+	pthread_rwlock_rdlock(&backendLock);
+	found = backend->lookup(name, family, e.addrs);
+	store(key, e, found);
+	pthread_rwlock_unlock(&backendLock);
+	addrs = e.addrs;
+	return found;
+}
+
+string Resolver::reverse (const string& addr) throw()  {
+	struct sockaddr_storage ss;
+	Key key(-1, addr);
+	Entry e;
+	bool found;
+
+	if (!numeric(addr, ss))  {
+		errno = EINVAL;
+		throw SocketException("invalid IPv4/IPv6 address");
+	}
+
+	if (find(key, e))
+		return e.name;
+
+	pthread_rwlock_rdlock(&backendLock);
+	found = backend->reverse(ss, e.name);
+	store(key, e, found);
+	pthread_rwlock_unlock(&backendLock);
+	return e.name;
+}
+
+void* Resolver::workerMain (void *arg)  {
+	Resolver *r = (Resolver*) arg;
+	pthread_mutex_lock(&(r->lock));
+
+	while (1)  {
+		while (!r->stopping && r->jobs.empty())
+			pthread_cond_wait(&(r->cond), &(r->lock));
+
+		if (r->stopping)
+			break;
+
+		Job job = r->jobs.front();
+		r->jobs.pop_front();
+		pthread_mutex_unlock(&(r->lock));
+
+		vector<struct sockaddr_storage> addrs;
+		r->resolve(job.name, addrs, job.family);
+
+		if (job.callback)
+			job.callback->onResolved(job.name, addrs);
+
+		pthread_mutex_lock(&(r->lock));
+	}
+
+	pthread_mutex_unlock(&(r->lock));
+	return NULL;
+}
+
+void Resolver::resolveAsync (const string& name, int family, ResolverCallback* callback) throw()  {
+	Job job;
+	job.name = name;
+	job.family = family;
+	job.callback = callback;
+
+	pthread_mutex_lock(&lock);
+
+	while (threads.size() < nthreads)  {
+		pthread_t t;
+
+		if (pthread_create(&t, NULL, workerMain, this) != 0)  {
+			pthread_mutex_unlock(&lock);
+			throw SocketException("thread creation failed");
+		}
+
+		threads.push_back(t);
+	}
+
+	jobs.push_back(job);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void Resolver::flush() throw()  {
+	pthread_mutex_lock(&lock);
+	cache.clear();
+	lru.clear();
+	pthread_mutex_unlock(&lock);
+}
+
+ResolverStats Resolver::stats() throw()  {
+	ResolverStats s;
+
+	pthread_mutex_lock(&lock);
+	s = counters;
+	s.entries = cache.size();
+	pthread_mutex_unlock(&lock);
+	return s;
+}
+
+Resolver& Resolver::getDefault() throw()  {
+	Resolver *r = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+
+	if (r)
+		return *r;
+
+	pthread_once(&builtin_once, createBuiltin);
+	return *builtin;
+}
+
+void Resolver::setDefault (Resolver* r) throw()  {
+	__atomic_store_n(&current, r, __ATOMIC_RELEASE);
+}
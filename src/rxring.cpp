@@ -0,0 +1,255 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_ring.h"
+
+#ifndef	PACKET_IGNORE_OUTGOING
+#define	PACKET_IGNORE_OUTGOING	23
+#endif
+
+using std::string;
+using std::vector;
+using namespace usock;
+
+RxRing::RxRing (const string& iface, u_int16_t proto, bool outgoing, u_int32_t blocks, u_int32_t bsize, u_int32_t retire) throw()  {
+	open(iface, proto, outgoing, blocks, bsize, retire);
+}
+
+RxRing::RxRing (RawSocket& s, u_int32_t blocks, u_int32_t bsize, u_int32_t retire) throw()  {
+	open(s.getInterface(), ETH_P_IP, false, blocks, bsize, retire);
+}
+
+void RxRing::open (const string& iface, u_int16_t proto, bool outgoing, u_int32_t blocks, u_int32_t bsize, u_int32_t retire) throw()  {
+	struct tpacket_req3 req;
+	struct sockaddr_ll sll;
+	int opt;
+
+	sd = -1;
+	ring = NULL;
+	current = 0;
+	held = false;
+	memset (&counters, 0, sizeof(counters));
+
+	memset (&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(proto);
+
+	if (!iface.empty() && !(sll.sll_ifindex = if_nametoindex(iface.c_str())))
+		throw SocketException("invalid network interface");
+
+	// Blocks made of whole pages, each holding at least a full frame
+	blockSize = RING_BLOCK_SIZE;
+
+	while (blockSize < bsize || blockSize < RING_FRAME_SIZE)
+		blockSize <<= 1;
+
+	blockNr = blocks ? blocks : 1;
+	size = (size_t) blockSize * blockNr;
+
+	memset (&req, 0, sizeof(req));
+	req.tp_block_size = blockSize;
+	req.tp_block_nr = blockNr;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (blockSize / RING_FRAME_SIZE) * blockNr;
+	req.tp_retire_blk_tov = retire;
+
+	// SOCK_DGRAM: the kernel strips the link-layer header, the packets start at the network header
+	if ((sd = ::socket(AF_PACKET, SOCK_DGRAM, htons(proto))) < 0)
+		throw SocketException("socket error");
+
+	opt = TPACKET_V3;
+
+	if (setsockopt(sd, SOL_PACKET, PACKET_VERSION, &opt, sizeof(opt)) < 0 ||
+			setsockopt(sd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)  {
+		::close(sd);
+		throw SocketException("unable to set up the receive ring");
+	}
+
+	// Kernels before 4.20 don't know this option, and the outgoing packets are then captured too
+	if (!outgoing)  {
+		opt = 1;
+		setsockopt(sd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &opt, sizeof(opt));
+	}
+
+	if ((ring = (u_int8_t*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sd, 0)) == MAP_FAILED)  {
+		ring = NULL;
+		::close(sd);
+		throw SocketException("unable to map the receive ring");
+	}
+
+	// Bound only once the ring is in place, so that no packet ends up in the plain socket queue
+	if (bind(sd, (struct sockaddr*) &sll, sizeof(sll)) < 0)  {
+		munmap(ring, size);
+		ring = NULL;
+		::close(sd);
+		throw SocketException("bind error");
+	}
+}
+
+RxRing::~RxRing()  {
+	if (ring)
+		munmap(ring, size);
+
+	if (sd >= 0)
+		::close(sd);
+}
+
+struct tpacket_block_desc* RxRing::block (u_int32_t i) throw()  {
+	return (struct tpacket_block_desc*) (ring + (size_t) i * blockSize);
+}
+
+void RxRing::release() throw()  {
+	if (!held)
+		return;
+
+	// Everything we read from the block must be done before the kernel can fill it again
+	__sync_synchronize();
+	block((current + blockNr - 1) % blockNr)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	held = false;
+}
+
+u_int32_t RxRing::next (vector<PacketView>& pkts, double timeout) throw()  {
+	struct tpacket_block_desc *bd;
+	struct timespec dl, now;
+	struct pollfd pfd;
+	int ms = -1;
+
+	release();
+	pkts.clear();
+
+	if (timeout > 0.0)  {
+		clock_gettime(CLOCK_MONOTONIC, &dl);
+		dl.tv_sec += (time_t) timeout;
+		dl.tv_nsec += (long) ((timeout - floor(timeout)) * 1e9);
+
+		if (dl.tv_nsec >= 1000000000)  {
+			dl.tv_sec++;
+			dl.tv_nsec -= 1000000000;
+		}
+	}
+
+	bd = block(current);
+
+	while (!(*(volatile u_int32_t*) &bd->hdr.bh1.block_status & TP_STATUS_USER))  {
+		if (timeout == 0.0)
+			return 0;
+
+		if (timeout > 0.0)  {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double left = (double) (dl.tv_sec - now.tv_sec) + (dl.tv_nsec - now.tv_nsec) / 1e9;
+
+			if (left <= 0.0)
+				return 0;
+
+			ms = (int) ceil(left * 1000.0);
+		}
+
+		pfd.fd = sd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, ms) < 0 && errno != EINTR)
+			throw SocketException("poll exception");
+	}
+
+	// The block header must be read before the packets in it
+	__sync_synchronize();
+
+	u_int32_t n = bd->hdr.bh1.num_pkts;
+	struct tpacket3_hdr *h = (struct tpacket3_hdr*) ((u_int8_t*) bd + bd->hdr.bh1.offset_to_first_pkt);
+	pkts.resize(n);
+
+	for (u_int32_t i=0; i < n; i++)  {
+		struct sockaddr_ll *sll = (struct sockaddr_ll*) ((u_int8_t*) h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		PacketView& v = pkts[i];
+
+		v.data = (const u_int8_t*) h + h->tp_net;
+		v.len = h->tp_snaplen;
+		v.wireLen = h->tp_len;
+		v.ts.tv_sec = h->tp_sec;
+		v.ts.tv_nsec = h->tp_nsec;
+		v.ifindex = sll->sll_ifindex;
+		v.protocol = ntohs(sll->sll_protocol);
+		v.pktType = sll->sll_pkttype;
+
+		h = (struct tpacket3_hdr*) ((u_int8_t*) h + h->tp_next_offset);
+	}
+
+	current = (current + 1) % blockNr;
+	held = true;
+	return n;
+}
+
+void RxRing::setFilter (const PacketFilter& f) throw()  {
+	if (f.empty())
+		PacketFilter::detach(sd);
+	else
+		f.attach(sd);
+}
+
+RxStats RxRing::stats() throw()  {
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	if (getsockopt(sd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)  {
+		counters.packets += st.tp_packets;
+		counters.drops += st.tp_drops;
+		counters.freezes += st.tp_freeze_q_cnt;
+	}
+
+	return counters;
+}
+
+int RxRing::getDescriptor() throw()  { return sd; }
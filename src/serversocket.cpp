@@ -42,26 +42,44 @@
  * this file might be covered by the GNU General Public License.
  */
 
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/signal.h>
+#include <sys/wait.h>
 
 #include "usock.h"
+#include "usock_async.h"
 #include "usock_exception.h"
 using namespace usock;
 
-ServerSocket::ServerSocket (u_int16_t port, u_int32_t m, const std::string& addr) throw()  {
-	struct sockaddr_in sin;
+ServerSocket::ServerSocket (u_int16_t port, u_int32_t m, const std::string& addr, bool reuseport) throw()  {
+	Endpoint ep;
+	int opt = 1;
+	int fd6;
 
-	sin.sin_family = domain;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = (addr.empty()) ? any : inet_addr(getHostByName(addr).c_str());
-	
 	maxconn = m;
-	//client_index = 0;
-	//client_pid = new int[m];
 
-	if (::bind(sd, (struct sockaddr*) &sin, sizeof(struct sockaddr)) < 0)
+	if (addr.empty())  {
+		// Listen on IPv4 and IPv6 at once through a dual-stack socket, unless the system has no IPv6
+		if ((fd6 = ::socket(AF_INET6, type, protocol)) >= 0)  {
+			::close(sd);
+			sd = fd6;
+			domain = AF_INET6;
+		}
+	} else {
+		ep = Endpoint(addr, port);
+		reopen(ep.family());
+	}
+
+	if (reuseport)
+		setSockOpt(SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+	if (ep.empty())
+		bind(port);
+	else if (::bind(sd, ep.addr(), ep.length()) < 0)
 		throw SocketException("bind error");
 
 	if (::listen(sd, maxconn) < 0)
@@ -69,13 +87,30 @@ ServerSocket::ServerSocket (u_int16_t port, u_int32_t m, const std::string& addr
 }
 
 void ServerSocket::bind (u_int16_t port) throw()  {
-	struct sockaddr_in sin;
+	struct sockaddr_storage sock;
+	socklen_t len;
+
+	memset (&sock, 0, sizeof(sock));
 
-	sin.sin_family = domain;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = any;
+	if (domain == AF_INET6)  {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &sock;
+		int off = 0;
+
+		setSockOpt(IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		sin6->sin6_addr = in6addr_any;
+		len = sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in*) &sock;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		sin->sin_addr.s_addr = any;
+		len = sizeof(struct sockaddr_in);
+	}
 
-	if (::bind(sd, (struct sockaddr*) &sin, sizeof(struct sockaddr)) < 0)
+	if (::bind(sd, (struct sockaddr*) &sock, len) < 0)
 		throw SocketException("bind error");
 }
 
@@ -86,10 +121,8 @@ void ServerSocket::listen() throw()  {
 
 Socket ServerSocket::accept() throw()  {
 	int new_sd;
-	struct sockaddr_in addr;
-	socklen_t len = sizeof(struct sockaddr);
 
-	if ( (new_sd = ::accept(sd, (struct sockaddr*) &addr, &len)) < 0)
+	if ( (new_sd = ::accept(sd, NULL, NULL)) < 0)
 		throw SocketException("accept error");
 
 	return Socket(new_sd);
@@ -98,11 +131,25 @@ Socket ServerSocket::accept() throw()  {
 void ServerSocket::accept (void (*clientHandler)(Socket&)) throw()  {
 	int pid;
 	int new_sd;
-	struct sockaddr_in addr;
-	socklen_t len = sizeof(struct sockaddr);
+
+	// Reap the finished children. If there are already maxconn of them, wait for the oldest one
+	for (u_int32_t i=0; i < children.size(); )  {
+		bool full = (i == 0 && children.size() >= maxconn);
+
+		if ((pid = waitpid(children[i], NULL, full ? 0 : WNOHANG)) < 0 && errno == EINTR)
+			continue;
+
+		if (pid != 0)  {
+			// Reaped, or not our child anymore (ECHILD)
+			children.erase(children.begin() + i);
+			continue;
+		}
+
+		i++;
+	}
 
 	do  {
-		if ( (new_sd = ::accept(sd, (struct sockaddr*) &addr, &len)) < 0)
+		if ( (new_sd = ::accept(sd, NULL, NULL)) < 0)
 			throw SocketException("accept error");
 	} while (new_sd <= 0);
 
@@ -124,7 +171,16 @@ void ServerSocket::accept (void (*clientHandler)(Socket&)) throw()  {
 		exit(0);
 	} else {
 		::close(new_sd);
-		//client_pid[client_index++] = pid;
+		children.push_back(pid);
 	}
 }
 
+AcceptOp ServerSocket::asyncAccept() throw()  {
+	struct timespec ts;
+
+	setBlocking(false);
+	return AcceptOp(this, deadline(ts));
+}
+
+u_int32_t ServerSocket::getMaxConn() throw()  { return maxconn; }
+
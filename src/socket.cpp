@@ -43,14 +43,23 @@
  */
 
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <cstring>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 #include "usock.h"
+#include "usock_async.h"
 #include "usock_exception.h"
 
 #include "raii.hh"
@@ -62,11 +71,20 @@ using namespace usock;
 Socket::Socket() throw() : BaseSocket(inet, sock_stream, tcp)  {}
 
 Socket::Socket (int sd, double timeout) throw()  {
+	socklen_t len = sizeof(domain);
+
 	this->sd = sd;
-	domain = AF_INET;
+
+	// The descriptor may come from a dual-stack listener
+	if (::getsockopt(sd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+		domain = AF_INET;
+
 	type = SOCK_STREAM;
 	protocol = IPPROTO_TCP;
 	this->timeout = timeout;
+
+	if (timeout > 0.0)
+		setBlocking(false);
 }
 
 Socket::Socket (const string& host, u_int16_t port, double timeout) throw() : BaseSocket(inet, sock_stream, tcp, timeout)  {
@@ -74,83 +92,308 @@ Socket::Socket (const string& host, u_int16_t port, double timeout) throw() : Ba
 }
 
 void Socket::connect (const string& host, u_int16_t port) throw()  {
-	string addr;
-	struct sockaddr_in sin;
+	std::vector<Endpoint> eps = Endpoint::resolve(host, port);
+
+	if (eps.empty())  {
+		errno = EHOSTUNREACH;
+		throw SocketException("unable to resolve host");
+	}
+
+	connect(eps);
+}
 
-	addr = getHostByName(host);
-	sin.sin_family = domain;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = inet_addr(addr.c_str());
+namespace  {
+	// Connection attempts still in progress, closed if they're not adopted by the socket
+	struct Attempts  {
+		std::vector<struct pollfd> pfds;
+		std::vector<int> families;
 
-	if (timeout == 0.0)  {
-		if (::connect(sd, (struct sockaddr*) &sin, sizeof(struct sockaddr)) < 0)
+		~Attempts()  {
+			for (u_int32_t i=0; i < pfds.size(); i++)
+				::close(pfds[i].fd);
+		}
+
+		void drop (u_int32_t i)  {
+			::close(pfds[i].fd);
+			pfds.erase(pfds.begin() + i);
+			families.erase(families.begin() + i);
+		}
+	};
+
+	double monotonic()  {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+}
+
+void Socket::connect (const std::vector<Endpoint>& eps) throw()  {
+	std::vector<const Endpoint*> order;
+	Attempts att;
+	u_int32_t next = 0;
+	int winner = -1, family = AF_UNSPEC, err = ECONNREFUSED;
+	double start = monotonic(), now = start, nextStart = start;
+
+	if (eps.size() < 2)  {
+		if (eps.empty())  {
+			errno = EHOSTUNREACH;
 			throw SocketException("connect exception");
-	} else {
-		setBlocking(false);
+		}
+
+		connect(eps[0]);
+		return;
+	}
+
+	// Alternate the address families, starting from the one the resolver preferred (RFC 8305)
+	for (u_int32_t i=0, j=0; i < eps.size() || j < eps.size(); )  {
+		while (i < eps.size() && eps[i].family() != eps[0].family()) i++;
+		while (j < eps.size() && eps[j].family() == eps[0].family()) j++;
+
+		if (i < eps.size()) order.push_back(&eps[i++]);
+		if (j < eps.size()) order.push_back(&eps[j++]);
+	}
+
+	while (winner < 0)  {
+		// Start a new attempt when the previous one is late, or as soon as it failed
+		if (next < order.size() && (att.pfds.empty() || now >= nextStart))  {
+			const Endpoint *ep = order[next++];
+			struct pollfd pfd;
+
+			if ((pfd.fd = ::socket(ep->family(), type | SOCK_NONBLOCK, protocol)) < 0)
+				throw SocketException("socket error");
+
+			if (::connect(pfd.fd, ep->addr(), ep->length()) == 0)  {
+				winner = pfd.fd;
+				family = ep->family();
+				break;
+			}
+
+			// A failure right away lets the next address start right away too, even with attempts pending
+			if (errno != EINPROGRESS)  {
+				err = errno;
+				::close(pfd.fd);
+				nextStart = now;
+				continue;
+			}
+
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			att.pfds.push_back(pfd);
+			att.families.push_back(ep->family());
+
+			// Staggered from the time this attempt was actually started
+			now = monotonic();
+			nextStart = now + CONNECT_STAGGER;
+			continue;
+		}
+
+		if (att.pfds.empty())
+			break;
+
+		double wait = -1.0;
+
+		if (next < order.size())
+			wait = nextStart - now;
+
+		if (timeout > 0.0 && (wait < 0.0 || start + timeout - now < wait))
+			wait = start + timeout - now;
+
+		if (timeout > 0.0 && start + timeout <= now)  {
+			errno = ETIMEDOUT;
+			throw SocketException("connection timeout");
+		}
+
+		int ret = poll(&att.pfds[0], att.pfds.size(), (wait < 0.0) ? -1 : (int) ceil(wait * 1000.0));
+		now = monotonic();
+
+		if (ret < 0 && errno != EINTR)
+			throw SocketException("poll exception");
+
+		for (u_int32_t i=0; ret > 0 && i < att.pfds.size(); )  {
+			int e = 0;
+			socklen_t len = sizeof(e);
+
+			if (!att.pfds[i].revents)  {
+				i++;
+				continue;
+			}
 
-		if (::connect(sd, (struct sockaddr*) &sin, sizeof(struct sockaddr)) < 0)  {
-			if (errno == EINPROGRESS)  {
-				int ret;
-
-				do  {
-					struct timeval tv;
-					fd_set set;
-
-					tv.tv_sec = (int) timeout;
-					tv.tv_usec = (int) ((timeout*1000) - (double) (tv.tv_sec*1000));
-					FD_ZERO(&set);
-					FD_SET(sd, &set);
-
-					if ((ret = select(sd+1, NULL, &set, NULL, &tv)) < 0)  {
-						if (errno == EINTR)
-							throw SocketException("connection exception");
-					} else if (ret>0)
-						break;
-					else
-						throw SocketException("connection timeout");
-				} while(1);
-			} else
-				throw SocketException("connection exception");
-		
-			setBlocking(true);
+			::getsockopt(att.pfds[i].fd, SOL_SOCKET, SO_ERROR, &e, &len);
+
+			if (!e)  {
+				winner = att.pfds[i].fd;
+				family = att.families[i];
+				att.pfds.erase(att.pfds.begin() + i);
+				break;
+			}
+
+			err = e;
+			att.drop(i);
+			nextStart = now;
+		}
+	}
+
+	if (winner < 0)  {
+		errno = err;
+		throw SocketException("connect exception");
+	}
+
+	// Adopt the descriptor which won the race
+	close();
+	sd = winner;
+	domain = family;
+
+	if (timeout <= 0.0)
+		setBlocking(true);
+}
+
+void Socket::connect (const Endpoint& ep) throw()  {
+	reopen(ep.family());
+
+	if (::connect(sd, ep.addr(), ep.length()) < 0)  {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		struct timespec ts;
+
+		// A non-blocking connect (either because of the timeout or of an EventLoop) completes in background
+		if (errno != EINPROGRESS && errno != EINTR)
+			throw SocketException("connect exception");
+
+		waitFor(POLLOUT, deadline(ts));
+		getSockOpt(SOL_SOCKET, SO_ERROR, &err, &len);
+
+		if (err)  {
+			errno = err;
+			throw SocketException("connect exception");
 		}
 	}
 }
 
 void Socket::send (const string& buf) throw()  {
-	if (timeout == 0.0)  {
-		if (::send(sd, buf.c_str(), buf.length(), 0) < 0)
-			throw SocketException("send exception");
-	} else {
-		setBlocking(false);
+	sendWait(buf.data(), buf.length());
+}
+
+void Socket::send (const void* buf, u_int32_t size) throw()  {
+	sendWait(buf, size);
+}
+
+void Socket::send (const struct iovec* iov, int iovcnt) throw()  {
+	struct msghdr msg;
+
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*) iov;
+	msg.msg_iovlen = iovcnt;
+	sendMsgWait(&msg);
+}
+
+off_t Socket::sendFile (int fd, off_t offset, off_t length) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	off_t sent = 0;
+
+	if (!length)  {
+		struct stat st;
+
+		if (fstat(fd, &st) < 0)
+			throw SocketException("fstat exception");
 
-		if (::send(sd, buf.c_str(), buf.length(), 0) < 0)  {
-			if (errno == EINPROGRESS)  {
-				int ret;
-
-				do  {
-					struct timeval tv;
-					fd_set set;
-
-					tv.tv_sec = (int) timeout;
-					tv.tv_usec = (int) ((timeout*1000) - (double) (tv.tv_sec*1000));
-					FD_ZERO(&set);
-					FD_SET(sd, &set);
-
-					if ((ret = select(sd+1, NULL, &set, NULL, &tv)) < 0)  {
-						if (errno == EINTR)
-							throw SocketException("connection exception");
-					} else if (ret>0)
-						break;
-					else
-						throw SocketException("connection timeout");
-				} while(1);
-			} else
-				throw SocketException("connection exception");
+		// Pipes and the like have no size: send everything up to their EOF
+		if (S_ISREG(st.st_mode))
+			length = (st.st_size > offset) ? st.st_size - offset : 0;
+		else
+			length = std::numeric_limits<off_t>::max();
+	}
+
+	while (sent < length)  {
+		// sendfile() advances offset by itself, so partial writes are resumed from the right place
+		ssize_t n = ::sendfile(sd, fd, &offset, length - sent);
+
+		if (n < 0)  {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)  {
+				if (!dl && timeout > 0.0)
+					dl = deadline(ts);
+
+				waitFor(POLLOUT, dl);
+				continue;
+			}
+
+			if ((errno == EINVAL || errno == ENOSYS || errno == ESPIPE) && !sent)
+				return spliceFile(fd, offset, length);
+
+			throw SocketException("sendfile exception");
+		}
+
+		if (!n)
+			break;
+
+		sent += n;
+	}
+
+	return sent;
+}
+
+off_t Socket::sendFile (const string& path, off_t offset, off_t length) throw()  {
+	int fd;
+
+	if ((fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+		throw SocketException("open exception");
+
+	raii_fd fd_holder(fd);
+	return sendFile(fd, offset, length);
+}
+
+off_t Socket::spliceFile (int fd, off_t offset, off_t length) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	off_t sent = 0;
+	off_t *off = (lseek(fd, 0, SEEK_CUR) < 0) ? NULL : &offset;
+	int p[2];
+
+	if (pipe2(p, O_CLOEXEC) < 0)
+		throw SocketException("pipe exception");
+
+	raii_fd rd_holder(p[0]), wr_holder(p[1]);
+
+	while (sent < length)  {
+		ssize_t in = splice(fd, off, p[1], NULL, length - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (in < 0)  {
+			if (errno == EINTR)
+				continue;
+
+			throw SocketException("splice exception");
+		}
+
+		if (!in)
+			break;
+
+		// Empty the pipe before filling it again
+		while (in > 0)  {
+			ssize_t out = splice(p[0], NULL, sd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+			if (out < 0)  {
+				if (errno == EINTR)
+					continue;
+
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					throw SocketException("splice exception");
+
+				if (!dl && timeout > 0.0)
+					dl = deadline(ts);
+
+				waitFor(POLLOUT, dl);
+				continue;
+			}
+
+			in -= out;
+			sent += out;
 		}
-			
-		setBlocking(true);
 	}
+
+	return sent;
 }
 
 void Socket::operator<< (const string& buf) throw()  { send(buf); }
@@ -180,86 +423,97 @@ void Socket::operator<< (const double& buf) throw()  {
 }
 
 string Socket::recv (u_int32_t nbytes) throw()  {
-	char* buf = new char[nbytes];
-	raii_array<char> buf_holder(buf);
-	u_int32_t n;
+	ssize_t n;
 
-	if (timeout == 0.0)  {
-		if ((n = ::recv(sd, buf, nbytes, 0)) < 0)
-			throw SocketException("recv exception");
-	} else {
-		setBlocking(false);
+	// Data already buffered by readline() comes first, without any syscall
+	if (pending())  {
+		string str(std::min(nbytes, pending()), '\0');
+		drain(&str[0], str.length());
+		return str;
+	}
 
-		if ((n = ::recv(sd, buf, nbytes, 0)) < 0)  {
-			if (errno == EINPROGRESS)  {
-				int ret;
-
-				do  {
-					struct timeval tv;
-					fd_set set;
-
-					tv.tv_sec = (int) timeout;
-					tv.tv_usec = (int) ((timeout*1000) - (double) (tv.tv_sec*1000));
-					FD_ZERO(&set);
-					FD_SET(sd, &set);
-
-					if ((ret = select(sd+1, NULL, &set, NULL, &tv)) < 0)  {
-						if (errno == EINTR)
-							throw SocketException("connection exception");
-					} else if (ret>0)
-						break;
-					else
-						throw SocketException("connection timeout");
-				} while(1);
-			} else
-				throw SocketException("connection exception");	
-		}
-		
-		setBlocking(true);
+	// Receive straight into the string: the bytes may be binary, NUL included
+	string str(nbytes, '\0');
+	n = recvWait(&str[0], nbytes);
+	str.resize(n);
+	return str;
+}
+
+Buffer Socket::recvBuffer (u_int32_t nbytes) throw()  {
+	if (pending())  {
+		Buffer b = BufferPool::getDefault().get(std::min(nbytes, pending()));
+		drain(b.data(), b.size());
+		return b;
 	}
 
-	if (!n) return string();
-	return string(buf);
+	Buffer b = BufferPool::getDefault().get(nbytes);
+	ssize_t n = recvWait(b.data(), nbytes);
+
+	if (!n)
+		return Buffer();
+
+	b.resize(n);
+	return b;
 }
 
 void Socket::recv (void* buf, u_int32_t size) throw()  {
+	if (drain(buf, size))
+		return;
+
+	if (!recvWait(buf, size)) buf = NULL;
+}
+
+u_int32_t Socket::recv (const struct iovec* iov, int iovcnt) throw()  {
+	struct msghdr msg;
 	u_int32_t n;
 
-	if (timeout == 0.0)  {
-		if ((n = ::recv(sd, buf, size, 0)) < 0)
-			throw SocketException("recv exception");
-	} else {
-		setBlocking(false);
+	if ((n = drain(iov, iovcnt)))
+		return n;
 
-		if ((n = ::recv(sd, buf, size, 0)) < 0)  {
-			if (errno == EINPROGRESS)  {
-				int ret;
-
-				do  {
-					struct timeval tv;
-					fd_set set;
-
-					tv.tv_sec = (int) timeout;
-					tv.tv_usec = (int) ((timeout*1000) - (double) (tv.tv_sec*1000));
-					FD_ZERO(&set);
-					FD_SET(sd, &set);
-
-					if ((ret = select(sd+1, NULL, &set, NULL, &tv)) < 0)  {
-						if (errno == EINTR)
-							throw SocketException("connection exception");
-					} else if (ret>0)
-						break;
-					else
-						throw SocketException("connection timeout");
-				} while(1);
-			} else
-				throw SocketException("connection exception");
-		}
-		
-		setBlocking(true);
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*) iov;
+	msg.msg_iovlen = iovcnt;
+	return recvMsgWait(&msg);
+}
+
+int Socket::tryRecv (void* buf, u_int32_t size)  {
+	ssize_t n;
+
+	if ((n = drain(buf, size)) > 0)
+		return (int) n;
+
+	do  {
+		n = ::recv(sd, buf, size, 0);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)  {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+
+		if (errno == ECONNRESET)
+			return 0;
+
+		throw SocketException("recv exception");
 	}
 
-	if (!n) buf = NULL;
+	return (int) n;
+}
+
+int Socket::trySend (const void* buf, u_int32_t size)  {
+	ssize_t n;
+
+	do  {
+		n = ::send(sd, buf, size, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0)  {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+
+		throw SocketException("send exception");
+	}
+
+	return (int) n;
 }
 
 void Socket::operator>> (string& buf) throw()  {
@@ -267,29 +521,64 @@ void Socket::operator>> (string& buf) throw()  {
 }
 
 string Socket::readline() throw()  {
-	string line;
-	bool isEOF = false;
-	bool isEOL = false;
-
-	while (!isEOL && !isEOF)  {
-		char buf;
-		u_int32_t n = ::recv(sd, &buf, 1, 0);
-		
-		if (n < 1)
-			isEOF = true;
-		else if (buf == '\n')
-			isEOL = true;
-		else  {
-			if (buf != '\r')
-				line += buf;
+	return bufferedReadline();
+}
+
+bool Socket::tryReadline (string& line)  {
+	u_int32_t scanned = 0;
+	ssize_t n;
+
+	while (!takeLine(line, scanned, false))  {
+		makeRoom(BUFRECV_SIZE);
+
+		do  {
+			n = ::recv(sd, &rbuf[rbuf_tail], rbuf.size() - rbuf_tail, 0);
+		} while (n < 0 && errno == EINTR);
+
+		if (n < 0)  {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+
+			if (errno != ECONNRESET)
+				throw SocketException("recv exception");
 		}
-	}
 
-	if (line.length() < 1)  {
-		if (isEOF) line = "";
-		else line = "\r";
+		if (n > 0)
+			rbuf_tail += n;
+		else
+			return takeLine(line, scanned, true);
 	}
 
-	return string(line);
+	return true;
+}
+
+ConnectOp Socket::asyncConnect (const Endpoint& ep) throw()  {
+	struct timespec ts;
+
+	reopen(ep.family());
+	setBlocking(false);
+	return ConnectOp(this, ep.addr(), ep.length(), deadline(ts));
 }
 
+ConnectOp Socket::asyncConnect (const string& host, u_int16_t port) throw()  {
+	return asyncConnect(Endpoint(host, port));
+}
+
+RecvOp Socket::asyncRecv (void* buf, u_int32_t size) throw()  {
+	struct timespec ts;
+	return RecvOp(this, buf, size, deadline(ts));
+}
+
+SendOp Socket::asyncSend (const void* buf, u_int32_t size) throw()  {
+	struct timespec ts;
+	return SendOp(this, buf, size, deadline(ts));
+}
+
+SendOp Socket::asyncSend (const string& buf) throw()  {
+	return asyncSend(buf.data(), buf.length());
+}
+
+ReadlineOp Socket::asyncReadline() throw()  {
+	struct timespec ts;
+	return ReadlineOp(this, deadline(ts));
+}
@@ -0,0 +1,298 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cmath>
+#include <cerrno>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_filter.h"
+#include "usock_packet.h"
+#include "usock_probe.h"
+
+using std::string;
+using namespace usock;
+
+#define	SCAN_RCVBUF	(4 << 20)
+
+namespace  {
+	double elapsed (const struct timespec& from, const struct timespec& to)  {
+		return (double) (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+	}
+
+	u_int64_t micros (const struct timespec& ts)  {
+		return (u_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	inline u_int64_t rotl (u_int64_t x, int b)  { return (x << b) | (x >> (64 - b)); }
+
+	inline void sipRound (u_int64_t& v0, u_int64_t& v1, u_int64_t& v2, u_int64_t& v3)  {
+		v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+		v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+		v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+		v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+	}
+
+	// SipHash-2-4 of a single 8-byte message
+	u_int64_t sipHash (const u_int64_t k[2], u_int64_t m)  {
+		u_int64_t v0 = k[0] ^ 0x736f6d6570736575ULL, v1 = k[1] ^ 0x646f72616e646f6dULL;
+		u_int64_t v2 = k[0] ^ 0x6c7967656e657261ULL, v3 = k[1] ^ 0x7465646279746573ULL;
+		u_int64_t last = (u_int64_t) 8 << 56;
+
+		v3 ^= m;
+		sipRound(v0, v1, v2, v3);
+		sipRound(v0, v1, v2, v3);
+		v0 ^= m;
+
+		v3 ^= last;
+		sipRound(v0, v1, v2, v3);
+		sipRound(v0, v1, v2, v3);
+		v0 ^= last;
+
+		v2 ^= 0xff;
+
+		for (int i=0; i < 4; i++)
+			sipRound(v0, v1, v2, v3);
+
+		return v0 ^ v1 ^ v2 ^ v3;
+	}
+}
+
+SynScanner::SynScanner (ScanHandler& h, double rate, double timeout, const string& src, const string& iface,
+		u_int16_t sport, u_int32_t burst) throw()
+	: s(iface), handler(h), limiter(rate, burst)  {
+	Xorshift rng;
+
+	if (timeout <= 0.0 || timeout > 3600.0)
+		throw SocketException("invalid scan timeout");
+
+	this->timeout = timeout;
+	this->sport = (sport) ? sport : 32768 + rng.next() % 28232;
+
+	// The MAC key must not be guessable: the clock-seeded generator is only a fallback
+	if (getrandom(key, sizeof(key), 0) != (ssize_t) sizeof(key))  {
+		key[0] = ((u_int64_t) rng.next() << 32) | rng.next();
+		key[1] = ((u_int64_t) rng.next() << 32) | rng.next();
+	}
+
+	// The 16-bit send time must span twice the timeout, so that a late answer can't pass for a fresh one
+	for (tickShift = 0; (65536.0 * (1 << tickShift)) / 1e6 < 2.0 * timeout; tickShift++);
+	lastSent.tv_sec = 0;
+	lastSent.tv_nsec = 0;
+	tuned = false;
+	buf.resize(IP_MAXPACKET);
+
+	// A single SYN, whose destination, port and sequence number are patched for each target
+	s.buildIPv4("127.0.0.1", (src.empty()) ? s.getIPv4addr() : src, RawSocket::tcp);
+	s.buildTCP(this->sport, 1, TH_SYN, 1);
+	t = PacketTemplate(s);
+
+	// The answers are the only TCP segments sent to our source port
+	s.setFilter(PacketFilter().dstPort(this->sport));
+}
+
+u_int16_t SynScanner::mac (in_addr_t dst, u_int16_t port, u_int16_t stamp) const throw()  {
+	return (u_int16_t) sipHash(key, ((u_int64_t) ntohl(dst) << 32) | ((u_int32_t) port << 16) | stamp);
+}
+
+u_int16_t SynScanner::stamp (const struct timespec& ts) const throw()  {
+	return (u_int16_t) (micros(ts) >> tickShift);
+}
+
+void SynScanner::add (in_addr_t dst, u_int16_t port) throw()  {
+	Target t;
+
+	t.dst = dst;
+	t.port = port;
+	todo.push_back(t);
+}
+
+void SynScanner::add (const string& host, u_int16_t port) throw()  {
+	// An unresolved name must throw: inet_addr("") would be INADDR_NONE, the broadcast address
+	Endpoint ep(host, port, AF_INET);
+	add(((const struct sockaddr_in*) ep.addr())->sin_addr.s_addr, port);
+}
+
+void SynScanner::send (const struct timespec& now) throw()  {
+	bool sent = false;
+
+	limiter.refill(now);
+
+	while (!todo.empty() && limiter.take())  {
+		const Target& target = todo.front();
+
+		t.setDst(target.dst);
+		t.setDstPort(target.port);
+		u_int16_t st = stamp(now);
+
+		// MAC in the high half, send time in the low half
+		t.setSeq(((u_int32_t) mac(target.dst, target.port, st) << 16) | st);
+		s.queue(t);
+
+		todo.pop_front();
+		sent = true;
+	}
+
+	if (!sent)
+		return;
+
+	s.flush();
+	lastSent = now;
+
+	if (!tuned)  {
+		int size = SCAN_RCVBUF;
+
+		if (setsockopt(s.getDescriptor(), SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+			setsockopt(s.getDescriptor(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+		tuned = true;
+	}
+}
+
+void SynScanner::receive (const struct timespec& now) throw()  {
+	int sd = s.getDescriptor();
+	u_int16_t st = stamp(now);
+	ssize_t n;
+
+	if (sd < 0)
+		return;
+
+	while ((n = ::recv(sd, &buf[0], buf.size(), MSG_DONTWAIT)) > 0)  {
+		const struct iphdr *ip = (const struct iphdr*) &buf[0];
+		u_int32_t hlen = ip->ihl << 2;
+
+		if ((size_t) n < hlen + sizeof(struct tcphdr) || ip->protocol != IPPROTO_TCP)
+			continue;
+
+		const struct tcphdr *tcp = (const struct tcphdr*) (&buf[0] + hlen);
+
+		// SYN+ACK or RST+ACK, acknowledging our SYN
+		if (tcp->dest != htons(sport) || !tcp->ack || !(tcp->rst || tcp->syn))
+			continue;
+
+		u_int16_t port = ntohs(tcp->source);
+		u_int32_t seq = ntohl(tcp->ack_seq) - 1;
+		u_int16_t sent = seq & 0xffff;
+
+		// Not one of our SYNs: the MAC is checked before the time is even looked at
+		if ((seq >> 16) != mac(ip->saddr, port, sent))
+			continue;
+
+		// Too old an answer
+		double age = (double) ((u_int64_t) (u_int16_t) (st - sent) << tickShift) / 1e6;
+
+		if (age > timeout)
+			continue;
+
+		ScanResult r;
+		r.dst = ip->saddr;
+		r.port = port;
+		r.open = tcp->syn;
+		r.ttl = ip->ttl;
+		r.rtt = age;
+		handler.onResult(r);
+	}
+
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		throw SocketException("recv exception");
+}
+
+u_int32_t SynScanner::step (double maxWait) throw()  {
+	struct timespec now;
+	struct pollfd pfd;
+	double wait = maxWait;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	send(now);
+
+	if (finished() && maxWait < 0.0)
+		return 0;
+
+	// Wake up for the next token, or when the last SYN expires
+	double next = (!todo.empty()) ? limiter.wait() : timeout - elapsed(lastSent, now);
+
+	if (wait < 0.0 || next < wait)
+		wait = next;
+
+	pfd.fd = s.getDescriptor();
+	pfd.events = POLLIN;
+
+	ret = poll(&pfd, (pfd.fd >= 0) ? 1 : 0, (int) ceil(((wait > 0.0) ? wait : 0.0) * 1000.0));
+
+	if (ret < 0 && errno != EINTR)
+		throw SocketException("poll exception");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	receive(now);
+	return todo.size();
+}
+
+void SynScanner::run() throw()  {
+	while (!finished())
+		step();
+}
+
+bool SynScanner::finished() throw()  {
+	struct timespec now;
+
+	if (!todo.empty())
+		return false;
+
+	if (!lastSent.tv_sec && !lastSent.tv_nsec)
+		return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return elapsed(lastSent, now) >= timeout;
+}
+
+u_int16_t SynScanner::getSourcePort() throw()  { return sport; }
+
+int SynScanner::getDescriptor() throw()  { return s.getDescriptor(); }
@@ -0,0 +1,230 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+
+#include "usock.h"
+#include "usock_exception.h"
+#include "usock_packet.h"
+#include "usock_ring.h"
+
+using std::string;
+using namespace usock;
+
+// Packet data starts right after the frame header: the kernel expects it there on transmit
+#define	TX_DATA_OFFSET	TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+TxRing::TxRing (const string& iface, const string& hwaddr, u_int32_t frames, u_int32_t fsize) throw()  {
+	open(iface, hwaddr, frames, fsize);
+}
+
+TxRing::TxRing (RawSocket& s, const string& hwaddr, u_int32_t frames, u_int32_t fsize) throw()  {
+	open(s.getInterface(), hwaddr, frames, fsize);
+}
+
+void TxRing::open (const string& iface, const string& hwaddr, u_int32_t frames, u_int32_t fsize) throw()  {
+	struct tpacket_req3 req;
+	unsigned int mac[6];
+	int opt;
+
+	sd = -1;
+	ring = NULL;
+	head = pending = 0;
+
+	memset (&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	sll.sll_halen = ETH_ALEN;
+
+	if (!(sll.sll_ifindex = if_nametoindex(iface.c_str())))
+		throw SocketException("invalid network interface");
+
+	if (hwaddr.empty())
+		memset (sll.sll_addr, 0xff, ETH_ALEN);
+	else if (sscanf(hwaddr.c_str(), "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6)  {
+		for (int i=0; i < ETH_ALEN; i++)
+			sll.sll_addr[i] = mac[i];
+	} else
+		throw SocketException("invalid hardware address");
+
+	// Frames aligned as the kernel wants them, and blocks made of whole pages
+	frameSize = TPACKET_ALIGN(fsize);
+	blockSize = RING_BLOCK_SIZE;
+
+	while (blockSize < frameSize)
+		blockSize <<= 1;
+
+	framesPerBlock = blockSize / frameSize;
+
+	memset (&req, 0, sizeof(req));
+	req.tp_block_size = blockSize;
+	req.tp_frame_size = frameSize;
+	req.tp_block_nr = (frames + framesPerBlock - 1) / framesPerBlock;
+	req.tp_frame_nr = req.tp_block_nr * framesPerBlock;
+	frameNr = req.tp_frame_nr;
+	size = (size_t) req.tp_block_size * req.tp_block_nr;
+
+	// Protocol 0: the socket is only used to send, no packet is ever queued for reading on it
+	if ((sd = ::socket(AF_PACKET, SOCK_DGRAM, 0)) < 0)
+		throw SocketException("socket error");
+
+	opt = TPACKET_V3;
+
+	if (setsockopt(sd, SOL_PACKET, PACKET_VERSION, &opt, sizeof(opt)) < 0 ||
+			setsockopt(sd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)  {
+		::close(sd);
+		throw SocketException("unable to set up the transmit ring");
+	}
+
+	// Skip the qdisc layer where supported, as the packets are already paced by the ring
+	opt = 1;
+	setsockopt(sd, SOL_PACKET, PACKET_QDISC_BYPASS, &opt, sizeof(opt));
+
+	if ((ring = (u_int8_t*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sd, 0)) == MAP_FAILED)  {
+		ring = NULL;
+		::close(sd);
+		throw SocketException("unable to map the transmit ring");
+	}
+}
+
+TxRing::~TxRing()  {
+	if (ring)
+		munmap(ring, size);
+
+	if (sd >= 0)
+		::close(sd);
+}
+
+struct tpacket3_hdr* TxRing::frame (u_int32_t i) throw()  {
+	return (struct tpacket3_hdr*) (ring + (size_t) (i / framesPerBlock) * blockSize + (i % framesPerBlock) * frameSize);
+}
+
+void TxRing::queue (const void* pkt, u_int32_t len) throw()  {
+	struct tpacket3_hdr *h = frame(head);
+	volatile u_int32_t *status = &h->tp_status;
+	u_int16_t proto = htons((len && (((const u_int8_t*) pkt)[0] >> 4) == 6) ? ETH_P_IPV6 : ETH_P_IP);
+
+	if (len > frameSize - TX_DATA_OFFSET)
+		throw SocketException("packet too big for the ring frames");
+
+	// The ethertype comes from the address given to send(), the same for all the frames it hands over
+	if (proto != sll.sll_protocol)  {
+		if (pending)
+			flush();
+
+		sll.sll_protocol = proto;
+	}
+
+	// The frame is still owned by the kernel: the ring is full
+	while (*status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))  {
+		struct pollfd pfd;
+
+		if (pending)  {
+			flush();
+			continue;
+		}
+
+		pfd.fd = sd;
+		pfd.events = POLLOUT;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			throw SocketException("poll exception");
+	}
+
+	memcpy ((u_int8_t*) h + TX_DATA_OFFSET, pkt, len);
+	h->tp_len = len;
+	h->tp_snaplen = len;
+	h->tp_next_offset = 0;
+
+	// The packet must be in place before the kernel can see the frame as ready
+	__sync_synchronize();
+	*status = TP_STATUS_SEND_REQUEST;
+
+	head = (head + 1) % frameNr;
+	pending++;
+}
+
+void TxRing::queue (const PacketTemplate& t) throw()  {
+	queue(t.data(), t.length());
+}
+
+u_int32_t TxRing::flush() throw()  {
+	u_int32_t n = pending;
+
+	if (!n)
+		return 0;
+
+	while (::sendto(sd, NULL, 0, 0, (struct sockaddr*) &sll, sizeof(sll)) < 0)  {
+		struct pollfd pfd;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno != ENOBUFS && errno != EAGAIN)
+			throw SocketException("send exception");
+
+		// The device queue is full: wait for the kernel to make room instead of spinning
+		pfd.fd = sd;
+		pfd.events = POLLOUT;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			throw SocketException("poll exception");
+	}
+
+	pending = 0;
+	return n;
+}
+
+u_int32_t TxRing::queued() throw()  { return pending; }
+
+u_int32_t TxRing::capacity() throw()  { return frameNr; }
+
+int TxRing::getDescriptor() throw()  { return sd; }
@@ -42,7 +42,9 @@
  * this file might be covered by the GNU General Public License.
  */
 
+#include <cstring>
 #include <arpa/inet.h>
+#include <poll.h>
 #include "usock.h"
 #include "usock_exception.h"
 
@@ -54,124 +56,249 @@ using namespace usock;
 UDPSocket::UDPSocket (int domain) throw() : BaseSocket(domain, SOCK_DGRAM, IPPROTO_UDP)  {}
 
 void UDPSocket::send (const string& buf, const string& host, u_int16_t port) throw()  {
-	string addr = getHostByName(host);
-	struct sockaddr_in sock;
+	send(buf.data(), buf.length(), Endpoint(host, port, resolveFamily()));
+}
 
-	sock.sin_family = domain;
-	sock.sin_port = htons(port);
-	sock.sin_addr.s_addr = inet_addr(addr.c_str());
+void UDPSocket::send (const void* buf, u_int32_t size, const string& host, u_int16_t port) throw()  {
+	send(buf, size, Endpoint(host, port, resolveFamily()));
+}
 
-	if (sendto(sd, buf.c_str(), buf.length(), 0, (struct sockaddr*) &sock, sizeof(struct sockaddr)) < 0)
-		throw SocketException("send exception");
+void UDPSocket::send (const struct iovec* iov, int iovcnt, const string& host, u_int16_t port) throw()  {
+	Endpoint ep(host, port, resolveFamily());
+	struct msghdr msg;
+	struct sockaddr_storage tmp;
+	socklen_t len;
+
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_name = (void*) peerAddr(ep, tmp, len);
+	msg.msg_namelen = len;
+	msg.msg_iov = (struct iovec*) iov;
+	msg.msg_iovlen = iovcnt;
+	sendMsgWait(&msg);
 }
 
-void UDPSocket::send (const void* buf, u_int32_t size, const string& host, u_int16_t port) throw()  {
-	string addr = getHostByName(host);
-	struct sockaddr_in sock;
+void UDPSocket::send (const void* buf, u_int32_t size, const Endpoint& ep) throw()  {
+	struct sockaddr_storage tmp;
+	socklen_t len;
+	const struct sockaddr *to = peerAddr(ep, tmp, len);
 
-	sock.sin_family = domain;
-	sock.sin_port = htons(port);
-	sock.sin_addr.s_addr = inet_addr(addr.c_str());
+	sendWait(buf, size, 0, to, len);
+}
 
-	if (sendto(sd, buf, size, 0, (struct sockaddr*) &sock, sizeof(struct sockaddr)) < 0)
-		throw SocketException("send exception");
+void UDPSocket::send (const string& buf, const Endpoint& ep) throw()  {
+	send(buf.data(), buf.length(), ep);
 }
 
-void UDPSocket::recv (void* buf, u_int32_t size, const string& host, u_int16_t port) throw()  {
-	string addr;
-	struct sockaddr_in sock;
-	socklen_t len = sizeof(struct sockaddr);
-
-	if (!host.empty())
-		addr = getHostByName(host);
-	else
-		addr = "";
-
-	if (port)  {
-		sock.sin_family = domain;
-		sock.sin_port = htons(port);
-		sock.sin_addr.s_addr = (!addr.empty()) ? inet_addr(addr.c_str()) : INADDR_ANY;
+void UDPSocket::send (const void* buf, u_int32_t size) throw()  {
+	sendWait(buf, size);
+}
+
+void UDPSocket::connect (const Endpoint& ep) throw()  {
+	struct sockaddr_storage tmp;
+	socklen_t len;
+	const struct sockaddr *to = peerAddr(ep, tmp, len);
+
+	if (::connect(sd, to, len) < 0)
+		throw SocketException("connect exception");
+}
+
+u_int32_t UDPSocket::recv (void* buf, u_int32_t size, Endpoint& from) throw()  {
+	struct sockaddr_storage sock;
+	socklen_t len = sizeof(sock);
+	u_int32_t n;
+
+	// The rest of a datagram already buffered by readline() comes first
+	if ((n = drain(buf, size)))  {
+		from = Endpoint((struct sockaddr*) &rbuf_from, rbuf_fromlen);
+		return n;
 	}
 
-	if (recvfrom(sd, buf, size, 0, (struct sockaddr*) &sock, &len) < 0)
-		throw SocketException("recv exception");
+	n = recvWait(buf, size, 0, (struct sockaddr*) &sock, &len);
+	from = Endpoint((struct sockaddr*) &sock, len);
+	return n;
 }
 
-string UDPSocket::recv (const string& host, u_int16_t port) throw()  {
-	char* buf = new char[BUFRECV_SIZE];
-	raii_array<char> buf_holder(buf);
+u_int32_t UDPSocket::recv (const struct iovec* iov, int iovcnt) throw()  {
+	struct msghdr msg;
 	u_int32_t n;
 
-	struct sockaddr_in sock;
-	string addr;
-	socklen_t len = sizeof(struct sockaddr);
+	if ((n = drain(iov, iovcnt)))
+		return n;
+
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec*) iov;
+	msg.msg_iovlen = iovcnt;
+	return recvMsgWait(&msg);
+}
+
+void UDPSocket::recv (void* buf, u_int32_t size, const string& host, u_int16_t port) throw()  {
+	// host and port are not used as a filter (recvfrom() just overwrites the address),
+	// so they are not resolved either: that would cost a lookup for each datagram
+	struct sockaddr_storage sock;
+	socklen_t len = sizeof(sock);
+
+	// The rest of a datagram already buffered by readline() comes first
+	if (drain(buf, size))
+		return;
 
-	if (!host.empty())
-		addr = getHostByName(host);
-	else
-		addr = "";
+	recvWait(buf, size, 0, (struct sockaddr*) &sock, &len);
+}
 
-	if (port)  {
-		sock.sin_family = domain;
-		sock.sin_port = htons(port);
-		sock.sin_addr.s_addr = (!addr.empty()) ? inet_addr(addr.c_str()) : INADDR_ANY;
+string UDPSocket::recv (const string& host, u_int16_t port) throw()  {
+	if (pending())  {
+		string str(pending(), '\0');
+		drain(&str[0], str.length());
+		return str;
 	}
 
-	if ((n = recvfrom(sd, buf, BUFRECV_SIZE, 0, (struct sockaddr*) &sock, &len)) < 0)
-		throw SocketException("recv exception");
+	char buf[BUFRECV_SIZE];
+	u_int32_t n;
+
+	struct sockaddr_storage sock;
+	socklen_t len = sizeof(sock);
+
+	n = recvWait(buf, BUFRECV_SIZE, 0, (struct sockaddr*) &sock, &len);
 
 	if (!n) return string();
-	return string(buf);
+	return string(buf, n);
 }
 
-string UDPSocket::readline(const string& host, u_int16_t port) throw()  {
-	string line, addr;
-	bool isEOF = false;
-	bool isEOL = false;
+Buffer UDPSocket::recvBuffer (u_int32_t size, Endpoint* from) throw()  {
+	struct sockaddr_storage sock;
+	socklen_t len = sizeof(sock);
 
-	struct sockaddr_in sock;
+	if (pending())  {
+		Buffer b = BufferPool::getDefault().get(std::min(size, pending()));
+		drain(b.data(), b.size());
 
-	if (!host.empty())
-		addr = getHostByName(host);
+		if (from)
+			*from = Endpoint((struct sockaddr*) &rbuf_from, rbuf_fromlen);
 
-	socklen_t len = sizeof(struct sockaddr);
+		return b;
+	}
+
+	Buffer b = BufferPool::getDefault().get(size);
+	b.resize(recvWait(b.data(), size, 0, (struct sockaddr*) &sock, &len));
+
+	if (from)
+		*from = Endpoint((struct sockaddr*) &sock, len);
+
+	return b;
+}
+
+u_int32_t UDPSocket::recvBatch (DatagramBatch& batch) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	int n;
+
+	batch.prepareRecv();
 
-	if (port)  {
-		sock.sin_family = domain;
-		sock.sin_port = htons(port);
-		sock.sin_addr.s_addr = (!addr.empty()) ? inet_addr(addr.c_str()) : INADDR_ANY;
+	while ((n = recvmmsg(sd, &batch.hdrs[0], batch.capacity(), MSG_WAITFORONE, NULL)) < 0)  {
+		if (errno == EINTR)
+			continue;
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			throw SocketException("recv exception");
+
+		if (!dl && timeout > 0.0)
+			dl = deadline(ts);
+
+		waitFor(POLLIN, dl);
 	}
 
-	while (!isEOL && !isEOF)  {
-		char buf;
-		u_int32_t n = recvfrom(sd, &buf, 1, 0, (struct sockaddr*) &sock, &len);
-		
-		if (n < 1)
-			isEOF = true;
-		else if (buf == '\n')
-			isEOL = true;
-		else  {
-			if (buf != '\r')
-				line += buf;
+	for (int i=0; i < n; i++)
+		batch.iovs[i].iov_len = batch.hdrs[i].msg_len;
+
+	batch.count = n;
+	return n;
+}
+
+u_int32_t UDPSocket::sendBatch (DatagramBatch& batch) throw()  {
+	struct timespec ts;
+	const struct timespec *dl = NULL;
+	u_int32_t sent = 0;
+	int n;
+
+	// As in send(..., Endpoint), IPv4 destinations become IPv4-mapped addresses on a dual-stack socket
+	if (domain == AF_INET6)  {
+		for (u_int32_t i=0; i < batch.count; i++)  {
+			struct sockaddr_storage tmp;
+			socklen_t len;
+
+			if (batch.addrs[i].ss_family != AF_INET)
+				continue;
+
+			// An IPv4 endpoint is always mapped into tmp
+			peerAddr(Endpoint((struct sockaddr*) &batch.addrs[i], batch.hdrs[i].msg_hdr.msg_namelen), tmp, len);
+			memcpy (&batch.addrs[i], &tmp, len);
+			batch.hdrs[i].msg_hdr.msg_namelen = len;
 		}
 	}
 
-	if (line.length() < 1)  {
-		if (isEOF) line = "";
-		else line = "\r";
+	// What has been sent leaves the batch right away, so that an error or a timeout
+	// leaves there only the datagrams which still have to go
+	while (batch.count)  {
+		if ((n = sendmmsg(sd, &batch.hdrs[0], batch.count, 0)) < 0)  {
+			if (errno == EINTR)
+				continue;
+
+			// sendmmsg() only fails on its first datagram: drop it, or every retry would fail on it again
+			if (errno != EAGAIN && errno != EWOULDBLOCK)  {
+				batch.consume(1);
+				throw SocketException("send exception");
+			}
+
+			if (!dl && timeout > 0.0)
+				dl = deadline(ts);
+
+			waitFor(POLLOUT, dl);
+			continue;
+		}
+
+		sent += n;
+		batch.consume(n);
 	}
 
-	return string(line);
+	return sent;
 }
 
-void UDPSocket::bind (u_int16_t port) throw()  {
-	struct sockaddr_in sock;
+string UDPSocket::readline(const string& host, u_int16_t port) throw()  {
+	// Each datagram is received as a whole into the input buffer, and the lines are then taken
+	// from there. Reading it one byte at a time would just drop everything after its first byte
+	return bufferedReadline();
+}
 
-	sock.sin_family = domain;
-	sock.sin_port = htons(port);
-	sock.sin_addr.s_addr = INADDR_ANY;
+void UDPSocket::bind (u_int16_t port) throw()  {
+	struct sockaddr_storage sock;
+	socklen_t len;
+
+	memset (&sock, 0, sizeof(sock));
+
+	if (domain == AF_INET6)  {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &sock;
+		int off = 0;
+
+		// Dual-stack: IPv4 peers are seen as IPv4-mapped addresses
+		setSockOpt(IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		sin6->sin6_addr = in6addr_any;
+		len = sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in*) &sock;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		sin->sin_addr.s_addr = INADDR_ANY;
+		len = sizeof(struct sockaddr_in);
+	}
 
-	if (::bind(sd, (struct sockaddr*) &sock, sizeof(struct sockaddr)) < 0)
+	if (::bind(sd, (struct sockaddr*) &sock, len) < 0)
 		throw SocketException("bind exception");
 }
 
+int UDPSocket::resolveFamily() throw()  {
+	// An IPv6 socket can reach IPv4 hosts too, through IPv4-mapped addresses
+	return (domain == AF_INET6) ? AF_UNSPEC : domain;
+}
+
@@ -0,0 +1,1002 @@
+/**
+ * ======================================
+ *  _ _ _                          _    
+ * | (_) |                        | |   
+ * | |_| |__  _   _ ___  ___   ___| | __
+ * | | | '_ \| | | / __|/ _ \ / __| |/ /
+ * | | | |_) | |_| \__ \ (_) | (__|   < 
+ * |_|_|_.__/ \__,_|___/\___/ \___|_|\_\
+ *
+ * ======================================
+ *
+ * The files in this directory and elsewhere which refer to this LICENCE
+ * file are part of uSock, the library for the high-level management of
+ * network sockets.
+ *
+ * Copyright (C) 2009 by BlackLight, <blacklight@autistici.org>
+ * Web: http://0x00.ath.cx
+ *
+ * uSock is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 or (at your option) any later 
+ * version.
+ *
+ * uSock is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with uSock; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *
+ * As a special exception, if other files instantiate templates or use
+ * macros or inline functions from these files, or you compile these
+ * files and link them with other works to produce a work based on these
+ * files, these files do not by themselves cause the resulting work to be
+ * covered by the GNU General Public License. However the source code for
+ * these files must still be made available in accordance with section (3)
+ * of the GNU General Public License.
+ *
+ * This exception does not invalidate any other reasons why a work based on
+ * this file might be covered by the GNU General Public License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "usock.h"
+#include "usock_uring.h"
+#include "usock_exception.h"
+
+using namespace usock;
+
+// Kinds of registered sockets
+enum  { KIND_SERVER, KIND_STREAM, KIND_DGRAM };
+
+// Requests, kept in the low bits of the user_data of their completions (the upper bits hold the entry).
+// The completions of OP_NONE requests are just reaped
+enum  { OP_NONE, OP_ACCEPT, OP_RECV, OP_SEND, OP_WAKE };
+
+#define	OP_MASK	7
+
+struct UringLoop::Ring  {
+	int fd;
+
+	///@brief Rings shared with the kernel (single mmap), and submission queue entries
+	void *map;
+	size_t maplen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+	unsigned sqentries;
+
+	///@brief Local tail of the submission queue, published to the kernel on enter()
+	unsigned tail;
+
+	///@brief Ring of provided receive buffers, and the buffers themselves
+	struct io_uring_buf_ring *br;
+	size_t brlen;
+	char *bufs;
+	u_int32_t nbufs, bufsize;
+	u_int16_t brtail;
+
+	///@brief The buffers are given through IORING_OP_PROVIDE_BUFFERS requests instead of the ring
+	bool legacy;
+
+	///@brief Requests whose last completion hasn't been reaped yet
+	u_int32_t inflight;
+
+	unsigned long enters, submitted;
+
+	Ring() : fd(-1), map(MAP_FAILED), sqes((struct io_uring_sqe*) MAP_FAILED), br((struct io_uring_buf_ring*) MAP_FAILED),
+		bufs(NULL), brtail(0), legacy(false), inflight(0), enters(0), submitted(0)  {}
+
+	~Ring()  {
+		if (br != MAP_FAILED)
+			munmap(br, brlen);
+
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqeslen);
+
+		if (map != MAP_FAILED)
+			munmap(map, maplen);
+
+		if (fd >= 0)
+			::close(fd);
+
+		delete [] bufs;
+	}
+
+	/**
+	 * Submit the queued entries, and wait for min completions (up to ms milliseconds, if ms >= 0)
+	 */
+	int enter (unsigned min, int ms)  {
+		struct io_uring_getevents_arg arg;
+		struct __kernel_timespec ts;
+		unsigned flags = 0;
+		int ret;
+
+		__atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+
+		if (min)  {
+			flags |= IORING_ENTER_GETEVENTS;
+
+			if (ms >= 0)  {
+				ts.tv_sec = ms / 1000;
+				ts.tv_nsec = (ms % 1000) * 1000000L;
+				memset (&arg, 0, sizeof(arg));
+				arg.sigmask_sz = _NSIG / 8;
+				arg.ts = (u_int64_t) (uintptr_t) &ts;
+				flags |= IORING_ENTER_EXT_ARG;
+			}
+		}
+
+		ret = syscall(__NR_io_uring_enter, fd, tail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE), min, flags,
+			(flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+		enters++;
+
+		if (ret > 0)
+			submitted += ret;
+
+		return ret;
+	}
+
+	/**
+	 * Get a blank submission queue entry, submitting the queued ones first if the queue is full
+	 */
+	struct io_uring_sqe* get()  {
+		while (tail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE) >= sqentries)
+			enter(0, -1);
+
+		struct io_uring_sqe *sqe = &sqes[tail & *sqmask];
+		memset (sqe, 0, sizeof(*sqe));
+		sqarray[tail & *sqmask] = tail & *sqmask;
+		tail++;
+		inflight++;
+		return sqe;
+	}
+
+	/**
+	 * Receive a byte from a socket pair through the provided buffers, and give the buffer back
+	 */
+	bool test();
+
+	///@brief Give a receive buffer back to the kernel
+	void recycle (u_int16_t bid)  {
+		if (legacy)  {
+			struct io_uring_sqe *sqe = get();
+
+			sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+			sqe->fd = 1;
+			sqe->addr = (u_int64_t) (uintptr_t) (bufs + (size_t) bid * bufsize);
+			sqe->len = bufsize;
+			sqe->off = bid;
+			sqe->buf_group = 0;
+			sqe->user_data = OP_NONE;
+			return;
+		}
+
+		struct io_uring_buf *b = &br->bufs[brtail & (nbufs - 1)];
+
+		b->addr = (u_int64_t) (uintptr_t) (bufs + (size_t) bid * bufsize);
+		b->len = bufsize;
+		b->bid = bid;
+		__atomic_store_n(&br->tail, ++brtail, __ATOMIC_RELEASE);
+	}
+};
+
+struct UringLoop::Entry  {
+	int fd;
+	int kind;
+	BaseSocket *sock;
+	UringHandler *handler;
+	bool owned;
+	bool dead;
+
+	///@brief Whether the entry is in the list of queued sends
+	bool queued;
+
+	///@brief Requests in flight on the socket
+	u_int32_t inflight;
+
+	///@brief TCP data queued by send(), and data being sent (from offset 'sent')
+	std::vector<char> outq, sending;
+	u_int32_t sent;
+
+	///@brief UDP datagrams: batch[cur] is filled by send() while the other one is being sent
+	DatagramBatch *batch[2];
+	u_int32_t cur, dgInflight;
+
+	///@brief Header for the multishot recvmsg() of a UDP socket
+	struct msghdr msg;
+};
+
+bool UringLoop::Ring::test()  {
+	struct io_uring_sqe *sqe;
+	int sv[2], res = -1;
+	u_int32_t flags = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return false;
+
+	if (::write(sv[1], "", 1) == 1)  {
+		sqe = get();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sv[0];
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = OP_RECV;
+
+		// Reap everything up to the receive (a PROVIDE_BUFFERS request may come before it)
+		while (inflight > 0 && enter(1, 1000) >= 0)  {
+			unsigned head = *cqhead;
+
+			for (; head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE); head++)  {
+				struct io_uring_cqe *cqe = &cqes[head & *cqmask];
+
+				if (cqe->user_data == OP_RECV)  {
+					res = cqe->res;
+					flags = cqe->flags;
+				}
+
+				inflight--;
+			}
+
+			__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	::close(sv[0]);
+	::close(sv[1]);
+
+	if (res == 1 && (flags & IORING_CQE_F_BUFFER))  {
+		recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+		return true;
+	}
+
+	return false;
+}
+
+bool UringLoop::setupRing (u_int32_t entries, u_int32_t nbufs)  {
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	std::vector<u_int8_t> probebuf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe *probe = (struct io_uring_probe*) &probebuf[0];
+	Ring *r = new Ring;
+	int fd;
+
+	memset (&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+	if ((fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)  {
+		delete r;
+		return false;
+	}
+
+	r->fd = fd;
+
+	// Multishot receives came with Linux 6.0, as IORING_OP_SEND_ZC did: the latter can be probed for
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+			syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+			probe->last_op < IORING_OP_SEND_ZC || !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))  {
+		delete r;
+		return false;
+	}
+
+	r->maplen = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	r->map = mmap(NULL, r->maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe*) mmap(NULL, r->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	r->brlen = nbufs * sizeof(struct io_uring_buf);
+	r->br = (struct io_uring_buf_ring*) mmap(NULL, r->brlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (r->map == MAP_FAILED || r->sqes == MAP_FAILED || r->br == MAP_FAILED)  {
+		delete r;
+		return false;
+	}
+
+	char *base = (char*) r->map;
+	r->sqhead = (unsigned*) (base + p.sq_off.head);
+	r->sqtail = (unsigned*) (base + p.sq_off.tail);
+	r->sqmask = (unsigned*) (base + p.sq_off.ring_mask);
+	r->sqarray = (unsigned*) (base + p.sq_off.array);
+	r->cqhead = (unsigned*) (base + p.cq_off.head);
+	r->cqtail = (unsigned*) (base + p.cq_off.tail);
+	r->cqmask = (unsigned*) (base + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (base + p.cq_off.cqes);
+	r->sqentries = p.sq_entries;
+	r->tail = *r->sqtail;
+
+	memset (&reg, 0, sizeof(reg));
+	reg.ring_addr = (u_int64_t) (uintptr_t) r->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = 0;
+
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)  {
+		delete r;
+		return false;
+	}
+
+	r->nbufs = nbufs;
+	r->bufsize = bufsize;
+	r->bufs = new char[(size_t) nbufs * bufsize];
+
+	for (u_int32_t i=0; i < nbufs; i++)
+		r->recycle(i);
+
+	// Some kernels accept the buffer ring but never pick a buffer from it (ENOBUFS): try a receive
+	// first, and hand the buffers the older way if it fails
+	if (!r->test())  {
+		syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		r->legacy = true;
+
+		struct io_uring_sqe *sqe = r->get();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = nbufs;
+		sqe->addr = (u_int64_t) (uintptr_t) r->bufs;
+		sqe->len = bufsize;
+		sqe->off = 0;
+		sqe->buf_group = 0;
+		sqe->user_data = OP_NONE;
+
+		if (!r->test())  {
+			delete r;
+			return false;
+		}
+	}
+
+	r->enters = r->submitted = 0;
+	ring = r;
+	return true;
+}
+
+void UringLoop::armWake() throw()  {
+	struct io_uring_sqe *sqe = ring->get();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = wakefd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = OP_WAKE;
+}
+
+UringLoop::UringLoop (u_int32_t entries, u_int32_t nbufs, u_int32_t bufsize, bool uring) throw()  {
+	ring = NULL;
+	epfd = -1;
+	running = true;
+	nentries = 0;
+	this->bufsize = bufsize;
+	memset (&counters, 0, sizeof(counters));
+
+	if (!nbufs || (nbufs & (nbufs - 1)) || nbufs > 32768 || !bufsize)  {
+		errno = EINVAL;
+		throw SocketException("invalid buffer ring size");
+	}
+
+	if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		throw SocketException("eventfd error");
+
+	if (uring && setupRing(entries, nbufs))  {
+		armWake();
+		return;
+	}
+
+	struct epoll_event ev;
+	rxbuf.resize(bufsize);
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		throw SocketException("epoll_create error");
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0)
+		throw SocketException("epoll_ctl error");
+}
+
+UringLoop::~UringLoop()  {
+	if (ring)  {
+		// The kernel may still write into our buffers until the requests are over: cancel them all, and wait
+		struct io_uring_sqe *sqe = ring->get();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = OP_NONE;
+
+		for (int tries=0; ring->inflight > 0 && tries < 100; tries++)  {
+			unsigned head = *ring->cqhead;
+
+			if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+				ring->enter(1, 10);
+
+			for (; head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE); head++)  {
+				struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqmask];
+
+				if ((cqe->user_data & OP_MASK) == OP_ACCEPT && cqe->res >= 0)
+					::close(cqe->res);
+
+				if (!(cqe->flags & IORING_CQE_F_MORE))
+					ring->inflight--;
+			}
+
+			__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+		}
+
+		delete ring;
+	}
+
+	for (u_int32_t i=0; i < entries.size(); i++)
+		if (entries[i])
+			closed.push_back(entries[i]);
+
+	for (u_int32_t i=0; i < closed.size(); i++)  {
+		if (closed[i]->owned)
+			delete closed[i]->sock;
+
+		delete closed[i]->batch[0];
+		delete closed[i]->batch[1];
+		delete closed[i];
+	}
+
+	::close(wakefd);
+
+	if (epfd >= 0)
+		::close(epfd);
+}
+
+bool UringLoop::usingUring() throw()  { return ring != NULL; }
+
+UringLoop::Entry* UringLoop::attach (BaseSocket* s, int kind, UringHandler& handler) throw()  {
+	Entry *e = new Entry;
+
+	e->fd = s->getDescriptor();
+	e->kind = kind;
+	e->sock = s;
+	e->handler = &handler;
+	e->owned = false;
+	e->dead = false;
+	e->queued = false;
+	e->inflight = 0;
+	e->sent = 0;
+	e->batch[0] = e->batch[1] = NULL;
+	e->cur = 0;
+	e->dgInflight = 0;
+	memset (&e->msg, 0, sizeof(e->msg));
+
+	if (kind == KIND_DGRAM)  {
+		e->batch[0] = new DatagramBatch(URING_UDP_BATCH, bufsize);
+		e->batch[1] = new DatagramBatch(URING_UDP_BATCH, bufsize);
+		e->msg.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+
+	if (ring)
+		arm(e);
+	else  {
+		struct epoll_event ev;
+
+		s->setBlocking(false);
+		ev.events = EPOLLIN;
+		ev.data.ptr = e;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0)  {
+			delete e->batch[0];
+			delete e->batch[1];
+			delete e;
+			return NULL;
+		}
+	}
+
+	if ((u_int32_t) e->fd >= entries.size())
+		entries.resize(e->fd + 1, NULL);
+
+	entries[e->fd] = e;
+	nentries++;
+	return e;
+}
+
+UringLoop::Entry* UringLoop::lookup (BaseSocket& s, int kind) throw()  {
+	int fd = s.getDescriptor();
+
+	if (fd < 0 || (u_int32_t) fd >= entries.size() || !entries[fd] || entries[fd]->kind != kind)  {
+		errno = EBADF;
+		throw SocketException("socket not registered onto the loop");
+	}
+
+	return entries[fd];
+}
+
+void UringLoop::add (ServerSocket& ss, UringHandler& handler) throw()  {
+	if (!attach(&ss, KIND_SERVER, handler))
+		throw SocketException("epoll_ctl error");
+}
+
+void UringLoop::add (Socket& s, UringHandler& handler) throw()  {
+	if (!attach(&s, KIND_STREAM, handler))
+		throw SocketException("epoll_ctl error");
+}
+
+void UringLoop::add (UDPSocket& s, UringHandler& handler) throw()  {
+	if (!attach(&s, KIND_DGRAM, handler))
+		throw SocketException("epoll_ctl error");
+}
+
+void UringLoop::arm (Entry* e) throw()  {
+	struct io_uring_sqe *sqe = ring->get();
+
+	sqe->fd = e->fd;
+
+	if (e->kind == KIND_SERVER)  {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = (u_int64_t) (uintptr_t) e | OP_ACCEPT;
+	} else {
+		sqe->opcode = (e->kind == KIND_STREAM) ? IORING_OP_RECV : IORING_OP_RECVMSG;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = (u_int64_t) (uintptr_t) e | OP_RECV;
+
+		if (e->kind == KIND_DGRAM)  {
+			sqe->addr = (u_int64_t) (uintptr_t) &e->msg;
+			sqe->len = 1;
+		}
+	}
+
+	e->inflight++;
+}
+
+void UringLoop::send (Socket& s, const void* buf, u_int32_t len) throw()  {
+	Entry *e = lookup(s, KIND_STREAM);
+
+	e->outq.insert(e->outq.end(), (const char*) buf, (const char*) buf + len);
+
+	if (!e->queued)  {
+		e->queued = true;
+		dirty.push_back(e);
+	}
+}
+
+void UringLoop::send (UDPSocket& s, const void* buf, u_int32_t len, const struct sockaddr* to, socklen_t tolen) throw()  {
+	Entry *e = lookup(s, KIND_DGRAM);
+
+	if (!e->batch[e->cur]->append(buf, len, to, tolen))  {
+		// Full batch: hand it to the kernel now, or send it in place if the other one is still in flight
+		if (ring && !e->dgInflight)
+			flush(e);
+		else
+			s.sendBatch(*e->batch[e->cur]);
+
+		e->batch[e->cur]->append(buf, len, to, tolen);
+	}
+
+	if (!e->queued)  {
+		e->queued = true;
+		dirty.push_back(e);
+	}
+}
+
+void UringLoop::flush (Entry* e)  {
+	if (e->dead)
+		return;
+
+	if (e->kind == KIND_DGRAM)  {
+		DatagramBatch *b = e->batch[e->cur];
+
+		if (!b->count)
+			return;
+
+		if (!ring)  {
+			counters.submitted++;
+			((UDPSocket*) e->sock)->sendBatch(*b);
+			return;
+		}
+
+		if (e->dgInflight)
+			return;
+
+		for (u_int32_t i=0; i < b->count; i++)  {
+			struct io_uring_sqe *sqe = ring->get();
+
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = e->fd;
+			sqe->addr = (u_int64_t) (uintptr_t) &b->hdrs[i].msg_hdr;
+			sqe->len = 1;
+			sqe->user_data = (u_int64_t) (uintptr_t) e | OP_SEND;
+		}
+
+		e->inflight += b->count;
+		e->dgInflight = b->count;
+		e->cur ^= 1;
+		return;
+	}
+
+	if (ring)  {
+		// One send in flight at a time per connection, so that the data goes out in order
+		if (!e->sending.empty() || e->outq.empty())
+			return;
+
+		e->sending.swap(e->outq);
+		e->sent = 0;
+
+		struct io_uring_sqe *sqe = ring->get();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = e->fd;
+		sqe->addr = (u_int64_t) (uintptr_t) &e->sending[0];
+		sqe->len = e->sending.size();
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = (u_int64_t) (uintptr_t) e | OP_SEND;
+		e->inflight++;
+		return;
+	}
+
+	while (e->sent < e->outq.size())  {
+		ssize_t n = ::send(e->fd, &e->outq[e->sent], e->outq.size() - e->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		counters.submitted++;
+
+		if (n < 0)  {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)  {
+				struct epoll_event ev;
+				ev.events = EPOLLIN | EPOLLOUT;
+				ev.data.ptr = e;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, e->fd, &ev);
+				return;
+			}
+
+			drop(e);
+			return;
+		}
+
+		e->sent += n;
+	}
+
+	e->outq.clear();
+	e->sent = 0;
+}
+
+void UringLoop::drop (Entry* e)  {
+	if (e->dead)
+		return;
+
+	e->dead = true;
+	entries[e->fd] = NULL;
+	nentries--;
+	closed.push_back(e);
+
+	if (e->queued)  {
+		dirty.erase(std::remove(dirty.begin(), dirty.end(), e), dirty.end());
+		e->queued = false;
+	}
+
+	if (ring)
+		// Makes the multishot receive, and the sends in flight, complete
+		::shutdown(e->fd, SHUT_RDWR);
+	else
+		epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, NULL);
+
+	if (e->kind == KIND_STREAM)
+		e->handler->onClosed(*this, *((Socket*) e->sock));
+
+	e->sock->close();
+}
+
+void UringLoop::close (Socket& s)  {
+	int fd = s.getDescriptor();
+
+	if (fd < 0 || (u_int32_t) fd >= entries.size() || !entries[fd])
+		return;
+
+	drop(entries[fd]);
+}
+
+void UringLoop::complete (Entry* e, int op, int res, u_int32_t flags)  {
+	bool more = (flags & IORING_CQE_F_MORE);
+	char *data = NULL;
+
+	if (!more)
+		e->inflight--;
+
+	if (op == OP_SEND)  {
+		if (e->kind == KIND_DGRAM)  {
+			// Send errors on a datagram socket only concern that datagram
+			if (--e->dgInflight == 0)  {
+				e->batch[e->cur ^ 1]->clear();
+
+				if (e->batch[e->cur]->count && !e->queued && !e->dead)  {
+					e->queued = true;
+					dirty.push_back(e);
+				}
+			}
+
+			return;
+		}
+
+		if (e->dead)
+			return;
+
+		if (res < 0)  {
+			drop(e);
+			return;
+		}
+
+		// Partial send: the rest goes out first, before anything queued in the meantime
+		if ((e->sent += res) < e->sending.size())  {
+			struct io_uring_sqe *sqe = ring->get();
+			sqe->opcode = IORING_OP_SEND;
+			sqe->fd = e->fd;
+			sqe->addr = (u_int64_t) (uintptr_t) &e->sending[e->sent];
+			sqe->len = e->sending.size() - e->sent;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = (u_int64_t) (uintptr_t) e | OP_SEND;
+			e->inflight++;
+			return;
+		}
+
+		e->sending.clear();
+		e->sent = 0;
+
+		if (!e->outq.empty() && !e->queued)  {
+			e->queued = true;
+			dirty.push_back(e);
+		}
+
+		return;
+	}
+
+	if (op == OP_ACCEPT)  {
+		if (res >= 0)  {
+			if (e->dead)
+				::close(res);
+			else  {
+				Socket *s = new Socket(res);
+				Entry *c = attach(s, KIND_STREAM, *(e->handler));
+				c->owned = true;
+				e->handler->onAccept(*this, *s);
+			}
+		}
+
+		// A listener which was closed, or shut down, fails with EBADF/EINVAL: don't spin on it
+		if (!more && !e->dead && res != -EBADF && res != -EINVAL && res != -ECANCELED)
+			arm(e);
+
+		return;
+	}
+
+	if (flags & IORING_CQE_F_BUFFER)
+		data = ring->bufs + (size_t) (flags >> IORING_CQE_BUFFER_SHIFT) * ring->bufsize;
+
+	if (res == -ENOBUFS)
+		counters.bufferStalls++;
+
+	if (e->kind == KIND_STREAM)  {
+		if (res > 0 && data && !e->dead)
+			e->handler->onData(*this, *((Socket*) e->sock), data, res);
+		else if (res != -ENOBUFS && !e->dead)
+			drop(e);
+	} else if (res > 0 && data && !e->dead)  {
+		struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) data;
+		u_int32_t hdrlen = sizeof(*out) + e->msg.msg_namelen + e->msg.msg_controllen;
+
+		if ((u_int32_t) res >= hdrlen)  {
+			e->handler->onDatagram(*this, *((UDPSocket*) e->sock), data + hdrlen,
+				std::min(out->payloadlen, (u_int32_t) res - hdrlen), (struct sockaddr*) (out + 1),
+				std::min(out->namelen, e->msg.msg_namelen));
+		}
+	}
+
+	if (data)
+		ring->recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+
+	if (!more && !e->dead)
+		arm(e);
+}
+
+void UringLoop::acceptAll (Entry* e)  {
+	while (!e->dead)  {
+		int new_sd = ::accept4(e->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		counters.submitted++;
+
+		if (new_sd < 0)  {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			break;
+		}
+
+		Socket *s = new Socket(new_sd);
+		Entry *c = attach(s, KIND_STREAM, *(e->handler));
+
+		if (!c)  {
+			delete s;
+			continue;
+		}
+
+		c->owned = true;
+		e->handler->onAccept(*this, *s);
+	}
+}
+
+void UringLoop::dispatch (Entry* e, u_int32_t events)  {
+	if (e->kind == KIND_SERVER)  {
+		acceptAll(e);
+		return;
+	}
+
+	if (e->kind == KIND_DGRAM)  {
+		struct sockaddr_storage from;
+
+		for (int i=0; i < URING_UDP_BATCH && !e->dead; i++)  {
+			socklen_t fromlen = sizeof(from);
+			ssize_t n = ::recvfrom(e->fd, &rxbuf[0], rxbuf.size(), 0, (struct sockaddr*) &from, &fromlen);
+			counters.submitted++;
+
+			if (n < 0)
+				break;
+
+			e->handler->onDatagram(*this, *((UDPSocket*) e->sock), &rxbuf[0], n, (struct sockaddr*) &from, fromlen);
+		}
+
+		return;
+	}
+
+	if (events & EPOLLOUT)  {
+		flush(e);
+
+		if (!e->dead && e->outq.empty())  {
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.ptr = e;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, e->fd, &ev);
+		}
+	}
+
+	if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !e->dead)  {
+		ssize_t n;
+
+		do  {
+			n = ::recv(e->fd, &rxbuf[0], rxbuf.size(), 0);
+			counters.submitted++;
+		} while (n < 0 && errno == EINTR);
+
+		if (n > 0)
+			e->handler->onData(*this, *((Socket*) e->sock), &rxbuf[0], n);
+		else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			drop(e);
+	}
+}
+
+int UringLoop::runOnce (int timeout)  {
+	std::vector<Entry*> pending;
+	int n = 0;
+
+	// The sends queued since the last iteration go out together with the wait
+	pending.swap(dirty);
+
+	// An entry is only taken off the list here, so it's never on it twice
+	for (u_int32_t i=0; i < pending.size(); i++)  {
+		pending[i]->queued = false;
+		flush(pending[i]);
+	}
+
+	if (ring)  {
+		unsigned head = *ring->cqhead;
+		bool ready = (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE));
+
+		if (!ready || ring->tail != __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE))  {
+			if (ring->enter((ready || !timeout) ? 0 : 1, timeout) < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+				throw SocketException("io_uring_enter error");
+		}
+
+		unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++, n++)  {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqmask];
+			u_int64_t ud = cqe->user_data;
+			int res = cqe->res;
+			u_int32_t flags = cqe->flags;
+
+			// Free the slot before dispatching, the handlers may submit new requests
+			__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+
+			if (!(flags & IORING_CQE_F_MORE))
+				ring->inflight--;
+
+			if ((ud & OP_MASK) == OP_WAKE)  {
+				eventfd_t val;
+				eventfd_read(wakefd, &val);
+				armWake();
+			} else if ((ud & OP_MASK) != OP_NONE)
+				complete((Entry*) (uintptr_t) (ud & ~(u_int64_t) OP_MASK), ud & OP_MASK, res, flags);
+		}
+
+		counters.completions += n;
+	} else {
+		struct epoll_event events[URING_ENTRIES];
+
+		counters.enters++;
+
+		if ((n = epoll_wait(epfd, events, URING_ENTRIES, timeout)) < 0)  {
+			if (errno != EINTR)
+				throw SocketException("epoll_wait error");
+
+			n = 0;
+		}
+
+		for (int i=0; i < n; i++)  {
+			Entry *e = (Entry*) events[i].data.ptr;
+
+			if (!e)  {
+				eventfd_t val;
+				eventfd_read(wakefd, &val);
+			} else if (!e->dead)
+				dispatch(e, events[i].events);
+		}
+
+		counters.completions += n;
+	}
+
+	// Free the closed entries the kernel is done with
+	for (u_int32_t i=0; i < closed.size(); )  {
+		Entry *e = closed[i];
+
+		if (e->inflight)  {
+			i++;
+			continue;
+		}
+
+		if (e->owned)
+			delete e->sock;
+
+		delete e->batch[0];
+		delete e->batch[1];
+		delete e;
+		closed[i] = closed.back();
+		closed.pop_back();
+	}
+
+	return n;
+}
+
+void UringLoop::run()  {
+	while (running && nentries > 0)
+		runOnce();
+
+	// The stop() which made us return is consumed, so that the loop can be run again
+	if (!running)
+		running = true;
+}
+
+void UringLoop::stop() throw()  {
+	running = false;
+	eventfd_write(wakefd, 1);
+}
+
+u_int32_t UringLoop::size() throw()  { return nentries; }
+
+UringStats UringLoop::stats() throw()  {
+	UringStats s = counters;
+
+	if (ring)  {
+		s.enters = ring->enters;
+		s.submitted = ring->submitted;
+	}
+
+	return s;
+}
+